@@ -37,12 +37,15 @@
 #include <fcntl.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <poll.h>
 #include <string.h>
 #include <time.h>
 #include <errno.h>
+#include <sched.h>
+#include <algorithm>
 
 #include "ae.h"
 #include "fastlock.h"
@@ -79,22 +82,245 @@ public:
         return cOwnLock > 0;
     }
 };
-mutex_wrapper g_lock;
+typedef mutex_wrapper ae_lock_core;
 
 #else
-fastlock g_lock;
+typedef fastlock ae_lock_core;
 #endif
 thread_local aeEventLoop *g_eventLoopThisThread = NULL;
 
 #define AE_ASSERT(x) if (!(x)) do { fprintf(stderr, "AE_ASSER FAILURE\n"); *((volatile int*)0) = 1; } while(0)
 
+/* The global lock can also be held in a shared mode by server threads that
+ * execute a command under one of the keyspace shard locks (see
+ * keyspace-lock-shards in redis.conf).  Shared holders only announce
+ * themselves in a per-thread slot, so they never write to a cache line
+ * another thread is using.  An exclusive owner raises m_fExclusive and then
+ * waits for every slot to drain, while a shared acquisition that sees an
+ * exclusive owner fails immediately so the caller can fall back to the
+ * exclusive lock.  This is a Dekker style handshake, which is why both sides
+ * use sequentially consistent operations. */
+#define AE_MAX_THREAD_SLOTS 128
+struct alignas(64) aeSharedSlot
+{
+    std::atomic<int> fHeld;
+};
+static aeSharedSlot g_rgsharedslot[AE_MAX_THREAD_SLOTS];
+
+/* Contention statistics of the global lock, one slot per thread and only
+ * written by that thread.  They are reported by INFO locks. */
+struct alignas(64) aeThreadLockStats
+{
+    aeLockStats stats;
+    uint64_t nsHoldStart;
+    void *siteHold;
+    unsigned csites;
+};
+static aeThreadLockStats g_rglockstats[AE_MAX_THREAD_SLOTS];
+
+/* Sampled call sites holding the global lock exclusively.  This table is
+ * only touched while holding the lock, which serializes it for free. */
+#define AE_MAX_LOCK_SITES 64
+static aeLockSite g_rglocksite[AE_MAX_LOCK_SITES];
+static std::atomic<int> g_lockSiteSampleRate { 0 };
+
+static std::atomic<int> g_cthreadslot { 0 };
+thread_local int t_ithreadslot = -1;
+thread_local int t_cexclusive = 0;
+
+extern "C" pid_t gettid();
+
+/* Return this thread's slot, or -1 if we ran out of them.  Threads without a
+ * slot always run exclusive and are not accounted in the statistics. */
+static inline int aeThreadSlot()
+{
+    if (t_ithreadslot < 0)
+    {
+        t_ithreadslot = std::min(g_cthreadslot.fetch_add(1, std::memory_order_acq_rel), AE_MAX_THREAD_SLOTS);
+        if (t_ithreadslot < AE_MAX_THREAD_SLOTS)
+            g_rglockstats[t_ithreadslot].stats.tid = gettid();
+    }
+    return t_ithreadslot < AE_MAX_THREAD_SLOTS ? t_ithreadslot : -1;
+}
+
+static inline uint64_t aeLockClockNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void aeLockSiteSample(void *site, uint64_t nsHold)
+{
+    unsigned idx = (unsigned)(((uintptr_t)site >> 2) % AE_MAX_LOCK_SITES);
+    for (int iprobe = 0; iprobe < AE_MAX_LOCK_SITES; ++iprobe)
+    {
+        aeLockSite &entry = g_rglocksite[(idx + iprobe) % AE_MAX_LOCK_SITES];
+        if (entry.site != nullptr && entry.site != site)
+            continue;
+        entry.site = site;
+        entry.samples++;
+        entry.hold_ns += nsHold;
+        if (nsHold > entry.max_hold_ns)
+            entry.max_hold_ns = nsHold;
+        return;
+    }
+    // Table full, drop the sample
+}
+
+class ae_global_lock
+{
+    ae_lock_core m_lock;
+    std::atomic<int> m_fExclusive { 0 };
+
+    // Returns the time spent waiting, or 0 if there were no shared holders
+    uint64_t waitForSharedHolders()
+    {
+        uint64_t nsStart = 0;
+        int cslots = std::min(g_cthreadslot.load(std::memory_order_acquire), AE_MAX_THREAD_SLOTS);
+        for (int islot = 0; islot < cslots; ++islot)
+        {
+            int cloops = 0;
+            while (g_rgsharedslot[islot].fHeld.load(std::memory_order_seq_cst))
+            {
+                if (nsStart == 0)
+                    nsStart = aeLockClockNs();
+                if ((++cloops % 1024) == 0)
+                    sched_yield();
+#if defined(__i386__) || defined(__amd64__)
+                __asm__ ("pause");
+#endif
+            }
+        }
+        return nsStart ? aeLockClockNs() - nsStart : 0;
+    }
+
+    void onExclusiveAcquired(void *site, uint64_t nsWaitStart)
+    {
+        t_cexclusive = 1;
+        m_fExclusive.store(1, std::memory_order_seq_cst);
+        uint64_t nsSharedWait = waitForSharedHolders();
+
+        int islot = aeThreadSlot();
+        if (islot < 0)
+            return;
+        aeThreadLockStats &tstats = g_rglockstats[islot];
+        uint64_t nsNow = aeLockClockNs();
+        tstats.stats.acquisitions++;
+        if (nsWaitStart != 0 || nsSharedWait != 0)
+        {
+            tstats.stats.contended++;
+            tstats.stats.wait_ns += nsWaitStart ? nsNow - nsWaitStart : nsSharedWait;
+        }
+        tstats.nsHoldStart = nsNow;
+        tstats.siteHold = site;
+    }
+
+public:
+    void lock(void *site)
+    {
+        AE_ASSERT(!fOwnShared());   // shared holders may not upgrade, they would wait on themselves
+        if (t_cexclusive > 0)
+        {
+            m_lock.lock();
+            ++t_cexclusive;
+            return;
+        }
+        uint64_t nsWaitStart = 0;
+        if (!m_lock.try_lock())
+        {
+            nsWaitStart = aeLockClockNs();
+            m_lock.lock();
+        }
+        onExclusiveAcquired(site, nsWaitStart);
+    }
+
+    bool try_lock(void *site)
+    {
+        AE_ASSERT(!fOwnShared());
+        if (!m_lock.try_lock())
+            return false;
+        if (t_cexclusive > 0)
+            ++t_cexclusive;
+        else
+            onExclusiveAcquired(site, 0);
+        return true;
+    }
+
+    // Used by std::unique_lock within this file, the call site is our caller
+    __attribute__((noinline)) void lock() { lock(__builtin_return_address(0)); }
+    __attribute__((noinline)) bool try_lock() { return try_lock(__builtin_return_address(0)); }
+
+    void unlock()
+    {
+        if (t_cexclusive == 1)
+        {
+            int islot = aeThreadSlot();
+            if (islot >= 0)
+            {
+                aeThreadLockStats &tstats = g_rglockstats[islot];
+                uint64_t nsHold = aeLockClockNs() - tstats.nsHoldStart;
+                tstats.stats.hold_ns += nsHold;
+                int rate = g_lockSiteSampleRate.load(std::memory_order_relaxed);
+                if (rate > 0 && (++tstats.csites % rate) == 0)
+                    aeLockSiteSample(tstats.siteHold, nsHold);
+            }
+            m_fExclusive.store(0, std::memory_order_release);
+        }
+        --t_cexclusive;
+        m_lock.unlock();
+    }
+
+    bool fOwnLock()
+    {
+        return m_lock.fOwnLock();
+    }
+
+    bool try_lock_shared()
+    {
+        if (t_cexclusive > 0)
+            return false;   // already exclusive, nothing to gain
+        int islot = aeThreadSlot();
+        if (islot < 0)
+            return false;   // out of slots, this thread always runs exclusive
+
+        aeSharedSlot &slot = g_rgsharedslot[islot];
+        slot.fHeld.store(1, std::memory_order_seq_cst);
+        if (m_fExclusive.load(std::memory_order_seq_cst))
+        {
+            slot.fHeld.store(0, std::memory_order_release);
+            g_rglockstats[islot].stats.shared_failures++;
+            return false;
+        }
+        g_rglockstats[islot].stats.shared_acquisitions++;
+        return true;
+    }
+
+    void unlock_shared()
+    {
+        AE_ASSERT(fOwnShared());
+        g_rgsharedslot[t_ithreadslot].fHeld.store(0, std::memory_order_release);
+    }
+
+    bool fOwnShared()
+    {
+        return t_ithreadslot >= 0 && t_ithreadslot < AE_MAX_THREAD_SLOTS
+            && g_rgsharedslot[t_ithreadslot].fHeld.load(std::memory_order_relaxed);
+    }
+};
+ae_global_lock g_lock;
+
 /* Include the best multiplexing layer supported by this system.
  * The following should be ordered by performances, descending. */
 #ifdef HAVE_EVPORT
 #include "ae_evport.c"
 #else
     #ifdef HAVE_EPOLL
-    #include "ae_epoll.cpp"
+        #ifdef HAVE_IO_URING
+        #include "ae_iouring.cpp"
+        #else
+        #include "ae_epoll.cpp"
+        #endif
     #else
         #ifdef HAVE_KQUEUE
         #include "ae_kqueue.c"
@@ -292,6 +518,7 @@ aeEventLoop *aeCreateEventLoop(int setsize) {
     eventLoop->maxfd = -1;
     eventLoop->beforesleep = NULL;
     eventLoop->aftersleep = NULL;
+    eventLoop->fIoUring = 0;
     if (aeApiCreate(eventLoop) == -1) goto err;
     /* Events with mask == AE_NONE are not set. So let's initialize the
      * vector with it. */
@@ -379,7 +606,7 @@ extern "C" int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask,
 
     if (aeApiAddEvent(eventLoop, fd, mask) == -1)
         return AE_ERR;
-    fe->mask |= mask;
+    fe->mask |= mask & ~AE_BUFFERED;
     if (mask & AE_READABLE) fe->rfileProc = proc;
     if (mask & AE_WRITABLE) fe->wfileProc = proc;
     fe->clientData = clientData;
@@ -790,6 +1017,73 @@ const char *aeGetApiName(void) {
     return aeApiName();
 }
 
+#ifndef HAVE_IO_URING
+static int aeApiSelect(aeEventLoop *eventLoop, const char *name) {
+    (void)eventLoop;
+    return strcasecmp(name, aeApiName()) ? -1 : 0;
+}
+
+static ssize_t aeApiRead(aeEventLoop *eventLoop, int fd, void *buf, size_t len) {
+    (void)eventLoop;
+    return read(fd, buf, len);
+}
+
+static ssize_t aeApiWritev(aeEventLoop *eventLoop, int fd, const struct iovec *iov, int iovcnt) {
+    (void)eventLoop;
+    return writev(fd, iov, iovcnt);
+}
+
+static void aeApiUnbuffer(aeEventLoop *eventLoop, int fd) {
+    (void)eventLoop;
+    (void)fd;
+}
+
+static void aeApiClose(aeEventLoop *eventLoop, int fd) {
+    (void)eventLoop;
+    close(fd);
+}
+#endif
+
+/* Read from a fd registered with AE_BUFFERED, same contract as read(2) */
+ssize_t aeRead(aeEventLoop *eventLoop, int fd, void *buf, size_t len) {
+    AE_ASSERT(g_eventLoopThisThread == NULL || g_eventLoopThisThread == eventLoop);
+    return aeApiRead(eventLoop, fd, buf, len);
+}
+
+/* Write to a fd registered with AE_BUFFERED, same contract as writev(2).  The
+ * data may only be queued, AE_WRITABLE fires once more can be accepted. */
+ssize_t aeWritev(aeEventLoop *eventLoop, int fd, const struct iovec *iov, int iovcnt) {
+    AE_ASSERT(g_eventLoopThisThread == NULL || g_eventLoopThisThread == eventLoop);
+    return aeApiWritev(eventLoop, fd, iov, iovcnt);
+}
+
+/* Stop buffering I/O for fd so the caller may read(2)/write(2) it directly
+ * (or hand it to a child process).  Waits for the queued sends to go out. */
+void aeUnbufferFile(aeEventLoop *eventLoop, int fd) {
+    AE_ASSERT(g_eventLoopThisThread == NULL || g_eventLoopThisThread == eventLoop);
+    if (fd >= eventLoop->setsize) return;
+    aeApiUnbuffer(eventLoop, fd);
+}
+
+/* Close a fd once its file events are deleted, dropping what the backend
+ * still holds for it */
+void aeCloseFile(aeEventLoop *eventLoop, int fd) {
+    AE_ASSERT(g_eventLoopThisThread == NULL || g_eventLoopThisThread == eventLoop);
+    if (fd >= eventLoop->setsize) {
+        close(fd);
+        return;
+    }
+    aeApiClose(eventLoop, fd);
+}
+
+/* Switch the event loop to the multiplexing API with the given name.
+ * Returns AE_ERR if it isn't built in or the kernel doesn't support it,
+ * in which case the event loop keeps using the API it had. */
+int aeSetApi(aeEventLoop *eventLoop, const char *name) {
+    AE_ASSERT(g_eventLoopThisThread == NULL || g_eventLoopThisThread == eventLoop);
+    return aeApiSelect(eventLoop, name) == 0 ? AE_OK : AE_ERR;
+}
+
 void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep, int flags) {
     eventLoop->beforesleep = beforesleep;
     eventLoop->beforesleepFlags = flags;
@@ -802,12 +1096,12 @@ void aeSetAfterSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *aftersleep,
 
 void aeAcquireLock()
 {
-    g_lock.lock();
+    g_lock.lock(__builtin_return_address(0));
 }
 
 int aeTryAcquireLock()
 {
-    return g_lock.try_lock();
+    return g_lock.try_lock(__builtin_return_address(0));
 }
 
 void aeReleaseLock()
@@ -819,3 +1113,68 @@ int aeThreadOwnsLock()
 {
     return g_lock.fOwnLock();
 }
+
+int aeTryAcquireSharedLock()
+{
+    return g_lock.try_lock_shared();
+}
+
+void aeReleaseSharedLock()
+{
+    g_lock.unlock_shared();
+}
+
+int aeThreadOwnsSharedLock()
+{
+    return g_lock.fOwnShared();
+}
+
+/* Copy the global lock statistics of the thread in slot 'islot' to 'stats'.
+ * Returns 0 once 'islot' is past the last slot in use. */
+int aeGetLockStats(int islot, aeLockStats *stats)
+{
+    if (islot < 0 || islot >= std::min(g_cthreadslot.load(std::memory_order_acquire), AE_MAX_THREAD_SLOTS))
+        return 0;
+    *stats = g_rglockstats[islot].stats;
+    return 1;
+}
+
+/* Copy up to 'csites' sampled call sites to 'sites', returns the number of
+ * sites copied.  Must be called with the global lock held. */
+int aeGetLockSites(aeLockSite *sites, int csites)
+{
+    int c = 0;
+    AE_ASSERT(g_lock.fOwnLock());
+    for (int isite = 0; isite < AE_MAX_LOCK_SITES && c < csites; ++isite)
+    {
+        if (g_rglocksite[isite].site != nullptr)
+            sites[c++] = g_rglocksite[isite];
+    }
+    return c;
+}
+
+/* Sample the call site of one out of 'rate' exclusive acquisitions of the
+ * global lock, 0 disables sampling. */
+void aeSetLockSiteSampling(int rate)
+{
+    g_lockSiteSampleRate.store(rate < 0 ? 0 : rate, std::memory_order_relaxed);
+}
+
+int aeGetLockSiteSampling()
+{
+    return g_lockSiteSampleRate.load(std::memory_order_relaxed);
+}
+
+/* Must be called with the global lock held. */
+void aeResetLockStats()
+{
+    AE_ASSERT(g_lock.fOwnLock());
+    for (int islot = 0; islot < AE_MAX_THREAD_SLOTS; ++islot)
+    {
+        aeLockStats &stats = g_rglockstats[islot].stats;
+        int tid = stats.tid;
+        memset(&stats, 0, sizeof(stats));
+        stats.tid = tid;
+    }
+    memset(g_rglocksite, 0, sizeof(g_rglocksite));
+}
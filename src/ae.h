@@ -37,6 +37,8 @@
 #include <functional>
 #endif
 #include <time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include "fastlock.h"
 
 #ifdef __cplusplus
@@ -57,6 +59,9 @@ extern "C" {
 #define AE_READ_THREADSAFE 8
 #define AE_WRITE_THREADSAFE 16
 #define AE_SLEEP_THREADSAFE 32
+#define AE_BUFFERED 64  /* The handlers only use aeRead()/aeWritev() on this
+                           fd, so the backend may receive ahead and queue
+                           sends until aeUnbufferFile() or aeCloseFile(). */
 
 #define AE_FILE_EVENTS 1
 #define AE_TIME_EVENTS 2
@@ -124,6 +129,7 @@ typedef struct aeEventLoop {
     int fdCmdWrite;
     int fdCmdRead;
     int cevents;
+    int fIoUring;   /* Polling with io_uring instead of epoll, see aeSetApi() */
 } aeEventLoop;
 
 /* Prototypes */
@@ -145,6 +151,10 @@ int aeCreateRemoteFileEvent(aeEventLoop *eventLoop, int fd, int mask,
 void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask);
 void aeDeleteFileEventAsync(aeEventLoop *eventLoop, int fd, int mask);
 int aeGetFileEvents(aeEventLoop *eventLoop, int fd);
+ssize_t aeRead(aeEventLoop *eventLoop, int fd, void *buf, size_t len);
+ssize_t aeWritev(aeEventLoop *eventLoop, int fd, const struct iovec *iov, int iovcnt);
+void aeUnbufferFile(aeEventLoop *eventLoop, int fd);
+void aeCloseFile(aeEventLoop *eventLoop, int fd);
 long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
         aeTimeProc *proc, void *clientData,
         aeEventFinalizerProc *finalizerProc);
@@ -153,6 +163,7 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags);
 int aeWait(int fd, int mask, long long milliseconds);
 void aeMain(aeEventLoop *eventLoop);
 const char *aeGetApiName(void);
+int aeSetApi(aeEventLoop *eventLoop, const char *name);
 void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep, int flags);
 void aeSetAfterSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *aftersleep, int flags);
 int aeGetSetSize(aeEventLoop *eventLoop);
@@ -162,6 +173,34 @@ void aeAcquireLock();
 int aeTryAcquireLock();
 void aeReleaseLock();
 int aeThreadOwnsLock();
+int aeTryAcquireSharedLock();
+void aeReleaseSharedLock();
+int aeThreadOwnsSharedLock();
+
+/* Global lock contention statistics, per thread */
+typedef struct aeLockStats {
+    int tid;                                /* Thread id of the owner */
+    unsigned long long acquisitions;        /* Exclusive acquisitions */
+    unsigned long long contended;           /* ... of which had to wait */
+    unsigned long long wait_ns;             /* Time spent waiting for the lock */
+    unsigned long long hold_ns;             /* Time spent holding it exclusively */
+    unsigned long long shared_acquisitions; /* Shared acquisitions (keyspace shards) */
+    unsigned long long shared_failures;     /* Shared attempts failing due to an exclusive owner */
+} aeLockStats;
+
+/* A sampled call site holding the global lock */
+typedef struct aeLockSite {
+    void *site;
+    unsigned long long samples;
+    unsigned long long hold_ns;
+    unsigned long long max_hold_ns;
+} aeLockSite;
+
+int aeGetLockStats(int islot, aeLockStats *stats);
+int aeGetLockSites(aeLockSite *sites, int csites);
+void aeSetLockSiteSampling(int rate);
+int aeGetLockSiteSampling();
+void aeResetLockStats();
 
 #ifdef __cplusplus
 }
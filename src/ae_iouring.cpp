@@ -0,0 +1,943 @@
+/* Linux io_uring based ae.c module
+ *
+ * Copyright (c) 2019, John Sully <john at eqalpha dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Interest in a file descriptor is expressed as a one shot IORING_OP_POLL_ADD
+ * that we re-arm after it fires, and changes to that interest are queued as
+ * SQEs.  All of them are handed to the kernel by the same io_uring_enter()
+ * call that waits for completions, so an iteration of the event loop costs a
+ * single system call no matter how many clients installed or removed their
+ * write handler.  Multishot polls are edge triggered and would break the
+ * level triggered contract the rest of ae relies on, which is why we re-arm.
+ *
+ * File events created with AE_BUFFERED go further and let the ring do the
+ * I/O itself.  Reads are a multishot IORING_OP_RECV that picks its buffers
+ * from a ring of provided buffers registered once per event loop, so a
+ * client streaming commands costs no system call at all: aeRead() copies
+ * out of the buffers the kernel already filled.  aeWritev() copies the reply
+ * into a send op that goes out as an IORING_OP_SEND with the next
+ * io_uring_enter(), batched with every other client's.  Readiness of those
+ * fds is derived from what is buffered, keeping ae level triggered.
+ *
+ * The epoll backend is always built next to this one and stays the default,
+ * aeSetApi(eventLoop, "io_uring") moves an event loop over. */
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#define aeApiState aeEpollState
+#define aeApiCreate aeEpollCreate
+#define aeApiResize aeEpollResize
+#define aeApiFree aeEpollFree
+#define aeApiAddEvent aeEpollAddEvent
+#define aeApiDelEvent aeEpollDelEvent
+#define aeApiPoll aeEpollPoll
+#define aeApiName aeEpollName
+#include "ae_epoll.cpp"
+#undef aeApiState
+#undef aeApiCreate
+#undef aeApiResize
+#undef aeApiFree
+#undef aeApiAddEvent
+#undef aeApiDelEvent
+#undef aeApiPoll
+#undef aeApiName
+
+#define AE_URING_SQ_ENTRIES 1024
+#define AE_URING_FEATURES_REQUIRED (IORING_FEAT_SINGLE_MMAP|IORING_FEAT_NODROP|IORING_FEAT_EXT_ARG)
+
+/* The low bits of user_data tell what completed.  Polls and receives carry
+ * the fd and a generation, sends carry a pointer to their aeUringSend. */
+#define AE_URING_OP_POLL 0
+#define AE_URING_OP_RECV 1
+#define AE_URING_OP_SEND 2
+#define AE_URING_OP_MASK 3
+#define AE_URING_USERDATA_IGNORE UINT64_MAX    /* completions of removals and cancels */
+
+#define AE_URING_RECV_BGID 0
+#define AE_URING_RECV_BUFS 256                  /* must be a power of two */
+#define AE_URING_RECV_BUFSIZE (16*1024)
+#define AE_URING_SEND_MAX (1024*1024)           /* bytes a fd may have queued */
+#define AE_URING_CLOSE_TIMEOUT 10               /* seconds a closed fd may take to send */
+
+#define AE_URING_RECV_NONE 0
+#define AE_URING_RECV_ARMED 1
+#define AE_URING_RECV_CANCELLING 2
+
+static int g_fUseIoUring = 0;  /* Backend last selected, for aeGetApiName() */
+
+typedef struct aeUringSend {
+    int fd;
+    unsigned gen;               /* file generation the data belongs to */
+    int submitted;              /* SQE handed out, the buffer may not grow anymore */
+    size_t len;
+    size_t off;                 /* bytes the kernel already took */
+    int fClose;                 /* aeCloseFile() was called, close the fd once sent */
+    int fCancelled;             /* gave up on sending, waiting for the completion */
+    time_t closeBy;             /* when to give up on a closed fd */
+    struct aeUringSend *nextClosing;
+} aeUringSend;
+
+/* The data follows the header in the same allocation */
+static inline char *aeUringSendBuf(aeUringSend *op) {
+    return (char*)(op+1);
+}
+
+typedef struct aeUringFile {
+    int armed;                  /* AE mask of the poll in flight */
+    unsigned gen;               /* generation of that poll, to spot stale completions */
+    unsigned fileGen;           /* bumped by aeCloseFile(), tags the recv in flight */
+    int pollFired;              /* AE mask the last poll completed with, not yet delivered */
+    int buffered;               /* recv and send go through the ring, see AE_BUFFERED */
+    int direct;                 /* aeUnbufferFile() was called, ignore AE_BUFFERED */
+    int recv;                   /* AE_URING_RECV_* */
+    int rbufHead, rbufTail;     /* received buffers not yet consumed, -1 when empty */
+    unsigned rbufOff;           /* bytes of rbufHead already consumed */
+    int rdEof;
+    int rdErr;                  /* errno the recv stopped with, returned after the data */
+    int starved;                /* recv ran out of buffers, aeRead() goes to the socket */
+    aeUringSend *send;          /* reply accepted by aeWritev() and not yet sent */
+    int wrErr;                  /* errno of a failed send */
+    int ready;                  /* on the ready list */
+} aeUringFile;
+
+typedef struct aeUringState {
+    int ringfd;
+    void *ring;                 /* SQ and CQ rings share one mapping */
+    size_t cbRing;
+    struct io_uring_sqe *sqes;
+    size_t cbSqes;
+
+    unsigned *sqHead, *sqTail, *sqMask;
+    unsigned sqTailLocal;       /* SQEs queued but not yet published to the kernel */
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+
+    aeUringFile *files;
+    unsigned genNext;
+
+    /* Provided buffers the multishot receives pick from */
+    int fRecv;                  /* buffered fds use a multishot recv */
+    struct io_uring_buf *bufRing;   /* the ring tail overlays bufRing[0].resv */
+    char *bufs;
+    unsigned short bufRingTail;
+    int *bufNext;               /* chains the buffers queued on a fd */
+    unsigned *bufLen;
+
+    int *readyq;                /* fds that may be ready without the kernel telling us */
+    int cready;
+    int *sendq;                 /* fds with a send waiting for its SQE */
+    int csend;
+    aeUringSend *closing;       /* sends of closed fds, still open until they are done */
+} aeUringState;
+
+static int aeUringSetup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int aeUringEnter(int ringfd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, ringfd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int aeUringRegister(int ringfd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, ringfd, opcode, arg, nr_args);
+}
+
+static int aeUringSupported(void) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int ringfd = aeUringSetup(1, &p);
+    if (ringfd < 0) return 0;
+    close(ringfd);
+    return (p.features & AE_URING_FEATURES_REQUIRED) == AE_URING_FEATURES_REQUIRED;
+}
+
+static inline uint64_t aeUringUserData(int fd, unsigned gen, int op) {
+    return ((uint64_t)gen << 32) | ((uint64_t)(uint32_t)fd << 2) | op;
+}
+
+/* Reset what belongs to the connection, ops still in flight and the ready
+ * list outlive it */
+static void aeUringFileInit(aeUringFile *f) {
+    aeUringFile fOld = *f;
+    memset(f, 0, sizeof(*f));
+    f->armed = fOld.armed;
+    f->gen = fOld.gen;
+    f->fileGen = fOld.fileGen;
+    f->recv = fOld.recv;
+    f->ready = fOld.ready;
+    f->rbufHead = f->rbufTail = -1;
+}
+
+/* Hand every queued SQE to the kernel, optionally waiting for completions */
+static int aeUringSubmit(aeUringState *state, unsigned min_complete, struct __kernel_timespec *ts) {
+    struct io_uring_getevents_arg arg;
+    unsigned flags = 0;
+    unsigned to_submit;
+
+    __atomic_store_n(state->sqTail, state->sqTailLocal, __ATOMIC_RELEASE);
+    to_submit = state->sqTailLocal - __atomic_load_n(state->sqHead, __ATOMIC_ACQUIRE);
+    if (to_submit == 0 && min_complete == 0) return 0;
+
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t)(uintptr_t)ts;
+    if (min_complete || ts) flags |= IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG;
+    return aeUringEnter(state->ringfd, to_submit, min_complete, flags, &arg, sizeof(arg));
+}
+
+static struct io_uring_sqe *aeUringGetSqe(aeUringState *state) {
+    unsigned head = __atomic_load_n(state->sqHead, __ATOMIC_ACQUIRE);
+    if (state->sqTailLocal - head > *state->sqMask) {
+        /* The submission ring is full, flush it without waiting */
+        aeUringSubmit(state, 0, NULL);
+        head = __atomic_load_n(state->sqHead, __ATOMIC_ACQUIRE);
+        if (state->sqTailLocal - head > *state->sqMask) return NULL;
+    }
+    struct io_uring_sqe *sqe = &state->sqes[state->sqTailLocal & *state->sqMask];
+    state->sqTailLocal++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static int aeUringCancel(aeUringState *state, uint64_t user_data) {
+    struct io_uring_sqe *sqe = aeUringGetSqe(state);
+    if (sqe == NULL) return -1;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->user_data = AE_URING_USERDATA_IGNORE;
+    return 0;
+}
+
+static int aeUringArm(aeUringState *state, int fd, int mask) {
+    aeUringFile *f = &state->files[fd];
+    struct io_uring_sqe *sqe = aeUringGetSqe(state);
+    if (sqe == NULL) return -1;
+    unsigned events = 0;
+    if (mask & AE_READABLE) events |= POLLIN;
+    if (mask & AE_WRITABLE) events |= POLLOUT;
+#if __BYTE_ORDER == __BIG_ENDIAN
+    events = __swahw32(events);
+#endif
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    f->gen = state->genNext++;
+    sqe->user_data = aeUringUserData(fd, f->gen, AE_URING_OP_POLL);
+    f->armed = mask;
+    return 0;
+}
+
+/* Make the poll in flight for fd match mask */
+static int aeUringUpdate(aeUringState *state, int fd, int mask) {
+    aeUringFile *f = &state->files[fd];
+    if (f->armed == mask) return 0;
+    if (f->armed != AE_NONE) {
+        struct io_uring_sqe *sqe = aeUringGetSqe(state);
+        if (sqe == NULL) return -1;
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = aeUringUserData(fd, f->gen, AE_URING_OP_POLL);
+        sqe->user_data = AE_URING_USERDATA_IGNORE;
+        f->armed = AE_NONE;
+    }
+    if (mask == AE_NONE) return 0;
+    return aeUringArm(state, fd, mask);
+}
+
+static int aeUringArmRecv(aeUringState *state, int fd) {
+#ifdef IORING_RECV_MULTISHOT
+    aeUringFile *f = &state->files[fd];
+    struct io_uring_sqe *sqe = aeUringGetSqe(state);
+    if (sqe == NULL) return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = AE_URING_RECV_BGID;
+    sqe->user_data = aeUringUserData(fd, f->fileGen, AE_URING_OP_RECV);
+    f->recv = AE_URING_RECV_ARMED;
+    return 0;
+#else
+    (void)state; (void)fd;
+    return -1;
+#endif
+}
+
+/* Bring what is in flight for fd in line with the interest mask, a buffered
+ * fd reads with a multishot recv and needs no poll at all */
+static int aeUringRefresh(aeUringState *state, int fd, int mask) {
+    aeUringFile *f = &state->files[fd];
+    int fRecv = f->buffered && state->fRecv;
+    int pollMask = 0;
+
+    mask &= AE_READABLE|AE_WRITABLE;
+    if (!fRecv) pollMask |= mask & AE_READABLE;
+    if (!f->buffered) pollMask |= mask & AE_WRITABLE;
+    if (aeUringUpdate(state, fd, pollMask) == -1) return -1;
+
+    int fWantRecv = fRecv && (mask & AE_READABLE) && !f->rdEof && !f->rdErr && !f->starved;
+    if (fWantRecv && f->recv == AE_URING_RECV_NONE)
+        return aeUringArmRecv(state, fd);
+    if (!fWantRecv && f->recv == AE_URING_RECV_ARMED) {
+        /* Whatever it received up to the cancel stays queued on the fd */
+        if (aeUringCancel(state, aeUringUserData(fd, f->fileGen, AE_URING_OP_RECV)) == -1) return -1;
+        f->recv = AE_URING_RECV_CANCELLING;
+    }
+    return 0;
+}
+
+static void aeUringMarkReady(aeUringState *state, int fd) {
+    aeUringFile *f = &state->files[fd];
+    if (f->ready) return;
+    f->ready = 1;
+    state->readyq[state->cready++] = fd;
+}
+
+/* The AE mask fd should fire with right now */
+static int aeUringReadyMask(aeEventLoop *eventLoop, aeUringState *state, int fd) {
+    aeUringFile *f = &state->files[fd];
+    int mask = eventLoop->events[fd].mask;
+    int ready = f->pollFired;
+
+    if (f->rbufHead != -1 || f->rdEof || f->rdErr || f->starved) ready |= AE_READABLE;
+    if (f->buffered && f->send == NULL) ready |= AE_WRITABLE;
+    return ready & mask & (AE_READABLE|AE_WRITABLE);
+}
+
+static void aeUringPutBuf(aeUringState *state, int bid) {
+    /* Not through io_uring_buf_ring::bufs, C++ puts that flexible array
+     * 8 bytes further than C does */
+    struct io_uring_buf *buf = &state->bufRing[state->bufRingTail & (AE_URING_RECV_BUFS-1)];
+    buf->addr = (uint64_t)(uintptr_t)(state->bufs + (size_t)bid*AE_URING_RECV_BUFSIZE);
+    buf->len = AE_URING_RECV_BUFSIZE;
+    buf->bid = bid;
+    state->bufRingTail++;
+    __atomic_store_n(&state->bufRing[0].resv, state->bufRingTail, __ATOMIC_RELEASE);
+}
+
+static void aeUringDropBufs(aeUringState *state, aeUringFile *f) {
+    while (f->rbufHead != -1) {
+        int bid = f->rbufHead;
+        f->rbufHead = state->bufNext[bid];
+        aeUringPutBuf(state, bid);
+    }
+    f->rbufTail = -1;
+    f->rbufOff = 0;
+}
+
+static int aeUringQueueSend(aeUringState *state, aeUringSend *op) {
+    struct io_uring_sqe *sqe = aeUringGetSqe(state);
+    if (sqe == NULL) return -1;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = op->fd;
+    sqe->addr = (uint64_t)(uintptr_t)(aeUringSendBuf(op) + op->off);
+    sqe->len = op->len - op->off;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)op | AE_URING_OP_SEND;
+    op->submitted = 1;
+    return 0;
+}
+
+/* Turn the replies aeWritev() gathered since the last iteration into SQEs */
+static void aeUringFlushSends(aeUringState *state) {
+    for (int i = 0; i < state->csend; ++i) {
+        aeUringFile *f = &state->files[state->sendq[i]];
+        if (f->send != NULL && !f->send->submitted && aeUringQueueSend(state, f->send) == -1) {
+            /* Out of SQEs, the rest go out with the next batch */
+            memmove(state->sendq, state->sendq+i, sizeof(int)*(state->csend-i));
+            state->csend -= i;
+            return;
+        }
+    }
+    state->csend = 0;
+}
+
+/* The last reply of a closed fd is sent or failed, the fd can go */
+static void aeUringSendClosed(aeUringState *state, aeUringSend *op) {
+    aeUringSend **pop = &state->closing;
+    while (*pop != op) pop = &(*pop)->nextClosing;
+    *pop = op->nextClosing;
+    close(op->fd);
+    zfree(op);
+}
+
+static void aeUringSendDone(aeUringState *state, aeUringSend *op, int res) {
+    int fd = op->fd;
+    aeUringFile *f = &state->files[fd];
+    if (op->fClose) {
+        if (res > 0) {
+            op->off += res;
+            if (op->off < op->len && !op->fCancelled && aeUringQueueSend(state, op) == 0)
+                return;
+        }
+        aeUringSendClosed(state, op);
+        return;
+    }
+    if (op->gen != f->fileGen || f->send != op) {
+        zfree(op);  /* not the send of this fd anymore */
+        return;
+    }
+    if (res > 0) {
+        op->off += res;
+        if (op->off < op->len && aeUringQueueSend(state, op) == 0)
+            return;     /* short send, queue the rest */
+        if (op->off < op->len) res = -ENOMEM;
+    }
+    if (res <= 0) f->wrErr = res ? -res : EPIPE;
+    f->send = NULL;
+    zfree(op);
+    aeUringMarkReady(state, fd);
+}
+
+static void aeUringRecvDone(aeEventLoop *eventLoop, aeUringState *state, int fd, unsigned gen, int res, unsigned flags) {
+    aeUringFile *f = &state->files[fd];
+    int bid = (flags & IORING_CQE_F_BUFFER) ? (int)(flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+    int fFinal = !(flags & IORING_CQE_F_MORE);
+
+    if (fFinal) f->recv = AE_URING_RECV_NONE;
+    if (gen != f->fileGen) {
+        /* Data for a connection aeCloseFile() already closed */
+        if (bid != -1) aeUringPutBuf(state, bid);
+    } else if (res > 0 && bid != -1) {
+        state->bufLen[bid] = res;
+        state->bufNext[bid] = -1;
+        if (f->rbufTail == -1) f->rbufHead = bid;
+        else state->bufNext[f->rbufTail] = bid;
+        f->rbufTail = bid;
+        aeUringMarkReady(state, fd);
+    } else if (res == 0) {
+        f->rdEof = 1;
+        aeUringMarkReady(state, fd);
+    } else if (res == -ENOBUFS) {
+        /* Let the handler read() until the socket is drained, by then the
+         * other fds have given buffers back */
+        f->starved = 1;
+        aeUringMarkReady(state, fd);
+    } else if (res == -EINVAL) {
+        /* No multishot recv in this kernel, fall back to polls */
+        state->fRecv = 0;
+    } else if (res != -ECANCELED) {
+        f->rdErr = -res;
+        aeUringMarkReady(state, fd);
+    }
+    if (fFinal) aeUringRefresh(state, fd, eventLoop->events[fd].mask);
+}
+
+/* Process every completion waiting in the CQ, turning them into per fd state */
+static void aeUringReap(aeEventLoop *eventLoop, aeUringState *state) {
+    unsigned head = *state->cqHead;
+    unsigned tail = __atomic_load_n(state->cqTail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &state->cqes[head & *state->cqMask];
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+        head++;
+
+        if (user_data == AE_URING_USERDATA_IGNORE) continue;
+        if ((user_data & AE_URING_OP_MASK) == AE_URING_OP_SEND) {
+            aeUringSendDone(state, (aeUringSend*)(uintptr_t)(user_data & ~(uint64_t)AE_URING_OP_MASK), res);
+            continue;
+        }
+
+        int fd = (int)((uint32_t)user_data >> 2);
+        unsigned gen = (unsigned)(user_data >> 32);
+        if (fd >= eventLoop->setsize) continue;
+        if ((user_data & AE_URING_OP_MASK) == AE_URING_OP_RECV) {
+            aeUringRecvDone(eventLoop, state, fd, gen, res, flags);
+            continue;
+        }
+
+        aeUringFile *f = &state->files[fd];
+        if (f->gen != gen || f->armed == AE_NONE)
+            continue;   /* The poll was replaced after it completed */
+
+        f->armed = AE_NONE;
+        if (res < 0) continue;   /* e.g. EBADF, like epoll we drop the fd */
+
+        if (res & POLLIN) f->pollFired |= AE_READABLE;
+        if (res & POLLOUT) f->pollFired |= AE_WRITABLE;
+        if (res & POLLERR) f->pollFired |= AE_WRITABLE;
+        if (res & POLLHUP) f->pollFired |= AE_WRITABLE;
+        aeUringMarkReady(state, fd);
+    }
+    __atomic_store_n(state->cqHead, head, __ATOMIC_RELEASE);
+}
+
+/* Register the provided buffers the multishot receives fill */
+static int aeUringSetupRecv(aeUringState *state) {
+#ifdef IORING_RECV_MULTISHOT
+    struct io_uring_buf_reg reg;
+    size_t cbRing = sizeof(struct io_uring_buf)*AE_URING_RECV_BUFS;
+
+    state->bufRing = (struct io_uring_buf*)mmap(NULL, cbRing, PROT_READ|PROT_WRITE,
+        MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (state->bufRing == MAP_FAILED) {
+        state->bufRing = NULL;
+        return -1;
+    }
+    state->bufs = (char*)mmap(NULL, (size_t)AE_URING_RECV_BUFS*AE_URING_RECV_BUFSIZE,
+        PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (state->bufs == MAP_FAILED) {
+        state->bufs = NULL;
+        return -1;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)state->bufRing;
+    reg.ring_entries = AE_URING_RECV_BUFS;
+    reg.bgid = AE_URING_RECV_BGID;
+    if (aeUringRegister(state->ringfd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return -1;
+
+    state->bufNext = (int*)zmalloc(sizeof(int)*AE_URING_RECV_BUFS, MALLOC_LOCAL);
+    state->bufLen = (unsigned*)zmalloc(sizeof(unsigned)*AE_URING_RECV_BUFS, MALLOC_LOCAL);
+    for (int bid = 0; bid < AE_URING_RECV_BUFS; ++bid)
+        aeUringPutBuf(state, bid);
+    state->fRecv = 1;
+    return 0;
+#else
+    (void)state;
+    return -1;
+#endif
+}
+
+static int aeUringCreate(aeEventLoop *eventLoop) {
+    struct io_uring_params p;
+    aeUringState *state = (aeUringState*)zcalloc(sizeof(aeUringState), MALLOC_LOCAL);
+
+    if (!state) return -1;
+    state->ringfd = -1;
+    state->files = (aeUringFile*)zcalloc(sizeof(aeUringFile)*eventLoop->setsize, MALLOC_LOCAL);
+    state->readyq = (int*)zmalloc(sizeof(int)*eventLoop->setsize, MALLOC_LOCAL);
+    state->sendq = (int*)zmalloc(sizeof(int)*eventLoop->setsize, MALLOC_LOCAL);
+    if (!state->files || !state->readyq || !state->sendq) goto err;
+    for (int fd = 0; fd < eventLoop->setsize; ++fd)
+        aeUringFileInit(&state->files[fd]);
+
+    /* Every fd has at most one poll in flight and the receives at most one
+     * completion per provided buffer, NODROP covers us past that */
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE|IORING_SETUP_CLAMP;
+    p.cq_entries = eventLoop->setsize*2 + AE_URING_RECV_BUFS;
+    state->ringfd = aeUringSetup(AE_URING_SQ_ENTRIES, &p);
+    if (state->ringfd < 0) goto err;
+    if ((p.features & AE_URING_FEATURES_REQUIRED) != AE_URING_FEATURES_REQUIRED) goto err;
+
+    state->cbRing = std::max(p.sq_off.array + p.sq_entries*sizeof(unsigned),
+        p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe));
+    state->ring = mmap(NULL, state->cbRing, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+        state->ringfd, IORING_OFF_SQ_RING);
+    if (state->ring == MAP_FAILED) {
+        state->ring = NULL;
+        goto err;
+    }
+    state->cbSqes = p.sq_entries*sizeof(struct io_uring_sqe);
+    state->sqes = (struct io_uring_sqe*)mmap(NULL, state->cbSqes, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE, state->ringfd, IORING_OFF_SQES);
+    if (state->sqes == MAP_FAILED) {
+        state->sqes = NULL;
+        goto err;
+    }
+
+    state->sqHead = (unsigned*)((char*)state->ring + p.sq_off.head);
+    state->sqTail = (unsigned*)((char*)state->ring + p.sq_off.tail);
+    state->sqMask = (unsigned*)((char*)state->ring + p.sq_off.ring_mask);
+    state->sqTailLocal = *state->sqTail;
+    state->cqHead = (unsigned*)((char*)state->ring + p.cq_off.head);
+    state->cqTail = (unsigned*)((char*)state->ring + p.cq_off.tail);
+    state->cqMask = (unsigned*)((char*)state->ring + p.cq_off.ring_mask);
+    state->cqes = (struct io_uring_cqe*)((char*)state->ring + p.cq_off.cqes);
+
+    /* SQE slots map 1:1 to the submission array */
+    {
+        unsigned *sqArray = (unsigned*)((char*)state->ring + p.sq_off.array);
+        for (unsigned i = 0; i < p.sq_entries; ++i)
+            sqArray[i] = i;
+    }
+
+    /* Without provided buffers (before 5.19) buffered fds still send
+     * through the ring but are polled for reading */
+    aeUringSetupRecv(state);
+
+    eventLoop->apidata = state;
+    return 0;
+
+err:
+    if (state->sqes) munmap(state->sqes, state->cbSqes);
+    if (state->ring) munmap(state->ring, state->cbRing);
+    if (state->ringfd >= 0) close(state->ringfd);
+    zfree(state->files);
+    zfree(state->readyq);
+    zfree(state->sendq);
+    zfree(state);
+    return -1;
+}
+
+static int aeUringResize(aeEventLoop *eventLoop, int setsize) {
+    aeUringState *state = (aeUringState*)eventLoop->apidata;
+
+    state->files = (aeUringFile*)zrealloc(state->files, sizeof(aeUringFile)*setsize, MALLOC_LOCAL);
+    state->readyq = (int*)zrealloc(state->readyq, sizeof(int)*setsize, MALLOC_LOCAL);
+    state->sendq = (int*)zrealloc(state->sendq, sizeof(int)*setsize, MALLOC_LOCAL);
+    for (int fd = eventLoop->setsize; fd < setsize; ++fd) {
+        memset(&state->files[fd], 0, sizeof(aeUringFile));
+        aeUringFileInit(&state->files[fd]);
+    }
+    return 0;
+}
+
+static void aeUringFree(aeEventLoop *eventLoop) {
+    aeUringState *state = (aeUringState*)eventLoop->apidata;
+
+    /* The buffers of the sends still in flight must outlive them */
+    while (state->closing != NULL) {
+        for (aeUringSend *op = state->closing; op != NULL; op = op->nextClosing) {
+            if (!op->fCancelled && aeUringCancel(state, (uint64_t)(uintptr_t)op | AE_URING_OP_SEND) == 0)
+                op->fCancelled = 1;
+        }
+        if (aeUringSubmit(state, 1, NULL) < 0 && errno != EINTR) break;
+        aeUringReap(eventLoop, state);
+    }
+
+    munmap(state->sqes, state->cbSqes);
+    munmap(state->ring, state->cbRing);
+    close(state->ringfd);
+    if (state->bufRing) munmap(state->bufRing, sizeof(struct io_uring_buf)*AE_URING_RECV_BUFS);
+    if (state->bufs) munmap(state->bufs, (size_t)AE_URING_RECV_BUFS*AE_URING_RECV_BUFSIZE);
+    zfree(state->bufNext);
+    zfree(state->bufLen);
+    zfree(state->files);
+    zfree(state->readyq);
+    zfree(state->sendq);
+    zfree(state);
+}
+
+static int aeUringAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    aeUringState *state = (aeUringState*)eventLoop->apidata;
+    aeUringFile *f = &state->files[fd];
+
+    if ((mask & AE_BUFFERED) && !f->direct) f->buffered = 1;
+    mask |= eventLoop->events[fd].mask;
+    if (aeUringRefresh(state, fd, mask) == -1) {
+        perror("io_uring poll failed");
+        return -1;
+    }
+    /* Data may be waiting from before the handler was removed */
+    if (f->buffered) aeUringMarkReady(state, fd);
+    return 0;
+}
+
+static void aeUringDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
+    aeUringState *state = (aeUringState*)eventLoop->apidata;
+
+    /* Narrow the poll too, a stale AE_WRITABLE poll would fire constantly */
+    aeUringRefresh(state, fd, eventLoop->events[fd].mask & (~delmask));
+}
+
+static int aeUringPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
+    aeUringState *state = (aeUringState*)eventLoop->apidata;
+    struct __kernel_timespec ts, *pts = NULL;
+    unsigned min_complete = 1;
+    int numevents = 0;
+
+    /* Drop what the handlers consumed since the last iteration, anything
+     * still ready means we must not block */
+    int cready = 0;
+    for (int i = 0; i < state->cready; ++i) {
+        int fd = state->readyq[i];
+        if (aeUringReadyMask(eventLoop, state, fd)) state->readyq[cready++] = fd;
+        else state->files[fd].ready = 0;
+    }
+    state->cready = cready;
+
+    if (tvp) {
+        ts.tv_sec = tvp->tv_sec;
+        ts.tv_nsec = tvp->tv_usec*1000;
+        pts = &ts;
+        if (tvp->tv_sec == 0 && tvp->tv_usec == 0) min_complete = 0;
+    }
+    if (__atomic_load_n(state->cqTail, __ATOMIC_ACQUIRE) != *state->cqHead || state->cready)
+        min_complete = 0;   /* Completions are already waiting for us */
+
+    /* Give up on the closed fds whose peer stopped reading */
+    if (state->closing != NULL) {
+        time_t now = time(NULL);
+        for (aeUringSend *op = state->closing; op != NULL; op = op->nextClosing) {
+            if (op->fCancelled || now < op->closeBy) continue;
+            if (aeUringCancel(state, (uint64_t)(uintptr_t)op | AE_URING_OP_SEND) == 0)
+                op->fCancelled = 1;
+        }
+    }
+
+    /* Errors (ETIME, EINTR, EBUSY) just mean there is nothing new to reap */
+    aeUringFlushSends(state);
+    aeUringSubmit(state, min_complete, min_complete ? pts : NULL);
+    aeUringReap(eventLoop, state);
+
+    cready = 0;
+    for (int i = 0; i < state->cready; ++i) {
+        int fd = state->readyq[i];
+        aeUringFile *f = &state->files[fd];
+        int mask = aeUringReadyMask(eventLoop, state, fd);
+        f->pollFired = 0;
+
+        /* Re-arm now, the SQE goes out with our next wait by which time the
+         * handler has consumed what made the fd ready */
+        aeUringRefresh(state, fd, eventLoop->events[fd].mask);
+        if (mask == AE_NONE) {
+            f->ready = 0;
+            continue;
+        }
+        eventLoop->fired[numevents].fd = fd;
+        eventLoop->fired[numevents].mask = mask;
+        numevents++;
+        state->readyq[cready++] = fd;
+    }
+    state->cready = cready;
+    return numevents;
+}
+
+static ssize_t aeUringRead(aeEventLoop *eventLoop, int fd, void *buf, size_t len) {
+    aeUringState *state = (aeUringState*)eventLoop->apidata;
+    aeUringFile *f = &state->files[fd];
+    size_t cb = 0;
+
+    while (f->rbufHead != -1 && cb < len) {
+        int bid = f->rbufHead;
+        size_t avail = state->bufLen[bid] - f->rbufOff;
+        size_t take = std::min(avail, len - cb);
+        memcpy((char*)buf + cb, state->bufs + (size_t)bid*AE_URING_RECV_BUFSIZE + f->rbufOff, take);
+        cb += take;
+        f->rbufOff += take;
+        if (take == avail) {
+            f->rbufHead = state->bufNext[bid];
+            if (f->rbufHead == -1) f->rbufTail = -1;
+            f->rbufOff = 0;
+            aeUringPutBuf(state, bid);
+        }
+    }
+    if (cb) return cb;
+    if (f->rdErr) {
+        errno = f->rdErr;
+        return -1;
+    }
+    if (f->rdEof) return 0;
+    if (f->recv != AE_URING_RECV_NONE) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    ssize_t nread = read(fd, buf, len);
+    if (nread == -1 && errno == EAGAIN && f->starved) {
+        /* Drained, go back to the multishot recv */
+        f->starved = 0;
+        aeUringRefresh(state, fd, eventLoop->events[fd].mask);
+    }
+    return nread;
+}
+
+static ssize_t aeUringWritev(aeEventLoop *eventLoop, int fd, const struct iovec *iov, int iovcnt) {
+    aeUringState *state = (aeUringState*)eventLoop->apidata;
+    aeUringFile *f = &state->files[fd];
+
+    if (!f->buffered) return writev(fd, iov, iovcnt);
+    if (f->wrErr) {
+        errno = f->wrErr;
+        return -1;
+    }
+
+    /* Replies written during the same iteration share one send, once it is
+     * in the kernel the fd is writable again when it completes */
+    aeUringSend *op = f->send;
+    size_t cbQueued = op ? op->len : 0;
+    if ((op && op->submitted) || cbQueued >= AE_URING_SEND_MAX) {
+        errno = EAGAIN;
+        return -1;
+    }
+    size_t cb = 0;
+    for (int i = 0; i < iovcnt; ++i) cb += iov[i].iov_len;
+    cb = std::min(cb, AE_URING_SEND_MAX - cbQueued);
+
+    op = (aeUringSend*)zrealloc(op, sizeof(aeUringSend) + cbQueued + cb, MALLOC_LOCAL);
+    if (f->send == NULL) {
+        op->fd = fd;
+        op->gen = f->fileGen;
+        op->submitted = 0;
+        op->len = 0;
+        op->off = 0;
+        op->fClose = 0;
+        op->fCancelled = 0;
+        state->sendq[state->csend++] = fd;
+    }
+    f->send = op;
+    for (int i = 0; i < iovcnt && op->len < cbQueued + cb; ++i) {
+        size_t take = std::min(iov[i].iov_len, cbQueued + cb - op->len);
+        memcpy(aeUringSendBuf(op) + op->len, iov[i].iov_base, take);
+        op->len += take;
+    }
+    return cb;
+}
+
+/* Hand the fd back to plain read()/write(), once everything queued is sent
+ * and the recv is gone */
+static void aeUringUnbuffer(aeEventLoop *eventLoop, int fd) {
+    aeUringState *state = (aeUringState*)eventLoop->apidata;
+    aeUringFile *f = &state->files[fd];
+
+    f->direct = 1;
+    if (!f->buffered) return;
+    f->buffered = 0;
+    aeUringRefresh(state, fd, eventLoop->events[fd].mask);
+    aeUringFlushSends(state);
+    while (f->send != NULL || f->recv != AE_URING_RECV_NONE) {
+        if (aeUringSubmit(state, 1, NULL) < 0 && errno != EINTR) break;
+        aeUringReap(eventLoop, state);
+    }
+}
+
+static void aeUringClose(aeEventLoop *eventLoop, int fd) {
+    aeUringState *state = (aeUringState*)eventLoop->apidata;
+    aeUringFile *f = &state->files[fd];
+
+    if (f->recv == AE_URING_RECV_ARMED) {
+        aeUringCancel(state, aeUringUserData(fd, f->fileGen, AE_URING_OP_RECV));
+        f->recv = AE_URING_RECV_CANCELLING;
+    }
+    aeUringSend *op = f->send;
+    if (op != NULL && !op->submitted && aeUringQueueSend(state, op) == -1) {
+        zfree(op);  /* never reached the kernel */
+        op = NULL;
+    }
+    aeUringDropBufs(state, f);
+    f->fileGen++;
+    aeUringFileInit(f);
+
+    if (op != NULL) {
+        /* aeWritev() told the caller the reply was written (like the one of
+         * QUIT), so the fd stays open until it is sent, or the peer stops
+         * reading for AE_URING_CLOSE_TIMEOUT seconds. The fd number can't be
+         * reused meanwhile. */
+        op->fClose = 1;
+        op->closeBy = time(NULL) + AE_URING_CLOSE_TIMEOUT;
+        op->nextClosing = state->closing;
+        state->closing = op;
+        aeUringSubmit(state, 0, NULL);
+        return;
+    }
+
+    /* SQEs naming this fd must reach the kernel before the number is reused */
+    if (state->sqTailLocal != *state->sqTail) aeUringSubmit(state, 0, NULL);
+    close(fd);
+}
+
+/* Each event loop starts out on epoll and can be switched with aeSetApi() */
+static int aeApiCreate(aeEventLoop *eventLoop) {
+    return eventLoop->fIoUring ? aeUringCreate(eventLoop) : aeEpollCreate(eventLoop);
+}
+
+static int aeApiResize(aeEventLoop *eventLoop, int setsize) {
+    return eventLoop->fIoUring ? aeUringResize(eventLoop, setsize) : aeEpollResize(eventLoop, setsize);
+}
+
+static void aeApiFree(aeEventLoop *eventLoop) {
+    if (eventLoop->fIoUring) aeUringFree(eventLoop);
+    else aeEpollFree(eventLoop);
+}
+
+static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    return eventLoop->fIoUring ? aeUringAddEvent(eventLoop, fd, mask) : aeEpollAddEvent(eventLoop, fd, mask);
+}
+
+static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
+    if (eventLoop->fIoUring) aeUringDelEvent(eventLoop, fd, delmask);
+    else aeEpollDelEvent(eventLoop, fd, delmask);
+}
+
+static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
+    return eventLoop->fIoUring ? aeUringPoll(eventLoop, tvp) : aeEpollPoll(eventLoop, tvp);
+}
+
+static ssize_t aeApiRead(aeEventLoop *eventLoop, int fd, void *buf, size_t len) {
+    return eventLoop->fIoUring ? aeUringRead(eventLoop, fd, buf, len) : read(fd, buf, len);
+}
+
+static ssize_t aeApiWritev(aeEventLoop *eventLoop, int fd, const struct iovec *iov, int iovcnt) {
+    return eventLoop->fIoUring ? aeUringWritev(eventLoop, fd, iov, iovcnt) : writev(fd, iov, iovcnt);
+}
+
+static void aeApiUnbuffer(aeEventLoop *eventLoop, int fd) {
+    if (eventLoop->fIoUring) aeUringUnbuffer(eventLoop, fd);
+}
+
+static void aeApiClose(aeEventLoop *eventLoop, int fd) {
+    if (eventLoop->fIoUring) aeUringClose(eventLoop, fd);
+    else close(fd);
+}
+
+static const char *aeApiName(void) {
+    return g_fUseIoUring ? "io_uring" : aeEpollName();
+}
+
+/* Move an event loop to another backend, re-registering its file events */
+static int aeApiSelect(aeEventLoop *eventLoop, const char *name) {
+    int fIoUring;
+
+    if (!strcasecmp(name, "epoll")) fIoUring = 0;
+    else if (!strcasecmp(name, "io_uring")) fIoUring = 1;
+    else return -1;
+    if (fIoUring && !aeUringSupported()) return -1;
+    if (fIoUring == eventLoop->fIoUring) return 0;
+
+    void *apidataOld = eventLoop->apidata;
+    eventLoop->fIoUring = fIoUring;
+    if (aeApiCreate(eventLoop) == -1) {
+        eventLoop->apidata = apidataOld;
+        eventLoop->fIoUring = !fIoUring;
+        return -1;
+    }
+    void *apidataNew = eventLoop->apidata;
+    eventLoop->apidata = apidataOld;
+    eventLoop->fIoUring = !fIoUring;
+    aeApiFree(eventLoop);
+    eventLoop->apidata = apidataNew;
+    eventLoop->fIoUring = fIoUring;
+
+    for (int fd = 0; fd <= eventLoop->maxfd; ++fd) {
+        int mask = eventLoop->events[fd].mask;
+        if (!(mask & (AE_READABLE|AE_WRITABLE))) continue;
+        eventLoop->events[fd].mask = AE_NONE;   /* so epoll does an ADD */
+        aeApiAddEvent(eventLoop, fd, mask & (AE_READABLE|AE_WRITABLE));
+        eventLoop->events[fd].mask = mask;
+    }
+    g_fUseIoUring = fIoUring;
+    return 0;
+}
@@ -536,7 +536,7 @@ void clusterReset(int hard) {
     /* Turn into master. */
     if (nodeIsSlave(myself)) {
         clusterSetNodeAsMaster(myself);
-        replicationUnsetMaster();
+        replicationUnsetAllMasters();
         emptyDb(-1,EMPTYDB_NO_FLAGS,NULL);
     }
 
@@ -623,7 +623,7 @@ void clusterAcceptHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
 
     /* If the server is starting up, don't accept cluster connections:
      * UPDATE messages may interact with the database content. */
-    if (server.masterhost == NULL && server.loading) return;
+    if (listLength(server.masters) == 0 && server.loading) return;
 
     while(max--) {
         cfd = anetTcpAccept(server.neterr, fd, cip, sizeof(cip), &cport);
@@ -1493,7 +1493,7 @@ int nodeUpdateAddressIfNeeded(clusterNode *node, clusterLink *link,
     /* Check if this is our master and we have to change the
      * replication target as well. */
     if (nodeIsSlave(myself) && myself->slaveof == node)
-        replicationSetMaster(node->ip, node->port);
+        replicationAddMaster(node->ip, node->port);
     return 1;
 }
 
@@ -2913,7 +2913,7 @@ void clusterFailoverReplaceYourMaster(void) {
 
     /* 1) Turn this node into a master. */
     clusterSetNodeAsMaster(myself);
-    replicationUnsetMaster();
+    replicationUnsetAllMasters();
 
     /* 2) Claim all the slots assigned to our master. */
     for (j = 0; j < CLUSTER_SLOTS; j++) {
@@ -2945,6 +2945,7 @@ void clusterFailoverReplaceYourMaster(void) {
  */
 void clusterHandleSlaveFailover(void) {
     mstime_t data_age;
+    redisMaster *mi = firstMaster();
     mstime_t auth_age = mstime() - server.cluster->failover_auth_time;
     int needed_quorum = (server.cluster->size / 2) + 1;
     int manual_failover = server.cluster->mf_end != 0 &&
@@ -2985,11 +2986,11 @@ void clusterHandleSlaveFailover(void) {
 
     /* Set data_age to the number of seconds we are disconnected from
      * the master. */
-    if (server.repl_state == REPL_STATE_CONNECTED) {
-        data_age = (mstime_t)(server.unixtime - server.master->lastinteraction)
+    if (mi && mi->repl_state == REPL_STATE_CONNECTED) {
+        data_age = (mstime_t)(server.unixtime - mi->master->lastinteraction)
                    * 1000;
     } else {
-        data_age = (mstime_t)(server.unixtime - server.repl_down_since) * 1000;
+        data_age = (mstime_t)(server.unixtime - (mi ? mi->repl_down_since : 0)) * 1000;
     }
 
     /* Remove the node timeout from the data age as it is fine that we are
@@ -3559,11 +3560,11 @@ void clusterCron(void) {
      * enable it if we know the address of our master and it appears to
      * be up. */
     if (nodeIsSlave(myself) &&
-        server.masterhost == NULL &&
+        listLength(server.masters) == 0 &&
         myself->slaveof &&
         nodeHasAddr(myself->slaveof))
     {
-        replicationSetMaster(myself->slaveof->ip, myself->slaveof->port);
+        replicationAddMaster(myself->slaveof->ip, myself->slaveof->port);
     }
 
     /* Abourt a manual failover if the timeout is reached. */
@@ -3943,7 +3944,7 @@ void clusterSetMaster(clusterNode *n) {
     }
     myself->slaveof = n;
     clusterNodeAddSlave(n,myself);
-    replicationSetMaster(n->ip, n->port);
+    replicationAddMaster(n->ip, n->port);
     resetManualFailover();
 }
 
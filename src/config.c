@@ -91,6 +91,13 @@ configEnum aof_fsync_enum[] = {
     {NULL, 0}
 };
 
+configEnum repl_diskless_load_enum[] = {
+    {"disabled", REPL_DISKLESS_LOAD_DISABLED},
+    {"on-empty-db", REPL_DISKLESS_LOAD_WHEN_DB_EMPTY},
+    {"swapdb", REPL_DISKLESS_LOAD_SWAPDB},
+    {NULL, 0}
+};
+
 /* Output buffer limits presets. */
 clientBufferLimitsConfig clientBufferLimitsDefaults[CLIENT_TYPE_OBUF_COUNT] = {
     {0, 0, 0}, /* normal */
@@ -335,6 +342,18 @@ void loadServerConfigFromString(char *config) {
                 err = "maxmemory-samples must be 1 or greater";
                 goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"maxmemory-eviction-thread") && argc == 2) {
+            if ((server.maxmemory_eviction_thread = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"maxmemory-eviction-low-watermark") && argc == 2) {
+            server.maxmemory_eviction_low_watermark = atoi(argv[1]);
+            if (server.maxmemory_eviction_low_watermark < 1 ||
+                server.maxmemory_eviction_low_watermark > 100)
+            {
+                err = "maxmemory-eviction-low-watermark must be between 1 and 100";
+                goto loaderr;
+            }
         } else if ((!strcasecmp(argv[0],"proto-max-bulk-len")) && argc == 2) {
             server.proto_max_bulk_len = memtoll(argv[1],NULL);
         } else if ((!strcasecmp(argv[0],"client-query-buffer-limit")) && argc == 2) {
@@ -354,9 +373,10 @@ void loadServerConfigFromString(char *config) {
         } else if ((!strcasecmp(argv[0],"slaveof") ||
                     !strcasecmp(argv[0],"replicaof")) && argc == 3) {
             slaveof_linenum = linenum;
-            server.masterhost = sdsnew(argv[1]);
-            server.masterport = atoi(argv[2]);
-            server.repl_state = REPL_STATE_CONNECT;
+            /* Without multi-master only the last directive is used, see
+             * the sanity checks below. */
+            redisMaster *mi = replicationCreateMasterInfo(argv[1], atoi(argv[2]));
+            mi->repl_state = REPL_STATE_CONNECT;
         } else if ((!strcasecmp(argv[0],"repl-ping-slave-period") ||
                     !strcasecmp(argv[0],"repl-ping-replica-period")) &&
                     argc == 2)
@@ -380,6 +400,12 @@ void loadServerConfigFromString(char *config) {
             if ((server.repl_diskless_sync = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"repl-diskless-load") && argc==2) {
+            server.repl_diskless_load = configEnumGetValue(repl_diskless_load_enum,argv[1]);
+            if (server.repl_diskless_load == INT_MIN) {
+                err = "argument must be 'disabled', 'on-empty-db' or 'swapdb'";
+                goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"repl-diskless-sync-delay") && argc==2) {
             server.repl_diskless_sync_delay = atoi(argv[1]);
             if (server.repl_diskless_sync_delay < 0) {
@@ -528,6 +554,24 @@ void loadServerConfigFromString(char *config) {
                  yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"rdb-load-threads") && argc == 2) {
+            server.rdb_load_threads = atoi(argv[1]);
+            if (server.rdb_load_threads < 0 ||
+                server.rdb_load_threads > CONFIG_MAX_RDB_LOAD_THREADS)
+            {
+                err = "Invalid number of rdb load threads"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"rdb-save-threads") && argc == 2) {
+            server.rdb_save_threads = atoi(argv[1]);
+            if (server.rdb_save_threads < 0 ||
+                server.rdb_save_threads > CONFIG_MAX_RDB_SAVE_THREADS)
+            {
+                err = "Invalid number of rdb save threads"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"forkless-bgsave") && argc == 2) {
+            if ((server.forkless_bgsave = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"aof-load-truncated") && argc == 2) {
             if ((server.aof_load_truncated = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
@@ -560,6 +604,19 @@ void loadServerConfigFromString(char *config) {
         } else if(!strcasecmp(argv[0],"db-s3-object") && argc == 2) {
             zfree(server.rdb_s3bucketpath);
             server.rdb_s3bucketpath = zstrdup(argv[1]);
+        } else if (!strcasecmp(argv[0],"s3-endpoint") && argc == 2) {
+            zfree(server.s3_endpoint);
+            server.s3_endpoint = zstrdup(argv[1]);
+        } else if (!strcasecmp(argv[0],"s3-region") && argc == 2) {
+            zfree(server.s3_region);
+            server.s3_region = zstrdup(argv[1]);
+        } else if (!strcasecmp(argv[0],"s3-threads") && argc == 2) {
+            server.s3_threads = atoi(argv[1]);
+            if (server.s3_threads < 1 ||
+                server.s3_threads > CONFIG_MAX_S3_THREADS)
+            {
+                err = "Invalid number of S3 threads"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"active-defrag-threshold-lower") && argc == 2) {
             server.active_defrag_threshold_lower = atoi(argv[1]);
             if (server.active_defrag_threshold_lower < 0 ||
@@ -714,6 +771,14 @@ void loadServerConfigFromString(char *config) {
             server.lua_time_limit = strtoll(argv[1],NULL,10);
         } else if (!strcasecmp(argv[0],"lua-replicate-commands") && argc == 2) {
             server.lua_always_replicate_commands = yesnotoi(argv[1]);
+        } else if (!strcasecmp(argv[0],"lua-shard-scripts") && argc == 2) {
+            if ((server.lua_shard_scripts = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"lua-persist-scripts") && argc == 2) {
+            if ((server.lua_persist_scripts = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"slowlog-log-slower-than") &&
                    argc == 2)
         {
@@ -834,12 +899,46 @@ void loadServerConfigFromString(char *config) {
             err = "KeyDB not compliled with scratch-file support.";
             goto loaderr;
 #endif
+        } else if (!strcasecmp(argv[0],"scratch-file-tiering") && argc == 2) {
+            if ((server.scratch_file_tiering = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+#ifndef USE_MEMKIND
+            if (server.scratch_file_tiering) {
+                err = "KeyDB not compliled with scratch-file support.";
+                goto loaderr;
+            }
+#endif
+        } else if (!strcasecmp(argv[0],"scratch-file-tiering-lfu-threshold") && argc == 2) {
+            server.scratch_file_tiering_lfu_threshold = atoi(argv[1]);
+            if (server.scratch_file_tiering_lfu_threshold < 0 ||
+                server.scratch_file_tiering_lfu_threshold > 255)
+            {
+                err = "scratch-file-tiering-lfu-threshold must be between 0 and 255";
+                goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"server-threads") && argc == 2) {
             server.cthreads = atoi(argv[1]);
             if (server.cthreads <= 0 || server.cthreads > MAX_EVENT_LOOPS) {
                 err = "Invalid number of threads specified";
                 goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"keyspace-lock-shards") && argc == 2) {
+            server.keyspace_lock_shards = atoi(argv[1]);
+            if (server.keyspace_lock_shards < 0 ||
+                server.keyspace_lock_shards > 65536 ||
+                (server.keyspace_lock_shards & (server.keyspace_lock_shards-1)))
+            {
+                err = "keyspace-lock-shards must be 0 or a power of two no larger than 65536";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"replica-apply-threads") && argc == 2) {
+            server.repl_apply_threads = atoi(argv[1]);
+            if (server.repl_apply_threads < 0 ||
+                server.repl_apply_threads > CONFIG_MAX_REPL_APPLY_THREADS)
+            {
+                err = "Invalid number of replica apply threads"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"server-thread-affinity") && argc == 2) {
             if (strcasecmp(argv[1], "true") == 0) {
                 server.fThreadAffinity = TRUE;
@@ -849,6 +948,10 @@ void loadServerConfigFromString(char *config) {
                 err = "Unknown argument: server-thread-affinity expects either true or false";
                 goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"io-uring") && argc == 2) {
+            if ((server.fIoUring = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0], "active-replica") && argc == 2) {
             server.fActiveReplica = yesnotoi(argv[1]);
             if (server.repl_slave_ro) {
@@ -859,6 +962,14 @@ void loadServerConfigFromString(char *config) {
                 server.fActiveReplica = CONFIG_DEFAULT_ACTIVE_REPLICA;
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"active-replica-timestamps") && argc == 2) {
+            if ((server.fActiveReplicaTimestamps = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"multi-master") && argc == 2) {
+            if ((server.fMultiMaster = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else {
             err = "Bad directive or wrong number of arguments"; goto loaderr;
         }
@@ -866,12 +977,26 @@ void loadServerConfigFromString(char *config) {
     }
 
     /* Sanity checks. */
-    if (server.cluster_enabled && server.masterhost) {
+    if (server.cluster_enabled && listLength(server.masters)) {
         linenum = slaveof_linenum;
         i = linenum-1;
         err = "replicaof directive not allowed in cluster mode";
         goto loaderr;
     }
+    if (server.repl_apply_threads && !server.keyspace_lock_shards) {
+        err = "replica-apply-threads requires keyspace-lock-shards";
+        goto loaderr;
+    }
+    if (server.fMultiMaster && (!server.fActiveReplica || server.cluster_enabled)) {
+        err = "multi-master requires active-replica and is not allowed in cluster mode";
+        goto loaderr;
+    }
+    while (!server.fMultiMaster && listLength(server.masters) > 1) {
+        redisMaster *mi = listNodeValue(listFirst(server.masters));
+        sdsfree(mi->masterhost);
+        zfree(mi);
+        listDelNode(server.masters,listFirst(server.masters));
+    }
 
     sdsfreesplitres(lines,totlines);
     return;
@@ -1151,6 +1276,8 @@ void configSetCommand(client *c) {
       "aof-rewrite-incremental-fsync",server.aof_rewrite_incremental_fsync) {
     } config_set_bool_field(
       "rdb-save-incremental-fsync",server.rdb_save_incremental_fsync) {
+    } config_set_bool_field(
+      "forkless-bgsave",server.forkless_bgsave) {
     } config_set_bool_field(
       "aof-load-truncated",server.aof_load_truncated) {
     } config_set_bool_field(
@@ -1190,6 +1317,18 @@ void configSetCommand(client *c) {
       "stop-writes-on-bgsave-error",server.stop_writes_on_bgsave_err) {
     } config_set_bool_field(
       "lazyfree-lazy-eviction",server.lazyfree_lazy_eviction) {
+    } config_set_bool_field(
+      "maxmemory-eviction-thread",server.maxmemory_eviction_thread) {
+        if (server.maxmemory_eviction_thread) evictionThreadStart();
+    } config_set_bool_field(
+      "scratch-file-tiering",server.scratch_file_tiering) {
+        if (tieringApplyConfig() == C_ERR) {
+            server.scratch_file_tiering = 0;
+            addReplyError(c,
+                "-DISABLED Tiering cannot be enabled: it requires a KeyDB "
+                "server compiled with memkind and a scratch-file-path");
+            return;
+        }
     } config_set_bool_field(
       "lazyfree-lazy-expire",server.lazyfree_lazy_expire) {
     } config_set_bool_field(
@@ -1202,6 +1341,12 @@ void configSetCommand(client *c) {
       "no-appendfsync-on-rewrite",server.aof_no_fsync_on_rewrite) {
     } config_set_bool_field(
       "dynamic-hz",server.dynamic_hz) {
+    } config_set_bool_field(
+      "active-replica-timestamps",server.fActiveReplicaTimestamps) {
+    } config_set_bool_field(
+      "lua-shard-scripts",server.lua_shard_scripts) {
+    } config_set_bool_field(
+      "lua-persist-scripts",server.lua_persist_scripts) {
 
     /* Numerical fields.
      * config_set_numerical_field(name,var,min,max) */
@@ -1209,6 +1354,10 @@ void configSetCommand(client *c) {
       "tcp-keepalive",server.tcpkeepalive,0,INT_MAX) {
     } config_set_numerical_field(
       "maxmemory-samples",server.maxmemory_samples,1,INT_MAX) {
+    } config_set_numerical_field(
+      "maxmemory-eviction-low-watermark",server.maxmemory_eviction_low_watermark,1,100) {
+    } config_set_numerical_field(
+      "scratch-file-tiering-lfu-threshold",server.scratch_file_tiering_lfu_threshold,0,255) {
     } config_set_numerical_field(
       "lfu-log-factor",server.lfu_log_factor,0,INT_MAX) {
     } config_set_numerical_field(
@@ -1301,6 +1450,10 @@ void configSetCommand(client *c) {
       "cluster-slave-validity-factor",server.cluster_slave_validity_factor,0,INT_MAX) {
     } config_set_numerical_field(
       "cluster-replica-validity-factor",server.cluster_slave_validity_factor,0,INT_MAX) {
+    } config_set_numerical_field(
+      "rdb-load-threads",server.rdb_load_threads,0,CONFIG_MAX_RDB_LOAD_THREADS) {
+    } config_set_numerical_field(
+      "rdb-save-threads",server.rdb_save_threads,0,CONFIG_MAX_RDB_SAVE_THREADS) {
     } config_set_numerical_field(
       "hz",server.config_hz,0,INT_MAX) {
         /* Hz is more an hint from the user, so we accept values out of range
@@ -1340,6 +1493,8 @@ void configSetCommand(client *c) {
       "maxmemory-policy",server.maxmemory_policy,maxmemory_policy_enum) {
     } config_set_enum_field(
       "appendfsync",server.aof_fsync,aof_fsync_enum) {
+    } config_set_enum_field(
+      "repl-diskless-load",server.repl_diskless_load,repl_diskless_load_enum) {
 
     /* Everyhing else is an error... */
     } config_set_else {
@@ -1420,6 +1575,8 @@ void configGetCommand(client *c) {
     config_get_numerical_field("proto-max-bulk-len",server.proto_max_bulk_len);
     config_get_numerical_field("client-query-buffer-limit",server.client_max_querybuf_len);
     config_get_numerical_field("maxmemory-samples",server.maxmemory_samples);
+    config_get_numerical_field("maxmemory-eviction-low-watermark",server.maxmemory_eviction_low_watermark);
+    config_get_numerical_field("scratch-file-tiering-lfu-threshold",server.scratch_file_tiering_lfu_threshold);
     config_get_numerical_field("lfu-log-factor",server.lfu_log_factor);
     config_get_numerical_field("lfu-decay-time",server.lfu_decay_time);
     config_get_numerical_field("timeout",server.maxidletime);
@@ -1465,6 +1622,8 @@ void configGetCommand(client *c) {
     config_get_numerical_field("cluster-announce-bus-port",server.cluster_announce_bus_port);
     config_get_numerical_field("tcp-backlog",server.tcp_backlog);
     config_get_numerical_field("databases",server.dbnum);
+    config_get_numerical_field("keyspace-lock-shards",server.keyspace_lock_shards);
+    config_get_numerical_field("replica-apply-threads",server.repl_apply_threads);
     config_get_numerical_field("repl-ping-slave-period",server.repl_ping_slave_period);
     config_get_numerical_field("repl-ping-replica-period",server.repl_ping_slave_period);
     config_get_numerical_field("repl-timeout",server.repl_timeout);
@@ -1481,6 +1640,8 @@ void configGetCommand(client *c) {
     config_get_numerical_field("min-slaves-max-lag",server.repl_min_slaves_max_lag);
     config_get_numerical_field("min-replicas-max-lag",server.repl_min_slaves_max_lag);
     config_get_numerical_field("hz",server.config_hz);
+    config_get_numerical_field("rdb-load-threads",server.rdb_load_threads);
+    config_get_numerical_field("rdb-save-threads",server.rdb_save_threads);
     config_get_numerical_field("cluster-node-timeout",server.cluster_node_timeout);
     config_get_numerical_field("cluster-migration-barrier",server.cluster_migration_barrier);
     config_get_numerical_field("cluster-slave-validity-factor",server.cluster_slave_validity_factor);
@@ -1526,12 +1687,18 @@ void configGetCommand(client *c) {
             server.aof_rewrite_incremental_fsync);
     config_get_bool_field("rdb-save-incremental-fsync",
             server.rdb_save_incremental_fsync);
+    config_get_bool_field("forkless-bgsave",
+            server.forkless_bgsave);
     config_get_bool_field("aof-load-truncated",
             server.aof_load_truncated);
     config_get_bool_field("aof-use-rdb-preamble",
             server.aof_use_rdb_preamble);
     config_get_bool_field("lazyfree-lazy-eviction",
             server.lazyfree_lazy_eviction);
+    config_get_bool_field("maxmemory-eviction-thread",
+            server.maxmemory_eviction_thread);
+    config_get_bool_field("scratch-file-tiering",
+            server.scratch_file_tiering);
     config_get_bool_field("lazyfree-lazy-expire",
             server.lazyfree_lazy_expire);
     config_get_bool_field("lazyfree-lazy-server-del",
@@ -1540,8 +1707,18 @@ void configGetCommand(client *c) {
             server.repl_slave_lazy_flush);
     config_get_bool_field("replica-lazy-flush",
             server.repl_slave_lazy_flush);
+    config_get_bool_field("io-uring",
+            server.fIoUring);
     config_get_bool_field("dynamic-hz",
             server.dynamic_hz);
+    config_get_bool_field("active-replica-timestamps",
+            server.fActiveReplicaTimestamps);
+    config_get_bool_field("multi-master",
+            server.fMultiMaster);
+    config_get_bool_field("lua-shard-scripts",
+            server.lua_shard_scripts);
+    config_get_bool_field("lua-persist-scripts",
+            server.lua_persist_scripts);
 
     /* Enum values */
     config_get_enum_field("maxmemory-policy",
@@ -1552,6 +1729,8 @@ void configGetCommand(client *c) {
             server.supervised_mode,supervised_mode_enum);
     config_get_enum_field("appendfsync",
             server.aof_fsync,aof_fsync_enum);
+    config_get_enum_field("repl-diskless-load",
+            server.repl_diskless_load,repl_diskless_load_enum);
     config_get_enum_field("syslog-facility",
             server.syslog_facility,syslog_facility_enum);
 
@@ -1620,14 +1799,23 @@ void configGetCommand(client *c) {
                         "slaveof" : "replicaof";
         char buf[256];
 
-        addReplyBulkCString(c,optname);
-        if (server.masterhost)
+        listIter li;
+        listNode *ln;
+
+        listRewind(server.masters,&li);
+        while ((ln = listNext(&li))) {
+            redisMaster *mi = listNodeValue(ln);
+            addReplyBulkCString(c,optname);
             snprintf(buf,sizeof(buf),"%s %d",
-                server.masterhost, server.masterport);
-        else
-            buf[0] = '\0';
-        addReplyBulkCString(c,buf);
-        matches++;
+                mi->masterhost, mi->masterport);
+            addReplyBulkCString(c,buf);
+            matches++;
+        }
+        if (listLength(server.masters) == 0) {
+            addReplyBulkCString(c,optname);
+            addReplyBulkCString(c,"");
+            matches++;
+        }
     }
     if (stringmatch(pattern,"notify-keyspace-events",1)) {
         robj *flagsobj = createObject(OBJ_STRING,
@@ -2024,13 +2212,19 @@ void rewriteConfigSlaveofOption(struct rewriteConfigState *state, char *option)
     /* If this is a master, we want all the slaveof config options
      * in the file to be removed. Note that if this is a cluster instance
      * we don't want a slaveof directive inside redis.conf. */
-    if (server.cluster_enabled || server.masterhost == NULL) {
+    if (server.cluster_enabled || listLength(server.masters) == 0) {
         rewriteConfigMarkAsProcessed(state,option);
         return;
     }
-    line = sdscatprintf(sdsempty(),"%s %s %d", option,
-        server.masterhost, server.masterport);
-    rewriteConfigRewriteLine(state,option,line,1);
+    listIter li;
+    listNode *ln;
+    listRewind(server.masters,&li);
+    while ((ln = listNext(&li))) {
+        redisMaster *mi = listNodeValue(ln);
+        line = sdscatprintf(sdsempty(),"%s %s %d", option,
+            mi->masterhost, mi->masterport);
+        rewriteConfigRewriteLine(state,option,line,1);
+    }
 }
 
 /* Rewrite the notify-keyspace-events option. */
@@ -2278,6 +2472,9 @@ int rewriteConfig(char *path) {
     rewriteConfigSaveOption(state);
     rewriteConfigUserOption(state);
     rewriteConfigNumericalOption(state,"databases",server.dbnum,CONFIG_DEFAULT_DBNUM);
+    rewriteConfigNumericalOption(state,"keyspace-lock-shards",server.keyspace_lock_shards,CONFIG_DEFAULT_KEYSPACE_LOCK_SHARDS);
+    rewriteConfigNumericalOption(state,"replica-apply-threads",server.repl_apply_threads,CONFIG_DEFAULT_REPL_APPLY_THREADS);
+    rewriteConfigYesNoOption(state,"io-uring",server.fIoUring,CONFIG_DEFAULT_IO_URING);
     rewriteConfigYesNoOption(state,"stop-writes-on-bgsave-error",server.stop_writes_on_bgsave_err,CONFIG_DEFAULT_STOP_WRITES_ON_BGSAVE_ERROR);
     rewriteConfigYesNoOption(state,"rdbcompression",server.rdb_compression,CONFIG_DEFAULT_RDB_COMPRESSION);
     rewriteConfigYesNoOption(state,"rdbchecksum",server.rdb_checksum,CONFIG_DEFAULT_RDB_CHECKSUM);
@@ -2298,6 +2495,7 @@ int rewriteConfig(char *path) {
     rewriteConfigYesNoOption(state,"repl-disable-tcp-nodelay",server.repl_disable_tcp_nodelay,CONFIG_DEFAULT_REPL_DISABLE_TCP_NODELAY);
     rewriteConfigYesNoOption(state,"repl-diskless-sync",server.repl_diskless_sync,CONFIG_DEFAULT_REPL_DISKLESS_SYNC);
     rewriteConfigNumericalOption(state,"repl-diskless-sync-delay",server.repl_diskless_sync_delay,CONFIG_DEFAULT_REPL_DISKLESS_SYNC_DELAY);
+    rewriteConfigEnumOption(state,"repl-diskless-load",server.repl_diskless_load,repl_diskless_load_enum,CONFIG_DEFAULT_REPL_DISKLESS_LOAD);
     rewriteConfigNumericalOption(state,"replica-priority",server.slave_priority,CONFIG_DEFAULT_SLAVE_PRIORITY);
     rewriteConfigNumericalOption(state,"min-replicas-to-write",server.repl_min_slaves_to_write,CONFIG_DEFAULT_MIN_SLAVES_TO_WRITE);
     rewriteConfigNumericalOption(state,"min-replicas-max-lag",server.repl_min_slaves_max_lag,CONFIG_DEFAULT_MIN_SLAVES_MAX_LAG);
@@ -2308,6 +2506,10 @@ int rewriteConfig(char *path) {
     rewriteConfigBytesOption(state,"client-query-buffer-limit",server.client_max_querybuf_len,PROTO_MAX_QUERYBUF_LEN);
     rewriteConfigEnumOption(state,"maxmemory-policy",server.maxmemory_policy,maxmemory_policy_enum,CONFIG_DEFAULT_MAXMEMORY_POLICY);
     rewriteConfigNumericalOption(state,"maxmemory-samples",server.maxmemory_samples,CONFIG_DEFAULT_MAXMEMORY_SAMPLES);
+    rewriteConfigYesNoOption(state,"maxmemory-eviction-thread",server.maxmemory_eviction_thread,CONFIG_DEFAULT_MAXMEMORY_EVICTION_THREAD);
+    rewriteConfigNumericalOption(state,"maxmemory-eviction-low-watermark",server.maxmemory_eviction_low_watermark,CONFIG_DEFAULT_MAXMEMORY_EVICTION_LOW_WATERMARK);
+    rewriteConfigYesNoOption(state,"scratch-file-tiering",server.scratch_file_tiering,CONFIG_DEFAULT_SCRATCH_FILE_TIERING);
+    rewriteConfigNumericalOption(state,"scratch-file-tiering-lfu-threshold",server.scratch_file_tiering_lfu_threshold,CONFIG_DEFAULT_SCRATCH_FILE_TIERING_LFU_THRESHOLD);
     rewriteConfigNumericalOption(state,"lfu-log-factor",server.lfu_log_factor,CONFIG_DEFAULT_LFU_LOG_FACTOR);
     rewriteConfigNumericalOption(state,"lfu-decay-time",server.lfu_decay_time,CONFIG_DEFAULT_LFU_DECAY_TIME);
     rewriteConfigNumericalOption(state,"active-defrag-threshold-lower",server.active_defrag_threshold_lower,CONFIG_DEFAULT_DEFRAG_THRESHOLD_LOWER);
@@ -2323,6 +2525,8 @@ int rewriteConfig(char *path) {
     rewriteConfigNumericalOption(state,"auto-aof-rewrite-percentage",server.aof_rewrite_perc,AOF_REWRITE_PERC);
     rewriteConfigBytesOption(state,"auto-aof-rewrite-min-size",server.aof_rewrite_min_size,AOF_REWRITE_MIN_SIZE);
     rewriteConfigNumericalOption(state,"lua-time-limit",server.lua_time_limit,LUA_SCRIPT_TIME_LIMIT);
+    rewriteConfigYesNoOption(state,"lua-shard-scripts",server.lua_shard_scripts,CONFIG_DEFAULT_LUA_SHARD_SCRIPTS);
+    rewriteConfigYesNoOption(state,"lua-persist-scripts",server.lua_persist_scripts,CONFIG_DEFAULT_LUA_PERSIST_SCRIPTS);
     rewriteConfigYesNoOption(state,"cluster-enabled",server.cluster_enabled,0);
     rewriteConfigStringOption(state,"cluster-config-file",server.cluster_configfile,CONFIG_DEFAULT_CLUSTER_CONFIG_FILE);
     rewriteConfigYesNoOption(state,"cluster-require-full-coverage",server.cluster_require_full_coverage,CLUSTER_DEFAULT_REQUIRE_FULL_COVERAGE);
@@ -2352,6 +2556,9 @@ int rewriteConfig(char *path) {
     rewriteConfigNumericalOption(state,"hz",server.config_hz,CONFIG_DEFAULT_HZ);
     rewriteConfigYesNoOption(state,"aof-rewrite-incremental-fsync",server.aof_rewrite_incremental_fsync,CONFIG_DEFAULT_AOF_REWRITE_INCREMENTAL_FSYNC);
     rewriteConfigYesNoOption(state,"rdb-save-incremental-fsync",server.rdb_save_incremental_fsync,CONFIG_DEFAULT_RDB_SAVE_INCREMENTAL_FSYNC);
+    rewriteConfigNumericalOption(state,"rdb-load-threads",server.rdb_load_threads,CONFIG_DEFAULT_RDB_LOAD_THREADS);
+    rewriteConfigNumericalOption(state,"rdb-save-threads",server.rdb_save_threads,CONFIG_DEFAULT_RDB_SAVE_THREADS);
+    rewriteConfigYesNoOption(state,"forkless-bgsave",server.forkless_bgsave,CONFIG_DEFAULT_FORKLESS_BGSAVE);
     rewriteConfigYesNoOption(state,"aof-load-truncated",server.aof_load_truncated,CONFIG_DEFAULT_AOF_LOAD_TRUNCATED);
     rewriteConfigYesNoOption(state,"aof-use-rdb-preamble",server.aof_use_rdb_preamble,CONFIG_DEFAULT_AOF_USE_RDB_PREAMBLE);
     rewriteConfigEnumOption(state,"supervised",server.supervised_mode,supervised_mode_enum,SUPERVISED_NONE);
@@ -2361,6 +2568,8 @@ int rewriteConfig(char *path) {
     rewriteConfigYesNoOption(state,"replica-lazy-flush",server.repl_slave_lazy_flush,CONFIG_DEFAULT_SLAVE_LAZY_FLUSH);
     rewriteConfigYesNoOption(state,"dynamic-hz",server.dynamic_hz,CONFIG_DEFAULT_DYNAMIC_HZ);
     rewriteConfigYesNoOption(state,"active-replica",server.fActiveReplica,CONFIG_DEFAULT_ACTIVE_REPLICA);
+    rewriteConfigYesNoOption(state,"active-replica-timestamps",server.fActiveReplicaTimestamps,CONFIG_DEFAULT_ACTIVE_REPLICA_TIMESTAMPS);
+    rewriteConfigYesNoOption(state,"multi-master",server.fMultiMaster,CONFIG_DEFAULT_MULTI_MASTER);
 
     /* Rewrite Sentinel config if in Sentinel mode. */
     if (server.sentinel_mode) rewriteConfigSentinelOption(state);
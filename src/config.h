@@ -78,6 +78,11 @@
 #define HAVE_EPOLL 1
 #endif
 
+/* io_uring can be selected at runtime instead of epoll (needs 5.11 headers) */
+#if defined(__linux__) && (LINUX_VERSION_CODE >= 0x050b00)
+#define HAVE_IO_URING 1
+#endif
+
 #if (defined(__APPLE__) && defined(MAC_OS_X_VERSION_10_6)) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined (__NetBSD__)
 #define HAVE_KQUEUE 1
 #endif
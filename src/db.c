@@ -69,6 +69,7 @@ robj *lookupKey(redisDb *db, robj *key, int flags) {
             } else {
                 val->lru = LRU_CLOCK();
             }
+            if (server.scratch_file_tiering) tieringPromoteValue(val);
         }
         return val;
     } else {
@@ -99,14 +100,14 @@ robj *lookupKey(redisDb *db, robj *key, int flags) {
  * expiring our key via DELs in the replication link. */
 robj *lookupKeyReadWithFlags(redisDb *db, robj *key, int flags) {
     robj *val;
-    serverAssert(GlobalLocksAcquired());
+    serverAssert(KeyspaceLocksAcquired());
 
     if (expireIfNeeded(db,key) == 1) {
         /* Key expired. If we are in the context of a master, expireIfNeeded()
          * returns 0 only when the key does not exist at all, so it's safe
          * to return NULL ASAP. */
-        if (server.masterhost == NULL) {
-            server.stat_keyspace_misses++;
+        if (listLength(server.masters) == 0) {
+            atomicIncr(server.stat_keyspace_misses,1);
             return NULL;
         }
 
@@ -123,19 +124,19 @@ robj *lookupKeyReadWithFlags(redisDb *db, robj *key, int flags) {
          *
          * Notably this covers GETs when slaves are used to scale reads. */
         if (server.current_client &&
-            server.current_client != server.master &&
+            !(server.current_client->flags & CLIENT_MASTER) &&
             server.current_client->cmd &&
             server.current_client->cmd->flags & CMD_READONLY)
         {
-            server.stat_keyspace_misses++;
+            atomicIncr(server.stat_keyspace_misses,1);
             return NULL;
         }
     }
     val = lookupKey(db,key,flags);
     if (val == NULL)
-        server.stat_keyspace_misses++;
+        atomicIncr(server.stat_keyspace_misses,1);
     else
-        server.stat_keyspace_hits++;
+        atomicIncr(server.stat_keyspace_hits,1);
     return val;
 }
 
@@ -151,6 +152,7 @@ robj *lookupKeyRead(redisDb *db, robj *key) {
  * Returns the linked value object if the key exists or NULL if the key
  * does not exist in the specified DB. */
 robj *lookupKeyWrite(redisDb *db, robj *key) {
+    snapshotPreserveKey(db,key);
     expireIfNeeded(db,key);
     return lookupKey(db,key,LOOKUP_NONE);
 }
@@ -168,6 +170,7 @@ robj *lookupKeyWriteOrReply(client *c, robj *key, robj *reply) {
 }
 
 int dbAddCore(redisDb *db, robj *key, robj *val) {
+    snapshotPreserveKey(db,key);
     sds copy = sdsdup(ptrFromObj(key));
     int retval = dictAdd(db->pdict, copy, val);
 
@@ -196,9 +199,27 @@ void dbAdd(redisDb *db, robj *key, robj *val)
     serverAssertWithInfo(NULL,key,retval == DICT_OK);
 }
 
-/* Insert a key, handling duplicate keys according to fReplace */
-int dbMerge(redisDb *db, robj *key, robj *val, int fReplace)
+/* Insert a key, handling duplicate keys according to fReplace. With
+ * active-replica-timestamps the value written most recently wins instead,
+ * 'stamp' being the one of 'val' (see mvccPack()), so two active replicas
+ * merging each other's data converge. */
+int dbMerge(redisDb *db, robj *key, robj *val, int fReplace, uint64_t stamp)
 {
+    if (server.fActiveReplicaTimestamps)
+    {
+        int fInserted = TRUE;
+        if (dictFind(db->pdict,ptrFromObj(key)) == NULL) {
+            fInserted = (dbAddCore(db, key, val) == DICT_OK);
+        } else {
+            uint64_t stampLocal = getMvccStamp(db,key);
+            if (stampLocal == stamp ? !fReplace : !mvccIsNewer(stamp,stampLocal))
+                return FALSE;
+            setKey(db, key, val);
+        }
+        if (fInserted && stamp) setMvccStamp(db,key,stamp);
+        return fInserted;
+    }
+
     if (fReplace)
     {
         setKey(db, key, val);
@@ -216,6 +237,7 @@ int dbMerge(redisDb *db, robj *key, robj *val, int fReplace)
  *
  * The program is aborted if the key was not already present. */
 void dbOverwrite(redisDb *db, robj *key, robj *val) {
+    snapshotPreserveKey(db,key);
     dictEntry *de = dictFind(db->pdict,ptrFromObj(key));
 
     serverAssertWithInfo(NULL,key,de != NULL);
@@ -276,7 +298,7 @@ robj *dbRandomKey(redisDb *db) {
         key = dictGetKey(de);
         keyobj = createStringObject(key,sdslen(key));
         if (dictFind(db->expires,key)) {
-            if (allvolatile && server.masterhost && --maxtries == 0) {
+            if (allvolatile && listLength(server.masters) && --maxtries == 0) {
                 /* If the DB is composed only of keys with an expire set,
                  * it could happen that all the keys are already logically
                  * expired in the slave, so the function cannot stop because
@@ -298,9 +320,11 @@ robj *dbRandomKey(redisDb *db) {
 
 /* Delete a key, value, and associated expiration entry if any, from the DB */
 int dbSyncDelete(redisDb *db, robj *key) {
+    snapshotPreserveKey(db,key);
     /* Deleting an entry from the expires dict will not free the sds of
      * the key, because it is shared with the main dictionary. */
     if (dictSize(db->expires) > 0) dictDelete(db->expires,ptrFromObj(key));
+    if (dictSize(db->mvcc) > 0) dictDelete(db->mvcc,ptrFromObj(key));
     if (dictDelete(db->pdict,ptrFromObj(key)) == DICT_OK) {
         if (server.cluster_enabled) slotToKeyDel(key);
         return 1;
@@ -385,6 +409,9 @@ long long emptyDb(int dbnum, int flags, void(callback)(void*)) {
         startdb = enddb = dbnum;
     }
 
+    /* A forkless BGSAVE must be done with the DBs before they are emptied. */
+    snapshotDrain(enddb);
+
     for (int j = startdb; j <= enddb; j++) {
         removed += dictSize(server.db[j].pdict);
         if (async) {
@@ -392,7 +419,10 @@ long long emptyDb(int dbnum, int flags, void(callback)(void*)) {
         } else {
             dictEmpty(server.db[j].pdict,callback);
             dictEmpty(server.db[j].expires,callback);
+            dictEmpty(server.db[j].mvcc,callback);
         }
+        /* Size the new tables for the keyspace shard locks right away. */
+        if (server.keyspace_lock_shards) tryResizeHashTables(j);
     }
     if (server.cluster_enabled) {
         if (async) {
@@ -423,6 +453,14 @@ int selectDb(client *c, int id) {
 
 void signalModifiedKey(redisDb *db, robj *key) {
     touchWatchedKey(db,key);
+
+    /* Stamp the key with the time of the command modifying it. Keys loaded
+     * from an RDB keep the timestamp they were saved with. */
+    if (server.fActiveReplicaTimestamps && server.mvcc_cmd_stamp &&
+        !server.loading)
+    {
+        setMvccStamp(db,key,server.mvcc_cmd_stamp);
+    }
 }
 
 void signalFlushedDb(int dbid) {
@@ -474,6 +512,7 @@ void flushallCommand(client *c) {
     int flags;
 
     if (getFlushCommandFlags(c,&flags) == C_ERR) return;
+    if (server.rdb_thread_active) snapshotAbort();
     signalFlushedDb(-1);
     server.dirty += emptyDb(-1,flags,NULL);
     addReply(c,shared.ok);
@@ -1027,6 +1066,7 @@ int dbSwapDatabases(int id1, int id2) {
     if (id1 < 0 || id1 >= server.dbnum ||
         id2 < 0 || id2 >= server.dbnum) return C_ERR;
     if (id1 == id2) return C_OK;
+    snapshotDrain(id1 > id2 ? id1 : id2);
     redisDb aux = server.db[id1];
     redisDb *db1 = &server.db[id1], *db2 = &server.db[id2];
 
@@ -1035,10 +1075,12 @@ int dbSwapDatabases(int id1, int id2) {
      * remain in the same DB they were. */
     db1->pdict = db2->pdict;
     db1->expires = db2->expires;
+    db1->mvcc = db2->mvcc;
     db1->avg_ttl = db2->avg_ttl;
 
     db2->pdict = aux.pdict;
     db2->expires = aux.expires;
+    db2->mvcc = aux.mvcc;
     db2->avg_ttl = aux.avg_ttl;
 
     /* Now we need to handle clients blocked on lists: as an effect
@@ -1091,6 +1133,7 @@ void swapdbCommand(client *c) {
 int removeExpire(redisDb *db, robj *key) {
     /* An expire may only be removed if there is a corresponding entry in the
      * main dict. Otherwise, the key will never be freed. */
+    snapshotPreserveKey(db,key);
     serverAssertWithInfo(NULL,key,dictFind(db->pdict,ptrFromObj(key)) != NULL);
     return dictDelete(db->expires,ptrFromObj(key)) == DICT_OK;
 }
@@ -1101,7 +1144,8 @@ int removeExpire(redisDb *db, robj *key) {
  * after which the key will no longer be considered valid. */
 void setExpire(client *c, redisDb *db, robj *key, long long when) {
     dictEntry *kde, *de;
-    serverAssert(GlobalLocksAcquired());
+    serverAssert(KeyspaceLocksAcquired());
+    snapshotPreserveKey(db,key);
 
     /* Reuse the sds from the main dict in the expire dict */
     kde = dictFind(db->pdict,ptrFromObj(key));
@@ -1109,7 +1153,7 @@ void setExpire(client *c, redisDb *db, robj *key, long long when) {
     de = dictAddOrFind(db->expires,dictGetKey(kde));
     dictSetSignedIntegerVal(de,when);
 
-    int writable_slave = server.masterhost && server.repl_slave_ro == 0;
+    int writable_slave = listLength(server.masters) && server.repl_slave_ro == 0;
     if (c && writable_slave && !(c->flags & CLIENT_MASTER))
         rememberSlaveKeyWithExpire(db,key);
 }
@@ -1129,6 +1173,31 @@ long long getExpire(redisDb *db, robj *key) {
     return dictGetSignedIntegerVal(de);
 }
 
+/*-----------------------------------------------------------------------------
+ * Timestamps API, see active-replica-timestamps
+ *----------------------------------------------------------------------------*/
+
+/* Record 'stamp', packed by mvccPack(), as the time and the origin of the
+ * last write to the key. Nothing is recorded if the key doesn't exist. */
+void setMvccStamp(redisDb *db, robj *key, uint64_t stamp) {
+    dictEntry *kde, *de;
+
+    /* Reuse the sds from the main dict, as the expires dict does. */
+    kde = dictFind(db->pdict,ptrFromObj(key));
+    if (kde == NULL) return;
+    de = dictAddOrFind(db->mvcc,dictGetKey(kde));
+    dictSetUnsignedIntegerVal(de,stamp);
+}
+
+/* Return the stamp of the last write to the key, or 0 if it is unknown. */
+uint64_t getMvccStamp(redisDb *db, robj *key) {
+    dictEntry *de;
+
+    if (dictSize(db->mvcc) == 0 ||
+       (de = dictFind(db->mvcc,ptrFromObj(key))) == NULL) return 0;
+    return dictGetUnsignedIntegerVal(de);
+}
+
 /* Propagate expires into slaves and the AOF file.
  * When a key expires in the master, a DEL operation for this key is sent
  * to all the slaves and the AOF file if enabled.
@@ -1138,7 +1207,7 @@ long long getExpire(redisDb *db, robj *key) {
  * will be consistent even if we allow write operations against expiring
  * keys. */
 void propagateExpire(redisDb *db, robj *key, int lazy) {
-    serverAssert(GlobalLocksAcquired());
+    serverAssert(KeyspaceLocksAcquired());
     robj *argv[2];
 
     argv[0] = lazy ? shared.unlink : shared.del;
@@ -1160,15 +1229,18 @@ int keyIsExpired(redisDb *db, robj *key) {
 
     if (when < 0) return 0; /* No expire for this key */
 
-    /* Don't expire anything while loading. It will be done later. */
-    if (server.loading) return 0;
+    /* Don't expire anything while loading. It will be done later. The
+     * dataset still served while a replica loads a new one aside is not the
+     * one loading. */
+    if (server.loading && !server.async_loading) return 0;
 
     /* If we are in the context of a Lua script, we pretend that time is
      * blocked to when the Lua script started. This way a key can expire
      * only the first time it is accessed and not in the middle of the
      * script execution, making propagation to slaves / AOF consistent.
      * See issue #1525 on Github for more information. */
-    mstime_t now = server.lua_caller ? server.lua_time_start : mstime();
+    mstime_t now = (serverTL != NULL && serverTL->lua_caller) ?
+        serverTL->lua_time_start : mstime();
 
     return now > when;
 }
@@ -1203,10 +1275,15 @@ int expireIfNeeded(redisDb *db, robj *key) {
      * Still we try to return the right information to the caller,
      * that is, 0 if we think the key should be still valid, 1 if
      * we think the key is expired at this time. */
-    if (server.masterhost != NULL) return 1;
+    if (listLength(server.masters)) return 1;
+
+    /* Commands holding a keyspace shard lock for reading can't modify the
+     * keyspace, the key will be deleted later by a writer or by the active
+     * expire cycle. */
+    if (serverTL != NULL && serverTL->fShardReadOnly) return 1;
 
     /* Delete the key */
-    server.stat_expiredkeys++;
+    atomicIncr(server.stat_expiredkeys,1);
     propagateExpire(db,key,server.lazyfree_lazy_expire);
     notifyKeyspaceEvent(NOTIFY_EXPIRED,
         "expired",key,db->id);
@@ -1214,6 +1291,203 @@ int expireIfNeeded(redisDb *db, robj *key) {
                                          dbSyncDelete(db,key);
 }
 
+/* -----------------------------------------------------------------------------
+ * Keyspace shard locks
+ *
+ * When keyspace-lock-shards is set, every DB has an array of shard locks and
+ * a key belongs to the shard selected by the low bits of its dict hash. Since
+ * the keyspace tables are kept at least as large as the number of shards, two
+ * keys that share a dict bucket always share a shard lock. Commands flagged
+ * as "shardable" may then run holding the global lock in shared mode plus the
+ * lock of the single shard they touch, instead of the exclusive global lock.
+ *
+ * Read-only commands take the shard lock for reading only, so GETs scale with
+ * the number of server threads even on hot keys. Holding the global lock in
+ * shared mode plays the role of an RCU read side critical section: anything
+ * that restructures the keyspace (rehashing, FLUSHALL, eviction, ...) takes
+ * the lock exclusively, which waits for every shared holder to leave first.
+ * Readers never free anything: an expired key they find is reported as
+ * missing but left in place, to be deleted by the next writer or by the
+ * active expire cycle.
+ * ---------------------------------------------------------------------------*/
+
+/* Return 1 if the table 'd' of 'db' may be modified by concurrent shard lock
+ * holders. It must not be rehashing, must have one bucket per shard at least,
+ * and must be able to absorb one new key per server thread and replica apply
+ * thread without growing, since the shard lock holders can only add one key
+ * each, plus the keys reserved by the scripts running under a shard lock and
+ * 'extra' more keys. */
+static int keyspaceShardTableReady(redisDb *db, dict *d, long extra) {
+    long reserved = __atomic_load_n(&db->shard_reserved,__ATOMIC_RELAXED);
+    return dictSlots(d) >= (unsigned long)server.keyspace_lock_shards &&
+           dictCanAddWithoutResize(d,server.cthreads+server.repl_apply_threads+
+                                     reserved+extra);
+}
+
+/* Return the keyspace shard the keys of the pending command of the client
+ * 'c' hash to, or -1 if the command is not flagged as shardable, has no keys
+ * or has keys spanning multiple shards. The DB tables must be able to take
+ * concurrent writers as well. The command is returned in '*pcmd'. */
+static long keyspaceShardOfCommand(client *c, struct redisCommand **pcmd) {
+    redisDb *db = c->db;
+    struct redisCommand *cmd;
+    unsigned long shard = ULONG_MAX;
+    int j, last;
+
+    /* lookupCommand() would perform a rehashing step if the command table
+     * was rehashing, so check this before looking up the command. */
+    if (dictIsRehashing(server.commands)) return -1;
+    cmd = lookupCommand(ptrFromObj(c->argv[0]));
+    if (cmd == NULL || !(cmd->flags & CMD_SHARDABLE)) return -1;
+    if ((cmd->arity > 0 && cmd->arity != c->argc) || c->argc < -cmd->arity)
+        return -1;
+
+    if (dictSize(db->watched_keys)) return -1;
+    if (!keyspaceShardTableReady(db,db->pdict,0) ||
+        !keyspaceShardTableReady(db,db->expires,0)) return -1;
+
+    last = cmd->lastkey;
+    if (last < 0) last = c->argc+last;
+    for (j = cmd->firstkey; j <= last && j < c->argc; j += cmd->keystep) {
+        robj *key = c->argv[j];
+        unsigned long keyshard;
+
+        if (!sdsEncodedObject(key)) return -1;
+        keyshard = dictHashKey(db->pdict,ptrFromObj(key)) &
+                   (server.keyspace_lock_shards-1);
+        if (shard != ULONG_MAX && keyshard != shard) return -1;
+        shard = keyshard;
+    }
+    if (shard == ULONG_MAX) return -1;
+    *pcmd = cmd;
+    return shard;
+}
+
+/* Like keyspaceShardOfCommand() for EVAL and EVALSHA, when the script opted
+ * in (see luaScriptOptsInShard()) and the keys it declared hash to a single
+ * shard. The script may then call the
+ * shardable commands on these keys only, see luaRedisGenericCommand(), so it
+ * can add as many keys to the tables as it declared: room for them is
+ * reserved on top of the one key per shard lock holder, until
+ * keyspaceShardReleaseScriptKeys() is called. */
+static long keyspaceShardOfScript(client *c) {
+    redisDb *db = c->db;
+    struct redisCommand *cmd;
+    unsigned long shard = ULONG_MAX;
+    long long numkeys;
+    long reserved;
+    int j;
+
+    if (!server.lua_shard_scripts || (c->flags & CLIENT_LUA_DEBUG)) return -1;
+    if (server.lua_time_limit <= 0) return -1;
+    if (dictIsRehashing(server.commands)) return -1;
+    cmd = lookupCommand(ptrFromObj(c->argv[0]));
+    if (cmd == NULL ||
+        (cmd->proc != evalCommand && cmd->proc != evalShaCommand)) return -1;
+    if (c->argc < 3 || getLongLongFromObject(c->argv[2],&numkeys) != C_OK ||
+        numkeys < 1 || numkeys > c->argc-3) return -1;
+    if (!luaScriptOptsInShard(c->argv[1],cmd->proc == evalShaCommand))
+        return -1;
+    if (dictSize(db->watched_keys)) return -1;
+
+    for (j = 3; j < 3+numkeys; j++) {
+        robj *key = c->argv[j];
+        unsigned long keyshard;
+
+        if (!sdsEncodedObject(key)) return -1;
+        keyshard = dictHashKey(db->pdict,ptrFromObj(key)) &
+                   (server.keyspace_lock_shards-1);
+        if (shard != ULONG_MAX && keyshard != shard) return -1;
+        shard = keyshard;
+    }
+
+    reserved = __atomic_load_n(&db->shard_reserved,__ATOMIC_RELAXED);
+    do {
+        if (!keyspaceShardTableReady(db,db->pdict,numkeys) ||
+            !keyspaceShardTableReady(db,db->expires,numkeys)) return -1;
+    } while (!__atomic_compare_exchange_n(&db->shard_reserved,&reserved,
+                reserved+numkeys,0,__ATOMIC_RELAXED,__ATOMIC_RELAXED));
+    serverTL->lua_shard_db = db;
+    serverTL->lua_shard_reserved = numkeys;
+    return shard;
+}
+
+/* Release the keys reserved by keyspaceShardOfScript(), once the script is
+ * done and before its shard lock is released. */
+void keyspaceShardReleaseScriptKeys(void) {
+    if (serverTL == NULL || serverTL->lua_shard_reserved == 0) return;
+    __atomic_fetch_sub(&serverTL->lua_shard_db->shard_reserved,
+                       serverTL->lua_shard_reserved,__ATOMIC_RELAXED);
+    serverTL->lua_shard_db = NULL;
+    serverTL->lua_shard_reserved = 0;
+}
+
+/* Called with the global lock held in shared mode before the pending command
+ * of the client 'c' is processed. Returns the shard lock the command has to
+ * hold, setting '*pfWrite' to 1 if it has to be held for writing, or NULL if
+ * the command can't be sharded and must run under the
+ * exclusive global lock: this is the case for commands that are not flagged
+ * as shardable, for keys spanning multiple shards, and whenever the command
+ * could touch state shared with other clients such as the replication
+ * stream, the AOF, MONITOR, keyspace notifications, the eviction pool or the
+ * logical clock of active-replica-timestamps. */
+pthread_rwlock_t *keyspaceShardLockForCommand(client *c, int *pfWrite) {
+    redisDb *db = c->db;
+    struct redisCommand *cmd;
+    long shard;
+
+    serverAssert(aeThreadOwnsSharedLock());
+    if (db->rgshardlock == NULL) return NULL;
+
+    if (c->flags & (CLIENT_MULTI|CLIENT_MASTER|CLIENT_SLAVE|CLIENT_LUA|
+                    CLIENT_BLOCKED|CLIENT_PUBSUB|CLIENT_MONITOR)) return NULL;
+    if (listLength(server.masters) || server.cluster_enabled ||
+        server.fActiveReplicaTimestamps ||
+        server.aof_state != AOF_OFF || server.repl_backlog ||
+        listLength(server.slaves) || listLength(server.monitors) ||
+        server.notify_keyspace_events || moduleCount() ||
+        server.loading || server.lua_timedout ||
+        server.snapshot_capturing) return NULL;
+    if (server.maxmemory && zmalloc_used_memory() > server.maxmemory)
+        return NULL;
+
+    if ((shard = keyspaceShardOfCommand(c,&cmd)) >= 0) {
+        *pfWrite = !(cmd->flags & CMD_READONLY);
+        return &db->rgshardlock[shard];
+    }
+    if ((shard = keyspaceShardOfScript(c)) >= 0) {
+        *pfWrite = 1;
+        return &db->rgshardlock[shard];
+    }
+    return NULL;
+}
+
+/* Like keyspaceShardLockForCommand() for a command of our master applied by
+ * the replica apply threads. A replica doesn't propagate what its master
+ * sends through call(), the stream is proxied to our sub-slaves as it is, so
+ * only the AOF and the other state a write could touch matter here. The
+ * command is always applied holding the shard lock for writing. */
+pthread_rwlock_t *keyspaceShardLockForReplicaCommand(client *c) {
+    redisDb *db = c->db;
+    struct redisCommand *cmd;
+    long shard;
+
+    serverAssert(aeThreadOwnsSharedLock());
+    if (db->rgshardlock == NULL) return NULL;
+
+    if (c->flags & CLIENT_MULTI) return NULL;
+    if (server.fActiveReplica || server.cluster_enabled ||
+        server.aof_state != AOF_OFF || listLength(server.monitors) ||
+        server.notify_keyspace_events || moduleCount() ||
+        server.loading || server.lua_timedout ||
+        server.snapshot_capturing) return NULL;
+    if (server.maxmemory && !server.repl_slave_ignore_maxmemory &&
+        zmalloc_used_memory() > server.maxmemory) return NULL;
+
+    if ((shard = keyspaceShardOfCommand(c,&cmd)) < 0) return NULL;
+    return &db->rgshardlock[shard];
+}
+
 /* -----------------------------------------------------------------------------
  * API to get key arguments from commands
  * ---------------------------------------------------------------------------*/
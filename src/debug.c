@@ -34,6 +34,7 @@
 #include <arpa/inet.h>
 #include <signal.h>
 #include <dlfcn.h>
+#include <uuid/uuid.h>
 
 #ifdef HAVE_BACKTRACE
 #include <execinfo.h>
@@ -307,6 +308,8 @@ void debugCommand(client *c) {
 "DIGEST-VALUE <key-1> ... <key-N>-- Output a hex signature of the values of all the specified keys.",
 "ERROR <string> -- Return a Redis protocol error with <string> as message. Useful for clients unit tests to simulate Redis errors.",
 "LOG <message> -- write message to the server log.",
+"LOCKSTATS RESET -- Reset the global lock contention statistics reported by INFO locks.",
+"LOCKSTATS SAMPLING <rate> -- Sample the call site of one in <rate> global lock acquisitions, 0 to disable.",
 "HTSTATS <dbid> -- Return hash table statistics of the specified Redis database.",
 "HTSTATS-KEY <key> -- Like htstats but for the hash table stored as key's value.",
 "LOADAOF -- Flush the AOF buffers on disk and reload the AOF in memory.",
@@ -354,6 +357,9 @@ NULL
         serverLog(LL_WARNING, "DEBUG LOG: %s", (char*)ptrFromObj(c->argv[2]));
         addReply(c,shared.ok);
     } else if (!strcasecmp(ptrFromObj(c->argv[1]),"reload")) {
+        /* The dataset is replaced, and the snapshot thread would rename
+         * its older file over the one saved here. */
+        if (server.rdb_thread_active) snapshotAbort();
         rdbSaveInfo rsi, *rsiptr;
         rsiptr = rdbPopulateSaveInfo(&rsi);
         if (rdbSave(rsiptr) != C_OK) {
@@ -396,7 +402,7 @@ NULL
         val = dictGetVal(de);
         strenc = strEncoding(val->encoding);
 
-        char extra[138] = {0};
+        char extra[256] = {0};
         if (val->encoding == OBJ_ENCODING_QUICKLIST) {
             char *nextra = extra;
             int remaining = sizeof(extra);
@@ -428,6 +434,16 @@ NULL
             nextra += used;
             remaining -= used;
         }
+        if (server.fActiveReplicaTimestamps) {
+            /* Time and origin of the last write to the key */
+            uint64_t stamp = getMvccStamp(c->db,c->argv[2]);
+            char szUUID[37];
+            uuid_unparse(mvccOriginUuid(MVCC_ORIGIN(stamp)),szUUID);
+            size_t used = strlen(extra);
+            snprintf(extra+used, sizeof(extra)-used,
+                " mvcc_tstamp:%llu mvcc_origin:%s",
+                (unsigned long long)MVCC_TSTAMP(stamp), szUUID);
+        }
 
         addReplyStatusFormat(c,
             "Value at:%p refcount:%d "
@@ -668,6 +684,24 @@ NULL
             dictGetStats(buf,sizeof(buf),ht);
             addReplyBulkCString(c,buf);
         }
+    } else if (!strcasecmp(ptrFromObj(c->argv[1]),"lockstats") && c->argc == 3 &&
+               !strcasecmp(ptrFromObj(c->argv[2]),"reset"))
+    {
+        aeResetLockStats();
+        addReply(c,shared.ok);
+    } else if (!strcasecmp(ptrFromObj(c->argv[1]),"lockstats") && c->argc == 4 &&
+               !strcasecmp(ptrFromObj(c->argv[2]),"sampling"))
+    {
+        long rate;
+
+        if (getLongFromObjectOrReply(c,c->argv[3],&rate,NULL) != C_OK)
+            return;
+        if (rate < 0 || rate > INT_MAX) {
+            addReplyError(c,"Invalid sampling rate");
+            return;
+        }
+        aeSetLockSiteSampling(rate);
+        addReply(c,shared.ok);
     } else if (!strcasecmp(ptrFromObj(c->argv[1]),"change-repl-id") && c->argc == 2) {
         serverLog(LL_WARNING,"Changing replication IDs after receiving DEBUG change-repl-id");
         changeReplicationId();
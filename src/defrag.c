@@ -776,6 +776,10 @@ long defragKey(redisDb *db, dictEntry *de) {
         uint64_t hash = dictGetHash(db->pdict, de->key);
         replaceSateliteDictKeyPtrAndOrDefragDictEntry(db->expires, keysds, newsds, hash, &defragged);
     }
+    if (dictSize(db->mvcc)) {
+        uint64_t hash = dictGetHash(db->pdict, de->key);
+        replaceSateliteDictKeyPtrAndOrDefragDictEntry(db->mvcc, keysds, newsds, hash, &defragged);
+    }
 
     /* Try to defrag robj and / or string value. */
     ob = dictGetVal(de);
@@ -310,7 +310,9 @@ dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing)
     entry = zmalloc(sizeof(*entry), MALLOC_SHARED);
     entry->next = ht->table[index];
     ht->table[index] = entry;
-    ht->used++;
+    /* The counter is shared by all buckets, which may be modified by
+     * several threads at once when the keyspace is sharded. */
+    __atomic_add_fetch(&ht->used, 1, __ATOMIC_RELAXED);
 
     /* Set the hash entry fields. */
     dictSetKey(d, entry, key);
@@ -387,7 +389,7 @@ static dictEntry *dictGenericDelete(dict *d, const void *key, int nofree) {
                     dictFreeVal(d, he);
                     zfree(he);
                 }
-                d->ht[table].used--;
+                __atomic_sub_fetch(&d->ht[table].used, 1, __ATOMIC_RELAXED);
                 return he;
             }
             prevHe = he;
@@ -977,6 +979,19 @@ static unsigned long _dictNextPower(unsigned long size)
     }
 }
 
+/* Return non-zero if 'count' elements can be added to the hash table without
+ * it being expanded, or a rehash being in progress.  While this holds the
+ * bucket of every key is fixed, so callers serializing access per bucket
+ * group (see keyspaceShardLockForCommand()) can operate concurrently. */
+int dictCanAddWithoutResize(dict *d, unsigned long count) {
+    unsigned long used;
+
+    if (dictIsRehashing(d) || d->ht[0].size == 0) return 0;
+    used = d->ht[0].used + count;
+    if (used <= d->ht[0].size) return 1;
+    return !dict_can_resize && (used-1)/d->ht[0].size <= dict_force_resize_ratio;
+}
+
 /* Returns the index of a free slot that can be populated with
  * a hash entry for the given 'key'.
  * If the key already exists, -1 is returned
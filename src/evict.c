@@ -60,6 +60,11 @@ struct evictionPoolEntry {
 
 static struct evictionPoolEntry *EvictionPoolLRU;
 
+/* The pool of the background eviction thread, see the "Background eviction"
+ * section below. */
+#define EVPOOL_BG_SIZE 1024
+static struct evictionPoolEntry *EvictionPoolBackground;
+
 /* ----------------------------------------------------------------------------
  * Implementation of eviction, aging and LRU
  * --------------------------------------------------------------------------*/
@@ -135,19 +140,60 @@ unsigned long long estimateObjectIdleTime(robj *o) {
  * one key that can be evicted, if there is at least one key that can be
  * evicted in the whole database. */
 
-/* Create a new eviction pool. */
-void evictionPoolAlloc(void) {
+/* Create a new eviction pool of 'size' entries. */
+static struct evictionPoolEntry *evictionPoolCreate(int size) {
     struct evictionPoolEntry *ep;
     int j;
 
-    ep = zmalloc(sizeof(*ep)*EVPOOL_SIZE, MALLOC_LOCAL);
-    for (j = 0; j < EVPOOL_SIZE; j++) {
+    ep = zmalloc(sizeof(*ep)*size, MALLOC_LOCAL);
+    for (j = 0; j < size; j++) {
         ep[j].idle = 0;
         ep[j].key = NULL;
         ep[j].cached = sdsnewlen(NULL,EVPOOL_CACHED_SDS_SIZE);
         ep[j].dbid = 0;
     }
-    EvictionPoolLRU = ep;
+    return ep;
+}
+
+void evictionPoolAlloc(void) {
+    EvictionPoolLRU = evictionPoolCreate(EVPOOL_SIZE);
+}
+
+/* Return the eviction score of the key 'de' of 'sampledict', according to
+ * the policy: an higher score means a better candidate. 'keydict' is the
+ * main dictionary of the DB, where the value of the key is looked up when
+ * 'sampledict' is the expires one. */
+static unsigned long long evictionScore(dict *sampledict, dict *keydict, dictEntry *de) {
+    robj *o = NULL;
+
+    /* If the dictionary we are sampling from is not the main
+     * dictionary (but the expires one) we need to lookup the key
+     * again in the key dictionary to obtain the value object. */
+    if (server.maxmemory_policy != MAXMEMORY_VOLATILE_TTL) {
+        if (sampledict != keydict) de = dictFind(keydict, dictGetKey(de));
+        o = dictGetVal(de);
+    }
+
+    /* Calculate the idle time according to the policy. This is called
+     * idle just because the code initially handled LRU, but is in fact
+     * just a score where an higher score means better candidate. */
+    if (server.maxmemory_policy & MAXMEMORY_FLAG_LRU) {
+        return estimateObjectIdleTime(o);
+    } else if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
+        /* When we use an LRU policy, we sort the keys by idle time
+         * so that we expire keys starting from greater idle time.
+         * However when the policy is an LFU one, we have a frequency
+         * estimation, and we want to evict keys with lower frequency
+         * first. So inside the pool we put objects using the inverted
+         * frequency subtracting the actual frequency to the maximum
+         * frequency of 255. */
+        return 255-LFUDecrAndReturn(o);
+    } else if (server.maxmemory_policy == MAXMEMORY_VOLATILE_TTL) {
+        /* In this case the sooner the expire the better. */
+        return ULLONG_MAX - (long)dictGetVal(de);
+    }
+    serverPanic("Unknown eviction policy in evictionScore()");
+    return 0;
 }
 
 /* This is an helper function for freeMemoryIfNeeded(), it is used in order
@@ -159,7 +205,7 @@ void evictionPoolAlloc(void) {
  * idle time are on the left, and keys with the higher idle time on the
  * right. */
 
-void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, struct evictionPoolEntry *pool) {
+void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, struct evictionPoolEntry *pool, int size) {
     int j, k, count;
     dictEntry *samples[server.maxmemory_samples];
 
@@ -167,65 +213,36 @@ void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, struct evic
     for (j = 0; j < count; j++) {
         unsigned long long idle;
         sds key;
-        robj *o;
         dictEntry *de;
 
         de = samples[j];
         key = dictGetKey(de);
-
-        /* If the dictionary we are sampling from is not the main
-         * dictionary (but the expires one) we need to lookup the key
-         * again in the key dictionary to obtain the value object. */
-        if (server.maxmemory_policy != MAXMEMORY_VOLATILE_TTL) {
-            if (sampledict != keydict) de = dictFind(keydict, key);
-            o = dictGetVal(de);
-        }
-
-        /* Calculate the idle time according to the policy. This is called
-         * idle just because the code initially handled LRU, but is in fact
-         * just a score where an higher score means better candidate. */
-        if (server.maxmemory_policy & MAXMEMORY_FLAG_LRU) {
-            idle = estimateObjectIdleTime(o);
-        } else if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
-            /* When we use an LRU policy, we sort the keys by idle time
-             * so that we expire keys starting from greater idle time.
-             * However when the policy is an LFU one, we have a frequency
-             * estimation, and we want to evict keys with lower frequency
-             * first. So inside the pool we put objects using the inverted
-             * frequency subtracting the actual frequency to the maximum
-             * frequency of 255. */
-            idle = 255-LFUDecrAndReturn(o);
-        } else if (server.maxmemory_policy == MAXMEMORY_VOLATILE_TTL) {
-            /* In this case the sooner the expire the better. */
-            idle = ULLONG_MAX - (long)dictGetVal(de);
-        } else {
-            serverPanic("Unknown eviction policy in evictionPoolPopulate()");
-        }
+        idle = evictionScore(sampledict,keydict,de);
 
         /* Insert the element inside the pool.
          * First, find the first empty bucket or the first populated
          * bucket that has an idle time smaller than our idle time. */
         k = 0;
-        while (k < EVPOOL_SIZE &&
+        while (k < size &&
                pool[k].key &&
                pool[k].idle < idle) k++;
-        if (k == 0 && pool[EVPOOL_SIZE-1].key != NULL) {
+        if (k == 0 && pool[size-1].key != NULL) {
             /* Can't insert if the element is < the worst element we have
              * and there are no empty buckets. */
             continue;
-        } else if (k < EVPOOL_SIZE && pool[k].key == NULL) {
+        } else if (k < size && pool[k].key == NULL) {
             /* Inserting into empty position. No setup needed before insert. */
         } else {
             /* Inserting in the middle. Now k points to the first element
              * greater than the element to insert.  */
-            if (pool[EVPOOL_SIZE-1].key == NULL) {
+            if (pool[size-1].key == NULL) {
                 /* Free space on the right? Insert at k shifting
                  * all the elements from k to end to the right. */
 
                 /* Save SDS before overwriting. */
-                sds cached = pool[EVPOOL_SIZE-1].cached;
+                sds cached = pool[size-1].cached;
                 memmove(pool+k+1,pool+k,
-                    sizeof(pool[0])*(EVPOOL_SIZE-k-1));
+                    sizeof(pool[0])*(size-k-1));
                 pool[k].cached = cached;
             } else {
                 /* No free space on right? Insert at k-1 */
@@ -364,6 +381,7 @@ size_t freeMemoryGetNotCountedMemory(void) {
             overhead += getClientOutputBufferMemoryUsage(slave);
         }
     }
+    overhead += tieringColdMemory();
     if (server.aof_state != AOF_OFF) {
         overhead += sdsalloc(server.aof_buf)+aofRewriteBufferSize();
     }
@@ -448,7 +466,7 @@ int freeMemoryIfNeeded(void) {
     serverAssert(GlobalLocksAcquired());
     /* By default replicas should ignore maxmemory
      * and just be masters exact copies. */
-    if (server.masterhost && server.repl_slave_ignore_maxmemory) return C_OK;
+    if (listLength(server.masters) && server.repl_slave_ignore_maxmemory) return C_OK;
 
     size_t mem_reported, mem_tofree, mem_freed;
     mstime_t latency, eviction_latency;
@@ -462,6 +480,10 @@ int freeMemoryIfNeeded(void) {
     if (getMaxmemoryState(&mem_reported,NULL,&mem_tofree,NULL) == C_OK)
         return C_OK;
 
+    /* The background eviction fell behind: let it catch up with the next
+     * batch right away. */
+    if (server.maxmemory_eviction_thread) evictionThreadWakeup();
+
     mem_freed = 0;
 
     if (server.maxmemory_policy == MAXMEMORY_NO_EVICTION)
@@ -493,7 +515,7 @@ int freeMemoryIfNeeded(void) {
                     dict = (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) ?
                             db->pdict : db->expires;
                     if ((keys = dictSize(dict)) != 0) {
-                        evictionPoolPopulate(i, dict, db->pdict, pool);
+                        evictionPoolPopulate(i, dict, db->pdict, pool, EVPOOL_SIZE);
                         total_keys += keys;
                     }
                 }
@@ -635,3 +657,255 @@ int freeMemoryIfNeededAndSafe(void) {
     if (server.lua_timedout || server.loading) return C_OK;
     return freeMemoryIfNeeded();
 }
+
+/* ----------------------------------------------------------------------------
+ * Background eviction
+ *
+ * With maxmemory-eviction-thread enabled a thread keeps the memory counted
+ * for maxmemory below maxmemory-eviction-low-watermark percent of it, so that
+ * a write crossing the limit rarely finds anything left to evict in
+ * freeMemoryIfNeeded(), which remains the hard limit.
+ *
+ * The thread samples the keys of every DB under the global lock into a pool
+ * of EVPOOL_BG_SIZE candidates. The pool is kept across cycles, so it gets a
+ * better approximation of the LRU/LFU order than the small pool of the
+ * synchronous path. The best candidates are then handed in batches to the
+ * main thread, that deletes them with dbAsyncDelete() and propagates the
+ * DELs, since replies and propagation need a thread running an event loop.
+ * Until a batch is executed the thread does not prepare the next one.
+ * --------------------------------------------------------------------------*/
+
+#define EVICTION_BG_BATCH 64    /* Keys handed to the main thread at once */
+
+struct evictionBatch {
+    int count;
+    int dbid[EVICTION_BG_BATCH];
+    unsigned long long idle[EVICTION_BG_BATCH]; /* Score when sampled */
+    sds key[EVICTION_BG_BATCH];
+};
+
+static pthread_t evictionThread;
+static int evictionThreadStarted = 0;
+static pthread_mutex_t evictionMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t evictionCond = PTHREAD_COND_INITIALIZER;
+static int evictionBatchPending = 0;    /* A batch waits for the main thread */
+static int evictionWakeupPending = 0;   /* Don't wait for the next cycle */
+
+/* Return true if the background eviction should run right now. The same
+ * conditions of freeMemoryIfNeededAndSafe() apply, but the pause of the
+ * clients is left for the main thread to lift. */
+static int evictionBackgroundActive(void) {
+    if (!server.maxmemory_eviction_thread || !server.maxmemory) return 0;
+    if (server.maxmemory_policy == MAXMEMORY_NO_EVICTION) return 0;
+    if (listLength(server.masters) && server.repl_slave_ignore_maxmemory) return 0;
+    if (server.lua_timedout || server.loading) return 0;
+    return !server.clients_paused;
+}
+
+static size_t evictionLowWatermark(void) {
+    return server.maxmemory/100*server.maxmemory_eviction_low_watermark;
+}
+
+/* Return true if the memory counted for maxmemory is above the low
+ * watermark. Must be called with the global lock held. */
+static int evictionAboveLowWatermark(void) {
+    size_t mem_used = zmalloc_used_memory();
+    size_t overhead = freeMemoryGetNotCountedMemory();
+
+    mem_used = (mem_used > overhead) ? mem_used-overhead : 0;
+    return mem_used > evictionLowWatermark();
+}
+
+/* Sample the keyspace into the background pool and move its best candidates
+ * to a new batch. Returns NULL if there is nothing to evict. Must be called
+ * with the global lock held. */
+static struct evictionBatch *evictionBatchCreate(void) {
+    struct evictionBatch *batch = zmalloc(sizeof(*batch), MALLOC_LOCAL);
+    int i, k;
+
+    batch->count = 0;
+    if (server.maxmemory_policy & (MAXMEMORY_FLAG_LRU|MAXMEMORY_FLAG_LFU) ||
+        server.maxmemory_policy == MAXMEMORY_VOLATILE_TTL)
+    {
+        struct evictionPoolEntry *pool = EvictionPoolBackground;
+        long samples = 0;
+
+        /* Sample as many keys per batch as the synchronous path would
+         * sample evicting the same number of keys. */
+        while (samples < (long)EVICTION_BG_BATCH*server.maxmemory_samples) {
+            unsigned long total_keys = 0;
+
+            for (i = 0; i < server.dbnum; i++) {
+                redisDb *db = server.db+i;
+                dict *d = (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) ?
+                        db->pdict : db->expires;
+                if (dictSize(d) == 0) continue;
+                evictionPoolPopulate(i, d, db->pdict, pool, EVPOOL_BG_SIZE);
+                total_keys += dictSize(d);
+                samples += server.maxmemory_samples;
+            }
+            if (!total_keys) break;
+        }
+
+        /* Take the best candidates, the pool is ordered by ascending
+         * score. */
+        for (k = EVPOOL_BG_SIZE-1; k >= 0 && batch->count < EVICTION_BG_BATCH; k--) {
+            if (pool[k].key == NULL) continue;
+            batch->dbid[batch->count] = pool[k].dbid;
+            batch->idle[batch->count] = pool[k].idle;
+            batch->key[batch->count] = sdsdup(pool[k].key);
+            batch->count++;
+
+            if (pool[k].key != pool[k].cached)
+                sdsfree(pool[k].key);
+            pool[k].key = NULL;
+            pool[k].idle = 0;
+        }
+    } else {
+        /* volatile-random and allkeys-random policy */
+        static unsigned int next_db = 0;
+
+        for (k = 0; k < EVICTION_BG_BATCH; k++) {
+            for (i = 0; i < server.dbnum; i++) {
+                int j = (++next_db) % server.dbnum;
+                redisDb *db = server.db+j;
+                dict *d = (server.maxmemory_policy == MAXMEMORY_ALLKEYS_RANDOM) ?
+                        db->pdict : db->expires;
+                if (dictSize(d) == 0) continue;
+                sds key = dictGetKey(dictGetRandomKey(d));
+                batch->dbid[batch->count] = j;
+                batch->idle[batch->count] = 0;
+                batch->key[batch->count] = sdsdup(key);
+                batch->count++;
+                break;
+            }
+        }
+    }
+
+    if (batch->count == 0) {
+        zfree(batch);
+        return NULL;
+    }
+    return batch;
+}
+
+/* Evict the keys of a batch prepared by the eviction thread. Runs on the
+ * main thread, with the global lock held. */
+static void evictionBatchExecute(void *arg) {
+    struct evictionBatch *batch = arg;
+    int j, fAgain = 0;
+
+    if (evictionBackgroundActive()) {
+        int pool = server.maxmemory_policy & (MAXMEMORY_FLAG_LRU|MAXMEMORY_FLAG_LFU) ||
+                   server.maxmemory_policy == MAXMEMORY_VOLATILE_TTL;
+        mstime_t latency;
+
+        latencyStartMonitor(latency);
+        for (j = 0; j < batch->count; j++) {
+            redisDb *db = server.db+batch->dbid[j];
+            dict *d = (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) ?
+                    db->pdict : db->expires;
+            dictEntry *de;
+            robj *keyobj;
+
+            if (!evictionAboveLowWatermark()) break;
+
+            /* Skip the ghosts, and the keys that got a lower score since
+             * they were sampled, for instance because they were accessed. */
+            if ((de = dictFind(d,batch->key[j])) == NULL) continue;
+            if (pool && evictionScore(d,db->pdict,de) < batch->idle[j]) continue;
+
+            keyobj = createStringObject(batch->key[j],sdslen(batch->key[j]));
+            propagateExpire(db,keyobj,server.lazyfree_lazy_eviction);
+            if (server.lazyfree_lazy_eviction)
+                dbAsyncDelete(db,keyobj);
+            else
+                dbSyncDelete(db,keyobj);
+            server.stat_evictedkeys++;
+            server.stat_evictedkeys_background++;
+            notifyKeyspaceEvent(NOTIFY_EVICTED, "evicted",
+                keyobj, db->id);
+            decrRefCount(keyobj);
+        }
+        latencyEndMonitor(latency);
+        latencyAddSampleIfNeeded("eviction-background",latency);
+        fAgain = evictionAboveLowWatermark();
+    }
+
+    for (j = 0; j < batch->count; j++) sdsfree(batch->key[j]);
+    zfree(batch);
+
+    pthread_mutex_lock(&evictionMutex);
+    evictionBatchPending = 0;
+    if (fAgain) evictionWakeupPending = 1;
+    pthread_cond_signal(&evictionCond);
+    pthread_mutex_unlock(&evictionMutex);
+}
+
+static void *evictionThreadMain(void *arg) {
+    UNUSED(arg);
+
+    for (;;) {
+        struct evictionBatch *batch = NULL;
+
+        pthread_mutex_lock(&evictionMutex);
+        while (evictionBatchPending)
+            pthread_cond_wait(&evictionCond,&evictionMutex);
+        if (!evictionWakeupPending) {
+            /* Check the memory usage at every serverCron() tick. */
+            struct timespec deadline;
+            long long ms = 1000/server.hz;
+
+            clock_gettime(CLOCK_REALTIME,&deadline);
+            deadline.tv_sec += ms/1000;
+            deadline.tv_nsec += (ms%1000)*1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&evictionCond,&evictionMutex,&deadline);
+        }
+        evictionWakeupPending = 0;
+        pthread_mutex_unlock(&evictionMutex);
+
+        /* Don't take the global lock while we are far from the watermark:
+         * the used memory includes what is not counted for maxmemory. */
+        if (!server.maxmemory_eviction_thread || !server.maxmemory ||
+            zmalloc_used_memory() <= evictionLowWatermark()) continue;
+
+        aeAcquireLock();
+        if (evictionBackgroundActive() && evictionAboveLowWatermark())
+            batch = evictionBatchCreate();
+        aeReleaseLock();
+        if (batch == NULL) continue;
+
+        pthread_mutex_lock(&evictionMutex);
+        evictionBatchPending = 1;
+        pthread_mutex_unlock(&evictionMutex);
+        aePostFunction(server.rgthreadvar[IDX_EVENT_LOOP_MAIN].el,
+            evictionBatchExecute,batch);
+    }
+    return NULL;
+}
+
+/* Start the background eviction thread, if not already running. Called at
+ * startup and when maxmemory-eviction-thread is enabled at runtime. */
+void evictionThreadStart(void) {
+    if (evictionThreadStarted) return;
+    EvictionPoolBackground = evictionPoolCreate(EVPOOL_BG_SIZE);
+    if (pthread_create(&evictionThread,NULL,evictionThreadMain,NULL) != 0) {
+        serverLog(LL_WARNING,"Fatal: Can't initialize the background eviction thread.");
+        exit(1);
+    }
+    evictionThreadStarted = 1;
+}
+
+/* Have the eviction thread check the memory usage without waiting for its
+ * next cycle. */
+void evictionThreadWakeup(void) {
+    if (!evictionThreadStarted) return;
+    pthread_mutex_lock(&evictionMutex);
+    evictionWakeupPending = 1;
+    pthread_cond_signal(&evictionCond);
+    pthread_mutex_unlock(&evictionMutex);
+}
@@ -36,6 +36,10 @@
 #include <assert.h>
 #include <pthread.h>
 #include <limits.h>
+#include <stddef.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#endif
 
 #ifdef __APPLE__
 #include <TargetConditionals.h>
@@ -53,10 +57,25 @@
  *
  *      Implementation of a fair spinlock.  To promote fairness we
  *      use a ticket lock instead of a raw spinlock
+ *
+ *      Waiters spin for an adaptively tuned number of iterations and
+ *      then park on a futex keyed to the ticket word.  Each parked thread
+ *      sets bit (ticket % 32) in m_futex and waits on that bit, so unlock
+ *      only wakes the thread whose ticket is up.  Collisions (more than 32
+ *      waiters) are handled by re-parking threads whose turn hasn't come.
  * 
  ****************************************************/
 
 static_assert(sizeof(pid_t) <= sizeof(fastlock::m_pidOwner), "fastlock::m_pidOwner not large enough");
+static_assert(sizeof(ticket) == sizeof(unsigned), "ticket must be a single futex word");
+static_assert(offsetof(fastlock, m_futex) == 12, "fastlock_x64.asm depends on this layout");
+static_assert(offsetof(fastlock, m_spinlimit) == 16, "fastlock_x64.asm depends on this layout");
+
+/* Bounds of the adaptive spin budget (in pause iterations) */
+#define FASTLOCK_SPIN_MIN 0x40
+#define FASTLOCK_SPIN_INIT 0x800
+#define FASTLOCK_SPIN_MAX 0x4000
+
 uint64_t g_longwaits = 0;
 
 uint64_t fastlock_getlongwaitcount()
@@ -82,12 +101,91 @@ extern "C" pid_t gettid()
     return pidCache;
 }
 
+#ifdef __linux__
+static int futex(volatile unsigned *uaddr, int futex_op, int val, const struct timespec *timeout, int val3)
+{
+    return syscall(SYS_futex, uaddr, futex_op, val, timeout, nullptr, val3);
+}
+#endif
+
+/* Both ticket counters as one word, this is what waiters park on */
+static inline volatile unsigned *ticketword(struct fastlock *lock)
+{
+    return reinterpret_cast<volatile unsigned*>(&lock->m_ticket);
+}
+
+static inline unsigned ticketmask(unsigned ticket)
+{
+    return 1U << (ticket % 32);
+}
+
+/* Park until our ticket may be up.  wake is the ticket word we last observed,
+    if it changed in the meantime the futex returns immediately */
+extern "C" void fastlock_sleep(struct fastlock *lock, unsigned wake, unsigned myticket)
+{
+#ifdef __linux__
+    unsigned mask = ticketmask(myticket);
+    __atomic_fetch_or(&lock->m_futex, mask, __ATOMIC_SEQ_CST);
+    futex(ticketword(lock), FUTEX_WAIT_BITSET_PRIVATE, wake, nullptr, mask);
+#else
+    (void)wake;
+    (void)myticket;
+    sched_yield();
+#endif
+    __atomic_fetch_add(&g_longwaits, 1, __ATOMIC_RELAXED);
+
+    // Spinning the full budget didn't get us the lock, so spin less next time
+    unsigned limit = __atomic_load_4(&lock->m_spinlimit, __ATOMIC_RELAXED);
+    limit -= limit / 8;
+    if (limit < FASTLOCK_SPIN_MIN)
+        limit = FASTLOCK_SPIN_MIN;
+    __atomic_store_4(&lock->m_spinlimit, limit, __ATOMIC_RELAXED);
+}
+
+/* Called by the new owner after an acquire that had to wait.  cloops is the
+    number of spins since we last parked (or since we took our ticket) */
+extern "C" void fastlock_contended(struct fastlock *lock, unsigned myticket, unsigned cloops)
+{
+    unsigned mask = ticketmask(myticket);
+    if (__atomic_load_4(&lock->m_futex, __ATOMIC_ACQUIRE) & mask)
+    {
+        // Release our wait bit, but keep it if a ticket 32 behind us may be parked on it
+        __atomic_fetch_and(&lock->m_futex, ~mask, __ATOMIC_SEQ_CST);
+        uint16_t avail = __atomic_load_2(&lock->m_ticket.m_avail, __ATOMIC_SEQ_CST);
+        if ((uint16_t)(avail - myticket) > 32)
+            __atomic_fetch_or(&lock->m_futex, mask, __ATOMIC_SEQ_CST);
+    }
+
+    // Track roughly twice the spin it takes to get the lock
+    int limit = (int)__atomic_load_4(&lock->m_spinlimit, __ATOMIC_RELAXED);
+    limit += ((int)(cloops * 2) - limit) / 8;
+    if (limit < FASTLOCK_SPIN_MIN)
+        limit = FASTLOCK_SPIN_MIN;
+    if (limit > FASTLOCK_SPIN_MAX)
+        limit = FASTLOCK_SPIN_MAX;
+    __atomic_store_4(&lock->m_spinlimit, (unsigned)limit, __ATOMIC_RELAXED);
+}
+
+/* Wake the thread holding ticket active if it is parked */
+extern "C" void fastlock_wake(struct fastlock *lock, unsigned active)
+{
+#ifdef __linux__
+    // Colliding tickets are woken too, they will notice it isn't their turn and park again
+    futex(ticketword(lock), FUTEX_WAKE_BITSET_PRIVATE, INT_MAX, nullptr, ticketmask(active));
+#else
+    (void)lock;
+    (void)active;
+#endif
+}
+
 extern "C" void fastlock_init(struct fastlock *lock)
 {
     lock->m_ticket.m_active = 0;
     lock->m_ticket.m_avail = 0;
     lock->m_depth = 0;
     lock->m_pidOwner = -1;
+    lock->m_futex = 0;
+    lock->m_spinlimit = FASTLOCK_SPIN_INIT;
 }
 
 #ifndef ASM_SPINLOCK
@@ -101,17 +199,25 @@ extern "C" void fastlock_lock(struct fastlock *lock)
 
     unsigned myticket = __atomic_fetch_add(&lock->m_ticket.m_avail, 1, __ATOMIC_RELEASE);
 
-    int cloops = 0;
-    while (__atomic_load_2(&lock->m_ticket.m_active, __ATOMIC_ACQUIRE) != myticket)
+    if (__atomic_load_2(&lock->m_ticket.m_active, __ATOMIC_ACQUIRE) != myticket)
     {
-        if ((++cloops % 1024*1024) == 0)
+        unsigned cloops = 0;
+        for (;;)
         {
-            sched_yield();
-            ++g_longwaits;
-        }
 #if defined(__i386__) || defined(__amd64__)
-        __asm__ ("pause");
+            __asm__ ("pause");
 #endif
+            ++cloops;
+            unsigned word = __atomic_load_4(ticketword(lock), __ATOMIC_ACQUIRE);
+            if ((word & 0xffff) == myticket)
+                break;
+            if (cloops >= __atomic_load_4(&lock->m_spinlimit, __ATOMIC_RELAXED))
+            {
+                fastlock_sleep(lock, word, myticket);
+                cloops = 0;
+            }
+        }
+        fastlock_contended(lock, myticket, cloops);
     }
 
     lock->m_depth = 1;
@@ -153,7 +259,10 @@ extern "C" void fastlock_unlock(struct fastlock *lock)
         assert((int)__atomic_load_4(&lock->m_pidOwner, __ATOMIC_RELAXED) >= 0);  // unlock after free
         lock->m_pidOwner = -1;
         std::atomic_thread_fence(std::memory_order_acquire);
-        __atomic_fetch_add(&lock->m_ticket.m_active, 1, __ATOMIC_ACQ_REL);  // on x86 the atomic is not required here, but ASM handles that case
+        // The full barrier orders our release against reading m_futex, otherwise we could miss a parking waiter
+        uint16_t activeNew = __atomic_add_fetch(&lock->m_ticket.m_active, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_4(&lock->m_futex, __ATOMIC_SEQ_CST) & ticketmask(activeNew))
+            fastlock_wake(lock, activeNew);
     }
 }
 #endif
@@ -31,6 +31,8 @@ struct fastlock
 
     volatile int m_pidOwner;
     volatile int m_depth;
+    volatile unsigned m_futex;      // bitmask of (ticket % 32) for threads parked on m_ticket
+    volatile unsigned m_spinlimit;  // adaptive spin budget before parking
 
 #ifdef __cplusplus
     fastlock()
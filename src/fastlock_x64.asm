@@ -1,8 +1,9 @@
 section .text
 
 extern gettid
-extern sched_yield
-extern g_longwaits
+extern fastlock_sleep
+extern fastlock_contended
+extern fastlock_wake
 
 ;	This is the first use of assembly in this codebase, a valid question is WHY?
 ;	The spinlock we implement here is performance critical, and simply put GCC
@@ -17,6 +18,8 @@ fastlock_lock:
 	;	uint16_t avail
 	;	int32_t m_pidOwner
 	;	int32_t m_depth
+	;	uint32_t m_futex
+	;	uint32_t m_spinlimit
 	
 	; First get our TID and put it in ecx
 	push rdi                ; we need our struct pointer (also balance the stack for the call)
@@ -31,31 +34,42 @@ fastlock_lock:
 	inc eax                 ; we want to add one
 	lock xadd [rdi+2], ax   ; do the xadd, ax contains the value before the addition
 	; eax now contains the ticket
+	cmp [rdi], ax           ; is our ticket up already?
+	je .LLocked             ; uncontended, skip the spin loop entirely
 	xor ecx, ecx
 ALIGN 16
 .LLoop:
-	cmp [rdi], ax           ; is our ticket up?
-	je .LLocked             ; leave the loop
 	pause
-	add ecx, 1000h          ; Have we been waiting a long time? (oflow if we have)
-	                        ;	1000h is set so we overflow on the 1024*1024'th iteration (like the C code)
-	jnc .LLoop              ; If so, give up our timeslice to someone who's doing real work
+	inc ecx
+	mov edx, [rdi]          ; load active and avail together, this is the futex word
+	cmp dx, ax              ; is our ticket up?
+	je .LLockedContended    ; leave the loop
+	cmp ecx, [rdi+16]       ; Have we spun for our whole budget?
+	jb .LLoop               ; If not keep going
 	; Like the compiler, you're probably thinking: "Hey! I should take these pushs out of the loop"
 	;	But the compiler doesn't know that we rarely hit this, and when we do we know the lock is
 	;	taking a long time to be released anyways.  We optimize for the common case of short
 	;	lock intervals.  That's why we're using a spinlock in the first place
 	push rsi
 	push rax
-	mov rax, 24             ; sys_sched_yield
-	syscall                 ; give up our timeslice we'll be here a while
+	mov esi, edx            ; the ticket word we observed, the futex won't sleep if it changed
+	mov edx, eax            ; our ticket
+	call fastlock_sleep     ; park until our ticket is up (rdi is still the lock)
 	pop rax
 	pop rsi
-	mov rcx, g_longwaits
-	inc qword [rcx]         ; increment our long wait counter
 	mov rdi, [rsp]          ; our struct pointer is on the stack already
 	xor ecx, ecx            ; Reset our loop counter
 	jmp .LLoop              ; Get back in the game
 ALIGN 16
+.LLockedContended:
+	push rsi                ; save our TID (twice to keep the stack aligned)
+	push rsi
+	mov edx, ecx            ; spins since we took our ticket or last woke up
+	mov esi, eax            ; our ticket
+	call fastlock_contended ; release our futex bit and tune the spin budget
+	pop rsi
+	pop rsi
+	mov rdi, [rsp]          ; get our struct pointer back
 .LLocked:
 	mov [rdi+4], esi        ; lock->m_pidOwner = gettid()
 	inc dword [rdi+8]       ; lock->m_depth++
@@ -70,6 +84,8 @@ fastlock_trylock:
 	;	uint16_t avail
 	;	int32_t m_pidOwner
 	;	int32_t m_depth
+	;	uint32_t m_futex
+	;	uint32_t m_spinlimit
 	
 	; First get our TID and put it in ecx
 	push rdi                ; we need our struct pointer (also balance the stack for the call)
@@ -114,9 +130,22 @@ fastlock_unlock:
 	;	uint16_t avail
 	;	int32_t m_pidOwner
 	;	int32_t m_depth
+	;	uint32_t m_futex
+	;	uint32_t m_spinlimit
 	sub dword [rdi+8], 1         ; decrement m_depth, don't use dec because it partially writes the flag register and we don't know its state
 	jnz .LDone                   ; if depth is non-zero this is a recursive unlock, and we still hold it
 	mov dword [rdi+4], -1        ; pidOwner = -1 (we don't own it anymore)
-	inc word [rdi]               ; give up our ticket (note: lock is not required here because the spinlock itself guards this variable)
+	mov eax, 1
+	lock xadd [rdi], ax          ; give up our ticket (note: lock is required so the m_futex read below can't pass this store)
+	inc eax                      ; eax is now the next ticket
+	mov ecx, eax
+	mov edx, 1
+	shl edx, cl                  ; the futex bit for the next ticket (shl only uses the low 5 bits)
+	test [rdi+12], edx           ; is the next thread parked?
+	jnz .LWake
 .LDone:
 	ret
+ALIGN 16
+.LWake:
+	mov esi, eax
+	jmp fastlock_wake            ; tail call fastlock_wake(lock, active)
@@ -34,6 +34,7 @@
  */
 
 #include "server.h"
+#include <math.h>
 
 /* Dictionary type for latency events. */
 int dictStringKeyCompare(void *privdata, const void *key1, const void *key2) {
@@ -371,7 +372,8 @@ sds createLatencyReport(void) {
             advices++;
         }
 
-        if (!strcasecmp(event,"eviction-cycle")) {
+        if (!strcasecmp(event,"eviction-cycle") ||
+            !strcasecmp(event,"eviction-background")) {
             advise_mass_eviction = 1;
             advices++;
         }
@@ -491,6 +493,139 @@ void latencyCommandReplyWithSamples(client *c, struct latencyTimeSeries *ts) {
     setDeferredArrayLen(c,replylen,samples);
 }
 
+/* ------------------------ Latency histograms ------------------------------ */
+
+struct latencyHistogram *createLatencyHistogram(void) {
+    return zcalloc(sizeof(struct latencyHistogram), MALLOC_LOCAL);
+}
+
+/* Return the highest latency, in microseconds, that falls in bucket 'idx'. */
+uint64_t latencyHistogramBucketMax(int idx) {
+    int exp;
+    uint64_t sub;
+
+    if (idx < LATENCY_HIST_SUB_BUCKETS) return idx;
+    if (idx == LATENCY_HIST_BUCKETS-1) return UINT64_MAX;
+    exp = (idx >> LATENCY_HIST_SUB_BITS) + LATENCY_HIST_SUB_BITS - 1;
+    sub = (idx & (LATENCY_HIST_SUB_BUCKETS-1)) + LATENCY_HIST_SUB_BUCKETS;
+    return ((sub+1) << (exp-LATENCY_HIST_SUB_BITS)) - 1;
+}
+
+/* Return the latency below which 'percentile' percent of the samples fall,
+ * as the upper bound of the bucket holding it, or 0 if there are no
+ * samples. */
+uint64_t latencyHistogramPercentile(const struct latencyHistogram *h, double percentile) {
+    uint64_t target, seen = 0;
+    int j;
+
+    if (h->count == 0) return 0;
+    target = (uint64_t)ceil(h->count * percentile / 100);
+    if (target == 0) target = 1;
+    for (j = 0; j < LATENCY_HIST_BUCKETS; j++) {
+        seen += h->buckets[j];
+        if (seen >= target) return latencyHistogramBucketMax(j);
+    }
+    return latencyHistogramBucketMax(LATENCY_HIST_BUCKETS-1);
+}
+
+/* Merge the per thread histograms of 'cmd' into 'h', which is overwritten.
+ * The owning threads keep recording while we read, so the result is only
+ * approximately consistent, that's fine for statistics. */
+void latencyCommandHistogram(struct redisCommand *cmd, struct latencyHistogram *h) {
+    int iel, j;
+
+    memset(h,0,sizeof(*h));
+    for (iel = 0; iel < MAX_EVENT_LOOPS; iel++) {
+        struct latencyHistogram *src = cmd->rghist[iel];
+        if (src == NULL) continue;
+        for (j = 0; j < LATENCY_HIST_BUCKETS; j++) {
+            h->buckets[j] += src->buckets[j];
+            h->count += src->buckets[j];
+        }
+    }
+}
+
+void latencyCommandHistogramReset(struct redisCommand *cmd) {
+    int iel;
+
+    for (iel = 0; iel < MAX_EVENT_LOOPS; iel++) {
+        if (cmd->rghist[iel] != NULL)
+            memset(cmd->rghist[iel],0,sizeof(struct latencyHistogram));
+    }
+}
+
+void latencyCommandHistogramFree(struct redisCommand *cmd) {
+    int iel;
+
+    for (iel = 0; iel < MAX_EVENT_LOOPS; iel++) {
+        zfree(cmd->rghist[iel]);
+        cmd->rghist[iel] = NULL;
+    }
+}
+
+/* latencyCommand() helper to produce the reply for the HISTOGRAM subcommand
+ * for a single command: its number of calls, a few percentiles and the
+ * cumulative distribution of the non empty buckets. */
+void latencyCommandReplyWithHistogram(client *c, struct redisCommand *cmd) {
+    struct latencyHistogram *h = createLatencyHistogram();
+    void *replylen;
+    uint64_t seen = 0;
+    int j, buckets = 0;
+
+    latencyCommandHistogram(cmd,h);
+    addReplyBulkCString(c,cmd->name);
+    addReplyMapLen(c,5);
+    addReplyBulkCString(c,"calls");
+    addReplyLongLong(c,h->count);
+    addReplyBulkCString(c,"p50");
+    addReplyLongLong(c,latencyHistogramPercentile(h,50));
+    addReplyBulkCString(c,"p99");
+    addReplyLongLong(c,latencyHistogramPercentile(h,99));
+    addReplyBulkCString(c,"p999");
+    addReplyLongLong(c,latencyHistogramPercentile(h,99.9));
+    addReplyBulkCString(c,"histogram_usec");
+    replylen = addReplyDeferredLen(c);
+    for (j = 0; j < LATENCY_HIST_BUCKETS; j++) {
+        if (h->buckets[j] == 0) continue;
+        seen += h->buckets[j];
+        addReplyLongLong(c,latencyHistogramBucketMax(j));
+        addReplyLongLong(c,seen);
+        buckets++;
+    }
+    setDeferredMapLen(c,replylen,buckets);
+    zfree(h);
+}
+
+/* latencyCommand() helper to produce the reply for the HISTOGRAM subcommand.
+ * With no arguments every command called at least once is reported, else
+ * the named commands that were called at least once. */
+void latencyCommandReplyWithHistograms(client *c) {
+    void *replylen = addReplyDeferredLen(c);
+    struct redisCommand *cmd;
+    int j, replies = 0;
+
+    if (c->argc == 2) {
+        dictIterator *di = dictGetIterator(server.commands);
+        dictEntry *de;
+
+        while((de = dictNext(di)) != NULL) {
+            cmd = dictGetVal(de);
+            if (!cmd->calls) continue;
+            latencyCommandReplyWithHistogram(c,cmd);
+            replies++;
+        }
+        dictReleaseIterator(di);
+    } else {
+        for (j = 2; j < c->argc; j++) {
+            cmd = lookupCommandOrOriginal(ptrFromObj(c->argv[j]));
+            if (cmd == NULL || !cmd->calls) continue;
+            latencyCommandReplyWithHistogram(c,cmd);
+            replies++;
+        }
+    }
+    setDeferredMapLen(c,replylen,replies);
+}
+
 /* latencyCommand() helper to produce the reply for the LATEST subcommand,
  * listing the last latency sample for every event type registered so far. */
 void latencyCommandReplyWithLatestEvents(client *c) {
@@ -565,6 +700,7 @@ sds latencyCommandGenSparkeline(char *event, struct latencyTimeSeries *ts) {
  * LATENCY DOCTOR: returns a human readable analysis of instance latency.
  * LATENCY GRAPH: provide an ASCII graph of the latency of the specified event.
  * LATENCY RESET: reset data of a specified event or all the data if no event provided.
+ * LATENCY HISTOGRAM: return the latency distribution of all or the specified commands.
  */
 void latencyCommand(client *c) {
     const char *help[] = {
@@ -572,6 +708,8 @@ void latencyCommand(client *c) {
 "GRAPH   <event>     -- Returns an ASCII latency graph for the event class.",
 "HISTORY <event>     -- Returns time-latency samples for the event class.",
 "LATEST              -- Returns the latest latency samples for all events.",
+"HISTOGRAM [command ...] -- Returns the latency distribution of commands.",
+"                       (default: all the commands called at least once)",
 "RESET   [event ...] -- Resets latency data of one or more event classes.",
 "                       (default: reset all data for all event classes)",
 "HELP                -- Prints this help.",
@@ -604,6 +742,9 @@ NULL
     } else if (!strcasecmp(ptrFromObj(c->argv[1]),"latest") && c->argc == 2) {
         /* LATENCY LATEST */
         latencyCommandReplyWithLatestEvents(c);
+    } else if (!strcasecmp(ptrFromObj(c->argv[1]),"histogram") && c->argc >= 2) {
+        /* LATENCY HISTOGRAM [command ...] */
+        latencyCommandReplyWithHistograms(c);
     } else if (!strcasecmp(ptrFromObj(c->argv[1]),"doctor") && c->argc == 2) {
         /* LATENCY DOCTOR */
         sds report = createLatencyReport();
@@ -65,9 +65,50 @@ struct latencyStats {
     time_t period;          /* Number of seconds since first event and now. */
 };
 
+/* Log-linear (HDR style) histogram of latencies in microseconds. Values
+ * below LATENCY_HIST_SUB_BUCKETS get a bucket each, then every power of two
+ * range is split in LATENCY_HIST_SUB_BUCKETS linear buckets, so the relative
+ * error of a reported value is always below 1/LATENCY_HIST_SUB_BUCKETS.
+ * Values of 2^(LATENCY_HIST_MAX_EXP+1) usec or more land in the last bucket. */
+#define LATENCY_HIST_SUB_BITS 4
+#define LATENCY_HIST_SUB_BUCKETS (1<<LATENCY_HIST_SUB_BITS)
+#define LATENCY_HIST_MAX_EXP 36
+#define LATENCY_HIST_BUCKETS ((LATENCY_HIST_MAX_EXP-LATENCY_HIST_SUB_BITS+2)<<LATENCY_HIST_SUB_BITS)
+
+struct latencyHistogram {
+    uint64_t count;     /* Number of samples. */
+    uint64_t buckets[LATENCY_HIST_BUCKETS];
+};
+
+struct redisCommand;
+
 void latencyMonitorInit(void);
 void latencyAddSample(const char *event, mstime_t latency);
 int THPIsEnabled(void);
+struct latencyHistogram *createLatencyHistogram(void);
+uint64_t latencyHistogramBucketMax(int idx);
+uint64_t latencyHistogramPercentile(const struct latencyHistogram *h, double percentile);
+void latencyCommandHistogram(struct redisCommand *cmd, struct latencyHistogram *h);
+void latencyCommandHistogramReset(struct redisCommand *cmd);
+void latencyCommandHistogramFree(struct redisCommand *cmd);
+
+/* Return the bucket index of a latency of 'usec' microseconds. */
+static inline int latencyHistogramIndex(uint64_t usec) {
+    int exp;
+
+    if (usec < LATENCY_HIST_SUB_BUCKETS) return (int)usec;
+    exp = 63 - __builtin_clzll(usec);
+    if (exp > LATENCY_HIST_MAX_EXP) return LATENCY_HIST_BUCKETS-1;
+    return ((exp-LATENCY_HIST_SUB_BITS+1) << LATENCY_HIST_SUB_BITS) +
+           (int)((usec >> (exp-LATENCY_HIST_SUB_BITS)) & (LATENCY_HIST_SUB_BUCKETS-1));
+}
+
+/* Record a sample. Histograms are owned by a single thread, so this is just
+ * two increments and doesn't need any locking. */
+static inline void latencyHistogramAdd(struct latencyHistogram *h, uint64_t usec) {
+    h->buckets[latencyHistogramIndex(usec)]++;
+    h->count++;
+}
 
 /* Latency monitoring macros. */
 
@@ -52,9 +52,11 @@ size_t lazyfreeGetFreeEffort(robj *obj) {
  * will be reclaimed in a different bio.c thread. */
 #define LAZYFREE_THRESHOLD 64
 int dbAsyncDelete(redisDb *db, robj *key) {
+    snapshotPreserveKey(db,key);
     /* Deleting an entry from the expires dict will not free the sds of
      * the key, because it is shared with the main dictionary. */
     if (dictSize(db->expires) > 0) dictDelete(db->expires,ptrFromObj(key));
+    if (dictSize(db->mvcc) > 0) dictDelete(db->mvcc,ptrFromObj(key));
 
     /* If the value is composed of a few allocations, to free in a lazy way
      * is actually just slower... So under a certain limit we just free
@@ -110,6 +112,12 @@ void emptyDbAsync(redisDb *db) {
     db->expires = dictCreate(&keyptrDictType,NULL);
     atomicIncr(lazyfree_objects,dictSize(oldht1));
     bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,oldht1,oldht2);
+    if (dictSize(db->mvcc)) {
+        /* The timestamps only reference the keys, released above. */
+        dict *oldht3 = db->mvcc;
+        db->mvcc = dictCreate(&keyptrDictType,NULL);
+        bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,oldht3,NULL);
+    }
 }
 
 /* Empty the slots-keys map of Redis CLuster by creating a new empty one
@@ -143,6 +151,12 @@ void lazyfreeFreeDatabaseFromBioThread(dict *ht1, dict *ht2) {
     atomicDecr(lazyfree_objects,numkeys);
 }
 
+/* Release a dictionary referencing the keys of a database, such as its
+ * timestamps, in the lazyfree thread. */
+void lazyfreeFreeDictFromBioThread(dict *ht) {
+    dictRelease(ht);
+}
+
 /* Release the skiplist mapping Redis Cluster keys to slots in the
  * lazyfree thread. */
 void lazyfreeFreeSlotsMapFromBioThread(rax *rt) {
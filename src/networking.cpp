@@ -43,6 +43,7 @@ void addReplyBulkCStringCore(client *c, const char *s, bool fAsync);
 class AeLocker
 {
     bool m_fArmed = false;
+    pthread_rwlock_t *m_pshardlock = nullptr;
 
 public:
     AeLocker()
@@ -81,6 +82,45 @@ public:
         }
     }
 
+    // Try to arm with the global lock in shared mode plus the keyspace shard lock
+    //  of the client's pending command.  Returns false if the command must run
+    //  under the exclusive lock, in which case the caller should use arm() instead
+    bool armShard(client *c)
+    {
+        serverAssert(!m_fArmed && m_pshardlock == nullptr);
+        if (server.keyspace_lock_shards == 0 || !aeTryAcquireSharedLock())
+            return false;
+
+        int fWrite;
+        pthread_rwlock_t *lock = keyspaceShardLockForCommand(c, &fWrite);
+        if (lock == nullptr)
+        {
+            aeReleaseSharedLock();
+            return false;
+        }
+        if (fWrite)
+            pthread_rwlock_wrlock(lock);
+        else
+            pthread_rwlock_rdlock(lock);
+        serverTL->fShardReadOnly = !fWrite;
+        m_pshardlock = lock;
+        return true;
+    }
+
+    bool fShard() const { return m_pshardlock != nullptr; }
+
+    // Release the global lock in shared mode and the keyspace shard lock taken
+    //  by armShard(), so that the command can run again after arm()
+    void releaseShard()
+    {
+        serverAssert(m_pshardlock != nullptr);
+        keyspaceShardReleaseScriptKeys();
+        serverTL->fShardReadOnly = FALSE;
+        pthread_rwlock_unlock(m_pshardlock);
+        m_pshardlock = nullptr;
+        aeReleaseSharedLock();
+    }
+
     void disarm()
     {
         serverAssert(m_fArmed);
@@ -92,6 +132,8 @@ public:
     {
         if (m_fArmed)
             aeReleaseLock();
+        if (m_pshardlock != nullptr)
+            releaseShard();
     }
 };
 
@@ -117,12 +159,16 @@ size_t getStringObjectSdsUsedMemory(robj *o) {
 /* Client.reply list dup and free methods. */
 void *dupClientReplyValue(void *o) {
     clientReplyBlock *old = (clientReplyBlock*)o;
-    clientReplyBlock *buf = (clientReplyBlock*)zmalloc(sizeof(clientReplyBlock) + old->size, MALLOC_LOCAL);
-    memcpy(buf, o, sizeof(clientReplyBlock) + old->size);
+    size_t cbData = old->obj ? 0 : old->size;
+    clientReplyBlock *buf = (clientReplyBlock*)zmalloc(sizeof(clientReplyBlock) + cbData, MALLOC_LOCAL);
+    memcpy(buf, o, sizeof(clientReplyBlock) + cbData);
+    if (buf->obj) incrRefCount(buf->obj);
     return buf;
 }
 
 void freeClientReplyValue(void *o) {
+    clientReplyBlock *block = (clientReplyBlock*)o;
+    if (block && block->obj) decrRefCount(block->obj);
     zfree(o);
 }
 
@@ -156,7 +202,7 @@ client *createClient(int fd, int iel) {
         anetEnableTcpNoDelay(NULL,fd);
         if (server.tcpkeepalive)
             anetKeepAlive(NULL,fd,server.tcpkeepalive);
-        if (aeCreateFileEvent(server.rgthreadvar[iel].el,fd,AE_READABLE|AE_READ_THREADSAFE,
+        if (aeCreateFileEvent(server.rgthreadvar[iel].el,fd,AE_READABLE|AE_READ_THREADSAFE|AE_BUFFERED,
             readQueryFromClient, c) == AE_ERR)
         {
             close(fd);
@@ -373,7 +419,7 @@ void _addReplyProtoToList(client *c, const char *s, size_t len) {
      * fo fill it later, when the size of the bulk length is set. */
 
     /* Append to tail string when possible. */
-    if (tail) {
+    if (tail && tail->obj == nullptr) {
         /* Copy the part we can fit into the tail, and leave the rest for a
          * new node */
         size_t avail = tail->size - tail->used;
@@ -391,6 +437,7 @@ void _addReplyProtoToList(client *c, const char *s, size_t len) {
         /* take over the allocation's internal fragmentation */
         tail->size = zmalloc_usable(tail) - sizeof(clientReplyBlock);
         tail->used = len;
+        tail->obj = nullptr;
         memcpy(tail->buf(), s, len);
         listAddNodeTail(c->reply, tail);
         c->reply_bytes += tail->size;
@@ -398,6 +445,24 @@ void _addReplyProtoToList(client *c, const char *s, size_t len) {
     asyncCloseClientOnOutputBufferLimitReached(c);
 }
 
+/* Queue a reference to a string object instead of copying it.  Objects
+ * shared through their refcount are never modified in place (callers such
+ * as APPEND or SETRANGE unshare them first) so the bytes stay valid until
+ * the block is written out and released. */
+void _addReplyObjectToList(client *c, robj *obj) {
+    if (c->flags & CLIENT_CLOSE_AFTER_REPLY) return;
+    AssertCorrectThread(c);
+
+    clientReplyBlock *block = (clientReplyBlock*)zmalloc(sizeof(clientReplyBlock), MALLOC_LOCAL);
+    incrRefCount(obj);
+    block->obj = obj;
+    block->off = 0;
+    block->size = block->used = sdslen((sds)ptrFromObj(obj));
+    listAddNodeTail(c->reply, block);
+    c->reply_bytes += block->size;
+    asyncCloseClientOnOutputBufferLimitReached(c);
+}
+
 /* -----------------------------------------------------------------------------
  * Higher level functions to queue data on the client output buffer.
  * The following functions are the ones that commands implementations will call.
@@ -406,6 +471,12 @@ void addReplyCore(client *c, robj *obj, bool fAsync) {
     if (prepareClientToWrite(c, fAsync) != C_OK) return;
 
     if (sdsEncodedObject(obj)) {
+        if (!fAsync && obj->encoding == OBJ_ENCODING_RAW &&
+            sdslen((sds)ptrFromObj(obj)) >= PROTO_REPLY_OBJ_MIN_BYTES)
+        {
+            _addReplyObjectToList(c,obj);
+            return;
+        }
         if (_addReplyToBuffer(c,(const char*)ptrFromObj(obj),sdslen((sds)ptrFromObj(obj)),fAsync) != C_OK)
             _addReplyProtoToList(c,(const char*)ptrFromObj(obj),sdslen((sds)ptrFromObj(obj)));
     } else if (obj->encoding == OBJ_ENCODING_INT) {
@@ -474,6 +545,50 @@ void addReplyProtoAsync(client *c, const char *s, size_t len) {
     addReplyProtoCore(c, s, len, true);
 }
 
+/* Queue 'len' bytes of the string object 'obj' starting at 'off' by
+ * reference. The bytes in that range must never change, but the object may
+ * grow past it: this is how the blocks of the replication backlog are shared
+ * with the output buffers of the replicas. A range following the one at the
+ * tail of the output buffer extends it, so feeding a replica command by
+ * command still queues a single block per backlog block. */
+void addReplyObjectRangeCore(client *c, robj *obj, size_t off, size_t len, bool fAsync) {
+    if (prepareClientToWrite(c, fAsync) != C_OK) return;
+    if (c->flags & CLIENT_CLOSE_AFTER_REPLY) return;
+
+    fAsync = fAsync && !FCorrectThread(c);
+    if (fAsync && c->bufposAsync > 0) {
+        /* Data waiting to be moved to the output buffer must go first */
+        _addReplyToBuffer(c,(const char*)ptrFromObj(obj)+off,len,fAsync);
+        return;
+    }
+
+    listNode *ln = listLast(c->reply);
+    clientReplyBlock *tail = (clientReplyBlock*) (ln? listNodeValue(ln): NULL);
+    if (tail && tail->obj == obj && tail->off + tail->used == off) {
+        tail->used += len;
+    } else {
+        clientReplyBlock *block = (clientReplyBlock*)zmalloc(sizeof(clientReplyBlock), MALLOC_LOCAL);
+        incrRefCount(obj);
+        block->obj = obj;
+        block->off = off;
+        block->used = len;
+        /* The size is all the memory the reference keeps alive, so the
+         * output buffer limits still apply to slow replicas. */
+        block->size = sizeof(robj) + getStringObjectSdsUsedMemory(obj);
+        listAddNodeTail(c->reply, block);
+        c->reply_bytes += block->size;
+    }
+    asyncCloseClientOnOutputBufferLimitReached(c);
+}
+
+void addReplyObjectRange(client *c, robj *obj, size_t off, size_t len) {
+    addReplyObjectRangeCore(c, obj, off, len, false);
+}
+
+void addReplyObjectRangeAsync(client *c, robj *obj, size_t off, size_t len) {
+    addReplyObjectRangeCore(c, obj, off, len, true);
+}
+
 /* Low level function called by the addReplyError...() functions.
  * It emits the protocol for a Redis error, in the form:
  *
@@ -598,6 +713,7 @@ void setDeferredAggregateLen(client *c, void *node, long length, char prefix) {
      * - It has enough room already allocated
      * - And not too large (avoid large memmove) */
     if (ln->next != NULL && (next = (clientReplyBlock*)listNodeValue(ln->next)) &&
+        next->obj == nullptr &&
         next->size - next->used >= lenstr_len &&
         next->used < PROTO_REPLY_CHUNK_BYTES * 4) {
         memmove(next->buf() + lenstr_len, next->buf(), next->used);
@@ -610,6 +726,7 @@ void setDeferredAggregateLen(client *c, void *node, long length, char prefix) {
         /* Take over the allocation's internal fragmentation */
         buf->size = zmalloc_usable(buf) - sizeof(clientReplyBlock);
         buf->used = lenstr_len;
+        buf->obj = nullptr;
         memcpy(buf->buf(), lenstr, lenstr_len);
         listNodeValue(ln) = buf;
         c->reply_bytes += buf->size;
@@ -1161,7 +1278,7 @@ void acceptUnixHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
 static void freeClientArgv(client *c) {
     int j;
     for (j = 0; j < c->argc; j++)
-        decrRefCount(c->argv[j]);
+        freeArgvStringObject(c->argv[j]);
     c->argc = 0;
     c->cmd = NULL;
 }
@@ -1214,7 +1331,7 @@ void unlinkClient(client *c) {
         /* Unregister async I/O handlers and close the socket. */
         aeDeleteFileEvent(server.rgthreadvar[c->iel].el,c->fd,AE_READABLE);
         aeDeleteFileEvent(server.rgthreadvar[c->iel].el,c->fd,AE_WRITABLE);
-        close(c->fd);
+        aeCloseFile(server.rgthreadvar[c->iel].el,c->fd);
         c->fd = -1;
 
         atomicDecr(server.rgthreadvar[c->iel].cclients, 1);
@@ -1273,13 +1390,14 @@ void freeClient(client *c) {
      *
      * Note that before doing this we make sure that the client is not in
      * some unexpected state, by checking its flags. */
-    if (server.master && c->flags & CLIENT_MASTER) {
+    redisMaster *mi = (c->flags & CLIENT_MASTER) ? MasterInfoFromClient(c) : NULL;
+    if (mi && mi->master == c) {
         serverLog(LL_WARNING,"Connection with master lost.");
         if (!(c->flags & (CLIENT_CLOSE_AFTER_REPLY|
                           CLIENT_CLOSE_ASAP|
                           CLIENT_BLOCKED)))
         {
-            replicationCacheMaster(c);
+            replicationCacheMaster(mi, c);
             return;
         }
     }
@@ -1339,7 +1457,7 @@ void freeClient(client *c) {
 
     /* Master/slave cleanup Case 2:
      * we lost the connection with the master. */
-    if (c->flags & CLIENT_MASTER) replicationHandleMasterDisconnection();
+    if (mi && mi->master == c) replicationHandleMasterDisconnection(mi);
 
     /* If this client was scheduled for async freeing we need to remove it
      * from the queue. */
@@ -1405,50 +1523,89 @@ client *lookupClientByID(uint64_t id) {
 int writeToClient(int fd, client *c, int handler_installed) {
     ssize_t nwritten = 0, totwritten = 0;
     clientReplyBlock *o;
+    listIter li;
+    listNode *ln;
+    struct iovec iov[IOV_MAX];
     AssertCorrectThread(c);
 
     std::unique_lock<decltype(c->lock)> lock(c->lock);
    
     while(clientHasPendingReplies(c)) {
+        int iovcnt = 0;
+        size_t iovbytes = 0;
+
+        /* Drop empty blocks from the head so sentlen applies to real data */
+        while (c->bufpos == 0 && listLength(c->reply) &&
+               ((clientReplyBlock*)listNodeValue(listFirst(c->reply)))->used == 0)
+        {
+            o = (clientReplyBlock*)listNodeValue(listFirst(c->reply));
+            c->reply_bytes -= o->size;
+            listDelNode(c->reply,listFirst(c->reply));
+        }
+        if (!clientHasPendingReplies(c)) break;
+
+        /* Gather the static buffer and as many reply blocks as we can into
+         * a single writev(), stopping once we have NET_MAX_WRITES_PER_EVENT
+         * bytes as the loop below would stop there anyway. */
+        size_t offset = c->sentlen;
         if (c->bufpos > 0) {
-            nwritten = write(fd,c->buf+c->sentlen,c->bufpos-c->sentlen);
+            iov[iovcnt].iov_base = c->buf+c->sentlen;
+            iov[iovcnt].iov_len = c->bufpos-c->sentlen;
+            iovbytes += iov[iovcnt].iov_len;
+            iovcnt++;
+            offset = 0;
+        }
+        listRewind(c->reply,&li);
+        while (iovcnt < IOV_MAX && iovbytes < NET_MAX_WRITES_PER_EVENT && (ln = listNext(&li))) {
+            o = (clientReplyBlock*)listNodeValue(ln);
+            if (o->used == 0) continue;
+            iov[iovcnt].iov_base = (char*)replyBlockData(o)+offset;
+            iov[iovcnt].iov_len = o->used-offset;
+            iovbytes += iov[iovcnt].iov_len;
+            iovcnt++;
+            offset = 0;
+        }
 
-            if (nwritten <= 0) break;
-            c->sentlen += nwritten;
-            totwritten += nwritten;
+        nwritten = aeWritev(server.rgthreadvar[c->iel].el,fd,iov,iovcnt);
+        if (nwritten <= 0) break;
+        totwritten += nwritten;
 
-            /* If the buffer was sent, set bufpos to zero to continue with
-             * the remainder of the reply. */
-            if ((int)c->sentlen == c->bufpos) {
+        /* Consume what was sent, starting with the static buffer */
+        size_t remaining = nwritten;
+        if (c->bufpos > 0) {
+            size_t left = c->bufpos-c->sentlen;
+            if (remaining >= left) {
+                /* If the buffer was sent, set bufpos to zero to continue with
+                 * the remainder of the reply. */
+                remaining -= left;
                 c->bufpos = 0;
                 c->sentlen = 0;
+            } else {
+                c->sentlen += remaining;
+                remaining = 0;
             }
-        } else {
+        }
+        while (remaining > 0) {
             o = (clientReplyBlock*)listNodeValue(listFirst(c->reply));
-            if (o->used == 0) {
-                c->reply_bytes -= o->size;
-                listDelNode(c->reply,listFirst(c->reply));
-                continue;
-            }
-
-            nwritten = write(fd, o->buf() + c->sentlen, o->used - c->sentlen);
-            if (nwritten <= 0)
+            size_t left = o->used-c->sentlen;
+            if (remaining < left) {
+                c->sentlen += remaining;
                 break;
-                
-            c->sentlen += nwritten;
-            totwritten += nwritten;
-            
-            /* If we fully sent the object on head go to the next one */
-            if (c->sentlen == o->used) {
-                c->reply_bytes -= o->size;
-                listDelNode(c->reply,listFirst(c->reply));
-                c->sentlen = 0;
-                /* If there are no longer objects in the list, we expect
-                    * the count of reply bytes to be exactly zero. */
-                if (listLength(c->reply) == 0)
-                    serverAssert(c->reply_bytes == 0);
             }
+            /* We fully sent the object on head, go to the next one */
+            remaining -= left;
+            c->reply_bytes -= o->size;
+            listDelNode(c->reply,listFirst(c->reply));
+            c->sentlen = 0;
         }
+        /* If there are no longer objects in the list, we expect
+         * the count of reply bytes to be exactly zero. */
+        if (listLength(c->reply) == 0)
+            serverAssert(c->reply_bytes == 0);
+
+        /* A short write means the socket buffer is full */
+        if ((size_t)nwritten < iovbytes) break;
+
         /* Note that we avoid to send more than NET_MAX_WRITES_PER_EVENT
          * bytes, in a single threaded server it's a good idea to serve
          * other clients as well, even if a very large request comes from
@@ -1543,14 +1700,19 @@ void ProcessPendingAsyncWrites()
 
         // TODO: Append to end of reply block?
 
-        size_t size = c->bufposAsync;
-        clientReplyBlock *reply = (clientReplyBlock*)zmalloc(size + sizeof(clientReplyBlock), MALLOC_LOCAL);
-        /* take over the allocation's internal fragmentation */
-        reply->size = zmalloc_usable(reply) - sizeof(clientReplyBlock);
-        reply->used = c->bufposAsync;
-        memcpy(reply->buf(), c->bufAsync, c->bufposAsync);
-        listAddNodeTail(c->reply, reply);
-        c->reply_bytes += reply->size;
+        /* Nothing to move if only references were queued, see
+         * addReplyObjectRangeAsync() */
+        if (c->bufposAsync > 0) {
+            size_t size = c->bufposAsync;
+            clientReplyBlock *reply = (clientReplyBlock*)zmalloc(size + sizeof(clientReplyBlock), MALLOC_LOCAL);
+            /* take over the allocation's internal fragmentation */
+            reply->size = zmalloc_usable(reply) - sizeof(clientReplyBlock);
+            reply->used = c->bufposAsync;
+            reply->obj = nullptr;
+            memcpy(reply->buf(), c->bufAsync, c->bufposAsync);
+            listAddNodeTail(c->reply, reply);
+            c->reply_bytes += reply->size;
+        }
 
         c->bufposAsync = 0;
         c->buflenAsync = 0;
@@ -1689,11 +1851,24 @@ void unprotectClient(client *c) {
     AssertCorrectThread(c);
     if (c->flags & CLIENT_PROTECTED) {
         c->flags &= ~CLIENT_PROTECTED;
-        aeCreateFileEvent(server.rgthreadvar[c->iel].el,c->fd,AE_READABLE|AE_READ_THREADSAFE,readQueryFromClient,c);
+        aeCreateFileEvent(server.rgthreadvar[c->iel].el,c->fd,AE_READABLE|AE_READ_THREADSAFE|AE_BUFFERED,readQueryFromClient,c);
         if (clientHasPendingReplies(c)) clientInstallWriteHandler(c);
     }
 }
 
+/* Make c->argv large enough for 'argc' arguments. The array is kept across
+ * commands so that a pipeline of small commands does not allocate one per
+ * command; only unusually large arrays are released. */
+static void clientReserveArgv(client *c, long long argc) {
+    if (c->argv) {
+        size_t cap = zmalloc_size(c->argv)/sizeof(robj*);
+        if ((size_t)argc <= cap && (cap <= PROTO_ARGV_REUSE_MAX || (size_t)argc > cap/2))
+            return;
+        zfree(c->argv);
+    }
+    c->argv = (robj**)zmalloc(sizeof(robj*)*argc, MALLOC_LOCAL);
+}
+
 /* Like processMultibulkBuffer(), but for the inline protocol instead of RESP,
  * this function consumes the client query buffer and creates a command ready
  * to be executed inside the client structure. Returns C_OK if the command
@@ -1744,10 +1919,7 @@ int processInlineBuffer(client *c) {
     c->qb_pos += querylen+linefeed_chars;
 
     /* Setup argv array on client structure */
-    if (argc) {
-        if (c->argv) zfree(c->argv);
-        c->argv = (robj**)zmalloc(sizeof(robj*)*argc, MALLOC_LOCAL);
-    }
+    if (argc) clientReserveArgv(c,argc);
 
     /* Create redis objects for all arguments. */
     for (c->argc = 0, j = 0; j < argc; j++) {
@@ -1792,6 +1964,60 @@ static void setProtocolError(const char *errstr, client *c) {
     c->flags |= CLIENT_CLOSE_AFTER_REPLY;
 }
 
+/* Parse a "<prefix><digits>\r\n" protocol line at *pp without scanning
+ * for the newline first.  Only canonical lengths are accepted, anything
+ * else (signs, leading zeros, overflow, missing data) returns 0 so the
+ * caller can let the regular parser produce the right error. */
+static inline int parseProtoLength(const char **pp, const char *end, char prefix, long long *out) {
+    const char *p = *pp;
+    if (p >= end || *p != prefix) return 0;
+    const char *digits = ++p;
+    long long v = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        v = v*10 + (*p - '0');
+        if (++p - digits > 18) return 0;
+    }
+    if (p == digits || end-p < 2 || p[0] != '\r' || p[1] != '\n') return 0;
+    if (*digits == '0' && p-digits > 1) return 0;
+    *out = v;
+    *pp = p+2;
+    return 1;
+}
+
+/* Fast path of processMultibulkBuffer() for the common case of a command
+ * that is entirely in the query buffer, as with pipelined clients.  The
+ * headers are validated in a first pass so nothing is allocated for an
+ * incomplete command, then argv is built in one go.  Returns 0 when the
+ * regular parser must handle the command. */
+static int processMultibulkBufferFast(client *c) {
+    const char *start = c->querybuf+c->qb_pos;
+    const char *end = c->querybuf+sdslen(c->querybuf);
+    const char *p = start;
+    long long mbulk, ll;
+
+    if (!parseProtoLength(&p,end,'*',&mbulk) || mbulk <= 0 || mbulk > 1024*1024)
+        return 0;
+
+    const char *args = p;
+    for (long long j = 0; j < mbulk; j++) {
+        if (!parseProtoLength(&p,end,'$',&ll) || ll > server.proto_max_bulk_len ||
+            ll >= PROTO_MBULK_BIG_ARG || end-p < ll+2)
+            return 0;
+        p += ll+2;
+    }
+
+    /* Setup argv array on client structure */
+    clientReserveArgv(c,mbulk);
+    p = args;
+    for (long long j = 0; j < mbulk; j++) {
+        parseProtoLength(&p,end,'$',&ll);
+        c->argv[c->argc++] = createArgvStringObject(p,ll);
+        p += ll+2;
+    }
+    c->qb_pos += p-start;
+    return 1;
+}
+
 /* Process the query buffer for client 'c', setting up the client argument
  * vector for command execution. Returns C_OK if after running the function
  * the client has a well-formed ready to be processed command, otherwise
@@ -1812,8 +2038,10 @@ int processMultibulkBuffer(client *c) {
         /* The client should have been reset */
         serverAssertWithInfo(c,NULL,c->argc == 0);
 
+        if (processMultibulkBufferFast(c)) return C_OK;
+
         /* Multi bulk length cannot be read without a \r\n */
-        newline = strchr(c->querybuf+c->qb_pos,'\r');
+        newline = (char*)memchr(c->querybuf+c->qb_pos,'\r',sdslen(c->querybuf)-c->qb_pos);
         if (newline == NULL) {
             if (sdslen(c->querybuf)-c->qb_pos > PROTO_INLINE_MAX_SIZE) {
                 addReplyError(c,"Protocol error: too big mbulk count string");
@@ -1843,15 +2071,14 @@ int processMultibulkBuffer(client *c) {
         c->multibulklen = ll;
 
         /* Setup argv array on client structure */
-        if (c->argv) zfree(c->argv);
-        c->argv = (robj**)zmalloc(sizeof(robj*)*c->multibulklen, MALLOC_LOCAL);
+        clientReserveArgv(c,c->multibulklen);
     }
 
     serverAssertWithInfo(c,NULL,c->multibulklen > 0);
     while(c->multibulklen) {
         /* Read bulk length if unknown */
         if (c->bulklen == -1) {
-            newline = strchr(c->querybuf+c->qb_pos,'\r');
+            newline = (char*)memchr(c->querybuf+c->qb_pos,'\r',sdslen(c->querybuf)-c->qb_pos);
             if (newline == NULL) {
                 if (sdslen(c->querybuf)-c->qb_pos > PROTO_INLINE_MAX_SIZE) {
                     addReplyError(c,
@@ -1923,7 +2150,7 @@ int processMultibulkBuffer(client *c) {
                 sdsclear(c->querybuf);
             } else {
                 c->argv[c->argc++] =
-                    createStringObject(c->querybuf+c->qb_pos,c->bulklen);
+                    createArgvStringObject(c->querybuf+c->qb_pos,c->bulklen);
                 c->qb_pos += c->bulklen+2;
             }
             c->bulklen = -1;
@@ -1945,6 +2172,7 @@ int processMultibulkBuffer(client *c) {
 void processInputBuffer(client *c) {
     AssertCorrectThread(c);
     bool fFreed = false;
+    long long reploffThreaded = -1;
     
     /* Keep processing while there is something in the input buffer */
     while(c->qb_pos < sdslen(c->querybuf)) {
@@ -1998,13 +2226,36 @@ void processInputBuffer(client *c) {
         /* Multibulk processing could see a <= 0 length. */
         if (c->argc == 0) {
             resetClient(c);
+        } else if ((c->flags & CLIENT_MASTER) && replicationApplyDispatch(c)) {
+            /* Handed to the replica apply threads: the applied offset of
+             * our master is updated once they are done with it. */
+            reploffThreaded = c->read_reploff - sdslen(c->querybuf) + c->qb_pos;
+            resetClient(c);
         } else {
+            /* The other commands of our master wait for the ones handed
+             * to the replica apply threads to be applied. */
+            if (c->flags & CLIENT_MASTER) replicationApplyDrain();
+
             AeLocker locker;
-            locker.arm(c);
-            server.current_client = c;
+            if (!locker.armShard(c))
+            {
+                locker.arm(c);
+                server.current_client = c;
+            }
+
+            int ret = processCommand(c);
+            if (locker.fShard() && serverTL->lua_shard_retry) {
+                /* The script could not go on under the shard lock before it
+                 * wrote anything: run it again under the global lock. */
+                serverTL->lua_shard_retry = 0;
+                locker.releaseShard();
+                locker.arm(c);
+                server.current_client = c;
+                ret = processCommand(c);
+            }
 
             /* Only reset the client when the command was executed. */
-            if (processCommand(c) == C_OK) {
+            if (ret == C_OK) {
                 if (c->flags & CLIENT_MASTER && !(c->flags & CLIENT_MULTI)) {
                     /* Update the applied replication offset of our master. */
                     c->reploff = c->read_reploff - sdslen(c->querybuf) + c->qb_pos;
@@ -2019,7 +2270,8 @@ void processInputBuffer(client *c) {
             }
             /* freeMemoryIfNeeded may flush slave output buffers. This may
              * result into a slave, that may be the active client, to be
-             * freed. */
+             * freed. Sharded commands never evict nor set current_client. */
+            if (locker.fShard()) continue;
             if (server.current_client == NULL) {
                 fFreed = true;
                 break;
@@ -2028,6 +2280,11 @@ void processInputBuffer(client *c) {
         }
     }
 
+    if (!fFreed && (c->flags & CLIENT_MASTER)) {
+        replicationApplyDrain();
+        if (reploffThreaded > c->reploff) c->reploff = reploffThreaded;
+    }
+
     /* Trim to pos */
     if (!fFreed && c->qb_pos) {
         sdsrange(c->querybuf,c->qb_pos,-1);
@@ -2047,10 +2304,14 @@ void processInputBufferAndReplicate(client *c) {
         processInputBuffer(c);
         size_t applied = c->reploff - prev_offset;
         if (applied) {
-            aeAcquireLock();
-            replicationFeedSlavesFromMasterStream(server.slaves,
-                    c->pending_querybuf, applied);
-            aeReleaseLock();
+            /* Active replicas propagate what they execute from call(), as
+             * masters do, so there is no stream to proxy. */
+            if (!server.fActiveReplica) {
+                aeAcquireLock();
+                replicationFeedSlavesFromMasterStream(server.slaves,
+                        c->pending_querybuf, applied);
+                aeReleaseLock();
+            }
             sdsrange(c->pending_querybuf,applied,-1);
         }
     }
@@ -2092,7 +2353,7 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
     if (c->querybuf_peak < qblen) c->querybuf_peak = qblen;
     c->querybuf = sdsMakeRoomFor(c->querybuf, readlen);
     
-    nread = read(fd, c->querybuf+qblen, readlen);
+    nread = aeRead(el, fd, c->querybuf+qblen, readlen);
     
     if (nread == -1) {
         if (errno == EAGAIN) {
@@ -2142,8 +2403,12 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
      * corresponding part of the replication stream, will be propagated to
      * the sub-slaves and to the replication backlog. */
     processInputBufferAndReplicate(c);
-    aelock.arm(c);
-    ProcessPendingAsyncWrites();
+    /* Only our own thread adds to this list, so if it is empty there is no
+     * need to take the global lock. */
+    if (listLength(serverTL->clients_pending_asyncwrite)) {
+        aelock.arm(c);
+        ProcessPendingAsyncWrites();
+    }
 }
 
 void getClientsMaxBuffers(unsigned long *longest_output_list,
@@ -2564,7 +2829,7 @@ void helloCommand(client *c) {
 
     if (!server.sentinel_mode) {
         addReplyBulkCString(c,"role");
-        addReplyBulkCString(c,server.masterhost ? "replica" : "master");
+        addReplyBulkCString(c,listLength(server.masters) ? "replica" : "master");
     }
 
     addReplyBulkCString(c,"modules");
@@ -78,14 +78,14 @@ robj *createRawStringObject(const char *ptr, size_t len) {
     return createObject(OBJ_STRING, sdsnewlen(ptr,len));
 }
 
-/* Create a string object with encoding OBJ_ENCODING_EMBSTR, that is
- * an object where the sds string is actually an unmodifiable string
- * allocated in the same chunk as the object itself. */
-robj *createEmbeddedStringObject(const char *ptr, size_t len) {
+static size_t embeddedStringObjectSize(size_t len) {
     size_t allocsize = sizeof(struct sdshdr8)+len+1;
     if (allocsize < sizeof(void*))
         allocsize = sizeof(void*);
-    robj *o = zmalloc(sizeof(robj)+allocsize-sizeof(o->m_ptr), MALLOC_SHARED);
+    return sizeof(robj)+allocsize-sizeof(((robj*)NULL)->m_ptr);
+}
+
+static void initEmbeddedStringObject(robj *o, const char *ptr, size_t len) {
     struct sdshdr8 *sh = (void*)(&o->m_ptr);
 
     o->type = OBJ_STRING;
@@ -108,6 +108,14 @@ robj *createEmbeddedStringObject(const char *ptr, size_t len) {
     } else {
         memset(sh->buf,0,len+1);
     }
+}
+
+/* Create a string object with encoding OBJ_ENCODING_EMBSTR, that is
+ * an object where the sds string is actually an unmodifiable string
+ * allocated in the same chunk as the object itself. */
+robj *createEmbeddedStringObject(const char *ptr, size_t len) {
+    robj *o = zmalloc(embeddedStringObjectSize(len), MALLOC_SHARED);
+    initEmbeddedStringObject(o,ptr,len);
     return o;
 }
 
@@ -125,6 +133,43 @@ robj *createStringObject(const char *ptr, size_t len) {
         return createRawStringObject(ptr,len);
 }
 
+/* Command arguments created by the protocol parser are almost never retained
+ * by the command: resetClient() releases them right after call(). To save a
+ * malloc/free pair per argument, unretained EMBSTR arguments are kept in a
+ * per-thread freelist bucketed by allocation size and reused for the next
+ * command. An argument the command keeps (e.g. the value of SET) had its
+ * refcount incremented, so it is just left on the heap and released with
+ * decrRefCount() as usual. */
+robj *createArgvStringObject(const char *ptr, size_t len) {
+    if (serverTL && len <= OBJ_ENCODING_EMBSTR_SIZE_LIMIT) {
+        size_t cls = (embeddedStringObjectSize(len)+15)/16;
+        robj *o = serverTL->argv_pool[cls];
+        if (o) {
+            serverTL->argv_pool[cls] = o->m_ptr;
+            serverTL->argv_pool_len[cls]--;
+            initEmbeddedStringObject(o,ptr,len);
+            return o;
+        }
+    }
+    return createStringObject(ptr,len);
+}
+
+/* Release a command argument, returning it to the per-thread pool when it
+ * is an EMBSTR object nobody else references. */
+void freeArgvStringObject(robj *o) {
+    if (serverTL && o->refcount == 1 && o->encoding == OBJ_ENCODING_EMBSTR) {
+        size_t cls = zmalloc_size(o)/16;
+        if (cls > ARGV_POOL_CLASSES) cls = ARGV_POOL_CLASSES;
+        if (serverTL->argv_pool_len[cls] < ARGV_POOL_MAX_PER_CLASS) {
+            o->m_ptr = serverTL->argv_pool[cls];
+            serverTL->argv_pool[cls] = o;
+            serverTL->argv_pool_len[cls]++;
+            return;
+        }
+    }
+    decrRefCount(o);
+}
+
 /* Create a string object from a long long value. When possible returns a
  * shared integer object, or at least an integer encoded one.
  *
@@ -348,12 +393,17 @@ void freeStreamObject(robj *o) {
     freeStream(ptrFromObj(o));
 }
 
+/* Reference counts are updated atomically: client reply blocks hold
+ * references to values and release them from the client's thread when the
+ * reply was written, without the global lock. */
 void incrRefCount(robj *o) {
-    if (o->refcount != OBJ_SHARED_REFCOUNT) o->refcount++;
+    if (o->refcount != OBJ_SHARED_REFCOUNT) __atomic_fetch_add(&o->refcount, 1, __ATOMIC_RELAXED);
 }
 
 void decrRefCount(robj *o) {
-    if (o->refcount == 1) {
+    if (o->refcount == OBJ_SHARED_REFCOUNT) return;
+    int refcount = __atomic_fetch_sub(&o->refcount, 1, __ATOMIC_ACQ_REL);
+    if (refcount == 1) {
         switch(o->type) {
         case OBJ_STRING: freeStringObject(o); break;
         case OBJ_LIST: freeListObject(o); break;
@@ -366,8 +416,7 @@ void decrRefCount(robj *o) {
         }
         zfree(o);
     } else {
-        if (o->refcount <= 0) serverPanic("decrRefCount against refcount <= 0");
-        if (o->refcount != OBJ_SHARED_REFCOUNT) o->refcount--;
+        if (refcount <= 0) serverPanic("decrRefCount against refcount <= 0");
     }
 }
 
@@ -981,8 +1030,7 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
     mem_total += server.initial_memory_usage;
 
     mem = 0;
-    if (server.repl_backlog)
-        mem += zmalloc_size(server.repl_backlog);
+    mem += replicationBacklogMemoryUsage();
     mh->repl_backlog = mem;
     mem_total += mem;
 
@@ -1,13 +1,697 @@
 extern "C" {
 #include "rio.h"
+#include "sha256.h"
 }
 #include "server.h"
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* ----------------------------------------------------------------------------
+ * Native S3 client
+ *
+ * When s3-endpoint is set, db-s3-object is read and written with the S3 REST
+ * API instead of the aws CLI: the RDB is uploaded with a multipart upload
+ * whose parts are sent by s3-threads threads while the dataset is still being
+ * serialized, and it is downloaded as ranges fetched in parallel that feed the
+ * loader in order. Failed parts or ranges are retried individually.
+ *
+ * Requests use plain HTTP with path style addressing, which S3 compatible
+ * servers accept, and are signed with AWS Signature Version 4 using the
+ * credentials of the AWS_ACCESS_KEY_ID, AWS_SECRET_ACCESS_KEY and
+ * AWS_SESSION_TOKEN environment variables.
+ * ------------------------------------------------------------------------- */
+
+#define S3_PART_SIZE (8*1024*1024)  /* Every part but the last is >= 5MB */
+#define S3_RETRIES 5
+#define S3_TIMEOUT_SEC 60
+
+struct S3Response
+{
+    int status = 0;
+    std::string etag;
+    long long contentLength = -1;
+    std::string body;
+};
+
+static std::string hexString(const unsigned char *p, size_t cb)
+{
+    static const char *digits = "0123456789abcdef";
+    std::string str;
+    str.reserve(cb*2);
+    for (size_t i = 0; i < cb; ++i)
+    {
+        str.push_back(digits[p[i] >> 4]);
+        str.push_back(digits[p[i] & 0xf]);
+    }
+    return str;
+}
+
+static std::string sha256Hex(const char *p, size_t cb)
+{
+    SHA256_CTX ctx;
+    BYTE hash[SHA256_BLOCK_SIZE];
+    sha256_init(&ctx);
+    sha256_update(&ctx, (const BYTE*)p, cb);
+    sha256_final(&ctx, hash);
+    return hexString(hash, sizeof(hash));
+}
+
+static std::string hmacSha256(const std::string &key, const std::string &msg)
+{
+    BYTE k[64] = {0}, ipad[64], opad[64], hash[SHA256_BLOCK_SIZE];
+    SHA256_CTX ctx;
+
+    if (key.size() > sizeof(k))
+    {
+        sha256_init(&ctx);
+        sha256_update(&ctx, (const BYTE*)key.data(), key.size());
+        sha256_final(&ctx, k);
+    }
+    else
+    {
+        memcpy(k, key.data(), key.size());
+    }
+    for (size_t i = 0; i < sizeof(k); ++i)
+    {
+        ipad[i] = k[i] ^ 0x36;
+        opad[i] = k[i] ^ 0x5c;
+    }
+    sha256_init(&ctx);
+    sha256_update(&ctx, ipad, sizeof(ipad));
+    sha256_update(&ctx, (const BYTE*)msg.data(), msg.size());
+    sha256_final(&ctx, hash);
+    sha256_init(&ctx);
+    sha256_update(&ctx, opad, sizeof(opad));
+    sha256_update(&ctx, hash, sizeof(hash));
+    sha256_final(&ctx, hash);
+    return std::string((const char*)hash, sizeof(hash));
+}
+
+/* URI encoding as required by SigV4: everything but the unreserved
+ * characters is percent-encoded, and '/' too unless it separates a path. */
+static std::string uriEncode(const std::string &str, bool fPath)
+{
+    std::string out;
+    char buf[4];
+    for (unsigned char ch : str)
+    {
+        if (isalnum(ch) || ch == '-' || ch == '_' || ch == '.' || ch == '~' || (fPath && ch == '/'))
+        {
+            out.push_back(ch);
+        }
+        else
+        {
+            snprintf(buf, sizeof(buf), "%%%02X", ch);
+            out += buf;
+        }
+    }
+    return out;
+}
+
+class S3Client
+{
+    std::string m_host;
+    int m_port = 80;
+    std::string m_region;
+    std::string m_accessKey;
+    std::string m_secretKey;
+    std::string m_sessionToken;
+    std::string m_bucket;
+    std::string m_key;
+
+    bool readResponse(int fd, bool fHead, S3Response &resp);
+
+public:
+    /* Parse the endpoint, credentials and an s3://bucket/key object path. */
+    bool init(const char *object)
+    {
+        const char *accessKey = getenv("AWS_ACCESS_KEY_ID");
+        const char *secretKey = getenv("AWS_SECRET_ACCESS_KEY");
+        const char *sessionToken = getenv("AWS_SESSION_TOKEN");
+        if (accessKey == nullptr || secretKey == nullptr)
+        {
+            serverLog(LL_WARNING, "S3: AWS_ACCESS_KEY_ID and AWS_SECRET_ACCESS_KEY must be set");
+            return false;
+        }
+        m_accessKey = accessKey;
+        m_secretKey = secretKey;
+        if (sessionToken != nullptr)
+            m_sessionToken = sessionToken;
+        m_region = server.s3_region;
+
+        std::string endpoint = server.s3_endpoint;
+        if (endpoint.compare(0, 7, "http://") == 0)
+            endpoint = endpoint.substr(7);
+        size_t colon = endpoint.rfind(':');
+        if (colon != std::string::npos)
+        {
+            m_port = atoi(endpoint.c_str() + colon + 1);
+            endpoint = endpoint.substr(0, colon);
+        }
+        m_host = endpoint;
+
+        if (strncmp(object, "s3://", 5) != 0 || strchr(object+5, '/') == nullptr)
+        {
+            serverLog(LL_WARNING, "S3: db-s3-object must be s3://bucket/key with s3-endpoint set");
+            return false;
+        }
+        const char *slash = strchr(object+5, '/');
+        m_bucket.assign(object+5, slash);
+        m_key = slash+1;
+        return !m_host.empty() && m_port > 0 && !m_bucket.empty() && !m_key.empty();
+    }
+
+    /* Perform a signed request on the object. 'query' is a canonical query
+     * string (sorted, encoded). Returns false on network errors only, the
+     * HTTP status is in 'resp'. */
+    bool request(const char *method, const std::string &query, const std::string &range,
+        const char *body, size_t cbBody, S3Response &resp);
+};
+
+bool S3Client::request(const char *method, const std::string &query, const std::string &range,
+    const char *body, size_t cbBody, S3Response &resp)
+{
+    char amzdate[17], datestamp[9];
+    time_t now = time(NULL);
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    strftime(amzdate, sizeof(amzdate), "%Y%m%dT%H%M%SZ", &tm);
+    strftime(datestamp, sizeof(datestamp), "%Y%m%d", &tm);
+
+    std::string host = m_host;
+    if (m_port != 80)
+        host += ":" + std::to_string(m_port);
+    std::string uri = "/" + uriEncode(m_bucket, false) + "/" + uriEncode(m_key, true);
+    std::string payloadHash = sha256Hex(body, cbBody);
+
+    std::string canonicalHeaders = "host:" + host + "\n"
+        + "x-amz-content-sha256:" + payloadHash + "\n"
+        + "x-amz-date:" + amzdate + "\n";
+    std::string signedHeaders = "host;x-amz-content-sha256;x-amz-date";
+    if (!m_sessionToken.empty())
+    {
+        canonicalHeaders += "x-amz-security-token:" + m_sessionToken + "\n";
+        signedHeaders += ";x-amz-security-token";
+    }
+    std::string canonicalRequest = std::string(method) + "\n" + uri + "\n" + query + "\n"
+        + canonicalHeaders + "\n" + signedHeaders + "\n" + payloadHash;
+    std::string scope = std::string(datestamp) + "/" + m_region + "/s3/aws4_request";
+    std::string stringToSign = std::string("AWS4-HMAC-SHA256\n") + amzdate + "\n" + scope + "\n"
+        + sha256Hex(canonicalRequest.data(), canonicalRequest.size());
+    std::string signingKey = hmacSha256(hmacSha256(hmacSha256(hmacSha256(
+        "AWS4" + m_secretKey, datestamp), m_region), "s3"), "aws4_request");
+    std::string signature = hmacSha256(signingKey, stringToSign);
+
+    std::string req = std::string(method) + " " + uri + (query.empty() ? "" : "?" + query) + " HTTP/1.1\r\n"
+        + "Host: " + host + "\r\n"
+        + "x-amz-content-sha256: " + payloadHash + "\r\n"
+        + "x-amz-date: " + amzdate + "\r\n";
+    if (!m_sessionToken.empty())
+        req += "x-amz-security-token: " + m_sessionToken + "\r\n";
+    if (!range.empty())
+        req += "Range: " + range + "\r\n";
+    req += "Authorization: AWS4-HMAC-SHA256 Credential=" + m_accessKey + "/" + scope
+        + ", SignedHeaders=" + signedHeaders
+        + ", Signature=" + hexString((const unsigned char*)signature.data(), signature.size()) + "\r\n"
+        + "Content-Length: " + std::to_string(cbBody) + "\r\n"
+        + "Connection: close\r\n\r\n";
+
+    char err[ANET_ERR_LEN];
+    int fd = anetTcpConnect(err, (char*)m_host.c_str(), m_port);
+    if (fd == -1)
+    {
+        serverLog(LL_WARNING, "S3: can't connect to %s:%d: %s", m_host.c_str(), m_port, err);
+        return false;
+    }
+    struct timeval tv = {S3_TIMEOUT_SEC, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    bool fOk = anetWrite(fd, (char*)req.data(), req.size()) == (int)req.size()
+        && (cbBody == 0 || anetWrite(fd, (char*)body, cbBody) == (int)cbBody)
+        && readResponse(fd, strcmp(method, "HEAD") == 0, resp);
+    close(fd);
+    if (!fOk)
+        serverLog(LL_WARNING, "S3: %s request failed: %s", method, strerror(errno));
+    return fOk;
+}
+
+bool S3Client::readResponse(int fd, bool fHead, S3Response &resp)
+{
+    std::string data;
+    char buf[16*1024];
+    size_t endHeaders;
+    ssize_t cb;
+
+    while ((endHeaders = data.find("\r\n\r\n")) == std::string::npos)
+    {
+        if ((cb = read(fd, buf, sizeof(buf))) <= 0)
+            return false;
+        data.append(buf, cb);
+    }
+
+    bool fChunked = false;
+    if (sscanf(data.c_str(), "HTTP/%*d.%*d %d", &resp.status) != 1)
+        return false;
+    size_t pos = data.find("\r\n") + 2;
+    while (pos < endHeaders)
+    {
+        size_t eol = data.find("\r\n", pos);
+        std::string line = data.substr(pos, eol - pos);
+        pos = eol + 2;
+        size_t colon = line.find(':');
+        if (colon == std::string::npos)
+            continue;
+        std::string name = line.substr(0, colon);
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        size_t start = line.find_first_not_of(' ', colon + 1);
+        std::string value = (start == std::string::npos) ? "" : line.substr(start);
+        if (name == "content-length")
+            resp.contentLength = strtoll(value.c_str(), nullptr, 10);
+        else if (name == "etag")
+            resp.etag = value;
+        else if (name == "transfer-encoding" && strcasestr(value.c_str(), "chunked"))
+            fChunked = true;
+    }
+    resp.body = data.substr(endHeaders + 4);
+    if (fHead)
+        return true;    // The length is the one of the object, not of a body
+
+    /* We sent "Connection: close", so without a length the body ends with
+     * the connection. */
+    if (resp.contentLength >= 0 && !fChunked)
+        resp.body.reserve(resp.contentLength);
+    while (fChunked || resp.contentLength < 0 || (long long)resp.body.size() < resp.contentLength)
+    {
+        if ((cb = read(fd, buf, sizeof(buf))) < 0)
+            return false;
+        if (cb == 0)
+            break;
+        resp.body.append(buf, cb);
+    }
+    if (!fChunked && resp.contentLength >= 0 && (long long)resp.body.size() != resp.contentLength)
+        return false;
+
+    if (fChunked)
+    {
+        std::string raw;
+        raw.swap(resp.body);
+        size_t off = 0;
+        for (;;)
+        {
+            size_t eol = raw.find("\r\n", off);
+            if (eol == std::string::npos)
+                return false;
+            size_t cbChunk = strtoul(raw.c_str() + off, nullptr, 16);
+            off = eol + 2;
+            if (cbChunk == 0)
+                break;
+            if (off + cbChunk > raw.size())
+                return false;
+            resp.body.append(raw, off, cbChunk);
+            off += cbChunk + 2;
+        }
+    }
+    return true;
+}
+
+/* Extract the text of the first <tag> element of an XML document. */
+static std::string xmlElement(const std::string &xml, const char *tag)
+{
+    std::string open = std::string("<") + tag + ">";
+    std::string close = std::string("</") + tag + ">";
+    size_t start = xml.find(open);
+    if (start == std::string::npos)
+        return std::string();
+    start += open.size();
+    size_t end = xml.find(close, start);
+    if (end == std::string::npos)
+        return std::string();
+    return xml.substr(start, end - start);
+}
+
+static void s3RetryDelay(int attempt)
+{
+    usleep((100*1000) << attempt);
+}
+
+/* Read exactly 'cb' bytes unless EOF is reached first. */
+static ssize_t readFull(int fd, char *p, size_t cb)
+{
+    size_t cbRead = 0;
+    while (cbRead < cb)
+    {
+        ssize_t ret = read(fd, p + cbRead, cb - cbRead);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            return -1;
+        if (ret == 0)
+            break;
+        cbRead += ret;
+    }
+    return cbRead;
+}
+
+/* Upload the RDB produced on the write end of a pipe: a reader thread cuts it
+ * in parts that s3-threads threads upload while the saving goes on. */
+class S3Uploader
+{
+    S3Client &m_client;
+    std::string m_uploadId;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<std::pair<int, std::string>> m_queue;
+    std::map<int, std::string> m_etags;
+    bool m_fEof = false;
+    bool m_fFailed = false;
+
+    std::string partQuery(int part) const
+    {
+        return "partNumber=" + std::to_string(part) + "&uploadId=" + uriEncode(m_uploadId, false);
+    }
+
+    void workerMain()
+    {
+        for (;;)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this]{ return !m_queue.empty() || m_fEof; });
+            if (m_queue.empty())
+                return;
+            auto part = std::move(m_queue.front());
+            m_queue.pop_front();
+            m_cv.notify_all();
+            bool fFailed = m_fFailed;
+            lock.unlock();
+            if (fFailed)
+                continue;   // Keep draining so the reader is never blocked
+
+            S3Response resp;
+            int attempt = 0;
+            while (!(m_client.request("PUT", partQuery(part.first), std::string(),
+                        part.second.data(), part.second.size(), resp)
+                    && resp.status == 200 && !resp.etag.empty()))
+            {
+                if (++attempt == S3_RETRIES)
+                    break;
+                serverLog(LL_NOTICE, "S3: retrying part %d (status %d)", part.first, resp.status);
+                s3RetryDelay(attempt);
+                resp = S3Response();
+            }
+
+            lock.lock();
+            if (attempt == S3_RETRIES)
+            {
+                serverLog(LL_WARNING, "S3: failed to upload part %d", part.first);
+                m_fFailed = true;
+            }
+            else
+            {
+                m_etags[part.first] = resp.etag;
+            }
+        }
+    }
+
+    void readerMain(int fd)
+    {
+        int part = 1;
+        for (;;)
+        {
+            std::string buf(S3_PART_SIZE, '\0');
+            ssize_t cb = readFull(fd, &buf[0], buf.size());
+            if (cb < 0)
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_fFailed = true;
+                break;
+            }
+            if (cb == 0 && part > 1)
+                break;
+            buf.resize(cb);
+
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this]{ return (int)m_queue.size() < server.s3_threads; });
+            m_queue.emplace_back(part++, std::move(buf));
+            m_cv.notify_all();
+            if (cb < S3_PART_SIZE)
+                break;
+        }
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_fEof = true;
+        m_cv.notify_all();
+    }
+
+public:
+    S3Uploader(S3Client &client)
+        : m_client(client)
+        {}
+
+    bool begin()
+    {
+        S3Response resp;
+        if (!m_client.request("POST", "uploads=", std::string(), nullptr, 0, resp) || resp.status != 200)
+        {
+            serverLog(LL_WARNING, "S3: can't initiate the multipart upload (status %d)", resp.status);
+            return false;
+        }
+        m_uploadId = xmlElement(resp.body, "UploadId");
+        return !m_uploadId.empty();
+    }
+
+    /* Upload everything read from 'fd' until EOF, then complete the upload
+     * if 'fSaved' is true when the workers are done, or abort it. */
+    bool run(int fd, const std::function<bool()> &save)
+    {
+        std::vector<std::thread> workers;
+        for (int i = 0; i < server.s3_threads; ++i)
+            workers.emplace_back(&S3Uploader::workerMain, this);
+        std::thread reader(&S3Uploader::readerMain, this, fd);
+
+        bool fSaved = save();
+        reader.join();
+        for (auto &worker : workers)
+            worker.join();
+
+        S3Response resp;
+        if (!fSaved || m_fFailed)
+        {
+            m_client.request("DELETE", "uploadId=" + uriEncode(m_uploadId, false), std::string(), nullptr, 0, resp);
+            return false;
+        }
+
+        std::string xml = "<CompleteMultipartUpload>";
+        for (auto &etag : m_etags)
+            xml += "<Part><PartNumber>" + std::to_string(etag.first) + "</PartNumber><ETag>" + etag.second + "</ETag></Part>";
+        xml += "</CompleteMultipartUpload>";
+        /* A failed completion may be reported with a 200 and an error body. */
+        if (!m_client.request("POST", "uploadId=" + uriEncode(m_uploadId, false), std::string(), xml.data(), xml.size(), resp)
+            || resp.status != 200 || resp.body.find("<Error>") != std::string::npos)
+        {
+            serverLog(LL_WARNING, "S3: can't complete the multipart upload (status %d)", resp.status);
+            return false;
+        }
+        return true;
+    }
+};
+
+static int rdbSaveS3Native(char *s3object, rdbSaveInfo *rsi)
+{
+    S3Client client;
+    if (!client.init(s3object))
+        return C_ERR;
+    S3Uploader uploader(client);
+    if (!uploader.begin())
+        return C_ERR;
+
+    int fd[2];
+    if (pipe(fd) != 0)
+        return C_ERR;
+    bool fOk = uploader.run(fd[0], [&]{
+        bool fSaved = rdbSaveFd(fd[1], rsi) == C_OK;
+        close(fd[1]);
+        return fSaved;
+    });
+    close(fd[0]);
+
+    if (!fOk)
+        serverLog(LL_WARNING, "Failed to save DB to S3");
+    else
+        serverLog(LL_NOTICE,"DB saved on S3");
+    return fOk ? C_OK : C_ERR;
+}
+
+/* Download the object in ranges fetched by s3-threads threads, writing them
+ * in order to a pipe the loader reads from. */
+class S3Downloader
+{
+    S3Client &m_client;
+    long long m_size = 0;
+    long long m_ranges = 0;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    long long m_nextRange = 0;      // Next range to fetch
+    long long m_nextWrite = 0;      // Next range to write to the pipe
+    std::map<long long, std::string> m_done;
+    bool m_fFailed = false;
+
+    void workerMain()
+    {
+        for (;;)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            /* Bound the memory used by ranges waiting for their turn. */
+            m_cv.wait(lock, [this]{ return m_fFailed || m_nextRange >= m_ranges
+                || m_nextRange < m_nextWrite + 2*server.s3_threads; });
+            if (m_fFailed || m_nextRange >= m_ranges)
+                return;
+            long long range = m_nextRange++;
+            lock.unlock();
+
+            long long start = range * S3_PART_SIZE;
+            long long end = std::min(start + S3_PART_SIZE, m_size) - 1;
+            std::string header = "bytes=" + std::to_string(start) + "-" + std::to_string(end);
+            S3Response resp;
+            int attempt = 0;
+            while (!(m_client.request("GET", std::string(), header, nullptr, 0, resp)
+                    && (resp.status == 206 || (resp.status == 200 && start == 0 && end == m_size-1))
+                    && (long long)resp.body.size() == end - start + 1))
+            {
+                if (++attempt == S3_RETRIES)
+                    break;
+                serverLog(LL_NOTICE, "S3: retrying range %s (status %d)", header.c_str(), resp.status);
+                s3RetryDelay(attempt);
+                resp = S3Response();
+            }
+
+            lock.lock();
+            if (attempt == S3_RETRIES)
+            {
+                serverLog(LL_WARNING, "S3: failed to download range %s", header.c_str());
+                m_fFailed = true;
+            }
+            else
+            {
+                m_done[range] = std::move(resp.body);
+            }
+            m_cv.notify_all();
+        }
+    }
+
+public:
+    S3Downloader(S3Client &client)
+        : m_client(client)
+        {}
+
+    bool begin()
+    {
+        S3Response resp;
+        if (!m_client.request("HEAD", std::string(), std::string(), nullptr, 0, resp) || resp.status != 200
+            || resp.contentLength <= 0)
+        {
+            serverLog(LL_WARNING, "S3: can't access the object (status %d)", resp.status);
+            return false;
+        }
+        m_size = resp.contentLength;
+        m_ranges = (m_size + S3_PART_SIZE - 1) / S3_PART_SIZE;
+        return true;
+    }
+
+    /* Write the ranges to 'fd' in order, closing it when done. On failure it
+     * is closed early, so the loader stops with a truncated file error. */
+    void writerMain(int fd)
+    {
+        std::vector<std::thread> workers;
+        for (int i = 0; i < server.s3_threads; ++i)
+            workers.emplace_back(&S3Downloader::workerMain, this);
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (m_nextWrite < m_ranges)
+        {
+            m_cv.wait(lock, [this]{ return m_fFailed || m_done.count(m_nextWrite); });
+            if (m_fFailed)
+                break;
+            std::string buf = std::move(m_done[m_nextWrite]);
+            m_done.erase(m_nextWrite);
+            lock.unlock();
+            bool fWritten = anetWrite(fd, &buf[0], buf.size()) == (int)buf.size();
+            lock.lock();
+            if (!fWritten)
+            {
+                m_fFailed = true;
+                break;
+            }
+            m_nextWrite++;
+            m_cv.notify_all();
+        }
+        m_cv.notify_all();
+        lock.unlock();
+        close(fd);
+        for (auto &worker : workers)
+            worker.join();
+    }
+
+    bool failed() const { return m_fFailed; }
+};
+
+static int rdbLoadS3Native(char *s3object, rdbSaveInfo *rsi)
+{
+    S3Client client;
+    if (!client.init(s3object))
+        return C_ERR;
+    S3Downloader downloader(client);
+    if (!downloader.begin())
+        return C_ERR;
+
+    int fd[2];
+    if (pipe(fd) != 0)
+        return C_ERR;
+    std::thread writer(&S3Downloader::writerMain, &downloader, fd[1]);
+
+    FILE *fp = fdopen(fd[0], "rb");
+    int retval = C_ERR;
+    if (fp != nullptr)
+    {
+        rio rdb;
+        startLoading(fp);
+        rioInitWithFile(&rdb,fileno(fp));
+        retval = rdbLoadRio(&rdb,rsi,0);
+        stopLoading();
+        fclose(fp);     // Unblocks the writer if the load stopped early
+    }
+    else
+    {
+        close(fd[0]);
+    }
+    writer.join();
+    if (downloader.failed())
+        retval = C_ERR;
+
+    if (retval != C_OK)
+        serverLog(LL_WARNING, "Failed to load DB from S3");
+    else
+        serverLog(LL_NOTICE,"DB loaded from S3");
+    return retval;
+}
 
 /* Save the DB on disk. Return C_ERR on error, C_OK on success. */
 extern "C" int rdbSaveS3(char *s3bucket, rdbSaveInfo *rsi)
 {
+    if (server.s3_endpoint != nullptr)
+        return rdbSaveS3Native(s3bucket, rsi);
+
     int status = EXIT_FAILURE;
     int fd[2];
     if (pipe(fd) != 0)
@@ -41,17 +725,17 @@ extern "C" int rdbSaveS3(char *s3bucket, rdbSaveInfo *rsi)
         close(fd[1]);
         waitpid(pid, &status, 0);
     }
-    
+
     if (status != EXIT_SUCCESS)
         serverLog(LL_WARNING, "Failed to save DB to AWS S3");
     else
         serverLog(LL_NOTICE,"DB saved on AWS S3");
-        
+
     return (status == EXIT_SUCCESS) ? C_OK : C_ERR;
 }
 
 
-int rdbLoadS3Core(int fd, rdbSaveInfo *rsi) 
+int rdbLoadS3Core(int fd, rdbSaveInfo *rsi)
 {
     FILE *fp;
     rio rdb;
@@ -68,6 +752,9 @@ int rdbLoadS3Core(int fd, rdbSaveInfo *rsi)
 
 int rdbLoadS3(char *s3bucket, rdbSaveInfo *rsi)
 {
+    if (server.s3_endpoint != nullptr)
+        return rdbLoadS3Native(s3bucket, rsi);
+
     int status = EXIT_FAILURE;
     int fd[2];
     if (pipe(fd) != 0)
@@ -101,11 +788,11 @@ int rdbLoadS3(char *s3bucket, rdbSaveInfo *rsi)
         close(fd[0]);
         waitpid(pid, &status, 0);
     }
-    
+
     if (status != EXIT_SUCCESS)
         serverLog(LL_WARNING, "Failed to load DB from AWS S3");
     else
         serverLog(LL_NOTICE,"DB loaded from AWS S3");
-        
+
     return (status == EXIT_SUCCESS) ? C_OK : C_ERR;
 }
@@ -1002,11 +1002,14 @@ size_t rdbSavedObjectLen(robj *o) {
     return len;
 }
 
-/* Save a key-value pair, with expire time, type, key, value.
+/* Save a key-value pair, with expire time, timestamp, type, key, value.
+ * 'mvcc_stamp' is the stamp of the last write to the key, see mvccPack().
  * On error -1 is returned.
  * On success if the key was actually saved 1 is returned, otherwise 0
  * is returned (the key was already expired). */
-int rdbSaveKeyValuePair(rio *rdb, robj *key, robj *val, long long expiretime) {
+int rdbSaveKeyValuePair(rio *rdb, robj *key, robj *val, long long expiretime,
+                        uint64_t mvcc_stamp)
+{
     int savelru = server.maxmemory_policy & MAXMEMORY_FLAG_LRU;
     int savelfu = server.maxmemory_policy & MAXMEMORY_FLAG_LFU;
 
@@ -1036,6 +1039,15 @@ int rdbSaveKeyValuePair(rio *rdb, robj *key, robj *val, long long expiretime) {
         if (rdbWriteRaw(rdb,buf,1) == -1) return -1;
     }
 
+    /* Save the timestamp of the last write, so that active replicas merging
+     * this data keep the most recent version of each key. */
+    if (server.fActiveReplicaTimestamps && mvcc_stamp) {
+        if (rdbSaveType(rdb,RDB_OPCODE_MVCC) == -1) return -1;
+        if (rdbSaveLen(rdb,MVCC_TSTAMP(mvcc_stamp)) == -1) return -1;
+        if (rdbWriteRaw(rdb,(void*)mvccOriginUuid(MVCC_ORIGIN(mvcc_stamp)),
+                        UUID_BINARY_LEN) == -1) return -1;
+    }
+
     /* Save type, key, value */
     if (rdbSaveObjectType(rdb,val) == -1) return -1;
     if (rdbSaveStringObject(rdb,key) == -1) return -1;
@@ -1092,6 +1104,30 @@ int rdbSaveInfoAuxFields(rio *rdb, int flags, rdbSaveInfo *rsi) {
     return 1;
 }
 
+/* Save the scripts of the Lua script cache as auxiliary fields: the SHA1 of
+ * each script in a "lua-sha" field, followed by its body in a "lua" field.
+ * Versions not knowing "lua-sha" skip it and load the body alone. Returns -1
+ * on error. */
+int rdbSaveLuaScripts(rio *rdb) {
+    dictIterator *di;
+    dictEntry *de;
+
+    if (dictSize(server.lua_scripts) == 0) return 0;
+    di = dictGetIterator(server.lua_scripts);
+    while((de = dictNext(di)) != NULL) {
+        sds sha = dictGetKey(de);
+        robj *body = dictGetVal(de);
+        if (rdbSaveAuxField(rdb,"lua-sha",7,sha,sdslen(sha)) == -1 ||
+            rdbSaveAuxField(rdb,"lua",3,ptrFromObj(body),sdslen(ptrFromObj(body))) == -1)
+        {
+            dictReleaseIterator(di);
+            return -1;
+        }
+    }
+    dictReleaseIterator(di);
+    return 0;
+}
+
 /* Produces a dump of the database in RDB format sending it to the specified
  * Redis I/O channel. On success C_OK is returned, otherwise C_ERR
  * is returned and part of the output, or all the output, can be
@@ -1100,6 +1136,256 @@ int rdbSaveInfoAuxFields(rio *rdb, int flags, rdbSaveInfo *rsi) {
  * When the function returns C_ERR and if 'error' is not NULL, the
  * integer pointed by 'error' is set to the value of errno just after the I/O
  * error. */
+/* ----------------------------------------------------------------------------
+ * Chunked saving
+ *
+ * With rdb-save-threads > 0 the keyspace is split in ranges of hash table
+ * buckets that a pool of threads serializes concurrently. Every thread fills
+ * an in-memory chunk with SELECTDB opcodes and key/value pairs in the usual
+ * format, and hands it LZF-compressed to the saving thread once it reaches
+ * RDB_SAVE_CHUNK_BYTES. The saving thread writes each chunk as a string
+ * preceded by RDB_OPCODE_CHUNK; the loader reads the keys of a chunk exactly
+ * like the ones of the main stream. Chunks are independent of each other, so
+ * they are written in whatever order they are completed.
+ *
+ * Module values are serialized by the saving thread after the chunks, since
+ * module callbacks can't be expected to be thread safe.
+ * ------------------------------------------------------------------------- */
+
+#define RDB_SAVE_CHUNK_BYTES (1024*1024)
+#define RDB_SAVE_UNIT_BUCKETS 4096  /* Hash table buckets per unit of work */
+
+typedef struct rdbSaveChunk {
+    struct rdbSaveChunk *next;
+    sds payload;                    /* Encoded string, ready to be written */
+} rdbSaveChunk;
+
+typedef struct rdbSavePool {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    /* Next unit of work */
+    int dbid, table;
+    unsigned long bucket;
+    /* Completed chunks */
+    rdbSaveChunk *ready, *ready_tail;
+    int cready, maxready;
+    int running;                    /* Threads not done yet */
+    int error;
+    /* Entries of module values, saved by the saving thread */
+    dictEntry **modkeys;
+    int *moddbs;
+    size_t cmodkeys, modkeys_alloc;
+} rdbSavePool;
+
+/* Get the next range of buckets to save. Returns 0 when there are none. */
+static int rdbSavePoolNextUnit(rdbSavePool *pool, int *dbid, dictht **ht,
+                               unsigned long *start, unsigned long *end)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (!pool->error && pool->dbid < server.dbnum) {
+        dict *d = server.db[pool->dbid].pdict;
+        dictht *cur = &d->ht[pool->table];
+        if (pool->bucket < cur->size) {
+            *dbid = pool->dbid;
+            *ht = cur;
+            *start = pool->bucket;
+            *end = pool->bucket + RDB_SAVE_UNIT_BUCKETS;
+            if (*end > cur->size) *end = cur->size;
+            pool->bucket = *end;
+            ret = 1;
+            break;
+        }
+        pool->bucket = 0;
+        if (++pool->table == 2) {
+            pool->table = 0;
+            pool->dbid++;
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return ret;
+}
+
+/* Queue a chunk for the saving thread, waiting if too many are pending. */
+static void rdbSavePoolPush(rdbSavePool *pool, sds chunk) {
+    rdbSaveChunk *c;
+    rio out;
+
+    /* Compress the whole chunk: unlike the values, the keys and the small
+     * values it contains are not compressed individually. */
+    rioInitWithBuffer(&out,sdsempty());
+    rdbSaveRawString(&out,(unsigned char*)chunk,sdslen(chunk));
+    sdsfree(chunk);
+
+    c = zmalloc(sizeof(*c), MALLOC_LOCAL);
+    c->next = NULL;
+    c->payload = out.io.buffer.ptr;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (!pool->error && pool->cready >= pool->maxready)
+        pthread_cond_wait(&pool->cond,&pool->mutex);
+    if (pool->ready_tail)
+        pool->ready_tail->next = c;
+    else
+        pool->ready = c;
+    pool->ready_tail = c;
+    pool->cready++;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+static void *rdbSaveThreadMain(void *arg) {
+    rdbSavePool *pool = arg;
+    int dbid, curdb = -1;
+    dictht *ht;
+    unsigned long start, end;
+    rio r;
+
+    rioInitWithBuffer(&r,sdsempty());
+    while (rdbSavePoolNextUnit(pool,&dbid,&ht,&start,&end)) {
+        redisDb *db = server.db+dbid;
+
+        for (unsigned long idx = start; idx < end; idx++) {
+            for (dictEntry *de = ht->table[idx]; de != NULL; de = de->next) {
+                robj key, *o = dictGetVal(de);
+
+                if (o->type == OBJ_MODULE) {
+                    pthread_mutex_lock(&pool->mutex);
+                    if (pool->cmodkeys == pool->modkeys_alloc) {
+                        pool->modkeys_alloc = pool->modkeys_alloc ? pool->modkeys_alloc*2 : 16;
+                        pool->modkeys = zrealloc(pool->modkeys,sizeof(dictEntry*)*pool->modkeys_alloc, MALLOC_LOCAL);
+                        pool->moddbs = zrealloc(pool->moddbs,sizeof(int)*pool->modkeys_alloc, MALLOC_LOCAL);
+                    }
+                    pool->modkeys[pool->cmodkeys] = de;
+                    pool->moddbs[pool->cmodkeys++] = dbid;
+                    pthread_mutex_unlock(&pool->mutex);
+                    continue;
+                }
+
+                if (curdb != dbid) {
+                    rdbSaveType(&r,RDB_OPCODE_SELECTDB);
+                    rdbSaveLen(&r,dbid);
+                    curdb = dbid;
+                }
+                initStaticStringObject(key,dictGetKey(de));
+                rdbSaveKeyValuePair(&r,&key,o,getExpire(db,&key),
+                                    getMvccStamp(db,&key));
+
+                if (sdslen(r.io.buffer.ptr) >= RDB_SAVE_CHUNK_BYTES) {
+                    rdbSavePoolPush(pool,r.io.buffer.ptr);
+                    rioInitWithBuffer(&r,sdsempty());
+                    curdb = -1;
+                }
+            }
+        }
+    }
+    if (sdslen(r.io.buffer.ptr))
+        rdbSavePoolPush(pool,r.io.buffer.ptr);
+    else
+        sdsfree(r.io.buffer.ptr);
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->running--;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+/* Save the keys of every DB using rdb-save-threads threads. The SELECTDB
+ * and RESIZEDB opcodes of every DB were already written. */
+static int rdbSaveChunked(rio *rdb, int nthreads) {
+    rdbSavePool pool;
+    pthread_t *threads;
+    int j, err = C_OK;
+
+    memset(&pool,0,sizeof(pool));
+    pthread_mutex_init(&pool.mutex,NULL);
+    pthread_cond_init(&pool.cond,NULL);
+    pool.maxready = nthreads*2;
+
+    /* Keep the dicts from rehashing under the threads: lookups in 'expires'
+     * and 'mvcc' would otherwise move entries around. */
+    for (j = 0; j < server.dbnum; j++) {
+        server.db[j].pdict->iterators++;
+        server.db[j].expires->iterators++;
+        server.db[j].mvcc->iterators++;
+    }
+
+    threads = zmalloc(sizeof(pthread_t)*nthreads, MALLOC_LOCAL);
+    for (j = 0; j < nthreads; j++) {
+        if (pthread_create(threads+j,NULL,rdbSaveThreadMain,&pool) != 0) break;
+        pool.running++;
+    }
+    nthreads = j;
+    if (nthreads == 0) {
+        /* Do the work ourselves, there is no limit to the chunks pending. */
+        pool.maxready = INT_MAX;
+        pool.running = 1;
+        rdbSaveThreadMain(&pool);
+    }
+
+    pthread_mutex_lock(&pool.mutex);
+    while (1) {
+        rdbSaveChunk *c;
+
+        while (pool.ready == NULL && pool.running)
+            pthread_cond_wait(&pool.cond,&pool.mutex);
+        if ((c = pool.ready) == NULL) break;
+        pool.ready = c->next;
+        if (pool.ready == NULL) pool.ready_tail = NULL;
+        pool.cready--;
+        pthread_cond_broadcast(&pool.cond);
+        pthread_mutex_unlock(&pool.mutex);
+
+        if (err == C_OK &&
+            (rdbSaveType(rdb,RDB_OPCODE_CHUNK) == -1 ||
+             rdbWriteRaw(rdb,c->payload,sdslen(c->payload)) == -1))
+        {
+            /* Let the threads finish without waiting on us. */
+            err = C_ERR;
+            pthread_mutex_lock(&pool.mutex);
+            pool.error = 1;
+            pthread_cond_broadcast(&pool.cond);
+            pthread_mutex_unlock(&pool.mutex);
+        }
+        sdsfree(c->payload);
+        zfree(c);
+        pthread_mutex_lock(&pool.mutex);
+    }
+    pthread_mutex_unlock(&pool.mutex);
+
+    for (j = 0; j < nthreads; j++)
+        pthread_join(threads[j],NULL);
+    zfree(threads);
+    for (j = 0; j < server.dbnum; j++) {
+        server.db[j].pdict->iterators--;
+        server.db[j].expires->iterators--;
+        server.db[j].mvcc->iterators--;
+    }
+
+    for (size_t i = 0; err == C_OK && i < pool.cmodkeys; i++) {
+        redisDb *db = server.db+pool.moddbs[i];
+        robj key;
+
+        if (rdbSaveType(rdb,RDB_OPCODE_SELECTDB) == -1 ||
+            rdbSaveLen(rdb,pool.moddbs[i]) == -1)
+        {
+            err = C_ERR;
+            break;
+        }
+        initStaticStringObject(key,dictGetKey(pool.modkeys[i]));
+        if (rdbSaveKeyValuePair(rdb,&key,dictGetVal(pool.modkeys[i]),
+                                getExpire(db,&key),getMvccStamp(db,&key)) == -1)
+            err = C_ERR;
+    }
+    zfree(pool.modkeys);
+    zfree(pool.moddbs);
+    pthread_mutex_destroy(&pool.mutex);
+    pthread_cond_destroy(&pool.cond);
+    return err;
+}
+
 int rdbSaveRio(rio *rdb, int *error, int flags, rdbSaveInfo *rsi) {
     dictIterator *di = NULL;
     dictEntry *de;
@@ -1107,6 +1393,7 @@ int rdbSaveRio(rio *rdb, int *error, int flags, rdbSaveInfo *rsi) {
     int j;
     uint64_t cksum;
     size_t processed = 0;
+    int fChunked = server.rdb_save_threads > 0 && !(flags & RDB_SAVE_AOF_PREAMBLE);
 
     if (server.rdb_checksum)
         rdb->update_cksum = rioGenericUpdateChecksum;
@@ -1118,7 +1405,6 @@ int rdbSaveRio(rio *rdb, int *error, int flags, rdbSaveInfo *rsi) {
         redisDb *db = server.db+j;
         dict *d = db->pdict;
         if (dictSize(d) == 0) continue;
-        di = dictGetSafeIterator(d);
 
         /* Write the SELECT DB opcode */
         if (rdbSaveType(rdb,RDB_OPCODE_SELECTDB) == -1) goto werr;
@@ -1135,7 +1421,13 @@ int rdbSaveRio(rio *rdb, int *error, int flags, rdbSaveInfo *rsi) {
         if (rdbSaveLen(rdb,db_size) == -1) goto werr;
         if (rdbSaveLen(rdb,expires_size) == -1) goto werr;
 
+        /* With rdb-save-threads the keys of all the DBs are saved at once
+         * below. The AOF preamble is always saved serially, since the child
+         * has to keep reading the diff from the parent while saving. */
+        if (fChunked) continue;
+
         /* Iterate this DB writing every entry */
+        di = dictGetSafeIterator(d);
         while((de = dictNext(di)) != NULL) {
             sds keystr = dictGetKey(de);
             robj key, *o = dictGetVal(de);
@@ -1143,7 +1435,8 @@ int rdbSaveRio(rio *rdb, int *error, int flags, rdbSaveInfo *rsi) {
 
             initStaticStringObject(key,keystr);
             expire = getExpire(db,&key);
-            if (rdbSaveKeyValuePair(rdb,&key,o,expire) == -1) goto werr;
+            if (rdbSaveKeyValuePair(rdb,&key,o,expire,
+                                    getMvccStamp(db,&key)) == -1) goto werr;
 
             /* When this RDB is produced as part of an AOF rewrite, move
              * accumulated diff from parent to child while rewriting in
@@ -1158,21 +1451,16 @@ int rdbSaveRio(rio *rdb, int *error, int flags, rdbSaveInfo *rsi) {
         dictReleaseIterator(di);
         di = NULL; /* So that we don't release it again on error. */
     }
+    if (fChunked && rdbSaveChunked(rdb,server.rdb_save_threads) == C_ERR)
+        goto werr;
 
     /* If we are storing the replication information on disk, persist
      * the script cache as well: on successful PSYNC after a restart, we need
      * to be able to process any EVALSHA inside the replication backlog the
-     * master will send us. */
-    if (rsi && dictSize(server.lua_scripts)) {
-        di = dictGetIterator(server.lua_scripts);
-        while((de = dictNext(di)) != NULL) {
-            robj *body = dictGetVal(de);
-            if (rdbSaveAuxField(rdb,"lua",3,ptrFromObj(body),sdslen(ptrFromObj(body))) == -1)
-                goto werr;
-        }
-        dictReleaseIterator(di);
-        di = NULL; /* So that we don't release it again on error. */
-    }
+     * master will send us. With lua-persist-scripts the cache is always
+     * saved, so that the clients don't get NOSCRIPT after a restart. */
+    if ((rsi || server.lua_persist_scripts) && rdbSaveLuaScripts(rdb) == -1)
+        goto werr;
 
     /* EOF opcode */
     if (rdbSaveType(rdb,RDB_OPCODE_EOF) == -1) goto werr;
@@ -1304,7 +1592,8 @@ int rdbSaveBackground(rdbSaveInfo *rsi) {
     pid_t childpid;
     long long start;
 
-    if (server.aof_child_pid != -1 || server.rdb_child_pid != -1) return C_ERR;
+    if (server.aof_child_pid != -1 || server.rdb_child_pid != -1 ||
+        server.rdb_thread_active) return C_ERR;
 
     server.dirty_before_bgsave = server.dirty;
     server.lastbgsave_try = time(NULL);
@@ -1353,6 +1642,15 @@ int rdbSaveBackground(rdbSaveInfo *rsi) {
     return C_OK; /* unreached */
 }
 
+/* Start a BGSAVE persisting the dataset on disk, as opposed to the ones
+ * replicas wait for. With forkless-bgsave the snapshot thread saves it when
+ * possible, otherwise a child is forked. */
+int rdbStartBgsave(rdbSaveInfo *rsi) {
+    if (server.rdb_thread_active) return C_ERR;
+    if (snapshotCanStart()) return snapshotStart(rsi);
+    return rdbSaveBackground(rsi);
+}
+
 void rdbRemoveTempFile(pid_t childpid) {
     char tmpfile[256];
 
@@ -1824,15 +2122,20 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
 void startLoading(FILE *fp) {
     struct stat sb;
 
+    if (fstat(fileno(fp), &sb) == -1) {
+        startLoadingStream(0);
+    } else {
+        startLoadingStream(sb.st_size);
+    }
+}
+
+/* Like startLoading() for a stream of 'size' bytes, 0 if unknown. */
+void startLoadingStream(size_t size) {
     /* Load the DB */
     server.loading = 1;
     server.loading_start_time = time(NULL);
     server.loading_loaded_bytes = 0;
-    if (fstat(fileno(fp), &sb) == -1) {
-        server.loading_total_bytes = 0;
-    } else {
-        server.loading_total_bytes = sb.st_size;
-    }
+    server.loading_total_bytes = size;
 }
 
 /* Refresh the loading progress info */
@@ -1859,20 +2162,421 @@ void rdbLoadProgressCallback(rio *r, const void *buf, size_t len) {
          * our cached time since it is used to create and update the last
          * interaction time with clients and for other important things. */
         updateCachedTime();
-        if (server.masterhost && server.repl_state == REPL_STATE_TRANSFER)
+        if (listLength(server.masters))
             replicationSendNewlineToMaster();
         loadingProgress(r->processed_bytes);
         processEventsWhileBlocked(serverTL - server.rgthreadvar);
     }
 }
 
+/* Add a key loaded from the RDB to 'db', applying the attributes set by the
+ * opcodes that preceded it. Keys that already expired are discarded when we
+ * are a master loading from disk: when the RDB comes from our master it is
+ * responsible for key expiry, and the snapshot it took must be reflected on
+ * the slave as it is. */
+static void rdbLoadInsertKey(redisDb *db, robj *key, robj *val,
+                             long long expiretime, long long lfu_freq,
+                             long long lru_idle, uint64_t mvcc_stamp,
+                             long long lru_clock, long long now,
+                             rdbSaveInfo *rsi, int loading_aof)
+{
+    if (listLength(server.masters) == 0 && !loading_aof && expiretime != -1 && expiretime < now) {
+        decrRefCount(key);
+        decrRefCount(val);
+    } else {
+        /* Our clock must not fall behind the writes we know about. */
+        if (mvcc_stamp && server.fActiveReplicaTimestamps)
+            mvccObserveTstamp(MVCC_TSTAMP(mvcc_stamp));
+
+        /* Add the new object in the hash table */
+        int fInserted = dbMerge(db, key, val, rsi->fForceSetKey, mvcc_stamp);
+
+        if (fInserted)
+        {
+            /* Set the expire time if needed */
+            if (expiretime != -1) setExpire(NULL,db,key,expiretime);
+
+            /* Set usage information (for eviction). */
+            objectSetLRUOrLFU(val,lfu_freq,lru_idle,lru_clock);
+
+            /* Decrement the key refcount since dbMerge() will take its
+            * own reference. */
+            decrRefCount(key);
+        }
+        else
+        {
+            decrRefCount(key);
+            decrRefCount(val);
+        }
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Parallel loading
+ *
+ * With rdb-load-threads > 0 the thread reading the RDB does not decode the
+ * values itself: it copies the serialized bytes of each value in a buffer,
+ * following only the framing (lengths and string encodings), and hands
+ * batches of values to a pool of threads that run rdbLoadObject() against an
+ * in-memory rio. Decoded batches come back to the loading thread, which adds
+ * them to the keyspace, so the DBs are still only touched by one thread and
+ * rdbLoadProgressCallback() keeps running as usual.
+ *
+ * Streams and module values can't be framed without fully parsing them, they
+ * are decoded by the loading thread itself.
+ * ------------------------------------------------------------------------- */
+
+#define RDB_LOAD_BATCH_KEYS 256
+#define RDB_LOAD_BATCH_BYTES (1024*1024)
+
+typedef struct rdbLoadJob {
+    redisDb *db;
+    int type;
+    robj *key;
+    sds payload;            /* Serialized value */
+    robj *val;              /* Decoded value, NULL on error */
+    long long expiretime, lfu_freq, lru_idle;
+    uint64_t mvcc_stamp;
+} rdbLoadJob;
+
+typedef struct rdbLoadBatch {
+    struct rdbLoadBatch *next;
+    int count;
+    size_t bytes;
+    rdbLoadJob jobs[RDB_LOAD_BATCH_KEYS];
+} rdbLoadBatch;
+
+typedef struct rdbLoadPool {
+    pthread_t *threads;
+    int nthreads;
+    pthread_mutex_t mutex;
+    pthread_cond_t todo_cond;
+    pthread_cond_t done_cond;
+    rdbLoadBatch *todo, *todo_tail;  /* Batches waiting for a thread */
+    rdbLoadBatch *done;              /* Decoded batches */
+    int shutdown;
+    /* Only accessed by the loading thread. */
+    rdbLoadBatch *cur;               /* Batch being filled */
+    int inflight;                    /* Batches submitted but not yet inserted */
+    long long lru_clock, now;
+    rdbSaveInfo *rsi;
+    int loading_aof;
+} rdbLoadPool;
+
+static int rdbCopyBytes(rio *rdb, sds *buf, size_t len) {
+    *buf = sdsMakeRoomFor(*buf,len);
+    if (rioRead(rdb,*buf+sdslen(*buf),len) == 0) return -1;
+    sdsIncrLen(*buf,len);
+    return 0;
+}
+
+/* Like rdbLoadLenByRef() but the encoded length is also appended to 'buf'. */
+static int rdbCopyLen(rio *rdb, sds *buf, int *isencoded, uint64_t *lenptr) {
+    size_t pos = sdslen(*buf);
+    unsigned char *p;
+    int type;
+
+    *isencoded = 0;
+    if (rdbCopyBytes(rdb,buf,1) == -1) return -1;
+    p = (unsigned char*)*buf+pos;
+    type = (p[0]&0xC0)>>6;
+    if (type == RDB_ENCVAL) {
+        *isencoded = 1;
+        *lenptr = p[0]&0x3F;
+    } else if (type == RDB_6BITLEN) {
+        *lenptr = p[0]&0x3F;
+    } else if (type == RDB_14BITLEN) {
+        if (rdbCopyBytes(rdb,buf,1) == -1) return -1;
+        p = (unsigned char*)*buf+pos;
+        *lenptr = ((p[0]&0x3F)<<8)|p[1];
+    } else if (p[0] == RDB_32BITLEN) {
+        uint32_t len;
+        if (rdbCopyBytes(rdb,buf,4) == -1) return -1;
+        memcpy(&len,*buf+pos+1,4);
+        *lenptr = ntohl(len);
+    } else if (p[0] == RDB_64BITLEN) {
+        uint64_t len;
+        if (rdbCopyBytes(rdb,buf,8) == -1) return -1;
+        memcpy(&len,*buf+pos+1,8);
+        *lenptr = ntohu64(len);
+    } else {
+        rdbExitReportCorruptRDB(
+            "Unknown length encoding %d in rdbLoadLen()",type);
+        return -1; /* Never reached. */
+    }
+    return 0;
+}
+
+static int rdbCopyString(rio *rdb, sds *buf) {
+    int isencoded;
+    uint64_t len, clen;
+
+    if (rdbCopyLen(rdb,buf,&isencoded,&len) == -1) return -1;
+    if (isencoded) {
+        switch(len) {
+        case RDB_ENC_INT8: return rdbCopyBytes(rdb,buf,1);
+        case RDB_ENC_INT16: return rdbCopyBytes(rdb,buf,2);
+        case RDB_ENC_INT32: return rdbCopyBytes(rdb,buf,4);
+        case RDB_ENC_LZF:
+            if (rdbCopyLen(rdb,buf,&isencoded,&clen) == -1) return -1;
+            if (rdbCopyLen(rdb,buf,&isencoded,&len) == -1) return -1;
+            return rdbCopyBytes(rdb,buf,clen);
+        default:
+            rdbExitReportCorruptRDB("Unknown RDB string encoding type %d",len);
+        }
+    }
+    return rdbCopyBytes(rdb,buf,len);
+}
+
+/* Return true if values of this type can be framed by rdbCopyObject(). */
+static int rdbCanCopyObject(int rdbtype) {
+    return rdbtype != RDB_TYPE_STREAM_LISTPACKS &&
+           rdbtype != RDB_TYPE_MODULE &&
+           rdbtype != RDB_TYPE_MODULE_2;
+}
+
+/* Append the serialized value of type 'rdbtype' to 'buf' without decoding
+ * it. The format mirrors what rdbLoadObject() reads. */
+static int rdbCopyObject(int rdbtype, rio *rdb, sds *buf) {
+    uint64_t len, i;
+    int isencoded;
+
+    if (rdbtype == RDB_TYPE_STRING ||
+        rdbtype == RDB_TYPE_HASH_ZIPMAP ||
+        rdbtype == RDB_TYPE_LIST_ZIPLIST ||
+        rdbtype == RDB_TYPE_SET_INTSET ||
+        rdbtype == RDB_TYPE_ZSET_ZIPLIST ||
+        rdbtype == RDB_TYPE_HASH_ZIPLIST)
+    {
+        return rdbCopyString(rdb,buf);
+    }
+
+    if (rdbtype != RDB_TYPE_LIST &&
+        rdbtype != RDB_TYPE_SET &&
+        rdbtype != RDB_TYPE_ZSET &&
+        rdbtype != RDB_TYPE_ZSET_2 &&
+        rdbtype != RDB_TYPE_HASH &&
+        rdbtype != RDB_TYPE_LIST_QUICKLIST)
+    {
+        rdbExitReportCorruptRDB("Unknown RDB encoding type %d",rdbtype);
+    }
+
+    /* A count followed by that many strings, each one paired with a second
+     * string (hash values) or a score (sorted sets). */
+    if (rdbCopyLen(rdb,buf,&isencoded,&len) == -1) return -1;
+    for (i = 0; i < len; i++) {
+        if (rdbCopyString(rdb,buf) == -1) return -1;
+        if (rdbtype == RDB_TYPE_HASH) {
+            if (rdbCopyString(rdb,buf) == -1) return -1;
+        } else if (rdbtype == RDB_TYPE_ZSET_2) {
+            if (rdbCopyBytes(rdb,buf,8) == -1) return -1;
+        } else if (rdbtype == RDB_TYPE_ZSET) {
+            unsigned char dlen;
+            if (rdbCopyBytes(rdb,buf,1) == -1) return -1;
+            dlen = (*buf)[sdslen(*buf)-1];
+            if (dlen < 253 && rdbCopyBytes(rdb,buf,dlen) == -1) return -1;
+        }
+    }
+    return 0;
+}
+
+static void *rdbLoadThreadMain(void *arg) {
+    rdbLoadPool *pool = arg;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (1) {
+        rdbLoadBatch *batch;
+
+        while (pool->todo == NULL && !pool->shutdown)
+            pthread_cond_wait(&pool->todo_cond,&pool->mutex);
+        if (pool->todo == NULL) break;
+        batch = pool->todo;
+        pool->todo = batch->next;
+        if (pool->todo == NULL) pool->todo_tail = NULL;
+        pthread_mutex_unlock(&pool->mutex);
+
+        for (int j = 0; j < batch->count; j++) {
+            rdbLoadJob *job = batch->jobs+j;
+            rio payload;
+
+            rioInitWithBuffer(&payload,job->payload);
+            job->val = rdbLoadObject(job->type,&payload,job->key);
+            /* The framing and the decoder must agree on the value size. */
+            if (job->val && (size_t)payload.io.buffer.pos != sdslen(job->payload)) {
+                decrRefCount(job->val);
+                job->val = NULL;
+            }
+            sdsfree(job->payload);
+            job->payload = NULL;
+        }
+
+        pthread_mutex_lock(&pool->mutex);
+        batch->next = pool->done;
+        pool->done = batch;
+        pthread_cond_signal(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+static void rdbLoadPoolStart(rdbLoadPool *pool, int nthreads, long long lru_clock,
+                             long long now, rdbSaveInfo *rsi, int loading_aof)
+{
+    memset(pool,0,sizeof(*pool));
+    pthread_mutex_init(&pool->mutex,NULL);
+    pthread_cond_init(&pool->todo_cond,NULL);
+    pthread_cond_init(&pool->done_cond,NULL);
+    pool->lru_clock = lru_clock;
+    pool->now = now;
+    pool->rsi = rsi;
+    pool->loading_aof = loading_aof;
+    pool->threads = zmalloc(sizeof(pthread_t)*nthreads, MALLOC_LOCAL);
+    for (pool->nthreads = 0; pool->nthreads < nthreads; pool->nthreads++) {
+        if (pthread_create(pool->threads+pool->nthreads,NULL,rdbLoadThreadMain,pool) != 0) {
+            serverLog(LL_WARNING,"Can't create RDB load thread: %s",strerror(errno));
+            break;
+        }
+    }
+    if (pool->nthreads)
+        serverLog(LL_NOTICE,"Decoding RDB values with %d threads",pool->nthreads);
+}
+
+/* Insert the decoded batches in the keyspace, waiting for at least one if
+ * 'wait' is true. Returns C_ERR if a value could not be decoded. */
+static int rdbLoadPoolCollect(rdbLoadPool *pool, int wait) {
+    rdbLoadBatch *batch;
+    int err = C_OK;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (wait && pool->done == NULL)
+        pthread_cond_wait(&pool->done_cond,&pool->mutex);
+    batch = pool->done;
+    pool->done = NULL;
+    pthread_mutex_unlock(&pool->mutex);
+
+    while (batch) {
+        rdbLoadBatch *next = batch->next;
+        for (int j = 0; j < batch->count; j++) {
+            rdbLoadJob *job = batch->jobs+j;
+            if (job->val == NULL || err == C_ERR) {
+                if (job->val) decrRefCount(job->val);
+                decrRefCount(job->key);
+                err = C_ERR;
+                continue;
+            }
+            rdbLoadInsertKey(job->db,job->key,job->val,job->expiretime,
+                job->lfu_freq,job->lru_idle,job->mvcc_stamp,
+                pool->lru_clock,pool->now,
+                pool->rsi,pool->loading_aof);
+        }
+        zfree(batch);
+        pool->inflight--;
+        batch = next;
+    }
+    return err;
+}
+
+/* Hand the batch being filled to the decoding threads. To bound the memory
+ * used by values in flight, wait for decoded batches when too many are
+ * pending. */
+static int rdbLoadPoolSubmit(rdbLoadPool *pool) {
+    rdbLoadBatch *batch = pool->cur;
+
+    if (batch == NULL) return C_OK;
+    pool->cur = NULL;
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->todo_tail)
+        pool->todo_tail->next = batch;
+    else
+        pool->todo = batch;
+    pool->todo_tail = batch;
+    pthread_cond_signal(&pool->todo_cond);
+    pthread_mutex_unlock(&pool->mutex);
+    pool->inflight++;
+
+    if (rdbLoadPoolCollect(pool,0) == C_ERR) return C_ERR;
+    while (pool->inflight > pool->nthreads*2) {
+        if (rdbLoadPoolCollect(pool,1) == C_ERR) return C_ERR;
+    }
+    return C_OK;
+}
+
+/* Read the value of 'key' from the stream and queue it for decoding. */
+static int rdbLoadPoolQueue(rdbLoadPool *pool, rio *rdb, redisDb *db, int type,
+                            robj *key, long long expiretime, long long lfu_freq,
+                            long long lru_idle, uint64_t mvcc_stamp)
+{
+    rdbLoadJob *job;
+
+    if (pool->cur == NULL) {
+        pool->cur = zmalloc(sizeof(rdbLoadBatch), MALLOC_LOCAL);
+        pool->cur->next = NULL;
+        pool->cur->count = 0;
+        pool->cur->bytes = 0;
+    }
+    job = pool->cur->jobs+pool->cur->count;
+    job->payload = sdsempty();
+    if (rdbCopyObject(type,rdb,&job->payload) == -1) {
+        sdsfree(job->payload);
+        return C_ERR;
+    }
+    job->db = db;
+    job->type = type;
+    job->key = key;
+    job->val = NULL;
+    job->expiretime = expiretime;
+    job->lfu_freq = lfu_freq;
+    job->lru_idle = lru_idle;
+    job->mvcc_stamp = mvcc_stamp;
+    pool->cur->bytes += sdslen(job->payload);
+    pool->cur->count++;
+
+    if (pool->cur->count == RDB_LOAD_BATCH_KEYS ||
+        pool->cur->bytes >= RDB_LOAD_BATCH_BYTES)
+    {
+        return rdbLoadPoolSubmit(pool);
+    }
+    return C_OK;
+}
+
+/* Wait for every queued value to be in the keyspace. */
+static int rdbLoadPoolDrain(rdbLoadPool *pool) {
+    if (rdbLoadPoolSubmit(pool) == C_ERR) return C_ERR;
+    while (pool->inflight) {
+        if (rdbLoadPoolCollect(pool,1) == C_ERR) return C_ERR;
+    }
+    return C_OK;
+}
+
+static void rdbLoadPoolStop(rdbLoadPool *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->todo_cond);
+    pthread_mutex_unlock(&pool->mutex);
+    for (int j = 0; j < pool->nthreads; j++)
+        pthread_join(pool->threads[j],NULL);
+    zfree(pool->threads);
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->todo_cond);
+    pthread_cond_destroy(&pool->done_cond);
+}
+
 /* Load an RDB file from the rio stream 'rdb'. On success C_OK is returned,
  * otherwise C_ERR is returned and 'errno' is set accordingly. */
 int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi, int loading_aof) {
+    return rdbLoadRioIntoDbs(rdb,rsi,loading_aof,server.db);
+}
+
+/* Like rdbLoadRio() but the keys are added to the 'rgdb' array of
+ * server.dbnum databases instead of server.db. */
+int rdbLoadRioIntoDbs(rio *rdb, rdbSaveInfo *rsi, int loading_aof, redisDb *rgdb) {
     uint64_t dbid;
     int type, rdbver;
-    redisDb *db = server.db+0;
+    redisDb *db = rgdb+0;
     char buf[1024];
+    rdbLoadPool pool;
+    int fParallel = 0;
+    sds chunkbuf = NULL;
 
     rdb->update_cksum = rdbLoadProgressCallback;
     rdb->max_processing_chunk = server.loading_process_events_interval_bytes;
@@ -1893,44 +2597,86 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi, int loading_aof) {
     /* Key-specific attributes, set by opcodes before the key type. */
     long long lru_idle = -1, lfu_freq = -1, expiretime = -1, now = mstime();
     long long lru_clock = LRU_CLOCK();
+    uint64_t mvcc_stamp = 0;
+    char luasha[41] = "";   /* Set by a "lua-sha" aux field. */
+
+    fParallel = server.rdb_load_threads > 0 && !rdbCheckMode;
+    if (fParallel) {
+        rdbLoadPoolStart(&pool,server.rdb_load_threads,lru_clock,now,rsi,loading_aof);
+        if (pool.nthreads == 0) {
+            rdbLoadPoolStop(&pool);
+            fParallel = 0;
+        }
+    }
+
+    /* Keys are read from 'cur', which is either the RDB stream itself or a
+     * chunk written with rdb-save-threads. */
+    rio *cur = rdb, chunk;
 
     while(1) {
         robj *key, *val;
 
+        /* Back to the main stream at the end of a chunk. */
+        if (cur != rdb && (size_t)chunk.io.buffer.pos == sdslen(chunkbuf)) {
+            sdsfree(chunkbuf);
+            chunkbuf = NULL;
+            cur = rdb;
+        }
+
         /* Read type. */
-        if ((type = rdbLoadType(rdb)) == -1) goto eoferr;
+        if ((type = rdbLoadType(cur)) == -1) goto eoferr;
 
         /* Handle special types. */
         if (type == RDB_OPCODE_EXPIRETIME) {
             /* EXPIRETIME: load an expire associated with the next key
              * to load. Note that after loading an expire we need to
              * load the actual type, and continue. */
-            expiretime = rdbLoadTime(rdb);
+            expiretime = rdbLoadTime(cur);
             expiretime *= 1000;
             continue; /* Read next opcode. */
         } else if (type == RDB_OPCODE_EXPIRETIME_MS) {
             /* EXPIRETIME_MS: milliseconds precision expire times introduced
              * with RDB v3. Like EXPIRETIME but no with more precision. */
-            expiretime = rdbLoadMillisecondTime(rdb,rdbver);
+            expiretime = rdbLoadMillisecondTime(cur,rdbver);
             continue; /* Read next opcode. */
         } else if (type == RDB_OPCODE_FREQ) {
             /* FREQ: LFU frequency. */
             uint8_t byte;
-            if (rioRead(rdb,&byte,1) == 0) goto eoferr;
+            if (rioRead(cur,&byte,1) == 0) goto eoferr;
             lfu_freq = byte;
             continue; /* Read next opcode. */
         } else if (type == RDB_OPCODE_IDLE) {
             /* IDLE: LRU idle time. */
             uint64_t qword;
-            if ((qword = rdbLoadLen(rdb,NULL)) == RDB_LENERR) goto eoferr;
+            if ((qword = rdbLoadLen(cur,NULL)) == RDB_LENERR) goto eoferr;
             lru_idle = qword;
             continue; /* Read next opcode. */
+        } else if (type == RDB_OPCODE_MVCC) {
+            /* MVCC: timestamp and origin UUID of the last write to the key. */
+            unsigned char uuid[UUID_BINARY_LEN];
+            uint64_t tstamp;
+            if ((tstamp = rdbLoadLen(cur,NULL)) == RDB_LENERR) goto eoferr;
+            if (rioRead(cur,uuid,UUID_BINARY_LEN) == 0) goto eoferr;
+            if (server.fActiveReplicaTimestamps)
+                mvcc_stamp = mvccPack(tstamp,mvccOriginIndex(uuid));
+            continue; /* Read next opcode. */
         } else if (type == RDB_OPCODE_EOF) {
             /* EOF: End of file, exit the main loop. */
+            if (cur != rdb) goto eoferr;
             break;
+        } else if (type == RDB_OPCODE_CHUNK) {
+            /* CHUNK: a string holding a block of keys, saved by one of the
+             * rdb-save-threads. Its keys are loaded like the ones of the
+             * main stream. */
+            if (cur != rdb) rdbExitReportCorruptRDB("Nested RDB chunk");
+            if ((chunkbuf = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL)) == NULL)
+                goto eoferr;
+            rioInitWithBuffer(&chunk,chunkbuf);
+            cur = &chunk;
+            continue; /* Read type again. */
         } else if (type == RDB_OPCODE_SELECTDB) {
             /* SELECTDB: Select the specified database. */
-            if ((dbid = rdbLoadLen(rdb,NULL)) == RDB_LENERR) goto eoferr;
+            if ((dbid = rdbLoadLen(cur,NULL)) == RDB_LENERR) goto eoferr;
             if (dbid >= (unsigned)server.dbnum) {
                 serverLog(LL_WARNING,
                     "FATAL: Data file was created with a Redis "
@@ -1938,15 +2684,15 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi, int loading_aof) {
                     "databases. Exiting\n", server.dbnum);
                 exit(1);
             }
-            db = server.db+dbid;
+            db = rgdb+dbid;
             continue; /* Read next opcode. */
         } else if (type == RDB_OPCODE_RESIZEDB) {
             /* RESIZEDB: Hint about the size of the keys in the currently
              * selected data base, in order to avoid useless rehashing. */
             uint64_t db_size, expires_size;
-            if ((db_size = rdbLoadLen(rdb,NULL)) == RDB_LENERR)
+            if ((db_size = rdbLoadLen(cur,NULL)) == RDB_LENERR)
                 goto eoferr;
-            if ((expires_size = rdbLoadLen(rdb,NULL)) == RDB_LENERR)
+            if ((expires_size = rdbLoadLen(cur,NULL)) == RDB_LENERR)
                 goto eoferr;
             dictExpand(db->pdict,db_size);
             dictExpand(db->expires,expires_size);
@@ -1958,8 +2704,8 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi, int loading_aof) {
              *
              * An AUX field is composed of two strings: key and value. */
             robj *auxkey, *auxval;
-            if ((auxkey = rdbLoadStringObject(rdb)) == NULL) goto eoferr;
-            if ((auxval = rdbLoadStringObject(rdb)) == NULL) goto eoferr;
+            if ((auxkey = rdbLoadStringObject(cur)) == NULL) goto eoferr;
+            if ((auxval = rdbLoadStringObject(cur)) == NULL) goto eoferr;
 
             if (((char*)ptrFromObj(auxkey))[0] == '%') {
                 /* All the fields with a name staring with '%' are considered
@@ -1977,13 +2723,26 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi, int loading_aof) {
                 }
             } else if (!strcasecmp(ptrFromObj(auxkey),"repl-offset")) {
                 if (rsi) rsi->repl_offset = strtoll(ptrFromObj(auxval),NULL,10);
+            } else if (!strcasecmp(ptrFromObj(auxkey),"lua-sha")) {
+                /* SHA1 of the script in the next "lua" field. */
+                if (sdslen(ptrFromObj(auxval)) == 40)
+                    memcpy(luasha,ptrFromObj(auxval),41);
             } else if (!strcasecmp(ptrFromObj(auxkey),"lua")) {
-                /* Load the script back in memory. */
-                if (luaCreateFunction(NULL,server.lua,auxval) == NULL) {
+                /* Load the script back in memory, compiling it so that it
+                 * is ready for the first EVALSHA, and check that it is the
+                 * script the master or the previous run knew by this SHA1. */
+                sds sha = luaCreateFunction(NULL,scriptingThreadLua(),auxval);
+                if (sha == NULL) {
                     rdbExitReportCorruptRDB(
                         "Can't load Lua script from RDB file! "
                         "BODY: %s", ptrFromObj(auxval));
                 }
+                if (luasha[0] != '\0' && strcasecmp(sha,luasha) != 0) {
+                    rdbExitReportCorruptRDB(
+                        "Lua script SHA1 mismatch in RDB file! "
+                        "Expected %s, got %s", luasha, sha);
+                }
+                luasha[0] = '\0';
             } else if (!strcasecmp(ptrFromObj(auxkey),"redis-ver")) {
                 serverLog(LL_NOTICE,"Loading RDB produced by version %s",
                     (const char*)ptrFromObj(auxval));
@@ -2020,7 +2779,7 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi, int loading_aof) {
              * we have the ability to read a MODULE_AUX opcode followed by an
              * identifier of the module, and a serialized value in "MODULE V2"
              * format. */
-            uint64_t moduleid = rdbLoadLen(rdb,NULL);
+            uint64_t moduleid = rdbLoadLen(cur,NULL);
             moduleType *mt = moduleTypeLookupModuleByID(moduleid);
             char name[10];
             moduleTypeNameByID(name,moduleid);
@@ -2036,44 +2795,22 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi, int loading_aof) {
                 exit(1);
             } else {
                 /* RDB check mode. */
-                robj *aux = rdbLoadCheckModuleValue(rdb,name);
+                robj *aux = rdbLoadCheckModuleValue(cur,name);
                 decrRefCount(aux);
             }
         }
 
         /* Read key */
-        if ((key = rdbLoadStringObject(rdb)) == NULL) goto eoferr;
-        /* Read value */
-        if ((val = rdbLoadObject(type,rdb,key)) == NULL) goto eoferr;
-        /* Check if the key already expired. This function is used when loading
-         * an RDB file from disk, either at startup, or when an RDB was
-         * received from the master. In the latter case, the master is
-         * responsible for key expiry. If we would expire keys here, the
-         * snapshot taken by the master may not be reflected on the slave. */
-        if (server.masterhost == NULL && !loading_aof && expiretime != -1 && expiretime < now) {
-            decrRefCount(key);
-            decrRefCount(val);
+        if ((key = rdbLoadStringObject(cur)) == NULL) goto eoferr;
+        if (fParallel && rdbCanCopyObject(type)) {
+            /* Queue the value, it is added to the keyspace once decoded */
+            if (rdbLoadPoolQueue(&pool,cur,db,type,key,expiretime,lfu_freq,
+                                 lru_idle,mvcc_stamp) == C_ERR) goto eoferr;
         } else {
-            /* Add the new object in the hash table */
-            int fInserted = dbMerge(db, key, val, rsi->fForceSetKey);
-
-            if (fInserted)
-            {
-                /* Set the expire time if needed */
-                if (expiretime != -1) setExpire(NULL,db,key,expiretime);
-
-                /* Set usage information (for eviction). */
-                objectSetLRUOrLFU(val,lfu_freq,lru_idle,lru_clock);
-
-                /* Decrement the key refcount since dbMerge() will take its
-                * own reference. */
-                decrRefCount(key);
-            }
-            else
-            {
-                decrRefCount(key);
-                decrRefCount(val);
-            }
+            /* Read value */
+            if ((val = rdbLoadObject(type,cur,key)) == NULL) goto eoferr;
+            rdbLoadInsertKey(db,key,val,expiretime,lfu_freq,lru_idle,
+                             mvcc_stamp,lru_clock,now,rsi,loading_aof);
         }
 
         /* Reset the state that is key-specified and is populated by
@@ -2081,6 +2818,12 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi, int loading_aof) {
         expiretime = -1;
         lfu_freq = -1;
         lru_idle = -1;
+        mvcc_stamp = 0;
+    }
+    if (fParallel) {
+        if (rdbLoadPoolDrain(&pool) == C_ERR) goto eoferr;
+        rdbLoadPoolStop(&pool);
+        fParallel = 0;
     }
     /* Verify the checksum if RDB version is >= 5 */
     if (rdbver >= 5) {
@@ -2100,6 +2843,18 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi, int loading_aof) {
     return C_OK;
 
 eoferr: /* unexpected end of file is handled here with a fatal exit */
+    if (rdb->flags & RIO_FLAG_READ_ERROR) {
+        /* Not a truncated file but a failing target, like the connection
+         * with the master streaming the RDB: the caller handles it. */
+        serverLog(LL_WARNING,"Error reading the RDB stream: %s",
+            strerror(errno));
+        if (fParallel) {
+            rdbLoadPoolDrain(&pool);
+            rdbLoadPoolStop(&pool);
+        }
+        if (chunkbuf) sdsfree(chunkbuf);
+        return C_ERR;
+    }
     serverLog(LL_WARNING,"Short read or OOM loading DB. Unrecoverable error, aborting now.");
     rdbExitReportCorruptRDB("Unexpected EOF reading RDB file");
     return C_ERR; /* Just to avoid warning */
@@ -2308,7 +3063,8 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
     long long start;
     int pipefds[2];
 
-    if (server.aof_child_pid != -1 || server.rdb_child_pid != -1) return C_ERR;
+    if (server.aof_child_pid != -1 || server.rdb_child_pid != -1 ||
+        server.rdb_thread_active) return C_ERR;
 
     /* Before to fork, create a pipe that will be used in order to
      * send back to the parent the IDs of the slaves that successfully
@@ -2458,7 +3214,7 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
 }
 
 void saveCommand(client *c) {
-    if (server.rdb_child_pid != -1) {
+    if (server.rdb_child_pid != -1 || server.rdb_thread_active) {
         addReplyError(c,"Background save already in progress");
         return;
     }
@@ -2489,7 +3245,7 @@ void bgsaveCommand(client *c) {
     rdbSaveInfo rsi, *rsiptr;
     rsiptr = rdbPopulateSaveInfo(&rsi);
 
-    if (server.rdb_child_pid != -1) {
+    if (server.rdb_child_pid != -1 || server.rdb_thread_active) {
         addReplyError(c,"Background save already in progress");
     } else if (server.aof_child_pid != -1) {
         if (schedule) {
@@ -2501,7 +3257,7 @@ void bgsaveCommand(client *c) {
                 "Use BGSAVE SCHEDULE in order to schedule a BGSAVE whenever "
                 "possible.");
         }
-    } else if (rdbSaveBackground(rsiptr) == C_OK) {
+    } else if (rdbStartBgsave(rsiptr) == C_OK) {
         addReplyStatus(c,"Background saving started");
     } else {
         addReply(c,shared.err);
@@ -2527,8 +3283,9 @@ rdbSaveInfo *rdbPopulateSaveInfo(rdbSaveInfo *rsi) {
      * scenario the replication info is useless, because when a slave
      * connects to us, the NULL repl_backlog will trigger a full
      * synchronization, at the same time we will use a new replid and clear
-     * replid2. */
-    if (!server.masterhost && server.repl_backlog) {
+     * replid2. Active replicas feed their slaves as masters do, even
+     * while the link with their masters is down. */
+    if ((!listLength(server.masters) || server.fActiveReplica) && server.repl_backlog) {
         /* Note that when server.slaveseldb is -1, it means that this master
          * didn't apply any write commands after a full synchronization.
          * So we can let repl_stream_db be 0, this allows a restarted slave
@@ -2540,8 +3297,9 @@ rdbSaveInfo *rdbPopulateSaveInfo(rdbSaveInfo *rsi) {
 
     /* If the instance is a slave we need a connected master
      * in order to fetch the currently selected DB. */
-    if (server.master) {
-        rsi->repl_stream_db = server.master->db->id;
+    redisMaster *mi = firstMaster();
+    if (mi && mi->master) {
+        rsi->repl_stream_db = mi->master->db->id;
         return rsi;
     }
 
@@ -2550,8 +3308,8 @@ rdbSaveInfo *rdbPopulateSaveInfo(rdbSaveInfo *rsi) {
      * increment the master_repl_offset only from data arriving from the
      * master, so if we are disconnected the offset in the cached master
      * is valid. */
-    if (server.cached_master) {
-        rsi->repl_stream_db = server.cached_master->db->id;
+    if (mi && mi->cached_master) {
+        rsi->repl_stream_db = mi->cached_master->db->id;
         return rsi;
     }
     return NULL;
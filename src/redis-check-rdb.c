@@ -182,6 +182,8 @@ int redis_check_rdb(char *rdbfilename, FILE *fp) {
     char buf[1024];
     long long expiretime, now = mstime();
     static rio rdb; /* Pointed by global struct riostate. */
+    rio *cur = &rdb, chunk;
+    sds chunkbuf = NULL;
 
     int closefile = (fp == NULL);
     if (fp == NULL && (fp = fopen(rdbfilename,"r")) == NULL) return 1;
@@ -206,9 +208,16 @@ int redis_check_rdb(char *rdbfilename, FILE *fp) {
     while(1) {
         robj *key, *val;
 
+        /* Back to the main stream at the end of a chunk. */
+        if (cur != &rdb && (size_t)chunk.io.buffer.pos == sdslen(chunkbuf)) {
+            sdsfree(chunkbuf);
+            chunkbuf = NULL;
+            cur = &rdb;
+        }
+
         /* Read type. */
         rdbstate.doing = RDB_CHECK_DOING_READ_TYPE;
-        if ((type = rdbLoadType(&rdb)) == -1) goto eoferr;
+        if ((type = rdbLoadType(cur)) == -1) goto eoferr;
 
         /* Handle special types. */
         if (type == RDB_OPCODE_EXPIRETIME) {
@@ -216,31 +225,55 @@ int redis_check_rdb(char *rdbfilename, FILE *fp) {
             /* EXPIRETIME: load an expire associated with the next key
              * to load. Note that after loading an expire we need to
              * load the actual type, and continue. */
-            if ((expiretime = rdbLoadTime(&rdb)) == -1) goto eoferr;
+            if ((expiretime = rdbLoadTime(cur)) == -1) goto eoferr;
             expiretime *= 1000;
             continue; /* Read next opcode. */
         } else if (type == RDB_OPCODE_EXPIRETIME_MS) {
             /* EXPIRETIME_MS: milliseconds precision expire times introduced
              * with RDB v3. Like EXPIRETIME but no with more precision. */
             rdbstate.doing = RDB_CHECK_DOING_READ_EXPIRE;
-            if ((expiretime = rdbLoadMillisecondTime(&rdb, rdbver)) == -1) goto eoferr;
+            if ((expiretime = rdbLoadMillisecondTime(cur, rdbver)) == -1) goto eoferr;
             continue; /* Read next opcode. */
         } else if (type == RDB_OPCODE_FREQ) {
             /* FREQ: LFU frequency. */
             uint8_t byte;
-            if (rioRead(&rdb,&byte,1) == 0) goto eoferr;
+            if (rioRead(cur,&byte,1) == 0) goto eoferr;
             continue; /* Read next opcode. */
         } else if (type == RDB_OPCODE_IDLE) {
             /* IDLE: LRU idle time. */
-            if (rdbLoadLen(&rdb,NULL) == RDB_LENERR) goto eoferr;
+            if (rdbLoadLen(cur,NULL) == RDB_LENERR) goto eoferr;
+            continue; /* Read next opcode. */
+        } else if (type == RDB_OPCODE_MVCC) {
+            /* MVCC: timestamp and origin UUID of the last write to the key. */
+            unsigned char uuid[UUID_BINARY_LEN];
+            if (rdbLoadLen(cur,NULL) == RDB_LENERR) goto eoferr;
+            if (rioRead(cur,uuid,UUID_BINARY_LEN) == 0) goto eoferr;
             continue; /* Read next opcode. */
         } else if (type == RDB_OPCODE_EOF) {
             /* EOF: End of file, exit the main loop. */
+            if (cur != &rdb) {
+                rdbCheckError("EOF inside a chunk");
+                goto err;
+            }
             break;
+        } else if (type == RDB_OPCODE_CHUNK) {
+            /* CHUNK: block of keys saved by one of the rdb-save-threads. */
+            if (cur != &rdb) {
+                rdbCheckError("Nested chunk");
+                goto err;
+            }
+            rdbstate.doing = RDB_CHECK_DOING_READ_LEN;
+            if ((chunkbuf = rdbGenericLoadStringObject(&rdb,RDB_LOAD_SDS,NULL)) == NULL)
+                goto eoferr;
+            rdbCheckInfo("Reading chunk of %llu bytes",
+                (unsigned long long)sdslen(chunkbuf));
+            rioInitWithBuffer(&chunk,chunkbuf);
+            cur = &chunk;
+            continue; /* Read type again. */
         } else if (type == RDB_OPCODE_SELECTDB) {
             /* SELECTDB: Select the specified database. */
             rdbstate.doing = RDB_CHECK_DOING_READ_LEN;
-            if ((dbid = rdbLoadLen(&rdb,NULL)) == RDB_LENERR)
+            if ((dbid = rdbLoadLen(cur,NULL)) == RDB_LENERR)
                 goto eoferr;
             rdbCheckInfo("Selecting DB ID %d", dbid);
             continue; /* Read type again. */
@@ -249,9 +282,9 @@ int redis_check_rdb(char *rdbfilename, FILE *fp) {
              * selected data base, in order to avoid useless rehashing. */
             uint64_t db_size, expires_size;
             rdbstate.doing = RDB_CHECK_DOING_READ_LEN;
-            if ((db_size = rdbLoadLen(&rdb,NULL)) == RDB_LENERR)
+            if ((db_size = rdbLoadLen(cur,NULL)) == RDB_LENERR)
                 goto eoferr;
-            if ((expires_size = rdbLoadLen(&rdb,NULL)) == RDB_LENERR)
+            if ((expires_size = rdbLoadLen(cur,NULL)) == RDB_LENERR)
                 goto eoferr;
             continue; /* Read type again. */
         } else if (type == RDB_OPCODE_AUX) {
@@ -262,8 +295,8 @@ int redis_check_rdb(char *rdbfilename, FILE *fp) {
              * An AUX field is composed of two strings: key and value. */
             robj *auxkey, *auxval;
             rdbstate.doing = RDB_CHECK_DOING_READ_AUX;
-            if ((auxkey = rdbLoadStringObject(&rdb)) == NULL) goto eoferr;
-            if ((auxval = rdbLoadStringObject(&rdb)) == NULL) goto eoferr;
+            if ((auxkey = rdbLoadStringObject(cur)) == NULL) goto eoferr;
+            if ((auxval = rdbLoadStringObject(cur)) == NULL) goto eoferr;
 
             rdbCheckInfo("AUX FIELD %s = '%s'",
                 (char*)ptrFromObj(auxkey), (char*)ptrFromObj(auxval));
@@ -280,12 +313,12 @@ int redis_check_rdb(char *rdbfilename, FILE *fp) {
 
         /* Read key */
         rdbstate.doing = RDB_CHECK_DOING_READ_KEY;
-        if ((key = rdbLoadStringObject(&rdb)) == NULL) goto eoferr;
+        if ((key = rdbLoadStringObject(cur)) == NULL) goto eoferr;
         rdbstate.key = key;
         rdbstate.keys++;
         /* Read value */
         rdbstate.doing = RDB_CHECK_DOING_READ_OBJECT_VALUE;
-        if ((val = rdbLoadObject(type,&rdb,key)) == NULL) goto eoferr;
+        if ((val = rdbLoadObject(type,cur,key)) == NULL) goto eoferr;
         /* Check if the key already expired. */
         if (expiretime != -1 && expiretime < now)
             rdbstate.already_expired++;
@@ -323,6 +356,7 @@ eoferr: /* unexpected end of file is handled here with a fatal exit */
         rdbCheckError("Unexpected EOF reading RDB file");
     }
 err:
+    if (chunkbuf) sdsfree(chunkbuf);
     if (closefile) fclose(fp);
     return 1;
 }
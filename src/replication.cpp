@@ -30,6 +30,9 @@
  */
 
 
+extern "C" {
+#include "rio.h"
+}
 #include "server.h"
 
 #include <sys/time.h>
@@ -38,13 +41,17 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include "atomicvar.h"
 #include <uuid/uuid.h>
 
-void replicationDiscardCachedMaster(void);
-void replicationResurrectCachedMaster(int newfd);
-void replicationSendAck(void);
+void replicationDiscardCachedMaster(redisMaster *mi);
+void replicationResurrectCachedMaster(redisMaster *mi, int newfd);
+void replicationSendAck(redisMaster *mi);
 void putSlaveOnline(client *slave);
-int cancelReplicationHandshake(void);
+int cancelReplicationHandshake(redisMaster *mi);
 
 /* --------------------------- Utility functions ---------------------------- */
 
@@ -93,13 +100,67 @@ static bool FSameHost(client *clientA, client *clientB)
     return (zeroCheck != 0);    // if the UUID is nil then it is never equal
 }
 
+/* Return true if the slave 'c' is also one of the masters we replicate from,
+ * as it happens in a multi-master mesh. */
+static bool FSlaveIsOurMaster(client *c)
+{
+    listIter li;
+    listNode *ln;
+
+    listRewind(server.masters, &li);
+    while ((ln = listNext(&li))) {
+        redisMaster *mi = (redisMaster*)listNodeValue(ln);
+        if (FSameHost(c, mi->master) || FSameHost(c, mi->cached_master)
+            || FUuidEqual(c->uuid, mi->master_uuid))
+            return true;
+    }
+    return false;
+}
+
+/* Close the connections of the slaves that are not also our masters, so
+ * they resync with us and get the data we merged. */
+static void disconnectSubSlaves(void)
+{
+    listIter li;
+    listNode *ln;
+
+    listRewind(server.slaves, &li);
+    while ((ln = listNext(&li))) {
+        client *c = (client*)listNodeValue(ln);
+        if (!FSlaveIsOurMaster(c))
+            freeClientAsync(c);
+    }
+}
+
 /* ---------------------------------- MASTER -------------------------------- */
 
+/* Usable bytes of a backlog block, sized so the whole allocation is used. */
+#define REPL_BACKLOG_BLOCK_DATA (REPL_BACKLOG_BLOCK_BYTES-sizeof(struct sdshdr16)-1)
+
+static robj *createReplicationBacklogBlock(void) {
+    sds block = sdsnewlen(SDS_NOINIT,REPL_BACKLOG_BLOCK_DATA);
+    sdssetlen(block,0);
+    return createObject(OBJ_STRING,block);
+}
+
+/* Number of blocks needed to hold a full history. */
+static unsigned long replicationBacklogBlocks(void) {
+    return server.repl_backlog_size / REPL_BACKLOG_BLOCK_DATA + 2;
+}
+
 void createReplicationBacklog(void) {
     serverAssert(server.repl_backlog == NULL);
-    server.repl_backlog = (char*)zmalloc(server.repl_backlog_size, MALLOC_LOCAL);
+    server.repl_backlog = listCreate();
+    listSetFreeMethod(server.repl_backlog,decrRefCountVoid);
     server.repl_backlog_histlen = 0;
-    server.repl_backlog_idx = 0;
+    server.repl_backlog_buflen = 0;
+
+    /* Allocate the blocks upfront, they are recycled once no replica
+     * needs them anymore, see trimReplicationBacklog(). */
+    server.repl_backlog_spare = listCreate();
+    listSetFreeMethod(server.repl_backlog_spare,decrRefCountVoid);
+    for (unsigned long j = 0; j < replicationBacklogBlocks(); j++)
+        listAddNodeTail(server.repl_backlog_spare,createReplicationBacklogBlock());
 
     /* We don't have any data inside our buffer, but virtually the first
      * byte we have is the next byte that will be generated for the
@@ -120,17 +181,13 @@ void resizeReplicationBacklog(long long newsize) {
 
     server.repl_backlog_size = newsize;
     if (server.repl_backlog != NULL) {
-        /* What we actually do is to flush the old buffer and realloc a new
-         * empty one. It will refill with new data incrementally.
-         * The reason is that copying a few gigabytes adds latency and even
-         * worse often we need to alloc additional space before freeing the
-         * old buffer. */
-        zfree(server.repl_backlog);
-        server.repl_backlog = (char*)zmalloc(server.repl_backlog_size, MALLOC_LOCAL);
-        server.repl_backlog_histlen = 0;
-        server.repl_backlog_idx = 0;
-        /* Next byte we have is... the next since the buffer is empty. */
-        server.repl_backlog_off = server.master_repl_offset+1;
+        /* What we actually do is to flush the old buffer and start a new
+         * empty one. It will refill with new data incrementally. Blocks
+         * still queued to replicas are released once sent. */
+        listRelease(server.repl_backlog);
+        listRelease(server.repl_backlog_spare);
+        server.repl_backlog = NULL;
+        createReplicationBacklog();
     }
 }
 
@@ -142,45 +199,79 @@ void freeReplicationBacklog(void) {
     while ((ln = listNext(&li))) {
         // server.slaves should be empty, or filled with clients pending close
         client *c = (client*)listNodeValue(ln);
-        serverAssert(c->flags & CLIENT_CLOSE_ASAP || FUuidEqual(server.master_uuid, c->uuid));
+        serverAssert(c->flags & CLIENT_CLOSE_ASAP || FSlaveIsOurMaster(c));
+    }
+    if (server.repl_backlog) {
+        listRelease(server.repl_backlog);
+        listRelease(server.repl_backlog_spare);
     }
-    zfree(server.repl_backlog);
     server.repl_backlog = NULL;
+    server.repl_backlog_spare = NULL;
 }
 
-/* Add data to the replication backlog.
- * This function also increments the global replication offset stored at
- * server.master_repl_offset, because there is no case where we want to feed
- * the backlog without incrementing the offset. */
-void feedReplicationBacklog(void *ptr, size_t len) {
+/* Memory used by the replication backlog blocks. */
+size_t replicationBacklogMemoryUsage(void) {
+    size_t mem = 0;
+    listIter li;
+    listNode *ln;
+
+    if (server.repl_backlog == NULL) return 0;
+    for (list *l : {server.repl_backlog, server.repl_backlog_spare}) {
+        listRewind(l,&li);
+        while ((ln = listNext(&li))) {
+            robj *block = (robj*)listNodeValue(ln);
+            mem += sizeof(listNode) + sizeof(robj) + sdsZmallocSize((sds)ptrFromObj(block));
+        }
+    }
+    return mem;
+}
+
+/* Append data to the replication backlog, see feedReplicationBacklog().
+ *
+ * The backlog is a list of string objects of REPL_BACKLOG_BLOCK_BYTES that
+ * are only ever appended to, so the output buffers of the replicas reference
+ * the bytes they need to send instead of copying them, see
+ * addReplyReplicationBacklog(). The blocks that fall out of the history are
+ * only dropped by trimReplicationBacklog(), so the data just appended can
+ * still be referenced even if it is larger than the backlog. */
+static void appendReplicationBacklog(const void *ptr, size_t len) {
     serverAssert(GlobalLocksAcquired());
-    unsigned char *p = (unsigned char*)ptr;
+    const unsigned char *p = (const unsigned char*)ptr;
 
     server.master_repl_offset += len;
+    server.repl_backlog_buflen += len;
+    server.repl_backlog_histlen += len;
 
-    /* This is a circular buffer, so write as much data we can at every
-     * iteration and rewind the "idx" index if we reach the limit. */
+    /* Fill the tail block and add new ones as needed. */
     while(len) {
-        size_t thislen = server.repl_backlog_size - server.repl_backlog_idx;
+        listNode *ln = listLast(server.repl_backlog);
+        sds block = ln ? (sds)ptrFromObj((robj*)listNodeValue(ln)) : NULL;
+        if (block == NULL || sdsavail(block) == 0) {
+            robj *o;
+            if (listLength(server.repl_backlog_spare)) {
+                listNode *spare = listFirst(server.repl_backlog_spare);
+                o = (robj*)listNodeValue(spare);
+                listAddNodeTail(server.repl_backlog,o);
+                incrRefCount(o);    /* Moved, not released by listDelNode */
+                listDelNode(server.repl_backlog_spare,spare);
+            } else {
+                o = createReplicationBacklogBlock();
+                listAddNodeTail(server.repl_backlog,o);
+            }
+            block = (sds)ptrFromObj(o);
+        }
+        size_t thislen = sdsavail(block);
         if (thislen > len) thislen = len;
-        memcpy(server.repl_backlog+server.repl_backlog_idx,p,thislen);
-        server.repl_backlog_idx += thislen;
-        if (server.repl_backlog_idx == server.repl_backlog_size)
-            server.repl_backlog_idx = 0;
+        memcpy(block+sdslen(block),p,thislen);
+        sdsIncrLen(block,thislen);
         len -= thislen;
         p += thislen;
-        server.repl_backlog_histlen += thislen;
     }
-    if (server.repl_backlog_histlen > server.repl_backlog_size)
-        server.repl_backlog_histlen = server.repl_backlog_size;
-    /* Set the offset of the first byte we have in the backlog. */
-    server.repl_backlog_off = server.master_repl_offset -
-                              server.repl_backlog_histlen + 1;
 }
 
-/* Wrapper for feedReplicationBacklog() that takes Redis string objects
+/* Wrapper for appendReplicationBacklog() that takes Redis string objects
  * as input. */
-void feedReplicationBacklogWithObject(robj *o) {
+static void appendReplicationBacklogWithObject(robj *o) {
     char llstr[LONG_STR_SIZE];
     void *p;
     size_t len;
@@ -192,9 +283,52 @@ void feedReplicationBacklogWithObject(robj *o) {
         len = sdslen((sds)ptrFromObj(o));
         p = ptrFromObj(o);
     }
-    feedReplicationBacklog(p,len);
+    appendReplicationBacklog(p,len);
 }
 
+/* Limit the history to the backlog size and drop the blocks holding no byte
+ * of it anymore. Replicas still sending them keep them alive. */
+static void trimReplicationBacklog(void) {
+    if (server.repl_backlog_histlen > server.repl_backlog_size)
+        server.repl_backlog_histlen = server.repl_backlog_size;
+
+    while (listLength(server.repl_backlog)) {
+        listNode *ln = listFirst(server.repl_backlog);
+        robj *o = (robj*)listNodeValue(ln);
+        long long blocklen = sdslen((sds)ptrFromObj(o));
+        if (server.repl_backlog_buflen - blocklen < server.repl_backlog_histlen) break;
+        server.repl_backlog_buflen -= blocklen;
+
+        /* Nobody else can take a new reference, so a block only the backlog
+         * references can be reused. */
+        if (o->refcount == 1 &&
+            listLength(server.repl_backlog_spare) < replicationBacklogBlocks())
+        {
+            sdssetlen((sds)ptrFromObj(o),0);
+            listAddNodeTail(server.repl_backlog_spare,o);
+            incrRefCount(o);
+            listDelNode(server.repl_backlog,ln);
+        } else {
+            listDelNode(server.repl_backlog,ln);
+        }
+    }
+
+    /* Set the offset of the first byte we have in the backlog. */
+    server.repl_backlog_off = server.master_repl_offset -
+                              server.repl_backlog_histlen + 1;
+}
+
+/* Add data to the replication backlog.
+ * This function also increments the global replication offset stored at
+ * server.master_repl_offset, because there is no case where we want to feed
+ * the backlog without incrementing the offset. */
+void feedReplicationBacklog(void *ptr, size_t len) {
+    appendReplicationBacklog(ptr,len);
+    trimReplicationBacklog();
+}
+
+long long addReplyReplicationBacklogCore(client *c, long long offset, bool fAsync);
+
 /* Propagate write commands to slaves, and populate the replication backlog
  * as well. This function is used if the instance is a master: we use
  * the commands received by our clients in order to create the replication
@@ -205,31 +339,30 @@ void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
     listIter li;
     int j, len;
     char llstr[LONG_STR_SIZE];
-    serverAssert(GlobalLocksAcquired());
+    serverAssert(KeyspaceLocksAcquired());
 
     /* If the instance is not a top level master, return ASAP: we'll just proxy
      * the stream of data we receive from our master instead, in order to
      * propagate *identical* replication stream. In this way this slave can
      * advertise the same replication ID as the master (since it shares the
      * master replication history and has the same backlog and offsets). */
-    if (!server.fActiveReplica && server.masterhost != NULL) return;
+    if (!server.fActiveReplica && listLength(server.masters)) return;
 
     /* If there aren't slaves, and there is no backlog buffer to populate,
      * we can return ASAP. */
     if (server.repl_backlog == NULL && listLength(slaves) == 0) return;
+    serverAssert(GlobalLocksAcquired());
 
     /* We can't have slaves attached and no backlog. */
     serverAssert(!(listLength(slaves) != 0 && server.repl_backlog == NULL));
 
-    /* Get the lock on all slaves */
-    listRewind(slaves,&li);
-    while((ln = listNext(&li))) {
-        ((client*)ln->value)->lock.lock();
-    }
+    /* The command is encoded once into the backlog, and the replicas are fed
+     * by referencing the bytes added to it. */
+    long long offset = server.master_repl_offset+1;
 
     /* Send SELECT command to every slave if needed. */
+    robj *selectcmd = NULL;
     if (server.slaveseldb != dictid) {
-        robj *selectcmd;
 
         /* For a few DBs we have pre-computed SELECT command. */
         if (dictid >= 0 && dictid < PROTO_SHARED_SELECT_CMDS) {
@@ -245,47 +378,59 @@ void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
         }
 
         /* Add the SELECT command into the backlog. */
-        if (server.repl_backlog) feedReplicationBacklogWithObject(selectcmd);
-
-        /* Send it to slaves. */
-        listRewind(slaves,&li);
-        while((ln = listNext(&li))) {
-            client *slave = (client*)ln->value;
-            if (slave->replstate == SLAVE_STATE_WAIT_BGSAVE_START) continue;
-            if (server.current_client && FSameHost(server.current_client, slave)) continue;
-            addReplyAsync(slave,selectcmd);
-        }
-
-        if (dictid < 0 || dictid >= PROTO_SHARED_SELECT_CMDS)
-            decrRefCount(selectcmd);
+        appendReplicationBacklogWithObject(selectcmd);
     }
     server.slaveseldb = dictid;
 
-    /* Write the command to the replication backlog if any. */
-    if (server.repl_backlog) {
-        char aux[LONG_STR_SIZE+3];
+    /* Write the command to the replication backlog. */
+    char aux[LONG_STR_SIZE+3];
+
+    /* Commands touching keys carry the time of the write with
+     * active-replica-timestamps, see rreplayCommand(). */
+    struct redisCommand *cmd = NULL;
+    if (server.fActiveReplicaTimestamps) {
+        cmd = lookupCommand((sds)ptrFromObj(argv[0]));
+        if (cmd && cmd->firstkey == 0 && cmd->getkeys_proc == NULL) cmd = NULL;
+    }
+
+    /* Add the multi bulk reply length. */
+    aux[0] = '*';
+    len = ll2string(aux+1,sizeof(aux)-1,cmd ? argc+3 : argc);
+    aux[len+1] = '\r';
+    aux[len+2] = '\n';
+    appendReplicationBacklog(aux,len+3);
+
+    if (cmd) {
+        uint64_t stamp = server.mvcc_cmd_stamp ? server.mvcc_cmd_stamp :
+                                                 mvccPack(mvccNextTstamp(),0);
+        char szUUID[37];
+        uuid_unparse(mvccOriginUuid(MVCC_ORIGIN(stamp)),szUUID);
+        appendReplicationBacklog("$7\r\nRREPLAY\r\n$36\r\n",18);
+        appendReplicationBacklog(szUUID,36);
+        appendReplicationBacklog("\r\n",2);
+        len = ll2string(llstr,sizeof(llstr),(long long)MVCC_TSTAMP(stamp));
+        aux[0] = '$';
+        int lenlen = ll2string(aux+1,sizeof(aux)-1,len);
+        aux[lenlen+1] = '\r';
+        aux[lenlen+2] = '\n';
+        appendReplicationBacklog(aux,lenlen+3);
+        appendReplicationBacklog(llstr,len);
+        appendReplicationBacklog(aux+lenlen+1,2);
+    }
 
-        /* Add the multi bulk reply length. */
-        aux[0] = '*';
-        len = ll2string(aux+1,sizeof(aux)-1,argc);
+    for (j = 0; j < argc; j++) {
+        long objlen = stringObjectLen(argv[j]);
+
+        /* We need to feed the buffer with the object as a bulk reply
+         * not just as a plain string, so create the $..CRLF payload len
+         * and add the final CRLF */
+        aux[0] = '$';
+        len = ll2string(aux+1,sizeof(aux)-1,objlen);
         aux[len+1] = '\r';
         aux[len+2] = '\n';
-        feedReplicationBacklog(aux,len+3);
-
-        for (j = 0; j < argc; j++) {
-            long objlen = stringObjectLen(argv[j]);
-
-            /* We need to feed the buffer with the object as a bulk reply
-             * not just as a plain string, so create the $..CRLF payload len
-             * and add the final CRLF */
-            aux[0] = '$';
-            len = ll2string(aux+1,sizeof(aux)-1,objlen);
-            aux[len+1] = '\r';
-            aux[len+2] = '\n';
-            feedReplicationBacklog(aux,len+3);
-            feedReplicationBacklogWithObject(argv[j]);
-            feedReplicationBacklog(aux+len+1,2);
-        }
+        appendReplicationBacklog(aux,len+3);
+        appendReplicationBacklogWithObject(argv[j]);
+        appendReplicationBacklog(aux+len+1,2);
     }
 
     /* Write the command to every slave. */
@@ -295,26 +440,31 @@ void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
 
         /* Don't feed slaves that are still waiting for BGSAVE to start */
         if (slave->replstate == SLAVE_STATE_WAIT_BGSAVE_START) continue;
-        if (server.current_client && FSameHost(server.current_client, slave)) continue;
+
+        std::lock_guard<decltype(slave->lock)> lock(slave->lock);
+        /* Don't send the command back where it came from. In a multi-master
+         * mesh our other masters got it from its origin already. Such slaves
+         * still need the SELECT, as slaveseldb is shared by all of them. */
+        if (server.current_client &&
+            (FSameHost(server.current_client, slave) ||
+             (server.fMultiMaster &&
+              (server.current_client->flags & CLIENT_MASTER) &&
+              FSlaveIsOurMaster(slave))))
+        {
+            if (selectcmd != NULL)
+                addReplyProtoAsync(slave,(const char*)ptrFromObj(selectcmd),
+                    sdslen((sds)ptrFromObj(selectcmd)));
+            continue;
+        }
 
         /* Feed slaves that are waiting for the initial SYNC (so these commands
          * are queued in the output buffer until the initial SYNC completes),
          * or are already in sync with the master. */
-
-        /* Add the multi bulk length. */
-        addReplyArrayLenAsync(slave,argc);
-
-        /* Finally any additional argument that was not stored inside the
-         * static buffer if any (from j to argc). */
-        for (j = 0; j < argc; j++)
-            addReplyBulkAsync(slave,argv[j]);
-    }
-
-    listRewind(slaves,&li);
-    while((ln = listNext(&li))) {
-        client *slave = (client*)ln->value;
-        slave->lock.unlock();
+        addReplyReplicationBacklogCore(slave,offset,true);
     }
+    if (selectcmd != NULL && (dictid < 0 || dictid >= PROTO_SHARED_SELECT_CMDS))
+        decrRefCount(selectcmd);
+    trimReplicationBacklog();
 }
 
 /* This function is used in order to proxy what we receive from our master
@@ -334,18 +484,23 @@ void replicationFeedSlavesFromMasterStream(list *slaves, char *buf, size_t bufle
         printf("\n");
     }
 
-    if (server.repl_backlog) feedReplicationBacklog(buf,buflen);
+    long long offset = server.master_repl_offset+1;
+    if (server.repl_backlog) appendReplicationBacklog(buf,buflen);
     listRewind(slaves,&li);
     while((ln = listNext(&li))) {
         client *slave = (client*)ln->value;
         std::lock_guard<decltype(slave->lock)> ulock(slave->lock);
-        if (FSameHost(slave, server.master))
+        if (FSlaveIsOurMaster(slave))
             continue;   // Active Active case, don't feed back
 
         /* Don't feed slaves that are still waiting for BGSAVE to start */
         if (slave->replstate == SLAVE_STATE_WAIT_BGSAVE_START) continue;
-        addReplyProtoAsync(slave,buf,buflen);
+        if (server.repl_backlog)
+            addReplyReplicationBacklogCore(slave,offset,true);
+        else
+            addReplyProtoAsync(slave,buf,buflen);
     }
+    if (server.repl_backlog) trimReplicationBacklog();
     
     if (listLength(slaves))
         ProcessPendingAsyncWrites();    // flush them to their respective threads
@@ -393,55 +548,51 @@ void replicationFeedMonitors(client *c, list *monitors, int dictid, robj **argv,
 }
 
 /* Feed the slave 'c' with the replication backlog starting from the
- * specified 'offset' up to the end of the backlog. */
-long long addReplyReplicationBacklog(client *c, long long offset) {
-    long long j, skip, len;
-
-    serverLog(LL_DEBUG, "[PSYNC] Replica request offset: %lld", offset);
-
-    if (server.repl_backlog_histlen == 0) {
-        serverLog(LL_DEBUG, "[PSYNC] Backlog history len is zero");
-        return 0;
+ * specified 'offset' up to the end of the backlog. The bytes are not copied,
+ * the output buffer of the slave references the backlog blocks. */
+long long addReplyReplicationBacklogCore(client *c, long long offset, bool fAsync) {
+    long long len, back;
+
+    /* The backlog may not be trimmed yet after new data was appended, so
+     * count from its end. */
+    len = server.master_repl_offset + 1 - offset;
+    if (len <= 0) return 0;
+
+    /* Find the block holding the first byte to send walking back from the
+     * tail, as replicas fed with new commands only need the last bytes. */
+    listNode *ln = listLast(server.repl_backlog);
+    back = len;
+    for (;;) {
+        long long blocklen = sdslen((sds)ptrFromObj((robj*)listNodeValue(ln)));
+        if (back <= blocklen) break;
+        back -= blocklen;
+        ln = listPrevNode(ln);
+    }
+
+    /* Reference the end of that block and the following ones. */
+    size_t off = sdslen((sds)ptrFromObj((robj*)listNodeValue(ln))) - back;
+    while (ln) {
+        robj *block = (robj*)listNodeValue(ln);
+        size_t thislen = sdslen((sds)ptrFromObj(block)) - off;
+        if (fAsync)
+            addReplyObjectRangeAsync(c,block,off,thislen);
+        else
+            addReplyObjectRange(c,block,off,thislen);
+        off = 0;
+        ln = listNextNode(ln);
     }
+    return len;
+}
 
+long long addReplyReplicationBacklog(client *c, long long offset) {
+    serverLog(LL_DEBUG, "[PSYNC] Replica request offset: %lld", offset);
     serverLog(LL_DEBUG, "[PSYNC] Backlog size: %lld",
              server.repl_backlog_size);
     serverLog(LL_DEBUG, "[PSYNC] First byte: %lld",
              server.repl_backlog_off);
     serverLog(LL_DEBUG, "[PSYNC] History len: %lld",
              server.repl_backlog_histlen);
-    serverLog(LL_DEBUG, "[PSYNC] Current index: %lld",
-             server.repl_backlog_idx);
-
-    /* Compute the amount of bytes we need to discard. */
-    skip = offset - server.repl_backlog_off;
-    serverLog(LL_DEBUG, "[PSYNC] Skipping: %lld", skip);
-
-    /* Point j to the oldest byte, that is actually our
-     * server.repl_backlog_off byte. */
-    j = (server.repl_backlog_idx +
-        (server.repl_backlog_size-server.repl_backlog_histlen)) %
-        server.repl_backlog_size;
-    serverLog(LL_DEBUG, "[PSYNC] Index of first byte: %lld", j);
-
-    /* Discard the amount of data to seek to the specified 'offset'. */
-    j = (j + skip) % server.repl_backlog_size;
-
-    /* Feed slave with data. Since it is a circular buffer we have to
-     * split the reply in two parts if we are cross-boundary. */
-    len = server.repl_backlog_histlen - skip;
-    serverLog(LL_DEBUG, "[PSYNC] Reply total length: %lld", len);
-    while(len) {
-        long long thislen =
-            ((server.repl_backlog_size - j) < len) ?
-            (server.repl_backlog_size - j) : len;
-
-        serverLog(LL_DEBUG, "[PSYNC] addReply() length: %lld", thislen);
-        addReplySds(c,sdsnewlen(server.repl_backlog + j, thislen));
-        len -= thislen;
-        j = 0;
-    }
-    return server.repl_backlog_histlen - skip;
+    return addReplyReplicationBacklogCore(c,offset,false);
 }
 
 /* Return the offset to provide as reply to the PSYNC command received
@@ -689,7 +840,7 @@ void syncCommand(client *c) {
     /* Refuse SYNC requests if we are a slave but the link with our master
      * is not ok... */
     if (!server.fActiveReplica) {
-        if (server.masterhost && server.repl_state != REPL_STATE_CONNECTED) {
+        if (listLength(server.masters) && firstMaster()->repl_state != REPL_STATE_CONNECTED) {
             addReplySds(c,sdsnew("-NOMASTERLINK Can't SYNC while not connected with my master\r\n"));
             return;
         }
@@ -704,6 +855,11 @@ void syncCommand(client *c) {
         return;
     }
 
+    /* The replication stream and the RDB are written to the socket directly,
+     * sometimes from a child process, so nothing may stay queued in the
+     * event loop for it */
+    aeUnbufferFile(server.rgthreadvar[c->iel].el, c->fd);
+
     serverLog(LL_NOTICE,"Replica %s asks for synchronization",
         replicationGetSlaveName(c));
 
@@ -810,7 +966,11 @@ void syncCommand(client *c) {
             /* Target is disk (or the slave is not capable of supporting
              * diskless replication) and we don't have a BGSAVE in progress,
              * let's start one. */
-            if (server.aof_child_pid == -1) {
+            if (server.rdb_thread_active) {
+                serverLog(LL_NOTICE,
+                    "A forkless BGSAVE is writing the RDB file. "
+                    "BGSAVE for replication delayed");
+            } else if (server.aof_child_pid == -1) {
                 startBgsaveForReplication(c->slave_capa);
             } else {
                 serverLog(LL_NOTICE,
@@ -917,7 +1077,8 @@ void replconfCommand(client *c) {
         } else if (!strcasecmp((const char*)ptrFromObj(c->argv[j]),"getack")) {
             /* REPLCONF GETACK is used in order to request an ACK ASAP
              * to the slave. */
-            if (server.masterhost && server.master) replicationSendAck();
+            redisMaster *mi = MasterInfoFromClient(c);
+            if (mi != NULL) replicationSendAck(mi);
             return;
         } else if (!strcasecmp((const char*)ptrFromObj(c->argv[j]),"uuid")) {
             /* REPLCONF uuid is used to set and send the UUID of each host */
@@ -1157,9 +1318,9 @@ void shiftReplicationId(void) {
 
 /* Returns 1 if the given replication state is a handshake state,
  * 0 otherwise. */
-int slaveIsInHandshakeState(void) {
-    return server.repl_state >= REPL_STATE_RECEIVE_PONG &&
-           server.repl_state <= REPL_STATE_RECEIVE_PSYNC;
+int slaveIsInHandshakeState(redisMaster *mi) {
+    return mi->repl_state >= REPL_STATE_RECEIVE_PONG &&
+           mi->repl_state <= REPL_STATE_RECEIVE_PSYNC;
 }
 
 /* Avoid the master to detect the slave is timing out while loading the
@@ -1174,8 +1335,19 @@ void replicationSendNewlineToMaster(void) {
     static time_t newline_sent;
     if (time(NULL) != newline_sent) {
         newline_sent = time(NULL);
-        if (write(server.repl_transfer_s,"\n",1) == -1) {
-            /* Pinging back in this stage is best-effort. */
+        listIter li;
+        listNode *ln;
+        listRewind(server.masters,&li);
+        while ((ln = listNext(&li))) {
+            redisMaster *mi = (redisMaster*)listNodeValue(ln);
+            if (mi->repl_state != REPL_STATE_TRANSFER) continue;
+            if (write(mi->repl_transfer_s,"\n",1) == -1) {
+                /* Pinging back in this stage is best-effort. */
+            }
+            /* The payload is still being processed: don't let
+             * replicationCron() time the transfer out meanwhile. A master
+             * that stops sending is caught by the socket read timeout. */
+            mi->repl_transfer_lastio = server.unixtime;
         }
     }
 }
@@ -1189,25 +1361,25 @@ void replicationEmptyDbCallback(void *privdata) {
 
 /* Once we have a link with the master and the synchroniziation was
  * performed, this function materializes the master client we store
- * at server.master, starting from the specified file descriptor. */
-void replicationCreateMasterClient(int fd, int dbid) {
-    server.master = createClient(fd, serverTL - server.rgthreadvar);
-    server.master->flags |= CLIENT_MASTER;
-    server.master->authenticated = 1;
-    server.master->reploff = server.master_initial_offset;
-    server.master->read_reploff = server.master->reploff;
-    server.master->puser = NULL; /* This client can do everything. */
+ * at mi->master, starting from the specified file descriptor. */
+void replicationCreateMasterClient(redisMaster *mi, int fd, int dbid) {
+    mi->master = createClient(fd, serverTL - server.rgthreadvar);
+    mi->master->flags |= CLIENT_MASTER;
+    mi->master->authenticated = 1;
+    mi->master->reploff = mi->master_initial_offset;
+    mi->master->read_reploff = mi->master->reploff;
+    mi->master->puser = NULL; /* This client can do everything. */
     
-    memcpy(server.master->uuid, server.master_uuid, UUID_BINARY_LEN);
-    memset(server.master_uuid, 0, UUID_BINARY_LEN); // make sure people don't use this temp storage buffer
+    memcpy(mi->master->uuid, mi->master_uuid, UUID_BINARY_LEN);
+    memset(mi->master_uuid, 0, UUID_BINARY_LEN); // make sure people don't use this temp storage buffer
 
-    memcpy(server.master->replid, server.master_replid,
-        sizeof(server.master_replid));
+    memcpy(mi->master->replid, mi->master_replid,
+        sizeof(mi->master_replid));
     /* If master offset is set to -1, this master is old and is not
      * PSYNC capable, so we flag it accordingly. */
-    if (server.master->reploff == -1)
-        server.master->flags |= CLIENT_PRE_PSYNC;
-    if (dbid != -1) selectDb(server.master,dbid);
+    if (mi->master->reploff == -1)
+        mi->master->flags |= CLIENT_PRE_PSYNC;
+    if (dbid != -1) selectDb(mi->master,dbid);
 }
 
 /* This function will try to re-enable the AOF file after the
@@ -1231,6 +1403,189 @@ void restartAOFAfterSYNC() {
     }
 }
 
+/* Final setup of the connected slave <- master link, once the dataset of
+ * the master 'mi' is loaded. */
+static void replicationFinishSync(redisMaster *mi, rdbSaveInfo *rsi, int aof_is_enabled) {
+    replicationCreateMasterClient(mi,mi->repl_transfer_s,rsi->repl_stream_db);
+    mi->repl_state = REPL_STATE_CONNECTED;
+    mi->repl_down_since = 0;
+    /* After a full resynchroniziation we use the replication ID and
+     * offset of the master. The secondary ID / offset are cleared since
+     * we are starting a new history. With several masters we merged
+     * their data in our own history instead, and keep it. */
+    if (!server.fMultiMaster) {
+        memcpy(server.replid,mi->master->replid,sizeof(server.replid));
+        server.master_repl_offset = mi->master->reploff;
+        clearReplicationId2();
+    }
+    /* Let's create the replication backlog if needed. Slaves need to
+     * accumulate the backlog regardless of the fact they have sub-slaves
+     * or not, in order to behave correctly if they are promoted to
+     * masters after a failover. */
+    if (server.repl_backlog == NULL) createReplicationBacklog();
+
+    serverLog(LL_NOTICE, "MASTER <-> REPLICA sync: Finished with success");
+    /* Restart the AOF subsystem now that we finished the sync. This
+     * will trigger an AOF rewrite, and when done will start appending
+     * to the new file. */
+    if (aof_is_enabled) restartAOFAfterSYNC();
+}
+
+/* Returns true if the RDB of our master is to be loaded from the socket as
+ * it arrives, instead of being written to a temp file loaded at the end of
+ * the transfer (see repl-diskless-load). */
+static int useDisklessLoad(void) {
+    if (server.repl_diskless_load == REPL_DISKLESS_LOAD_SWAPDB) return 1;
+    if (server.repl_diskless_load != REPL_DISKLESS_LOAD_WHEN_DB_EMPTY) return 0;
+    for (int j = 0; j < server.dbnum; j++) {
+        if (dictSize(server.db[j].pdict)) return 0;
+    }
+    return 1;
+}
+
+/* Create the databases a swapdb diskless load fills, aside of the ones
+ * still serving the clients. */
+static redisDb *disklessLoadCreateDbs(void) {
+    redisDb *rgdb = (redisDb*)zcalloc(sizeof(redisDb)*server.dbnum, MALLOC_LOCAL);
+    for (int j = 0; j < server.dbnum; j++) {
+        rgdb[j].pdict = dictCreate(&dbDictType,NULL);
+        rgdb[j].expires = dictCreate(&keyptrDictType,NULL);
+        rgdb[j].mvcc = dictCreate(&keyptrDictType,NULL);
+        rgdb[j].blocking_keys = dictCreate(&keylistDictType,NULL);
+        rgdb[j].ready_keys = dictCreate(&objectKeyPointerValueDictType,NULL);
+        rgdb[j].watched_keys = dictCreate(&keylistDictType,NULL);
+        rgdb[j].id = j;
+        rgdb[j].avg_ttl = 0;
+        rgdb[j].defrag_later = listCreate();
+        rgdb[j].rgshardlock = NULL;
+    }
+    return rgdb;
+}
+
+/* Release the databases created by disklessLoadCreateDbs(), and the keys
+ * they hold. */
+static void disklessLoadFreeDbs(redisDb *rgdb) {
+    for (int j = 0; j < server.dbnum; j++) {
+        if (server.repl_slave_lazy_flush) emptyDbAsync(rgdb+j);
+        dictRelease(rgdb[j].pdict);
+        dictRelease(rgdb[j].expires);
+        dictRelease(rgdb[j].mvcc);
+        dictRelease(rgdb[j].blocking_keys);
+        dictRelease(rgdb[j].ready_keys);
+        dictRelease(rgdb[j].watched_keys);
+        listRelease(rgdb[j].defrag_later);
+    }
+    zfree(rgdb);
+}
+
+/* Load the SYNC payload of the master 'mi' as it arrives on the socket 'fd',
+ * once its size or EOF mark is known. With repl-diskless-load swapdb the
+ * payload is loaded aside of the current dataset, that keeps serving read
+ * only commands, and replaces it only if the transfer succeeds. Otherwise it
+ * is loaded in the emptied dataset, as a payload written to disk would be. */
+static void readSyncBulkPayloadFromSocket(aeEventLoop *el, int fd, redisMaster *mi) {
+    int fUpdate = server.fActiveReplica;   // Should we update our database, or create from scratch?
+    int aof_is_enabled = server.aof_state != AOF_OFF;
+    /* Active replicas merge the payload in the dataset they have, and with
+     * Cluster enabled the slots to keys map follows the served dataset. */
+    int fSwap = !fUpdate && !server.cluster_enabled &&
+        server.repl_diskless_load == REPL_DISKLESS_LOAD_SWAPDB;
+    redisDb *rgdb = server.db;
+    rdbSaveInfo rsi = RDB_SAVE_INFO_INIT;
+    rio rdb;
+    int retval;
+
+    /* Ensure background save doesn't overwrite synced data */
+    if (server.rdb_child_pid != -1) {
+        serverLog(LL_NOTICE,
+            "Replica is about to load the RDB received from the master, but "
+            "there is a pending RDB child running. Killing process %ld",
+                (long) server.rdb_child_pid);
+        killRDBChild();
+    }
+    /* A forkless BGSAVE must be done with the DBs before keys are added. */
+    snapshotDrain(-1);
+    /* We need to stop any AOFRW fork before flusing and parsing
+     * RDB, otherwise we'll create a copy-on-write disaster. */
+    if (aof_is_enabled) stopAppendOnly();
+
+    if (fSwap) {
+        serverLog(LL_NOTICE, "MASTER <-> REPLICA sync: Loading DB aside of the served one");
+        rgdb = disklessLoadCreateDbs();
+    } else {
+        serverLog(LL_NOTICE, "MASTER <-> REPLICA sync: %s", fUpdate ? "Keeping old data" : "Flushing old data");
+        if (!fUpdate) {
+            signalFlushedDb(-1);
+            emptyDb(
+                -1,
+                server.repl_slave_lazy_flush ? EMPTYDB_ASYNC : EMPTYDB_NO_FLAGS,
+                replicationEmptyDbCallback);
+        }
+    }
+
+    /* The socket is read directly by the loading code: make it blocking,
+     * with a timeout, and stop the event loop from reading it meanwhile. */
+    aeDeleteFileEvent(el,fd,AE_READABLE);
+    anetBlock(NULL,fd);
+    anetRecvTimeout(NULL,fd,server.repl_timeout*1000);
+
+    serverLog(LL_NOTICE, "MASTER <-> REPLICA sync: Loading DB in memory from the socket");
+    rioInitWithSocket(&rdb,fd,mi->repl_transfer_usemark ? 0 : mi->repl_transfer_size);
+    startLoadingStream(mi->repl_transfer_usemark ? 0 : mi->repl_transfer_size);
+    server.async_loading = fSwap;
+    retval = rdbLoadRioIntoDbs(&rdb,&rsi,0,rgdb);
+    if (retval == C_OK && mi->repl_transfer_usemark) {
+        /* The payload is followed by the EOF mark the master announced. */
+        char eofmark[CONFIG_RUN_ID_SIZE];
+
+        rdb.update_cksum = NULL;
+        if (rioRead(&rdb,eofmark,CONFIG_RUN_ID_SIZE) == 0 ||
+            memcmp(eofmark,mi->repl_transfer_eofmark,CONFIG_RUN_ID_SIZE) != 0)
+        {
+            serverLog(LL_WARNING,"Replication stream EOF marker is broken");
+            retval = C_ERR;
+        }
+    }
+    server.async_loading = 0;
+    stopLoading();
+    server.stat_net_input_bytes += rdb.io.fdread.read_so_far;
+    rioFreeSocket(&rdb);
+    anetRecvTimeout(NULL,fd,0);
+    anetNonBlock(NULL,fd);
+
+    if (retval != C_OK) {
+        serverLog(LL_WARNING,"Failed trying to load the MASTER synchronization DB from socket");
+        if (fSwap) {
+            /* Keep serving the dataset we had. */
+            disklessLoadFreeDbs(rgdb);
+        } else if (!fUpdate) {
+            /* Don't serve part of the dataset of the master. */
+            emptyDb(-1,
+                server.repl_slave_lazy_flush ? EMPTYDB_ASYNC : EMPTYDB_NO_FLAGS,
+                NULL);
+        }
+        cancelReplicationHandshake(mi);
+        /* Re-enable the AOF if we disabled it earlier, in order to restore
+         * the original configuration. */
+        if (aof_is_enabled) restartAOFAfterSYNC();
+        return;
+    }
+
+    if (fSwap) {
+        /* Serve the new dataset, and release the old one. */
+        signalFlushedDb(-1);
+        for (int j = 0; j < server.dbnum; j++) {
+            std::swap(server.db[j].pdict,rgdb[j].pdict);
+            std::swap(server.db[j].expires,rgdb[j].expires);
+            std::swap(server.db[j].mvcc,rgdb[j].mvcc);
+            std::swap(server.db[j].avg_ttl,rgdb[j].avg_ttl);
+        }
+        flushSlaveKeysWithExpireList();
+        disklessLoadFreeDbs(rgdb);
+    }
+    replicationFinishSync(mi,&rsi,aof_is_enabled);
+}
+
 /* Asynchronously read the SYNC payload we receive from a master */
 #define REPL_MAX_WRITTEN_BEFORE_FSYNC (1024*1024*8) /* 8 MB */
 void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
@@ -1239,15 +1594,16 @@ void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
     off_t left;
     UNUSED(el);
     UNUSED(mask);
-    int fUpdate = (int)((ptrdiff_t)privdata);   // Should we update our database, or create from scratch?
+    redisMaster *mi = (redisMaster*)privdata;
+    int fUpdate = server.fActiveReplica;   // Should we update our database, or create from scratch?
 
     serverAssert(GlobalLocksAcquired());
 
-    /* Static vars used to hold the EOF mark, and the last bytes received
-     * form the server: when they match, we reached the end of the transfer. */
-    static char eofmark[CONFIG_RUN_ID_SIZE];
-    static char lastbytes[CONFIG_RUN_ID_SIZE];
-    static int usemark = 0;
+    /* The EOF mark, and the last bytes received form the server: when they
+     * match, we reached the end of the transfer. */
+    char *eofmark = mi->repl_transfer_eofmark;
+    char *lastbytes = mi->repl_transfer_lastbytes;
+    int &usemark = mi->repl_transfer_usemark;
 
     /* When a mark is used, we want to detect EOF asap in order to avoid
      * writing the EOF mark into the file... */
@@ -1255,7 +1611,7 @@ void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
 
     /* If repl_transfer_size == -1 we still have to read the bulk length
      * from the master reply. */
-    if (server.repl_transfer_size == -1) {
+    if (mi->repl_transfer_size == -1) {
         if (syncReadLine(fd,buf,1024,server.repl_syncio_timeout*1000) == -1) {
             serverLog(LL_WARNING,
                 "I/O error reading bulk count from MASTER: %s",
@@ -1272,7 +1628,7 @@ void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
             /* At this stage just a newline works as a PING in order to take
              * the connection live. So we refresh our last interaction
              * timestamp. */
-            server.repl_transfer_lastio = server.unixtime;
+            mi->repl_transfer_lastio = server.unixtime;
             return;
         } else if (buf[0] != '$') {
             serverLog(LL_WARNING,"Bad protocol from MASTER, the first byte is not '$' (we received '%s'), are you sure the host and port are right?", buf);
@@ -1295,16 +1651,18 @@ void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
             memset(lastbytes,0,CONFIG_RUN_ID_SIZE);
             /* Set any repl_transfer_size to avoid entering this code path
              * at the next call. */
-            server.repl_transfer_size = 0;
+            mi->repl_transfer_size = 0;
             serverLog(LL_NOTICE,
                 "MASTER <-> REPLICA sync: receiving streamed RDB from master");
         } else {
             usemark = 0;
-            server.repl_transfer_size = strtol(buf+1,NULL,10);
+            mi->repl_transfer_size = strtol(buf+1,NULL,10);
             serverLog(LL_NOTICE,
                 "MASTER <-> REPLICA sync: receiving %lld bytes from master",
-                (long long) server.repl_transfer_size);
+                (long long) mi->repl_transfer_size);
         }
+        /* Without a temp file the payload is loaded as it arrives. */
+        if (mi->repl_transfer_fd == -1) readSyncBulkPayloadFromSocket(el,fd,mi);
         return;
     }
 
@@ -1312,7 +1670,7 @@ void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
     if (usemark) {
         readlen = sizeof(buf);
     } else {
-        left = server.repl_transfer_size - server.repl_transfer_read;
+        left = mi->repl_transfer_size - mi->repl_transfer_read;
         readlen = (left < (signed)sizeof(buf)) ? left : (signed)sizeof(buf);
     }
 
@@ -1320,7 +1678,7 @@ void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
     if (nread <= 0) {
         serverLog(LL_WARNING,"I/O error trying to sync with MASTER: %s",
             (nread == -1) ? strerror(errno) : "connection lost");
-        cancelReplicationHandshake();
+        cancelReplicationHandshake(mi);
         return;
     }
     server.stat_net_input_bytes += nread;
@@ -1337,18 +1695,18 @@ void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
         if (memcmp(lastbytes,eofmark,CONFIG_RUN_ID_SIZE) == 0) eof_reached = 1;
     }
 
-    server.repl_transfer_lastio = server.unixtime;
-    if ((nwritten = write(server.repl_transfer_fd,buf,nread)) != nread) {
+    mi->repl_transfer_lastio = server.unixtime;
+    if ((nwritten = write(mi->repl_transfer_fd,buf,nread)) != nread) {
         serverLog(LL_WARNING,"Write error or short write writing to the DB dump file needed for MASTER <-> REPLICA synchronization: %s", 
             (nwritten == -1) ? strerror(errno) : "short write");
         goto error;
     }
-    server.repl_transfer_read += nread;
+    mi->repl_transfer_read += nread;
 
     /* Delete the last 40 bytes from the file if we reached EOF. */
     if (usemark && eof_reached) {
-        if (ftruncate(server.repl_transfer_fd,
-            server.repl_transfer_read - CONFIG_RUN_ID_SIZE) == -1)
+        if (ftruncate(mi->repl_transfer_fd,
+            mi->repl_transfer_read - CONFIG_RUN_ID_SIZE) == -1)
         {
             serverLog(LL_WARNING,"Error truncating the RDB file received from the master for SYNC: %s", strerror(errno));
             goto error;
@@ -1358,19 +1716,19 @@ void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
     /* Sync data on disk from time to time, otherwise at the end of the transfer
      * we may suffer a big delay as the memory buffers are copied into the
      * actual disk. */
-    if (server.repl_transfer_read >=
-        server.repl_transfer_last_fsync_off + REPL_MAX_WRITTEN_BEFORE_FSYNC)
+    if (mi->repl_transfer_read >=
+        mi->repl_transfer_last_fsync_off + REPL_MAX_WRITTEN_BEFORE_FSYNC)
     {
-        off_t sync_size = server.repl_transfer_read -
-                          server.repl_transfer_last_fsync_off;
-        rdb_fsync_range(server.repl_transfer_fd,
-            server.repl_transfer_last_fsync_off, sync_size);
-        server.repl_transfer_last_fsync_off += sync_size;
+        off_t sync_size = mi->repl_transfer_read -
+                          mi->repl_transfer_last_fsync_off;
+        rdb_fsync_range(mi->repl_transfer_fd,
+            mi->repl_transfer_last_fsync_off, sync_size);
+        mi->repl_transfer_last_fsync_off += sync_size;
     }
 
     /* Check if the transfer is now complete */
     if (!usemark) {
-        if (server.repl_transfer_read == server.repl_transfer_size)
+        if (mi->repl_transfer_read == mi->repl_transfer_size)
             eof_reached = 1;
     }
 
@@ -1388,10 +1746,10 @@ void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
             killRDBChild();
         }
 
-        if (rename(server.repl_transfer_tmpfile,server.rdb_filename) == -1) {
+        if (rename(mi->repl_transfer_tmpfile,server.rdb_filename) == -1) {
             serverLog(LL_WARNING,"Failed trying to rename the temp DB into %s in MASTER <-> REPLICA synchronization: %s", 
 			    server.rdb_filename, strerror(errno));
-            cancelReplicationHandshake();
+            cancelReplicationHandshake(mi);
             return;
         }
         serverLog(LL_NOTICE, "MASTER <-> REPLICA sync: %s", fUpdate ? "Keeping old data" : "Flushing old data");
@@ -1411,45 +1769,25 @@ void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
          * handler, otherwise it will get called recursively since
          * rdbLoad() will call the event loop to process events from time to
          * time for non blocking loading. */
-        aeDeleteFileEvent(el,server.repl_transfer_s,AE_READABLE);
+        aeDeleteFileEvent(el,mi->repl_transfer_s,AE_READABLE);
         serverLog(LL_NOTICE, "MASTER <-> REPLICA sync: Loading DB in memory");
         rdbSaveInfo rsi = RDB_SAVE_INFO_INIT;
         if (rdbLoad(&rsi) != C_OK) {
             serverLog(LL_WARNING,"Failed trying to load the MASTER synchronization DB from disk");
-            cancelReplicationHandshake();
+            cancelReplicationHandshake(mi);
             /* Re-enable the AOF if we disabled it earlier, in order to restore
              * the original configuration. */
             if (aof_is_enabled) restartAOFAfterSYNC();
             return;
         }
-        /* Final setup of the connected slave <- master link */
-        zfree(server.repl_transfer_tmpfile);
-        close(server.repl_transfer_fd);
-        replicationCreateMasterClient(server.repl_transfer_s,rsi.repl_stream_db);
-        server.repl_state = REPL_STATE_CONNECTED;
-        server.repl_down_since = 0;
-        /* After a full resynchroniziation we use the replication ID and
-         * offset of the master. The secondary ID / offset are cleared since
-         * we are starting a new history. */
-        memcpy(server.replid,server.master->replid,sizeof(server.replid));
-        server.master_repl_offset = server.master->reploff;
-        clearReplicationId2();
-        /* Let's create the replication backlog if needed. Slaves need to
-         * accumulate the backlog regardless of the fact they have sub-slaves
-         * or not, in order to behave correctly if they are promoted to
-         * masters after a failover. */
-        if (server.repl_backlog == NULL) createReplicationBacklog();
-
-        serverLog(LL_NOTICE, "MASTER <-> REPLICA sync: Finished with success");
-        /* Restart the AOF subsystem now that we finished the sync. This
-         * will trigger an AOF rewrite, and when done will start appending
-         * to the new file. */
-        if (aof_is_enabled) restartAOFAfterSYNC();
+        zfree(mi->repl_transfer_tmpfile);
+        close(mi->repl_transfer_fd);
+        replicationFinishSync(mi,&rsi,aof_is_enabled);
     }
     return;
 
 error:
-    cancelReplicationHandshake();
+    cancelReplicationHandshake(mi);
     return;
 }
 
@@ -1462,7 +1800,7 @@ error:
 #define SYNC_CMD_READ (1<<0)
 #define SYNC_CMD_WRITE (1<<1)
 #define SYNC_CMD_FULL (SYNC_CMD_READ|SYNC_CMD_WRITE)
-char *sendSynchronousCommand(int flags, int fd, ...) {
+char *sendSynchronousCommand(redisMaster *mi, int flags, int fd, ...) {
 
     /* Create the command to send to the master, we use redis binary
      * protocol to make sure correct arguments are sent. This function
@@ -1510,7 +1848,7 @@ char *sendSynchronousCommand(int flags, int fd, ...) {
             return sdscatprintf(sdsempty(),"-Reading from master: %s",
                     strerror(errno));
         }
-        server.repl_transfer_lastio = server.unixtime;
+        mi->repl_transfer_lastio = server.unixtime;
         return sdsnew(buf);
     }
     return NULL;
@@ -1528,7 +1866,7 @@ char *sendSynchronousCommand(int flags, int fd, ...) {
  * 1) We pass the function an already connected socket "fd".
  * 2) This function does not close the file descriptor "fd". However in case
  *    of successful partial resynchronization, the function will reuse
- *    'fd' as file descriptor of the server.master client structure.
+ *    'fd' as file descriptor of the mi->master client structure.
  *
  * The function is split in two halves: if read_reply is 0, the function
  * writes the PSYNC command on the socket, and a new function call is
@@ -1559,8 +1897,8 @@ char *sendSynchronousCommand(int flags, int fd, ...) {
  *
  * 1) As a side effect of the function call the function removes the readable
  *    event handler from "fd", unless the return value is PSYNC_WAIT_REPLY.
- * 2) server.master_initial_offset is set to the right value according
- *    to the master reply. This will be used to populate the 'server.master'
+ * 2) mi->master_initial_offset is set to the right value according
+ *    to the master reply. This will be used to populate the 'mi->master'
  *    structure replication offset.
  */
 
@@ -1570,7 +1908,7 @@ char *sendSynchronousCommand(int flags, int fd, ...) {
 #define PSYNC_FULLRESYNC 3
 #define PSYNC_NOT_SUPPORTED 4
 #define PSYNC_TRY_LATER 5
-int slaveTryPartialResynchronization(aeEventLoop *el, int fd, int read_reply) {
+int slaveTryPartialResynchronization(redisMaster *mi, aeEventLoop *el, int fd, int read_reply) {
     const char *psync_replid;
     char psync_offset[32];
     sds reply;
@@ -1581,12 +1919,12 @@ int slaveTryPartialResynchronization(aeEventLoop *el, int fd, int read_reply) {
          * master run_id and offset as not valid. Later if we'll be able to do
          * a FULL resync using the PSYNC command we'll set the offset at the
          * right value, so that this information will be propagated to the
-         * client structure representing the master into server.master. */
-        server.master_initial_offset = -1;
+         * client structure representing the master into mi->master. */
+        mi->master_initial_offset = -1;
 
-        if (server.cached_master && !server.fActiveReplica) {
-            psync_replid = server.cached_master->replid;
-            snprintf(psync_offset,sizeof(psync_offset),"%lld", server.cached_master->reploff+1);
+        if (mi->cached_master && !server.fActiveReplica) {
+            psync_replid = mi->cached_master->replid;
+            snprintf(psync_offset,sizeof(psync_offset),"%lld", mi->cached_master->reploff+1);
             serverLog(LL_NOTICE,"Trying a partial resynchronization (request %s:%s).", psync_replid, psync_offset);
         } else {
             serverLog(LL_NOTICE,"Partial resynchronization not possible (no cached master)");
@@ -1595,7 +1933,7 @@ int slaveTryPartialResynchronization(aeEventLoop *el, int fd, int read_reply) {
         }
 
         /* Issue the PSYNC command */
-        reply = sendSynchronousCommand(SYNC_CMD_WRITE,fd,"PSYNC",psync_replid,psync_offset,NULL);
+        reply = sendSynchronousCommand(mi,SYNC_CMD_WRITE,fd,"PSYNC",psync_replid,psync_offset,NULL);
         if (reply != NULL) {
             serverLog(LL_WARNING,"Unable to send PSYNC to master: %s",reply);
             sdsfree(reply);
@@ -1606,7 +1944,7 @@ int slaveTryPartialResynchronization(aeEventLoop *el, int fd, int read_reply) {
     }
 
     /* Reading half */
-    reply = sendSynchronousCommand(SYNC_CMD_READ,fd,NULL);
+    reply = sendSynchronousCommand(mi,SYNC_CMD_READ,fd,NULL);
     if (sdslen(reply) == 0) {
         /* The master may send empty newlines after it receives PSYNC
          * and before to reply, just to keep the connection alive. */
@@ -1634,17 +1972,17 @@ int slaveTryPartialResynchronization(aeEventLoop *el, int fd, int read_reply) {
              * reply means that the master supports PSYNC, but the reply
              * format seems wrong. To stay safe we blank the master
              * replid to make sure next PSYNCs will fail. */
-            memset(server.master_replid,0,CONFIG_RUN_ID_SIZE+1);
+            memset(mi->master_replid,0,CONFIG_RUN_ID_SIZE+1);
         } else {
-            memcpy(server.master_replid, replid, offset-replid-1);
-            server.master_replid[CONFIG_RUN_ID_SIZE] = '\0';
-            server.master_initial_offset = strtoll(offset,NULL,10);
+            memcpy(mi->master_replid, replid, offset-replid-1);
+            mi->master_replid[CONFIG_RUN_ID_SIZE] = '\0';
+            mi->master_initial_offset = strtoll(offset,NULL,10);
             serverLog(LL_NOTICE,"Full resync from master: %s:%lld",
-                server.master_replid,
-                server.master_initial_offset);
+                mi->master_replid,
+                mi->master_initial_offset);
         }
         /* We are going to full resync, discard the cached master structure. */
-        replicationDiscardCachedMaster();
+        replicationDiscardCachedMaster(mi);
         sdsfree(reply);
         return PSYNC_FULLRESYNC;
     }
@@ -1667,19 +2005,19 @@ int slaveTryPartialResynchronization(aeEventLoop *el, int fd, int read_reply) {
             memcpy(sznew,start,CONFIG_RUN_ID_SIZE);
             sznew[CONFIG_RUN_ID_SIZE] = '\0';
 
-            if (strcmp(sznew,server.cached_master->replid)) {
+            if (strcmp(sznew,mi->cached_master->replid)) {
                 /* Master ID changed. */
                 serverLog(LL_WARNING,"Master replication ID changed to %s",sznew);
 
                 /* Set the old ID as our ID2, up to the current offset+1. */
-                memcpy(server.replid2,server.cached_master->replid,
+                memcpy(server.replid2,mi->cached_master->replid,
                     sizeof(server.replid2));
                 server.second_replid_offset = server.master_repl_offset+1;
 
                 /* Update the cached master ID and our own primary ID to the
                  * new one. */
                 memcpy(server.replid,sznew,sizeof(server.replid));
-                memcpy(server.cached_master->replid,sznew,sizeof(server.replid));
+                memcpy(mi->cached_master->replid,sznew,sizeof(server.replid));
 
                 /* Disconnect all the sub-slaves: they need to be notified. */
                 disconnectSlaves();
@@ -1688,7 +2026,7 @@ int slaveTryPartialResynchronization(aeEventLoop *el, int fd, int read_reply) {
 
         /* Setup the replication to continue. */
         sdsfree(reply);
-        replicationResurrectCachedMaster(fd);
+        replicationResurrectCachedMaster(mi,fd);
 
         /* If this instance was restarted and we read the metadata to
          * PSYNC from the persistence file, our replication backlog could
@@ -1724,7 +2062,7 @@ int slaveTryPartialResynchronization(aeEventLoop *el, int fd, int read_reply) {
             "error state (reply: %s)", reply);
     }
     sdsfree(reply);
-    replicationDiscardCachedMaster();
+    replicationDiscardCachedMaster(mi);
     return PSYNC_NOT_SUPPORTED;
 }
 
@@ -1736,13 +2074,13 @@ void syncWithMaster(aeEventLoop *el, int fd, void *privdata, int mask) {
     int dfd = -1, maxtries = 5;
     int sockerr = 0, psync_result = PSYNC_FULLRESYNC;
     socklen_t errlen = sizeof(sockerr);
+    redisMaster *mi = (redisMaster*)privdata;
     UNUSED(el);
-    UNUSED(privdata);
     UNUSED(mask);
 
     /* If this event fired after the user turned the instance into a master
      * with SLAVEOF NO ONE we must just return ASAP. */
-    if (server.repl_state == REPL_STATE_NONE) {
+    if (mi->repl_state == REPL_STATE_NONE) {
         close(fd);
         return;
     }
@@ -1758,22 +2096,22 @@ void syncWithMaster(aeEventLoop *el, int fd, void *privdata, int mask) {
     }
 
     /* Send a PING to check the master is able to reply without errors. */
-    if (server.repl_state == REPL_STATE_CONNECTING) {
+    if (mi->repl_state == REPL_STATE_CONNECTING) {
         serverLog(LL_NOTICE,"Non blocking connect for SYNC fired the event.");
         /* Delete the writable event so that the readable event remains
          * registered and we can wait for the PONG reply. */
         aeDeleteFileEvent(el,fd,AE_WRITABLE);
-        server.repl_state = REPL_STATE_RECEIVE_PONG;
+        mi->repl_state = REPL_STATE_RECEIVE_PONG;
         /* Send the PING, don't check for errors at all, we have the timeout
          * that will take care about this. */
-        err = sendSynchronousCommand(SYNC_CMD_WRITE,fd,"PING",NULL);
+        err = sendSynchronousCommand(mi,SYNC_CMD_WRITE,fd,"PING",NULL);
         if (err) goto write_error;
         return;
     }
 
     /* Receive the PONG command. */
-    if (server.repl_state == REPL_STATE_RECEIVE_PONG) {
-        err = sendSynchronousCommand(SYNC_CMD_READ,fd,NULL);
+    if (mi->repl_state == REPL_STATE_RECEIVE_PONG) {
+        err = sendSynchronousCommand(mi,SYNC_CMD_READ,fd,NULL);
 
         /* We accept only two replies as valid, a positive +PONG reply
          * (we just check for "+") or an authentication error.
@@ -1792,87 +2130,94 @@ void syncWithMaster(aeEventLoop *el, int fd, void *privdata, int mask) {
                 "Master replied to PING, replication can continue...");
         }
         sdsfree(err);
-        server.repl_state = REPL_STATE_SEND_AUTH;
+        mi->repl_state = REPL_STATE_SEND_AUTH;
     }
 
     /* AUTH with the master if required. */
-    if (server.repl_state == REPL_STATE_SEND_AUTH) {
+    if (mi->repl_state == REPL_STATE_SEND_AUTH) {
         if (server.masteruser && server.masterauth) {
-            err = sendSynchronousCommand(SYNC_CMD_WRITE,fd,"AUTH",
+            err = sendSynchronousCommand(mi,SYNC_CMD_WRITE,fd,"AUTH",
                                          server.masteruser,server.masterauth,NULL);
             if (err) goto write_error;
-            server.repl_state = REPL_STATE_RECEIVE_AUTH;
+            mi->repl_state = REPL_STATE_RECEIVE_AUTH;
             return;
         } else if (server.masterauth) {
-            err = sendSynchronousCommand(SYNC_CMD_WRITE,fd,"AUTH",server.masterauth,NULL);
+            err = sendSynchronousCommand(mi,SYNC_CMD_WRITE,fd,"AUTH",server.masterauth,NULL);
             if (err) goto write_error;
-            server.repl_state = REPL_STATE_RECEIVE_AUTH;
+            mi->repl_state = REPL_STATE_RECEIVE_AUTH;
             return;
         } else {
-            server.repl_state = REPL_STATE_SEND_UUID;
+            mi->repl_state = REPL_STATE_SEND_UUID;
         }
     }
 
     /* Receive AUTH reply. */
-    if (server.repl_state == REPL_STATE_RECEIVE_AUTH) {
-        err = sendSynchronousCommand(SYNC_CMD_READ,fd,NULL);
+    if (mi->repl_state == REPL_STATE_RECEIVE_AUTH) {
+        err = sendSynchronousCommand(mi,SYNC_CMD_READ,fd,NULL);
         if (err[0] == '-') {
             serverLog(LL_WARNING,"Unable to AUTH to MASTER: %s",err);
             sdsfree(err);
             goto error;
         }
         sdsfree(err);
-        server.repl_state = REPL_STATE_SEND_UUID;
+        mi->repl_state = REPL_STATE_SEND_UUID;
     }
 
     /* Send UUID */
-    if (server.repl_state == REPL_STATE_SEND_UUID) {
+    if (mi->repl_state == REPL_STATE_SEND_UUID) {
         char szUUID[37] = {0};
-        memset(server.master_uuid, 0, UUID_BINARY_LEN);
+        memset(mi->master_uuid, 0, UUID_BINARY_LEN);
         uuid_unparse((unsigned char*)server.uuid, szUUID);
-        err = sendSynchronousCommand(SYNC_CMD_WRITE,fd,"REPLCONF","uuid",szUUID,NULL);
+        err = sendSynchronousCommand(mi,SYNC_CMD_WRITE,fd,"REPLCONF","uuid",szUUID,NULL);
         if (err) goto write_error;
-        server.repl_state = REPL_STATE_RECEIVE_UUID;
+        mi->repl_state = REPL_STATE_RECEIVE_UUID;
         return;
     }
 
     /* Receive UUID */
-    if (server.repl_state == REPL_STATE_RECEIVE_UUID) {
-        err = sendSynchronousCommand(SYNC_CMD_READ,fd,NULL);
+    if (mi->repl_state == REPL_STATE_RECEIVE_UUID) {
+        err = sendSynchronousCommand(mi,SYNC_CMD_READ,fd,NULL);
         if (err[0] == '-') {
             serverLog(LL_WARNING, "non-fatal: Master doesn't understand REPLCONF uuid");
         }
         else {
             if (strlen(err) != 37   // 36-byte UUID string and the leading '+'
-                || uuid_parse(err+1, server.master_uuid) != 0)   
+                || uuid_parse(err+1, mi->master_uuid) != 0)   
             {
                 serverLog(LL_WARNING, "Master replied with a UUID we don't understand");
                 sdsfree(err);
                 goto error;
             }
+            if (FUuidEqual(mi->master_uuid, server.uuid))
+            {
+                serverLog(LL_WARNING, "Master %s:%d is this instance, not replicating from myself",
+                    mi->masterhost, mi->masterport);
+                sdsfree(err);
+                goto error;
+            }
         }
         sdsfree(err);
-        server.repl_state = REPL_STATE_SEND_PORT;
+        mi->repl_state = REPL_STATE_SEND_PORT;
         // fallthrough
     }
 
     /* Set the slave port, so that Master's INFO command can list the
      * slave listening port correctly. */
-    if (server.repl_state == REPL_STATE_SEND_PORT) {
+    if (mi->repl_state == REPL_STATE_SEND_PORT) {
         sds port = sdsfromlonglong(server.slave_announce_port ?
             server.slave_announce_port : server.port);
-        err = sendSynchronousCommand(SYNC_CMD_WRITE,fd,"REPLCONF",
+        err = sendSynchronousCommand(mi,SYNC_CMD_WRITE,fd,"REPLCONF",
                 "listening-port",port, NULL);
         sdsfree(port);
         if (err) goto write_error;
         sdsfree(err);
-        server.repl_state = REPL_STATE_RECEIVE_PORT;
+        mi->repl_state = REPL_STATE_RECEIVE_PORT;
         return;
     }
 
     /* Receive REPLCONF listening-port reply. */
-    if (server.repl_state == REPL_STATE_RECEIVE_PORT) {
-        err = sendSynchronousCommand(SYNC_CMD_READ,fd,NULL);
+    if (mi->repl_state == REPL_STATE_RECEIVE_PORT) {
+        err = sendSynchronousCommand(mi,SYNC_CMD_READ,fd,NULL);
         /* Ignore the error if any, not all the Redis versions support
          * REPLCONF listening-port. */
         if (err[0] == '-') {
@@ -1880,30 +2225,30 @@ void syncWithMaster(aeEventLoop *el, int fd, void *privdata, int mask) {
                                 "REPLCONF listening-port: %s", err);
         }
         sdsfree(err);
-        server.repl_state = REPL_STATE_SEND_IP;
+        mi->repl_state = REPL_STATE_SEND_IP;
     }
 
     /* Skip REPLCONF ip-address if there is no slave-announce-ip option set. */
-    if (server.repl_state == REPL_STATE_SEND_IP &&
+    if (mi->repl_state == REPL_STATE_SEND_IP &&
         server.slave_announce_ip == NULL)
     {
-            server.repl_state = REPL_STATE_SEND_CAPA;
+            mi->repl_state = REPL_STATE_SEND_CAPA;
     }
 
     /* Set the slave ip, so that Master's INFO command can list the
      * slave IP address port correctly in case of port forwarding or NAT. */
-    if (server.repl_state == REPL_STATE_SEND_IP) {
-        err = sendSynchronousCommand(SYNC_CMD_WRITE,fd,"REPLCONF",
+    if (mi->repl_state == REPL_STATE_SEND_IP) {
+        err = sendSynchronousCommand(mi,SYNC_CMD_WRITE,fd,"REPLCONF",
                 "ip-address",server.slave_announce_ip, NULL);
         if (err) goto write_error;
         sdsfree(err);
-        server.repl_state = REPL_STATE_RECEIVE_IP;
+        mi->repl_state = REPL_STATE_RECEIVE_IP;
         return;
     }
 
     /* Receive REPLCONF ip-address reply. */
-    if (server.repl_state == REPL_STATE_RECEIVE_IP) {
-        err = sendSynchronousCommand(SYNC_CMD_READ,fd,NULL);
+    if (mi->repl_state == REPL_STATE_RECEIVE_IP) {
+        err = sendSynchronousCommand(mi,SYNC_CMD_READ,fd,NULL);
         /* Ignore the error if any, not all the Redis versions support
          * REPLCONF listening-port. */
         if (err[0] == '-') {
@@ -1911,7 +2256,7 @@ void syncWithMaster(aeEventLoop *el, int fd, void *privdata, int mask) {
                                 "REPLCONF ip-address: %s", err);
         }
         sdsfree(err);
-        server.repl_state = REPL_STATE_SEND_CAPA;
+        mi->repl_state = REPL_STATE_SEND_CAPA;
     }
 
     /* Inform the master of our (slave) capabilities.
@@ -1920,18 +2265,18 @@ void syncWithMaster(aeEventLoop *el, int fd, void *privdata, int mask) {
      * PSYNC2: supports PSYNC v2, so understands +CONTINUE <new repl ID>.
      *
      * The master will ignore capabilities it does not understand. */
-    if (server.repl_state == REPL_STATE_SEND_CAPA) {
-        err = sendSynchronousCommand(SYNC_CMD_WRITE,fd,"REPLCONF",
+    if (mi->repl_state == REPL_STATE_SEND_CAPA) {
+        err = sendSynchronousCommand(mi,SYNC_CMD_WRITE,fd,"REPLCONF",
                 "capa","eof","capa","psync2",NULL);
         if (err) goto write_error;
         sdsfree(err);
-        server.repl_state = REPL_STATE_RECEIVE_CAPA;
+        mi->repl_state = REPL_STATE_RECEIVE_CAPA;
         return;
     }
 
     /* Receive CAPA reply. */
-    if (server.repl_state == REPL_STATE_RECEIVE_CAPA) {
-        err = sendSynchronousCommand(SYNC_CMD_READ,fd,NULL);
+    if (mi->repl_state == REPL_STATE_RECEIVE_CAPA) {
+        err = sendSynchronousCommand(mi,SYNC_CMD_READ,fd,NULL);
         /* Ignore the error if any, not all the Redis versions support
          * REPLCONF capa. */
         if (err[0] == '-') {
@@ -1939,7 +2284,7 @@ void syncWithMaster(aeEventLoop *el, int fd, void *privdata, int mask) {
                                   "REPLCONF capa: %s", err);
         }
         sdsfree(err);
-        server.repl_state = REPL_STATE_SEND_PSYNC;
+        mi->repl_state = REPL_STATE_SEND_PSYNC;
     }
 
     /* Try a partial resynchonization. If we don't have a cached master
@@ -1947,24 +2292,24 @@ void syncWithMaster(aeEventLoop *el, int fd, void *privdata, int mask) {
      * to start a full resynchronization so that we get the master run id
      * and the global offset, to try a partial resync at the next
      * reconnection attempt. */
-    if (server.repl_state == REPL_STATE_SEND_PSYNC) {
-        if (slaveTryPartialResynchronization(el,fd,0) == PSYNC_WRITE_ERROR) {
+    if (mi->repl_state == REPL_STATE_SEND_PSYNC) {
+        if (slaveTryPartialResynchronization(mi,el,fd,0) == PSYNC_WRITE_ERROR) {
             err = sdsnew("Write error sending the PSYNC command.");
             goto write_error;
         }
-        server.repl_state = REPL_STATE_RECEIVE_PSYNC;
+        mi->repl_state = REPL_STATE_RECEIVE_PSYNC;
         return;
     }
 
     /* If reached this point, we should be in REPL_STATE_RECEIVE_PSYNC. */
-    if (server.repl_state != REPL_STATE_RECEIVE_PSYNC) {
+    if (mi->repl_state != REPL_STATE_RECEIVE_PSYNC) {
         serverLog(LL_WARNING,"syncWithMaster(): state machine error, "
                              "state should be RECEIVE_PSYNC but is %d",
-                             server.repl_state);
+                             mi->repl_state);
         goto error;
     }
 
-    psync_result = slaveTryPartialResynchronization(el,fd,1);
+    psync_result = slaveTryPartialResynchronization(mi,el,fd,1);
     if (psync_result == PSYNC_WAIT_REPLY) return; /* Try again later... */
 
     /* If the master is in an transient error, we should try to PSYNC
@@ -1985,11 +2330,17 @@ void syncWithMaster(aeEventLoop *el, int fd, void *privdata, int mask) {
      * as well, if we have any sub-slaves. The master may transfer us an
      * entirely different data set and we have no way to incrementally feed
      * our slaves after that. */
-    disconnectSlavesExcept(server.master_uuid); /* Force our slaves to resync with us as well. */
-    freeReplicationBacklog(); /* Don't allow our chained slaves to PSYNC. */
+    if (server.fMultiMaster) {
+        /* The data of this master is merged in ours, and our other masters
+         * get it from the master itself. Only our sub-slaves need it. */
+        disconnectSubSlaves();
+    } else {
+        disconnectSlavesExcept(mi->master_uuid); /* Force our slaves to resync with us as well. */
+        freeReplicationBacklog(); /* Don't allow our chained slaves to PSYNC. */
+    }
 
     /* Fall back to SYNC if needed. Otherwise psync_result == PSYNC_FULLRESYNC
-     * and the server.master_replid and master_initial_offset are
+     * and the mi->master_replid and master_initial_offset are
      * already populated. */
     if (psync_result == PSYNC_NOT_SUPPORTED) {
         serverLog(LL_NOTICE,"Retrying with SYNC...");
@@ -2000,21 +2351,25 @@ void syncWithMaster(aeEventLoop *el, int fd, void *privdata, int mask) {
         }
     }
 
-    /* Prepare a suitable temp file for bulk transfer */
-    while(maxtries--) {
-        snprintf(tmpfile,256,
-            "temp-%d.%ld.rdb",(int)server.unixtime,(long int)getpid());
-        dfd = open(tmpfile,O_CREAT|O_WRONLY|O_EXCL,0644);
-        if (dfd != -1) break;
-        sleep(1);
-    }
-    if (dfd == -1) {
-        serverLog(LL_WARNING,"Opening the temp file needed for MASTER <-> REPLICA synchronization: %s",strerror(errno));
-        goto error;
+    /* Prepare a suitable temp file for bulk transfer, unless the payload is
+     * loaded from the socket: a transfer without temp file is loaded as it
+     * arrives by readSyncBulkPayload(). */
+    if (!useDisklessLoad()) {
+        while(maxtries--) {
+            snprintf(tmpfile,256,
+                "temp-%d.%ld.%d.rdb",(int)server.unixtime,(long int)getpid(),fd);
+            dfd = open(tmpfile,O_CREAT|O_WRONLY|O_EXCL,0644);
+            if (dfd != -1) break;
+            sleep(1);
+        }
+        if (dfd == -1) {
+            serverLog(LL_WARNING,"Opening the temp file needed for MASTER <-> REPLICA synchronization: %s",strerror(errno));
+            goto error;
+        }
     }
 
     /* Setup the non blocking download of the bulk file. */
-    if (aeCreateFileEvent(el,fd, AE_READABLE,readSyncBulkPayload,(void*)((ptrdiff_t)server.fActiveReplica))
+    if (aeCreateFileEvent(el,fd, AE_READABLE,readSyncBulkPayload,mi)
             == AE_ERR)
     {
         serverLog(LL_WARNING,
@@ -2023,21 +2378,21 @@ void syncWithMaster(aeEventLoop *el, int fd, void *privdata, int mask) {
         goto error;
     }
 
-    server.repl_state = REPL_STATE_TRANSFER;
-    server.repl_transfer_size = -1;
-    server.repl_transfer_read = 0;
-    server.repl_transfer_last_fsync_off = 0;
-    server.repl_transfer_fd = dfd;
-    server.repl_transfer_lastio = server.unixtime;
-    server.repl_transfer_tmpfile = zstrdup(tmpfile);
+    mi->repl_state = REPL_STATE_TRANSFER;
+    mi->repl_transfer_size = -1;
+    mi->repl_transfer_read = 0;
+    mi->repl_transfer_last_fsync_off = 0;
+    mi->repl_transfer_fd = dfd;
+    mi->repl_transfer_lastio = server.unixtime;
+    mi->repl_transfer_tmpfile = (dfd != -1) ? zstrdup(tmpfile) : NULL;
     return;
 
 error:
     aeDeleteFileEvent(el,fd,AE_READABLE|AE_WRITABLE);
     if (dfd != -1) close(dfd);
     close(fd);
-    server.repl_transfer_s = -1;
-    server.repl_state = REPL_STATE_CONNECT;
+    mi->repl_transfer_s = -1;
+    mi->repl_state = REPL_STATE_CONNECT;
     return;
 
 write_error: /* Handle sendSynchronousCommand(SYNC_CMD_WRITE) errors. */
@@ -2046,18 +2401,18 @@ write_error: /* Handle sendSynchronousCommand(SYNC_CMD_WRITE) errors. */
     goto error;
 }
 
-int connectWithMaster(void) {
+int connectWithMaster(redisMaster *mi) {
     int fd;
 
     fd = anetTcpNonBlockBestEffortBindConnect(NULL,
-        server.masterhost,server.masterport,NET_FIRST_BIND_ADDR);
+        mi->masterhost,mi->masterport,NET_FIRST_BIND_ADDR);
     if (fd == -1) {
         serverLog(LL_WARNING,"Unable to connect to MASTER: %s",
             strerror(errno));
         return C_ERR;
     }
 
-    if (aeCreateFileEvent(server.rgthreadvar[IDX_EVENT_LOOP_MAIN].el,fd,AE_READABLE|AE_WRITABLE,syncWithMaster,NULL) ==
+    if (aeCreateFileEvent(server.rgthreadvar[IDX_EVENT_LOOP_MAIN].el,fd,AE_READABLE|AE_WRITABLE,syncWithMaster,mi) ==
             AE_ERR)
     {
         close(fd);
@@ -2065,9 +2420,9 @@ int connectWithMaster(void) {
         return C_ERR;
     }
 
-    server.repl_transfer_lastio = server.unixtime;
-    server.repl_transfer_s = fd;
-    server.repl_state = REPL_STATE_CONNECTING;
+    mi->repl_transfer_lastio = server.unixtime;
+    mi->repl_transfer_s = fd;
+    mi->repl_state = REPL_STATE_CONNECTING;
     return C_OK;
 }
 
@@ -2075,23 +2430,25 @@ int connectWithMaster(void) {
  * in progress to undo it.
  * Never call this function directly, use cancelReplicationHandshake() instead.
  */
-void undoConnectWithMaster(void) {
-    int fd = server.repl_transfer_s;
+void undoConnectWithMaster(redisMaster *mi) {
+    int fd = mi->repl_transfer_s;
 
     aeDeleteFileEvent(server.rgthreadvar[IDX_EVENT_LOOP_MAIN].el,fd,AE_READABLE|AE_WRITABLE);
     close(fd);
-    server.repl_transfer_s = -1;
+    mi->repl_transfer_s = -1;
 }
 
 /* Abort the async download of the bulk dataset while SYNC-ing with master.
  * Never call this function directly, use cancelReplicationHandshake() instead.
  */
-void replicationAbortSyncTransfer(void) {
-    serverAssert(server.repl_state == REPL_STATE_TRANSFER);
-    undoConnectWithMaster();
-    close(server.repl_transfer_fd);
-    unlink(server.repl_transfer_tmpfile);
-    zfree(server.repl_transfer_tmpfile);
+void replicationAbortSyncTransfer(redisMaster *mi) {
+    serverAssert(mi->repl_state == REPL_STATE_TRANSFER);
+    undoConnectWithMaster(mi);
+    if (mi->repl_transfer_fd != -1) {
+        close(mi->repl_transfer_fd);
+        unlink(mi->repl_transfer_tmpfile);
+        zfree(mi->repl_transfer_tmpfile);
+    }
 }
 
 /* This function aborts a non blocking replication attempt if there is one
@@ -2099,73 +2456,131 @@ void replicationAbortSyncTransfer(void) {
  * the initial bulk transfer.
  *
  * If there was a replication handshake in progress 1 is returned and
- * the replication state (server.repl_state) set to REPL_STATE_CONNECT.
+ * the replication state (mi->repl_state) set to REPL_STATE_CONNECT.
  *
  * Otherwise zero is returned and no operation is perforemd at all. */
-int cancelReplicationHandshake(void) {
-    if (server.repl_state == REPL_STATE_TRANSFER) {
-        replicationAbortSyncTransfer();
-        server.repl_state = REPL_STATE_CONNECT;
-    } else if (server.repl_state == REPL_STATE_CONNECTING ||
-               slaveIsInHandshakeState())
+int cancelReplicationHandshake(redisMaster *mi) {
+    if (mi->repl_state == REPL_STATE_TRANSFER) {
+        replicationAbortSyncTransfer(mi);
+        mi->repl_state = REPL_STATE_CONNECT;
+    } else if (mi->repl_state == REPL_STATE_CONNECTING ||
+               slaveIsInHandshakeState(mi))
     {
-        undoConnectWithMaster();
-        server.repl_state = REPL_STATE_CONNECT;
+        undoConnectWithMaster(mi);
+        mi->repl_state = REPL_STATE_CONNECT;
     } else {
         return 0;
     }
     return 1;
 }
 
-/* Set replication to the specified master address and port. */
-void replicationSetMaster(char *ip, int port) {
-    int was_master = server.masterhost == NULL;
+/* Return the link with the master 'c' is the client of, or NULL. */
+redisMaster *MasterInfoFromClient(client *c) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(server.masters,&li);
+    while ((ln = listNext(&li))) {
+        redisMaster *mi = (redisMaster*)listNodeValue(ln);
+        if (mi->master == c || mi->cached_master == c) return mi;
+    }
+    return NULL;
+}
 
-    sdsfree(server.masterhost);
-    server.masterhost = sdsnew(ip);
-    server.masterport = port;
-    if (server.master) {
-        if (FCorrectThread(server.master))
-            freeClient(server.master);
+/* Return true if the links with all our masters are up. */
+int FAllMastersConnected(void) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(server.masters,&li);
+    while ((ln = listNext(&li))) {
+        redisMaster *mi = (redisMaster*)listNodeValue(ln);
+        if (mi->repl_state != REPL_STATE_CONNECTED) return 0;
+    }
+    return 1;
+}
+
+/* Allocate the link with a new master and add it to server.masters. */
+redisMaster *replicationCreateMasterInfo(char *ip, int port) {
+    redisMaster *mi = (redisMaster*)zcalloc(sizeof(redisMaster), MALLOC_LOCAL);
+    mi->masterhost = sdsnew(ip);
+    mi->masterport = port;
+    mi->repl_state = REPL_STATE_NONE;
+    mi->repl_transfer_s = -1;
+    mi->repl_transfer_fd = -1;
+    mi->master_initial_offset = -1;
+    listAddNodeTail(server.masters,mi);
+    return mi;
+}
+
+/* Replicate from the specified master address and port. Without
+ * multi-master this replaces our master if we already had one, otherwise
+ * the master is added to the ones we replicate from. Returns the link with
+ * the master. */
+redisMaster *replicationAddMaster(char *ip, int port) {
+    int was_master = listLength(server.masters) == 0;
+    redisMaster *mi;
+
+    if (!server.fMultiMaster && !was_master) {
+        mi = firstMaster();
+        sdsfree(mi->masterhost);
+        mi->masterhost = sdsnew(ip);
+        mi->masterport = port;
+    } else {
+        mi = replicationCreateMasterInfo(ip, port);
+    }
+    if (mi->master) {
+        if (FCorrectThread(mi->master))
+            freeClient(mi->master);
         else
-            freeClientAsync(server.master);
+            freeClientAsync(mi->master);
     }
-    disconnectAllBlockedClients(); /* Clients blocked in master, now slave. */
 
     /* Force our slaves to resync with us as well. They may hopefully be able
-     * to partially resync with us, but we can notify the replid change. */
-    disconnectSlaves();
-    cancelReplicationHandshake();
+     * to partially resync with us, but we can notify the replid change.
+     * Another master of a multi-master replica doesn't change our history. */
+    if (!server.fMultiMaster || was_master) {
+        disconnectAllBlockedClients(); /* Clients blocked in master, now slave. */
+        disconnectSlaves();
+    }
+    cancelReplicationHandshake(mi);
     /* Before destroying our master state, create a cached master using
      * our own parameters, to later PSYNC with the new master. */
-    if (was_master) replicationCacheMasterUsingMyself();
-    server.repl_state = REPL_STATE_CONNECT;
+    if (was_master) replicationCacheMasterUsingMyself(mi);
+    mi->repl_state = REPL_STATE_CONNECT;
+    return mi;
 }
 
-/* Cancel replication, setting the instance as a master itself. */
-void replicationUnsetMaster(void) {
-    if (server.masterhost == NULL) return; /* Nothing to do. */
-    sdsfree(server.masterhost);
-    server.masterhost = NULL;
+/* Stop replicating from the master of 'mi' and free the link. When it was
+ * our last master, the instance becomes a master itself. */
+void replicationUnsetMaster(redisMaster *mi) {
+    listNode *ln = listSearchKey(server.masters,mi);
+    serverAssert(ln != NULL);
+
+    sdsfree(mi->masterhost);
+    mi->masterhost = NULL;
+    if (mi->master) {
+        if (FCorrectThread(mi->master))
+            freeClient(mi->master);
+        else
+            freeClientAsync(mi->master);
+    }
+    replicationDiscardCachedMaster(mi);
+    cancelReplicationHandshake(mi);
+    listDelNode(server.masters,ln);
+    zfree(mi);
+    if (listLength(server.masters)) return;
+
     /* When a slave is turned into a master, the current replication ID
      * (that was inherited from the master at synchronization time) is
      * used as secondary ID up to the current offset, and a new replication
      * ID is created to continue with a new replication history. */
     shiftReplicationId();
-    if (server.master) {
-        if (FCorrectThread(server.master))
-            freeClient(server.master);
-        else
-            freeClientAsync(server.master);
-    }
-    replicationDiscardCachedMaster();
-    cancelReplicationHandshake();
     /* Disconnecting all the slaves is required: we need to inform slaves
      * of the replication ID change (see shiftReplicationId() call). However
      * the slaves will be able to partially resync with us, so it will be
      * a very fast reconnection. */
     disconnectSlaves();
-    server.repl_state = REPL_STATE_NONE;
 
     /* We need to make sure the new master will start the replication stream
      * with a SELECT statement. This is forced after a full resync, but
@@ -2180,12 +2595,19 @@ void replicationUnsetMaster(void) {
     server.repl_no_slaves_since = server.unixtime;
 }
 
+/* Cancel replication with all our masters, setting the instance as a
+ * master itself. */
+void replicationUnsetAllMasters(void) {
+    while (listLength(server.masters))
+        replicationUnsetMaster(firstMaster());
+}
+
 /* This function is called when the slave lose the connection with the
  * master into an unexpected way. */
-void replicationHandleMasterDisconnection(void) {
-    server.master = NULL;
-    server.repl_state = REPL_STATE_CONNECT;
-    server.repl_down_since = server.unixtime;
+void replicationHandleMasterDisconnection(redisMaster *mi) {
+    mi->master = NULL;
+    mi->repl_state = REPL_STATE_CONNECT;
+    mi->repl_down_since = server.unixtime;
     /* We lost connection with our master, don't disconnect slaves yet,
      * maybe we'll be able to PSYNC with our master later. We'll disconnect
      * the slaves only if we'll have to do a full resync with our master. */
@@ -2203,8 +2625,8 @@ void replicaofCommand(client *c) {
      * into a master. Otherwise the new master address is set. */
     if (!strcasecmp((const char*)ptrFromObj(c->argv[1]),"no") &&
         !strcasecmp((const char*)ptrFromObj(c->argv[2]),"one")) {
-        if (server.masterhost) {
-            replicationUnsetMaster();
+        if (listLength(server.masters)) {
+            replicationUnsetAllMasters();
             sds client = catClientInfoString(sdsempty(),c);
             serverLog(LL_NOTICE,"MASTER MODE enabled (user request from '%s')",
                 client);
@@ -2226,21 +2648,27 @@ void replicaofCommand(client *c) {
             return;
 
         /* Check if we are already attached to the specified slave */
-        if (server.masterhost && !strcasecmp(server.masterhost,(const char*)ptrFromObj(c->argv[1]))
-            && server.masterport == port) {
-            serverLog(LL_NOTICE,"REPLICAOF would result into synchronization "
-                                "with the master we are already connected "
-                                "with. No operation performed.");
-            addReplySds(c,sdsnew("+OK Already connected to specified "
-                                 "master\r\n"));
-            return;
+        listIter li;
+        listNode *ln;
+        listRewind(server.masters,&li);
+        while ((ln = listNext(&li))) {
+            redisMaster *mi = (redisMaster*)listNodeValue(ln);
+            if (!strcasecmp(mi->masterhost,(const char*)ptrFromObj(c->argv[1]))
+                && mi->masterport == port) {
+                serverLog(LL_NOTICE,"REPLICAOF would result into synchronization "
+                                    "with the master we are already connected "
+                                    "with. No operation performed.");
+                addReplySds(c,sdsnew("+OK Already connected to specified "
+                                     "master\r\n"));
+                return;
+            }
         }
         /* There was no previous master or the user specified a different one,
          * we can continue. */
-        replicationSetMaster((char*)ptrFromObj(c->argv[1]), port);
+        redisMaster *mi = replicationAddMaster((char*)ptrFromObj(c->argv[1]), port);
         sds client = catClientInfoString(sdsempty(),c);
         serverLog(LL_NOTICE,"REPLICAOF %s:%d enabled (user request from '%s')",
-            server.masterhost, server.masterport, client);
+            mi->masterhost, mi->masterport, client);
         sdsfree(client);
     }
     addReplyAsync(c,shared.ok);
@@ -2248,9 +2676,10 @@ void replicaofCommand(client *c) {
 
 /* ROLE command: provide information about the role of the instance
  * (master or slave) and additional information related to replication
- * in an easy to process format. */
+ * in an easy to process format. A replica of several masters replies with
+ * the slave role of each link. */
 void roleCommand(client *c) {
-    if (server.masterhost == NULL) {
+    if (listLength(server.masters) == 0) {
         listIter li;
         listNode *ln;
         void *mbcount;
@@ -2279,35 +2708,44 @@ void roleCommand(client *c) {
         }
         setDeferredArrayLen(c,mbcount,slaves);
     } else {
-        const char *slavestate = NULL;
-
-        addReplyArrayLen(c,5);
-        addReplyBulkCBuffer(c,"slave",5);
-        addReplyBulkCString(c,server.masterhost);
-        addReplyLongLong(c,server.masterport);
-        if (slaveIsInHandshakeState()) {
-            slavestate = "handshake";
-        } else {
-            switch(server.repl_state) {
-            case REPL_STATE_NONE: slavestate = "none"; break;
-            case REPL_STATE_CONNECT: slavestate = "connect"; break;
-            case REPL_STATE_CONNECTING: slavestate = "connecting"; break;
-            case REPL_STATE_TRANSFER: slavestate = "sync"; break;
-            case REPL_STATE_CONNECTED: slavestate = "connected"; break;
-            default: slavestate = "unknown"; break;
+        listIter li;
+        listNode *ln;
+
+        if (listLength(server.masters) > 1)
+            addReplyArrayLen(c,listLength(server.masters));
+        listRewind(server.masters,&li);
+        while ((ln = listNext(&li))) {
+            redisMaster *mi = (redisMaster*)listNodeValue(ln);
+            const char *slavestate = NULL;
+
+            addReplyArrayLen(c,5);
+            addReplyBulkCBuffer(c,"slave",5);
+            addReplyBulkCString(c,mi->masterhost);
+            addReplyLongLong(c,mi->masterport);
+            if (slaveIsInHandshakeState(mi)) {
+                slavestate = "handshake";
+            } else {
+                switch(mi->repl_state) {
+                case REPL_STATE_NONE: slavestate = "none"; break;
+                case REPL_STATE_CONNECT: slavestate = "connect"; break;
+                case REPL_STATE_CONNECTING: slavestate = "connecting"; break;
+                case REPL_STATE_TRANSFER: slavestate = "sync"; break;
+                case REPL_STATE_CONNECTED: slavestate = "connected"; break;
+                default: slavestate = "unknown"; break;
+                }
             }
+            addReplyBulkCString(c,slavestate);
+            addReplyLongLong(c,mi->master ? mi->master->reploff : -1);
         }
-        addReplyBulkCString(c,slavestate);
-        addReplyLongLong(c,server.master ? server.master->reploff : -1);
     }
 }
 
 /* Send a REPLCONF ACK command to the master to inform it about the current
  * processed offset. If we are not connected with a master, the command has
  * no effects. */
-void replicationSendAck(void) 
+void replicationSendAck(redisMaster *mi) 
 {
-    client *c = server.master;
+    client *c = mi->master;
 
     if (c != NULL) {
         c->flags |= CLIENT_MASTER_FORCE_REPLY;
@@ -2323,7 +2761,7 @@ void replicationSendAck(void)
 
 /* In order to implement partial synchronization we need to be able to cache
  * our master's client structure after a transient disconnection.
- * It is cached into server.cached_master and flushed away using the following
+ * It is cached into mi->cached_master and flushed away using the following
  * functions. */
 
 /* This function is called by freeClient() in order to cache the master
@@ -2339,8 +2777,8 @@ void replicationSendAck(void)
  * replicationResurrectCachedMaster() that is used after a successful PSYNC
  * handshake in order to reactivate the cached master.
  */
-void replicationCacheMaster(client *c) {
-    serverAssert(server.master != NULL && server.cached_master == NULL);
+void replicationCacheMaster(redisMaster *mi, client *c) {
+    serverAssert(mi->master != NULL && mi->cached_master == NULL);
     serverLog(LL_NOTICE,"Caching the disconnected master state.");
     AssertCorrectThread(c);
     std::lock_guard<decltype(c->lock)> clientlock(c->lock);
@@ -2352,9 +2790,9 @@ void replicationCacheMaster(client *c) {
      * we want to discard te non processed query buffers and non processed
      * offsets, including pending transactions, already populated arguments,
      * pending outputs to the master. */
-    sdsclear(server.master->querybuf);
-    sdsclear(server.master->pending_querybuf);
-    server.master->read_reploff = server.master->reploff;
+    sdsclear(mi->master->querybuf);
+    sdsclear(mi->master->pending_querybuf);
+    mi->master->read_reploff = mi->master->reploff;
     if (c->flags & CLIENT_MULTI) discardTransaction(c);
     listEmpty(c->reply);
     c->sentlen = 0;
@@ -2365,7 +2803,7 @@ void replicationCacheMaster(client *c) {
 
     /* Save the master. Server.master will be set to null later by
      * replicationHandleMasterDisconnection(). */
-    server.cached_master = server.master;
+    mi->cached_master = mi->master;
 
     /* Invalidate the Peer ID cache. */
     if (c->peerid) {
@@ -2375,8 +2813,8 @@ void replicationCacheMaster(client *c) {
 
     /* Caching the master happens instead of the actual freeClient() call,
      * so make sure to adjust the replication state. This function will
-     * also set server.master to NULL. */
-    replicationHandleMasterDisconnection();
+     * also set mi->master to NULL. */
+    replicationHandleMasterDisconnection(mi);
 }
 
 /* This function is called when a master is turend into a slave, in order to
@@ -2388,35 +2826,35 @@ void replicationCacheMaster(client *c) {
  * the new master will accept its replication ID, and potentiall also the
  * current offset if no data was lost during the failover. So we use our
  * current replication ID and offset in order to synthesize a cached master. */
-void replicationCacheMasterUsingMyself(void) {
+void replicationCacheMasterUsingMyself(redisMaster *mi) {
     /* The master client we create can be set to any DBID, because
      * the new master will start its replication stream with SELECT. */
-    server.master_initial_offset = server.master_repl_offset;
-    replicationCreateMasterClient(-1,-1);
-    std::lock_guard<decltype(server.master->lock)> lock(server.master->lock);
+    mi->master_initial_offset = server.master_repl_offset;
+    replicationCreateMasterClient(mi,-1,-1);
+    std::lock_guard<decltype(mi->master->lock)> lock(mi->master->lock);
 
     /* Use our own ID / offset. */
-    memcpy(server.master->replid, server.replid, sizeof(server.replid));
+    memcpy(mi->master->replid, server.replid, sizeof(server.replid));
 
     /* Set as cached master. */
-    unlinkClient(server.master);
-    server.cached_master = server.master;
-    server.master = NULL;
+    unlinkClient(mi->master);
+    mi->cached_master = mi->master;
+    mi->master = NULL;
     serverLog(LL_NOTICE,"Before turning into a replica, using my master parameters to synthesize a cached master: I may be able to synchronize with the new master with just a partial transfer.");
 }
 
 /* Free a cached master, called when there are no longer the conditions for
  * a partial resync on reconnection. */
-void replicationDiscardCachedMaster(void) {
-    if (server.cached_master == NULL) return;
+void replicationDiscardCachedMaster(redisMaster *mi) {
+    if (mi->cached_master == NULL) return;
 
     serverLog(LL_NOTICE,"Discarding previously cached master state.");
-    server.cached_master->flags &= ~CLIENT_MASTER;
-    if (FCorrectThread(server.cached_master))
-        freeClient(server.cached_master);
+    mi->cached_master->flags &= ~CLIENT_MASTER;
+    if (FCorrectThread(mi->cached_master))
+        freeClient(mi->cached_master);
     else
-        freeClientAsync(server.cached_master);
-    server.cached_master = NULL;
+        freeClientAsync(mi->cached_master);
+    mi->cached_master = NULL;
 }
 
 /* Turn the cached master into the current master, using the file descriptor
@@ -2425,35 +2863,35 @@ void replicationDiscardCachedMaster(void) {
  * This function is called when successfully setup a partial resynchronization
  * so the stream of data that we'll receive will start from were this
  * master left. */
-void replicationResurrectCachedMaster(int newfd) {
-    server.master = server.cached_master;
-    server.cached_master = NULL;
-    server.master->fd = newfd;
-    server.master->flags &= ~(CLIENT_CLOSE_AFTER_REPLY|CLIENT_CLOSE_ASAP);
-    server.master->authenticated = 1;
-    server.master->lastinteraction = server.unixtime;
-    server.repl_state = REPL_STATE_CONNECTED;
-    server.repl_down_since = 0;
+void replicationResurrectCachedMaster(redisMaster *mi, int newfd) {
+    mi->master = mi->cached_master;
+    mi->cached_master = NULL;
+    mi->master->fd = newfd;
+    mi->master->flags &= ~(CLIENT_CLOSE_AFTER_REPLY|CLIENT_CLOSE_ASAP);
+    mi->master->authenticated = 1;
+    mi->master->lastinteraction = server.unixtime;
+    mi->repl_state = REPL_STATE_CONNECTED;
+    mi->repl_down_since = 0;
 
     /* Normally changing the thread of a client is a BIG NONO,
         but this client was unlinked so its OK here */
-    server.master->iel = serverTL - server.rgthreadvar; // martial to this thread
+    mi->master->iel = serverTL - server.rgthreadvar; // martial to this thread
 
     /* Re-add to the list of clients. */
-    linkClient(server.master);
-    if (aeCreateFileEvent(server.rgthreadvar[server.master->iel].el, newfd, AE_READABLE|AE_READ_THREADSAFE,
-                          readQueryFromClient, server.master)) {
+    linkClient(mi->master);
+    if (aeCreateFileEvent(server.rgthreadvar[mi->master->iel].el, newfd, AE_READABLE|AE_READ_THREADSAFE|AE_BUFFERED,
+                          readQueryFromClient, mi->master)) {
         serverLog(LL_WARNING,"Error resurrecting the cached master, impossible to add the readable handler: %s", strerror(errno));
-        freeClientAsync(server.master); /* Close ASAP. */
+        freeClientAsync(mi->master); /* Close ASAP. */
     }
 
     /* We may also need to install the write handler as well if there is
      * pending data in the write buffers. */
-    if (clientHasPendingReplies(server.master)) {
-        if (aeCreateFileEvent(server.rgthreadvar[server.master->iel].el, newfd, AE_WRITABLE|AE_WRITE_THREADSAFE,
-                          sendReplyToClient, server.master)) {
+    if (clientHasPendingReplies(mi->master)) {
+        if (aeCreateFileEvent(server.rgthreadvar[mi->master->iel].el, newfd, AE_WRITABLE|AE_WRITE_THREADSAFE,
+                          sendReplyToClient, mi->master)) {
             serverLog(LL_WARNING,"Error resurrecting the cached master, impossible to add the writable handler: %s", strerror(errno));
-            freeClientAsync(server.master); /* Close ASAP. */
+            freeClientAsync(mi->master); /* Close ASAP. */
         }
     }
 }
@@ -2624,7 +3062,7 @@ void waitCommand(client *c) {
     long numreplicas, ackreplicas;
     long long offset = c->woff;
 
-    if (server.masterhost) {
+    if (listLength(server.masters)) {
         addReplyError(c,"WAIT cannot be used with replica instances. Please also note that since Redis 4.0 if a replica is configured to be writable (which is not the default) writes to replicas are just local and are not propagated.");
         return;
     }
@@ -2707,11 +3145,12 @@ void processClientsWaitingReplicas(void) {
 long long replicationGetSlaveOffset(void) {
     long long offset = 0;
 
-    if (server.masterhost != NULL) {
-        if (server.master) {
-            offset = server.master->reploff;
-        } else if (server.cached_master) {
-            offset = server.cached_master->reploff;
+    redisMaster *mi = firstMaster();
+    if (mi != NULL) {
+        if (mi->master) {
+            offset = mi->master->reploff;
+        } else if (mi->cached_master) {
+            offset = mi->cached_master->reploff;
         }
     }
     /* offset may be -1 when the master does not support it at all, however
@@ -2722,60 +3161,355 @@ long long replicationGetSlaveOffset(void) {
     return offset;
 }
 
+/* ----------------------- ACTIVE REPLICA TIMESTAMPS ------------------------
+ * With active-replica-timestamps db->mvcc records the time of the last
+ * write to each key, taken from a hybrid logical clock: the wall clock in
+ * milliseconds in the high bits and a counter in the low bits, never going
+ * backwards and always ahead of any timestamp received from another master.
+ * Along with it goes the server where the write originated, as an index in
+ * a table of the UUIDs seen so far, see mvccPack().
+ *
+ * Every command writing to keys is propagated to the replicas as:
+ *
+ *   RREPLAY <origin uuid> <timestamp> <command> <arg> ... <arg>
+ *
+ * The replica executes the command only if none of its keys was written
+ * more recently, so two active replicas accepting writes for the same key
+ * settle on the last writer instead of on the arrival order. Two writes with
+ * the same timestamp are ordered by the UUID of their origin, so that every
+ * server of a mesh takes the same decision whatever the path the writes
+ * took. The stamps are saved in the RDB as well, so a full sync merges the
+ * datasets the same way, see dbMerge().
+ * -------------------------------------------------------------------------- */
+
+/* UUIDs of the servers that originated the writes we know about. The
+ * index 0 stands for this server. */
+static unsigned char mvcc_origins[MVCC_MAX_ORIGINS][UUID_BINARY_LEN];
+static int mvcc_origins_count = 1;
+
+/* Return the timestamp of a new event, bigger than any seen so far. */
+uint64_t mvccNextTstamp(void) {
+    uint64_t tstamp = ((uint64_t)mstime()) << MVCC_MS_SHIFT;
+    if (tstamp > server.mvcc_tstamp)
+        server.mvcc_tstamp = tstamp;
+    else
+        server.mvcc_tstamp++;
+    return server.mvcc_tstamp;
+}
+
+/* Move the clock past a timestamp generated elsewhere. */
+void mvccObserveTstamp(uint64_t tstamp) {
+    if (tstamp > server.mvcc_tstamp) server.mvcc_tstamp = tstamp;
+}
+
+/* Return the index of the server with the given UUID in the origins table,
+ * adding it if needed. */
+int mvccOriginIndex(const unsigned char *uuid) {
+    if (memcmp(uuid,server.uuid,UUID_BINARY_LEN) == 0) return 0;
+    for (int j = 1; j < mvcc_origins_count; j++) {
+        if (memcmp(uuid,mvcc_origins[j],UUID_BINARY_LEN) == 0) return j;
+    }
+    if (mvcc_origins_count == MVCC_MAX_ORIGINS) {
+        /* Ties with the writes of the extra servers may then be resolved
+         * differently by the servers of the mesh. */
+        static int fWarned = 0;
+        if (!fWarned) {
+            serverLog(LL_WARNING,"More than %d servers originated writes: "
+                "the ties between timestamps may be resolved inconsistently",
+                MVCC_MAX_ORIGINS-1);
+            fWarned = 1;
+        }
+        return MVCC_MAX_ORIGINS-1;
+    }
+    memcpy(mvcc_origins[mvcc_origins_count],uuid,UUID_BINARY_LEN);
+    return mvcc_origins_count++;
+}
+
+const unsigned char *mvccOriginUuid(int origin) {
+    return origin ? mvcc_origins[origin] : server.uuid;
+}
+
+/* Return true if the write stamped 'stamp' happened after the one stamped
+ * 'stampOther'. Writes with the same timestamp are ordered by the UUID of
+ * their origin. */
+int mvccIsNewer(uint64_t stamp, uint64_t stampOther) {
+    if (MVCC_TSTAMP(stamp) != MVCC_TSTAMP(stampOther))
+        return MVCC_TSTAMP(stamp) > MVCC_TSTAMP(stampOther);
+    return memcmp(mvccOriginUuid(MVCC_ORIGIN(stamp)),
+                  mvccOriginUuid(MVCC_ORIGIN(stampOther)),UUID_BINARY_LEN) > 0;
+}
+
+/* RREPLAY <origin uuid> <timestamp> <command> [<arg> ...]
+ *
+ * Only accepted from our masters: anybody else could make its writes win
+ * every conflict. */
+void rreplayCommand(client *c) {
+    unsigned char uuid[UUID_BINARY_LEN];
+    long long tstamp;
+    struct redisCommand *cmd;
+    int argc = c->argc-3;
+
+    if (!(c->flags & CLIENT_MASTER)) {
+        addReplyError(c,"RREPLAY is only accepted from a master");
+        return;
+    }
+    if (sdslen((sds)ptrFromObj(c->argv[1])) != 36 ||
+        uuid_parse((sds)ptrFromObj(c->argv[1]),uuid) != 0)
+    {
+        addReplyError(c,"Invalid origin UUID");
+        return;
+    }
+    if (getLongLongFromObjectOrReply(c,c->argv[2],&tstamp,NULL) != C_OK)
+        return;
+    cmd = lookupCommand((sds)ptrFromObj(c->argv[3]));
+    if (cmd == NULL || cmd->proc == rreplayCommand ||
+        (cmd->arity > 0 && cmd->arity != argc) || argc < -cmd->arity)
+    {
+        addReplyError(c,"Invalid command to replay");
+        return;
+    }
+    mvccObserveTstamp(tstamp);
+    uint64_t stamp = mvccPack((uint64_t)tstamp,mvccOriginIndex(uuid));
+
+    /* Drop the command if any of its keys was written after it. */
+    int numkeys, *keys = getKeysFromCommand(cmd,c->argv+3,argc,&numkeys);
+    bool fStale = false;
+    for (int j = 0; j < numkeys && !fStale; j++) {
+        robj *key = c->argv[keys[j]+3];
+        if (dictFind(c->db->pdict,ptrFromObj(key)) == NULL) continue;
+        fStale = !mvccIsNewer(stamp,getMvccStamp(c->db,key));
+    }
+    getKeysFreeResult(keys);
+    if (fStale) {
+        server.stat_mvcc_rejected++;
+        addReply(c,shared.ok);
+        return;
+    }
+
+    /* Execute the command in place of RREPLAY. It is propagated by the
+     * nested call() with the same stamp, so RREPLAY itself is not. */
+    for (int j = 0; j < 3; j++) decrRefCount(c->argv[j]);
+    memmove(c->argv,c->argv+3,sizeof(robj*)*argc);
+    c->argc = argc;
+    c->cmd = cmd;
+
+    uint64_t stampPrev = server.mvcc_cmd_stamp;
+    server.mvcc_cmd_stamp = stamp;
+    call(c,CMD_CALL_FULL);
+    server.mvcc_cmd_stamp = stampPrev;
+    c->flags |= CLIENT_PREVENT_PROP;
+}
+
+/* ------------------------ THREADED REPLICA APPLY --------------------------
+ * With replica-apply-threads the commands of our master touching the keys of
+ * a single keyspace shard are applied by a pool of threads, holding the
+ * shard lock as the server threads do for the commands of their clients (see
+ * keyspaceShardLockForCommand()). Each thread applies the commands of its
+ * own set of shards in the order they were received, so the writes to a key
+ * are applied in the order the master sent them.
+ *
+ * Any other command of the master, a MULTI/EXEC block or a script included,
+ * is a barrier: processInputBuffer() waits for the threads to apply all the
+ * commands handed to them before executing it. The same happens before the
+ * applied replication offset of the master is updated, so it never covers a
+ * command that was not applied yet.
+ * -------------------------------------------------------------------------- */
+
+struct replApplyJob {
+    robj **argv;
+    int argc;
+    int dbid;
+};
+
+struct replApplyThread {
+    pthread_t thread;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<replApplyJob> jobs;
+    client *c;          /* Fake master client applying the commands */
+};
+
+static replApplyThread *g_rgapplythread = nullptr;
+static std::atomic<long> g_capplypending { 0 };
+static std::mutex g_mutexApplyDone;
+static std::condition_variable g_cvApplyDone;
+
+/* Apply a command of our master on the replica apply thread of client 'c'.
+ * The command runs under its shard lock, unless what it could touch changed
+ * since it was dispatched, in which case it takes the global lock. */
+static void replicationApplyJob(client *c, replApplyJob *job) {
+    pthread_rwlock_t *lock = nullptr;
+
+    selectDb(c,job->dbid);
+    c->argv = job->argv;
+    c->argc = job->argc;
+    if (aeTryAcquireSharedLock()) {
+        lock = keyspaceShardLockForReplicaCommand(c);
+        if (lock == nullptr) aeReleaseSharedLock();
+    }
+    if (lock != nullptr)
+        pthread_rwlock_wrlock(lock);
+    else
+        aeAcquireLock();
+
+    c->cmd = c->lastcmd = lookupCommand((sds)ptrFromObj(c->argv[0]));
+    call(c,CMD_CALL_FULL);
+
+    /* The arguments may be referenced by the keyspace now, release them
+     * while still holding the lock. */
+    for (int j = 0; j < c->argc; j++)
+        freeArgvStringObject(c->argv[j]);
+    c->argc = 0;
+    c->argv = NULL;
+    c->cmd = NULL;
+
+    if (lock != nullptr) {
+        pthread_rwlock_unlock(lock);
+        aeReleaseSharedLock();
+    } else {
+        aeReleaseLock();
+    }
+    zfree(job->argv);
+}
+
+static void *replicationApplyThreadMain(void *arg) {
+    replApplyThread *t = (replApplyThread*)arg;
+
+    for (;;) {
+        replApplyJob job;
+        {
+            std::unique_lock<std::mutex> ulock(t->mutex);
+            t->cv.wait(ulock, [t]{ return !t->jobs.empty(); });
+            job = t->jobs.front();
+            t->jobs.pop_front();
+        }
+        replicationApplyJob(t->c,&job);
+        atomicIncr(server.stat_repl_apply_threaded,1);
+
+        if (--g_capplypending == 0) {
+            std::lock_guard<std::mutex> lock(g_mutexApplyDone);
+            g_cvApplyDone.notify_all();
+        }
+    }
+    return NULL;
+}
+
+/* Start the replica apply threads. */
+void replicationApplyInit(void) {
+    g_rgapplythread = new replApplyThread[server.repl_apply_threads];
+    for (int j = 0; j < server.repl_apply_threads; j++) {
+        replApplyThread *t = g_rgapplythread+j;
+        t->c = createClient(-1, IDX_EVENT_LOOP_MAIN);
+        t->c->flags |= CLIENT_MASTER;
+        if (pthread_create(&t->thread,NULL,replicationApplyThreadMain,t) != 0) {
+            serverLog(LL_WARNING,"Can't create the replica apply threads.");
+            exit(1);
+        }
+    }
+}
+
+/* Called by processInputBuffer() for each command received from our master
+ * before it is processed. Returns 1 if the command was handed to a replica
+ * apply thread, that took ownership of the arguments, or 0 if the caller
+ * has to process it after calling replicationApplyDrain(). */
+int replicationApplyDispatch(client *c) {
+    pthread_rwlock_t *lock;
+
+    if (g_rgapplythread == nullptr || server.fActiveReplica) return 0;
+    if (aeThreadOwnsLock() || !aeTryAcquireSharedLock()) return 0;
+    lock = keyspaceShardLockForReplicaCommand(c);
+    aeReleaseSharedLock();
+    if (lock == nullptr) return 0;
+
+    long shard = lock - c->db->rgshardlock;
+    replApplyThread *t = g_rgapplythread + (shard % server.repl_apply_threads);
+    replApplyJob job;
+    job.argv = (robj**)zmalloc(sizeof(robj*)*c->argc, MALLOC_LOCAL);
+    memcpy(job.argv,c->argv,sizeof(robj*)*c->argc);
+    job.argc = c->argc;
+    job.dbid = c->db->id;
+    c->argc = 0;
+
+    ++g_capplypending;
+    {
+        std::lock_guard<std::mutex> ulock(t->mutex);
+        t->jobs.push_back(job);
+    }
+    t->cv.notify_one();
+    return 1;
+}
+
+/* Wait for the replica apply threads to apply all the commands they were
+ * handed. Must be called without holding the global lock. */
+void replicationApplyDrain(void) {
+    if (g_capplypending == 0) return;
+    serverAssert(!aeThreadOwnsLock());
+    std::unique_lock<std::mutex> ulock(g_mutexApplyDone);
+    g_cvApplyDone.wait(ulock, []{ return g_capplypending == 0; });
+}
+
 /* --------------------------- REPLICATION CRON  ---------------------------- */
 
 /* Replication cron function, called 1 time per second. */
 void replicationCron(void) {
     serverAssert(GlobalLocksAcquired());
     static long long replication_cron_loops = 0;
-    std::unique_lock<decltype(server.master->lock)> ulock;
-    if (server.master != nullptr)
-        ulock = decltype(ulock)(server.master->lock);
-
-    /* Non blocking connection timeout? */
-    if (server.masterhost &&
-        (server.repl_state == REPL_STATE_CONNECTING ||
-         slaveIsInHandshakeState()) &&
-         (time(NULL)-server.repl_transfer_lastio) > server.repl_timeout)
-    {
-        serverLog(LL_WARNING,"Timeout connecting to the MASTER...");
-        cancelReplicationHandshake();
-    }
 
-    /* Bulk transfer I/O timeout? */
-    if (server.masterhost && server.repl_state == REPL_STATE_TRANSFER &&
-        (time(NULL)-server.repl_transfer_lastio) > server.repl_timeout)
+    listIter liMaster;
+    listNode *lnMaster;
+    listRewind(server.masters, &liMaster);
+    while ((lnMaster = listNext(&liMaster)))
     {
-        serverLog(LL_WARNING,"Timeout receiving bulk data from MASTER... If the problem persists try to set the 'repl-timeout' parameter in redis.conf to a larger value.");
-        cancelReplicationHandshake();
-    }
+        redisMaster *mi = (redisMaster*)listNodeValue(lnMaster);
+        std::unique_lock<decltype(mi->master->lock)> ulock;
+        if (mi->master != nullptr)
+            ulock = decltype(ulock)(mi->master->lock);
+
+        /* Non blocking connection timeout? */
+        if (mi->masterhost &&
+            (mi->repl_state == REPL_STATE_CONNECTING ||
+            slaveIsInHandshakeState(mi)) &&
+            (time(NULL)-mi->repl_transfer_lastio) > server.repl_timeout)
+        {
+            serverLog(LL_WARNING,"Timeout connecting to the MASTER...");
+            cancelReplicationHandshake(mi);
+        }
 
-    /* Timed out master when we are an already connected slave? */
-    if (server.masterhost && server.repl_state == REPL_STATE_CONNECTED &&
-        (time(NULL)-server.master->lastinteraction) > server.repl_timeout)
-    {
-        serverLog(LL_WARNING,"MASTER timeout: no data nor PING received...");
-        if (FCorrectThread(server.master))
-            freeClient(server.master);
-        else
-            freeClientAsync(server.master);
-    }
+        /* Bulk transfer I/O timeout? */
+        if (mi->masterhost && mi->repl_state == REPL_STATE_TRANSFER &&
+            (time(NULL)-mi->repl_transfer_lastio) > server.repl_timeout)
+        {
+            serverLog(LL_WARNING,"Timeout receiving bulk data from MASTER... If the problem persists try to set the 'repl-timeout' parameter in redis.conf to a larger value.");
+            cancelReplicationHandshake(mi);
+        }
 
-    /* Check if we should connect to a MASTER */
-    if (server.repl_state == REPL_STATE_CONNECT) {
-        serverLog(LL_NOTICE,"Connecting to MASTER %s:%d",
-            server.masterhost, server.masterport);
-        if (connectWithMaster() == C_OK) {
-            serverLog(LL_NOTICE,"MASTER <-> REPLICA sync started");
+        /* Timed out master when we are an already connected slave? */
+        if (mi->masterhost && mi->repl_state == REPL_STATE_CONNECTED &&
+            (time(NULL)-mi->master->lastinteraction) > server.repl_timeout)
+        {
+            serverLog(LL_WARNING,"MASTER timeout: no data nor PING received...");
+            if (FCorrectThread(mi->master))
+                freeClient(mi->master);
+            else
+                freeClientAsync(mi->master);
         }
-    }
 
-    /* Send ACK to master from time to time.
-     * Note that we do not send periodic acks to masters that don't
-     * support PSYNC and replication offsets. */
-    if (server.masterhost && server.master &&
-        !(server.master->flags & CLIENT_PRE_PSYNC))
-        replicationSendAck();
+        /* Check if we should connect to a MASTER */
+        if (mi->repl_state == REPL_STATE_CONNECT) {
+            serverLog(LL_NOTICE,"Connecting to MASTER %s:%d",
+                mi->masterhost, mi->masterport);
+            if (connectWithMaster(mi) == C_OK) {
+                serverLog(LL_NOTICE,"MASTER <-> REPLICA sync started");
+            }
+        }
+
+        /* Send ACK to master from time to time.
+         * Note that we do not send periodic acks to masters that don't
+         * support PSYNC and replication offsets. */
+        if (mi->masterhost && mi->master &&
+            !(mi->master->flags & CLIENT_PRE_PSYNC))
+            replicationSendAck(mi);
+    }
 
     /* If we have attached slaves, PING them from time to time.
      * So slaves can implement an explicit timeout to masters, and will
@@ -2855,7 +3589,7 @@ void replicationCron(void) {
      * backlog, in order to reply to PSYNC queries if they are turned into
      * masters after a failover. */
     if (listLength(server.slaves) == 0 && server.repl_backlog_time_limit &&
-        server.repl_backlog && server.masterhost == NULL)
+        server.repl_backlog && listLength(server.masters) == 0)
     {
         time_t idle = server.unixtime - server.repl_no_slaves_since;
 
@@ -2900,8 +3634,11 @@ void replicationCron(void) {
      *
      * In case of diskless replication, we make sure to wait the specified
      * number of seconds (according to configuration) so that other slaves
-     * have the time to arrive before we start streaming. */
-    if (server.rdb_child_pid == -1 && server.aof_child_pid == -1) {
+     * have the time to arrive before we start streaming. The forkless
+     * BGSAVE thread owns the RDB file until snapshotCron() renamed it. */
+    if (server.rdb_child_pid == -1 && server.aof_child_pid == -1 &&
+        !server.rdb_thread_active)
+    {
         time_t idle, max_idle = 0;
         int slaves_waiting = 0;
         int mincapa = -1;
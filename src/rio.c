@@ -94,6 +94,7 @@ static const rio rioBufferIO = {
     0,              /* current checksum */
     0,              /* bytes read or written */
     0,              /* read/write chunk size */
+    0,              /* flags */
     { { NULL, 0 } } /* union for io-specific vars */
 };
 
@@ -123,7 +124,15 @@ static size_t rioFileWrite(rio *r, const void *buf, size_t len) {
 
 /* Returns 1 or 0 for success/failure. */
 static size_t rioFileRead(rio *r, void *buf, size_t len) {
-    return read(r->io.file.fd,buf,len);
+    /* The fd may be a pipe, where a read can return less than requested. */
+    size_t nread = 0;
+    while (nread < len) {
+        ssize_t retval = read(r->io.file.fd,(char*)buf+nread,len-nread);
+        if (retval == -1 && errno == EINTR) continue;
+        if (retval <= 0) return 0;
+        nread += retval;
+    }
+    return 1;
 }
 
 /* Returns read/write position in file. */
@@ -146,6 +155,7 @@ static const rio rioFileIO = {
     0,              /* current checksum */
     0,              /* bytes read or written */
     0,              /* read/write chunk size */
+    0,              /* flags */
     { { NULL, 0 } } /* union for io-specific vars */
 };
 
@@ -259,6 +269,7 @@ static const rio rioFdsetIO = {
     0,              /* current checksum */
     0,              /* bytes read or written */
     0,              /* read/write chunk size */
+    0,              /* flags */
     { { NULL, 0 } } /* union for io-specific vars */
 };
 
@@ -282,6 +293,109 @@ void rioFreeFdset(rio *r) {
     sdsfree(r->io.fdset.buf);
 }
 
+/* ------------------------ Socket read implementation ----------------------- */
+
+/* Returns 1 or 0 for success/failure.
+ * The socket is blocking, with SO_RCVTIMEO set: data is read in big chunks,
+ * but never past 'read_limit', so that what follows the RDB in the stream is
+ * left in the socket for its next reader. Without a limit the reader must
+ * know nothing follows before it asks for it: a master streaming the RDB
+ * sends the replication stream only after the replica acknowledges it. */
+static size_t rioSocketRead(rio *r, void *buf, size_t len) {
+    size_t avail = sdslen(r->io.fdread.buf)-r->io.fdread.bufpos;
+
+    if (avail < len) {
+        /* Move the unread data at the start of the buffer, then read at
+         * least what is missing. */
+        sdsrange(r->io.fdread.buf,r->io.fdread.bufpos,-1);
+        r->io.fdread.bufpos = 0;
+        size_t toread = len-avail;
+        if (toread < PROTO_IOBUF_LEN) toread = PROTO_IOBUF_LEN;
+        if (r->io.fdread.read_limit &&
+            r->io.fdread.read_so_far+toread > r->io.fdread.read_limit)
+        {
+            toread = r->io.fdread.read_limit-r->io.fdread.read_so_far;
+            if (toread < len-avail) {
+                /* The caller wants more than the master sent: a truncated
+                 * payload, not an I/O error. */
+                return 0;
+            }
+        }
+        r->io.fdread.buf = sdsMakeRoomFor(r->io.fdread.buf,toread);
+
+        while (avail < len) {
+            ssize_t retval = read(r->io.fdread.fd,
+                r->io.fdread.buf+sdslen(r->io.fdread.buf),toread);
+            if (retval == -1 && errno == EINTR) continue;
+            if (retval <= 0) {
+                /* See rioFdsetWrite() about EWOULDBLOCK. */
+                if (retval == -1 && errno == EWOULDBLOCK) errno = ETIMEDOUT;
+                if (retval == 0) errno = ECONNRESET;
+                r->flags |= RIO_FLAG_READ_ERROR;
+                return 0;
+            }
+            sdsIncrLen(r->io.fdread.buf,retval);
+            r->io.fdread.read_so_far += retval;
+            avail += retval;
+            toread -= retval;
+        }
+    }
+
+    memcpy(buf,r->io.fdread.buf+r->io.fdread.bufpos,len);
+    r->io.fdread.bufpos += len;
+    r->io.fdread.pos += len;
+    return 1;
+}
+
+/* Returns 1 or 0 for success/failure. */
+static size_t rioSocketWrite(rio *r, const void *buf, size_t len) {
+    UNUSED(r);
+    UNUSED(buf);
+    UNUSED(len);
+    return 0; /* Error, this target does not support writing. */
+}
+
+/* Returns read/write position in the stream. */
+static off_t rioSocketTell(rio *r) {
+    return r->io.fdread.pos;
+}
+
+/* Flushes any buffer to target device if applicable. Returns 1 on success
+ * and 0 on failures. */
+static int rioSocketFlush(rio *r) {
+    UNUSED(r);
+    return 1; /* Nothing to do, this target is only read. */
+}
+
+static const rio rioSocketIO = {
+    rioSocketRead,
+    rioSocketWrite,
+    rioSocketTell,
+    rioSocketFlush,
+    NULL,           /* update_checksum */
+    0,              /* current checksum */
+    0,              /* bytes read or written */
+    0,              /* read/write chunk size */
+    0,              /* flags */
+    { { NULL, 0 } } /* union for io-specific vars */
+};
+
+/* Read from the blocking socket 'fd', at most 'read_limit' bytes if not 0. */
+void rioInitWithSocket(rio *r, int fd, size_t read_limit) {
+    *r = rioSocketIO;
+    r->io.fdread.fd = fd;
+    r->io.fdread.pos = 0;
+    r->io.fdread.buf = sdsempty();
+    r->io.fdread.bufpos = 0;
+    r->io.fdread.read_limit = read_limit;
+    r->io.fdread.read_so_far = 0;
+}
+
+/* release the rio stream. */
+void rioFreeSocket(rio *r) {
+    sdsfree(r->io.fdread.buf);
+}
+
 /* ---------------------------- Generic functions ---------------------------- */
 
 /* This function can be installed both in memory and file streams when checksum
@@ -60,6 +60,9 @@ struct _rio {
     /* maximum single read or write chunk size */
     size_t max_processing_chunk;
 
+    /* RIO_FLAG_* */
+    uint64_t flags;
+
     /* Backend-specific vars. */
     union {
         /* In-memory buffer target. */
@@ -81,11 +84,22 @@ struct _rio {
             off_t pos;
             sds buf;
         } fdset;
+        /* Socket read target (used to load the RDB streamed by a master). */
+        struct {
+            int fd;
+            off_t pos;          /* Bytes returned to the reader so far. */
+            sds buf;            /* Data read from the socket, not returned yet. */
+            size_t bufpos;      /* Position of the next byte to return in buf. */
+            size_t read_limit;  /* Never read more than this, 0 if unlimited. */
+            size_t read_so_far; /* Bytes read from the socket so far. */
+        } fdread;
     } io;
 };
 
 typedef struct _rio rio;
 
+#define RIO_FLAG_READ_ERROR (1<<0)  /* The target failed, it is not an EOF. */
+
 /* The following functions are our interface with the stream. They'll call the
  * actual implementation of read / write / tell, and will update the checksum
  * if needed. */
@@ -127,8 +141,10 @@ static inline int rioFlush(rio *r) {
 void rioInitWithFile(rio *r, int fd);
 void rioInitWithBuffer(rio *r, sds s);
 void rioInitWithFdset(rio *r, int *fds, int numfds);
+void rioInitWithSocket(rio *r, int fd, size_t read_limit);
 
 void rioFreeFdset(rio *r);
+void rioFreeSocket(rio *r);
 
 size_t rioWriteBulkCount(rio *r, char prefix, long count);
 size_t rioWriteBulkString(rio *r, const char *buf, size_t len);
@@ -191,7 +191,7 @@ char *redisProtocolToLuaType_MultiBulk(lua_State *lua, char *reply, int atype) {
     int j = 0;
 
     string2ll(reply+1,p-reply-1,&mbulklen);
-    if (server.lua_caller->resp == 2 || atype == '*') {
+    if (serverTL->lua_caller->resp == 2 || atype == '*') {
         p += 2;
         if (mbulklen == -1) {
             lua_pushboolean(lua,0);
@@ -203,7 +203,7 @@ char *redisProtocolToLuaType_MultiBulk(lua_State *lua, char *reply, int atype) {
             p = redisProtocolToLuaType(lua,p);
             lua_settable(lua,-3);
         }
-    } else if (server.lua_caller->resp == 3) {
+    } else if (serverTL->lua_caller->resp == 3) {
         /* Here we handle only Set and Map replies in RESP3 mode, since arrays
          * follow the above RESP2 code path. */
         p += 2;
@@ -364,6 +364,28 @@ void luaReplyToRedisReply(client *c, lua_State *lua) {
  * Lua redis.* functions implementations.
  * ------------------------------------------------------------------------- */
 
+/* Return true if the command 'cmd' about to be called by the Lua client 'c'
+ * can run under the keyspace shard lock the script holds: it must be
+ * shardable, and only touch keys the script declared, since these are the
+ * keys room was reserved for in the keyspace tables. */
+static int luaShardAllowsCommand(client *c, struct redisCommand *cmd) {
+    client *caller = serverTL->lua_caller;
+    int j, k, last;
+
+    if (!(cmd->flags & CMD_SHARDABLE)) return 0;
+    last = cmd->lastkey;
+    if (last < 0) last = c->argc+last;
+    for (j = cmd->firstkey; j <= last && j < c->argc; j += cmd->keystep) {
+        for (k = 0; k < serverTL->lua_shard_reserved; k++) {
+            if (equalStringObjects(c->argv[j],caller->argv[3+k])) break;
+        }
+        if (k == serverTL->lua_shard_reserved) return 0;
+    }
+    return 1;
+}
+
+void luaMaskCountHook(lua_State *lua, lua_Debug *ar);
+
 #define LUA_CMD_OBJCACHE_SIZE 32
 #define LUA_CMD_OBJCACHE_MAX_LEN 64
 int luaRedisGenericCommand(lua_State *lua, int raise_error) {
@@ -371,24 +393,24 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
     int acl_retval = 0;
     int call_flags = CMD_CALL_SLOWLOG | CMD_CALL_STATS;
     struct redisCommand *cmd;
-    client *c = server.lua_client;
+    client *c = serverTL->lua_client;
     sds reply;
     
     // Ensure our client is on the right thread
     serverAssert(!(c->flags & CLIENT_PENDING_WRITE));
     serverAssert(!(c->flags & CLIENT_UNBLOCKED));
-    serverAssert(GlobalLocksAcquired());
+    serverAssert(KeyspaceLocksAcquired());
     c->iel = serverTL - server.rgthreadvar;
 
-    /* Cached across calls. */
-    static robj **argv = NULL;
-    static int argv_size = 0;
-    static robj *cached_objects[LUA_CMD_OBJCACHE_SIZE];
-    static size_t cached_objects_len[LUA_CMD_OBJCACHE_SIZE];
-    static int inuse = 0;   /* Recursive calls detection. */
+    /* Cached across calls, by every thread running scripts. */
+    static __thread robj **argv = NULL;
+    static __thread int argv_size = 0;
+    static __thread robj *cached_objects[LUA_CMD_OBJCACHE_SIZE];
+    static __thread size_t cached_objects_len[LUA_CMD_OBJCACHE_SIZE];
+    static __thread int inuse = 0;   /* Recursive calls detection. */
 
     /* Reflect MULTI state */
-    if (server.lua_multi_emitted || (server.lua_caller->flags & CLIENT_MULTI)) {
+    if (serverTL->lua_multi_emitted || (serverTL->lua_caller->flags & CLIENT_MULTI)) {
         c->flags |= CLIENT_MULTI;
     } else {
         c->flags &= ~CLIENT_MULTI;
@@ -472,7 +494,7 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
     /* Setup our fake client for command execution */
     c->argv = argv;
     c->argc = argc;
-    c->puser = server.lua_caller->puser;
+    c->puser = serverTL->lua_caller->puser;
 
     /* Log the command if debugging is active. */
     if (ldb.active && ldb.step) {
@@ -523,18 +545,45 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
         goto cleanup;
     }
 
+    /* A script running under a keyspace shard lock may only call the commands
+     * that could run under it, on the keys it declared. If it did not write
+     * yet it runs again under the global lock instead, where it can call
+     * anything, otherwise the call fails as the script opted in for. Once
+     * stopped the script can't call anything, even catching the error. */
+    if (serverTL->lua_sharded && !serverTL->lua_shard_retry &&
+        !serverTL->lua_shard_timedout && !luaShardAllowsCommand(c,cmd))
+    {
+        if (serverTL->lua_write_dirty) {
+            luaPushError(lua,
+                "Lua script running under a keyspace shard lock attempted to "
+                "call a command that is not shardable, or to access a key it "
+                "did not declare");
+            goto cleanup;
+        }
+        serverTL->lua_shard_retry = 1;
+        lua_sethook(lua,luaMaskCountHook,LUA_MASKLINE,0);
+    }
+    if (serverTL->lua_sharded &&
+        (serverTL->lua_shard_retry || serverTL->lua_shard_timedout))
+    {
+        luaPushError(lua, serverTL->lua_shard_retry ?
+            "Script running again under the global lock" :
+            "Script running under a keyspace shard lock aborted after lua-time-limit");
+        goto cleanup;
+    }
+
     /* Write commands are forbidden against read-only slaves, or if a
      * command marked as non-deterministic was already called in the context
      * of this script. */
     if (cmd->flags & CMD_WRITE) {
         int deny_write_type = writeCommandsDeniedByDiskError();
-        if (server.lua_random_dirty && !server.lua_replicate_commands) {
+        if (serverTL->lua_random_dirty && !serverTL->lua_replicate_commands) {
             luaPushError(lua,
                 "Write commands not allowed after non deterministic commands. Call redis.replicate_commands() at the start of your script in order to switch to single commands replication mode.");
             goto cleanup;
-        } else if (server.masterhost && server.repl_slave_ro &&
+        } else if (listLength(server.masters) && server.repl_slave_ro &&
                    !server.loading &&
-                   !(server.lua_caller->flags & CLIENT_MASTER))
+                   !(serverTL->lua_caller->flags & CLIENT_MASTER))
         {
             luaPushError(lua, (char*)ptrFromObj(shared.roslaveerr));
             goto cleanup;
@@ -558,8 +607,8 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
      * in the middle. */
     if (server.maxmemory &&             /* Maxmemory is actually enabled. */
         !server.loading &&              /* Don't care about mem if loading. */
-        !server.masterhost &&           /* Slave must execute the script. */
-        server.lua_write_dirty == 0 &&  /* Script had no side effects so far. */
+        !listLength(server.masters) && /* Slave must execute the script. */
+        serverTL->lua_write_dirty == 0 &&  /* Script had no side effects so far. */
         (cmd->flags & CMD_DENYOOM))
     {
         if (getMaxmemoryState(NULL,NULL,NULL,NULL) != C_OK) {
@@ -568,18 +617,18 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
         }
     }
 
-    if (cmd->flags & CMD_RANDOM) server.lua_random_dirty = 1;
-    if (cmd->flags & CMD_WRITE) server.lua_write_dirty = 1;
+    if (cmd->flags & CMD_RANDOM) serverTL->lua_random_dirty = 1;
+    if (cmd->flags & CMD_WRITE) serverTL->lua_write_dirty = 1;
 
     /* If this is a Redis Cluster node, we need to make sure Lua is not
      * trying to access non-local keys, with the exception of commands
      * received from our master or when loading the AOF back in memory. */
     if (server.cluster_enabled && !server.loading &&
-        !(server.lua_caller->flags & CLIENT_MASTER))
+        !(serverTL->lua_caller->flags & CLIENT_MASTER))
     {
         /* Duplicate relevant flags in the lua client. */
         c->flags &= ~(CLIENT_READONLY|CLIENT_ASKING);
-        c->flags |= server.lua_caller->flags & (CLIENT_READONLY|CLIENT_ASKING);
+        c->flags |= serverTL->lua_caller->flags & (CLIENT_READONLY|CLIENT_ASKING);
         if (getNodeByQuery(c,c->cmd,c->argv,c->argc,NULL,NULL) !=
                            server.cluster->myself)
         {
@@ -593,22 +642,23 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
     /* If we are using single commands replication, we need to wrap what
      * we propagate into a MULTI/EXEC block, so that it will be atomic like
      * a Lua script in the context of AOF and slaves. */
-    if (server.lua_replicate_commands &&
-        !server.lua_multi_emitted &&
-        !(server.lua_caller->flags & CLIENT_MULTI) &&
-        server.lua_write_dirty &&
-        server.lua_repl != PROPAGATE_NONE)
+    if (serverTL->lua_replicate_commands &&
+        !serverTL->lua_sharded &&
+        !serverTL->lua_multi_emitted &&
+        !(serverTL->lua_caller->flags & CLIENT_MULTI) &&
+        serverTL->lua_write_dirty &&
+        serverTL->lua_repl != PROPAGATE_NONE)
     {
-        execCommandPropagateMulti(server.lua_caller);
-        server.lua_multi_emitted = 1;
+        execCommandPropagateMulti(serverTL->lua_caller);
+        serverTL->lua_multi_emitted = 1;
     }
 
     /* Run the command */
-    if (server.lua_replicate_commands) {
+    if (serverTL->lua_replicate_commands) {
         /* Set flags according to redis.set_repl() settings. */
-        if (server.lua_repl & PROPAGATE_AOF)
+        if (serverTL->lua_repl & PROPAGATE_AOF)
             call_flags |= CMD_CALL_PROPAGATE_AOF;
-        if (server.lua_repl & PROPAGATE_REPL)
+        if (serverTL->lua_repl & PROPAGATE_REPL)
             call_flags |= CMD_CALL_PROPAGATE_REPL;
     }
     call(c,call_flags);
@@ -629,7 +679,7 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
         while(listLength(c->reply)) {
             clientReplyBlock *o = (clientReplyBlock*)listNodeValue(listFirst(c->reply));
 
-            reply = sdscatlen(reply,o->buf(),o->used);
+            reply = sdscatlen(reply,replyBlockData(o),o->used);
             listDelNode(c->reply,listFirst(c->reply));
         }
     }
@@ -643,7 +693,7 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
     /* Sort the output array if needed, assuming it is a non-null multi bulk
      * reply as expected. */
     if ((cmd->flags & CMD_SORT_FOR_SCRIPT) &&
-        (server.lua_replicate_commands == 0) &&
+        (serverTL->lua_replicate_commands == 0) &&
         (reply[0] == '*' && reply[1] != '-')) {
             luaSortArray(lua);
     }
@@ -759,10 +809,10 @@ int luaRedisStatusReplyCommand(lua_State *lua) {
  * already started to write, returns false and stick to whole scripts
  * replication, which is our default. */
 int luaRedisReplicateCommandsCommand(lua_State *lua) {
-    if (server.lua_write_dirty) {
+    if (serverTL->lua_write_dirty) {
         lua_pushboolean(lua,0);
     } else {
-        server.lua_replicate_commands = 1;
+        serverTL->lua_replicate_commands = 1;
         /* When we switch to single commands replication, we can provide
          * different math.random() sequences at every call, which is what
          * the user normally expects. */
@@ -812,7 +862,7 @@ int luaRedisSetReplCommand(lua_State *lua) {
     int argc = lua_gettop(lua);
     int flags;
 
-    if (server.lua_replicate_commands == 0) {
+    if (serverTL->lua_replicate_commands == 0) {
         lua_pushstring(lua, "You can set the replication behavior only after turning on single commands replication with redis.replicate_commands().");
         return lua_error(lua);
     } else if (argc != 1) {
@@ -825,7 +875,7 @@ int luaRedisSetReplCommand(lua_State *lua) {
         lua_pushstring(lua, "Invalid replication flags. Use REPL_AOF, REPL_REPLICA, REPL_ALL or REPL_NONE.");
         return lua_error(lua);
     }
-    server.lua_repl = flags;
+    serverTL->lua_repl = flags;
     return 0;
 }
 
@@ -947,35 +997,17 @@ void scriptingEnableGlobalsProtection(lua_State *lua) {
     sdsfree(code);
 }
 
-/* Initialize the scripting environment.
- *
- * This function is called the first time at server startup with
- * the 'setup' argument set to 1.
- *
- * It can be called again multiple times during the lifetime of the Redis
- * process, with 'setup' set to 0, and following a scriptingRelease() call,
- * in order to reset the Lua scripting environment.
- *
- * However it is simpler to just call scriptingReset() that does just that. */
-void scriptingInit(int setup) {
+/* Create the Lua interpreter of the calling thread. Every server thread runs
+ * the scripts of its clients on its own interpreter, so that scripts running
+ * under keyspace shard locks execute concurrently. The interpreters share
+ * the dictionary of the scripts, and only define the function of a script
+ * the first time they run it, see evalGenericCommand(). */
+static lua_State *scriptingCreateLua(void) {
     lua_State *lua = lua_open();
 
-    if (setup) {
-        server.lua_client = NULL;
-        server.lua_caller = NULL;
-        server.lua_timedout = 0;
-        ldbInit();
-    }
-
     luaLoadLibraries(lua);
     luaRemoveUnsupportedFunctions(lua);
 
-    /* Initialize a dictionary we use to map SHAs to scripts.
-     * This is useful for replication, as we need to replicate EVALSHA
-     * as EVAL, so we need to remember the associated script. */
-    server.lua_scripts = dictCreate(&shaScriptObjectDictType,NULL);
-    server.lua_scripts_mem = 0;
-
     /* Register the redis commands table and fields */
     lua_newtable(lua);
 
@@ -1114,11 +1146,11 @@ void scriptingInit(int setup) {
 
     /* Create the (non connected) client that we use to execute Redis commands
      * inside the Lua interpreter.
-     * Note: there is no need to create it again when this function is called
-     * by scriptingReset(). */
-    if (server.lua_client == NULL) {
-        server.lua_client = createClient(-1, IDX_EVENT_LOOP_MAIN);
-        server.lua_client->flags |= CLIENT_LUA;
+     * Note: there is no need to create it again when the interpreter is
+     * created again after scriptingReset(). */
+    if (serverTL->lua_client == NULL) {
+        serverTL->lua_client = createClient(-1, serverTL - server.rgthreadvar);
+        serverTL->lua_client->flags |= CLIENT_LUA;
     }
 
     /* Lua beginners often don't use "local", this is likely to introduce
@@ -1126,15 +1158,68 @@ void scriptingInit(int setup) {
      * to global variables. */
     scriptingEnableGlobalsProtection(lua);
 
-    server.lua = lua;
+    return lua;
+}
+
+/* Return the Lua interpreter of the calling thread, creating it if needed. */
+lua_State *scriptingThreadLua(void) {
+    serverAssert(serverTL != NULL);
+    if (serverTL->lua == NULL) serverTL->lua = scriptingCreateLua();
+    return serverTL->lua;
+}
+
+/* Return the memory used by the Lua interpreters of all the threads. Must
+ * be called with the global lock held, so that no script is running. */
+size_t scriptingMemory(void) {
+    size_t mem = 0;
+
+    for (int iel = 0; iel < MAX_EVENT_LOOPS; iel++) {
+        lua_State *lua = server.rgthreadvar[iel].lua;
+        if (lua != NULL) mem += (size_t)lua_gc(lua,LUA_GCCOUNT,0)*1024;
+    }
+    return mem;
+}
+
+/* Initialize the scripting environment.
+ *
+ * This function is called the first time at server startup with
+ * the 'setup' argument set to 1.
+ *
+ * It can be called again multiple times during the lifetime of the Redis
+ * process, with 'setup' set to 0, and following a scriptingRelease() call,
+ * in order to reset the Lua scripting environment.
+ *
+ * However it is simpler to just call scriptingReset() that does just that. */
+void scriptingInit(int setup) {
+    if (setup) {
+        server.lua_caller = NULL;
+        server.lua_timedout = 0;
+        ldbInit();
+    }
+
+    /* Initialize a dictionary we use to map SHAs to scripts.
+     * This is useful for replication, as we need to replicate EVALSHA
+     * as EVAL, so we need to remember the associated script. */
+    server.lua_scripts = dictCreate(&shaScriptObjectDictType,NULL);
+    server.lua_scripts_mem = 0;
+
+    /* The interpreter of the calling thread is created right away, the other
+     * threads create theirs the first time they run a script. */
+    scriptingThreadLua();
 }
 
 /* Release resources related to Lua scripting.
- * This function is used in order to reset the scripting environment. */
+ * This function is used in order to reset the scripting environment. The
+ * interpreters of the other threads are released as well, the global lock
+ * guarantees they are not running a script. */
 void scriptingRelease(void) {
     dictRelease(server.lua_scripts);
     server.lua_scripts_mem = 0;
-    lua_close(server.lua);
+    for (int iel = 0; iel < MAX_EVENT_LOOPS; iel++) {
+        if (server.rgthreadvar[iel].lua == NULL) continue;
+        lua_close(server.rgthreadvar[iel].lua);
+        server.rgthreadvar[iel].lua = NULL;
+    }
 }
 
 void scriptingReset(void) {
@@ -1202,6 +1287,73 @@ int redis_math_randomseed (lua_State *L) {
  * EVAL and SCRIPT commands implementation
  * ------------------------------------------------------------------------- */
 
+/* Scripts running under keyspace shard locks access the dictionary of the
+ * scripts concurrently. Everything else accessing it holds the global lock
+ * exclusively, so it does not need to take this lock. */
+static std::mutex g_lockLuaScripts;
+
+/* Define the function 'funcname' with the specified body in the Lua
+ * interpreter 'lua'. Returns C_ERR on error, in which case the client 'c',
+ * if not NULL, is informed with an appropriate error describing the nature
+ * of the problem and the Lua interpreter error. */
+static int luaDefineFunction(client *c, lua_State *lua, const char *funcname, robj *body) {
+    sds funcdef = sdsempty();
+    funcdef = sdscat(funcdef,"function ");
+    funcdef = sdscatlen(funcdef,funcname,42);
+    funcdef = sdscatlen(funcdef,"() ",3);
+    funcdef = sdscatlen(funcdef,ptrFromObj(body),sdslen((sds)ptrFromObj(body)));
+    funcdef = sdscatlen(funcdef,"\nend",4);
+
+    if (luaL_loadbuffer(lua,funcdef,sdslen(funcdef),"@user_script")) {
+        if (c != NULL) {
+            addReplyErrorFormat(c,
+                "Error compiling script (new function): %s\n",
+                lua_tostring(lua,-1));
+        }
+        lua_pop(lua,1);
+        sdsfree(funcdef);
+        return C_ERR;
+    }
+    sdsfree(funcdef);
+
+    if (lua_pcall(lua,0,0,0)) {
+        if (c != NULL) {
+            addReplyErrorFormat(c,"Error running script (new function): %s\n",
+                lua_tostring(lua,-1));
+        }
+        lua_pop(lua,1);
+        return C_ERR;
+    }
+    return C_OK;
+}
+
+/* Return the body of the script with the specified lowercase SHA1, or NULL
+ * if it is not in the scripts dictionary. */
+static robj *luaScriptBody(const char *sha) {
+    std::unique_lock<std::mutex> ulock(g_lockLuaScripts);
+    return (robj*)dictFetchValue(server.lua_scripts,sha);
+}
+
+/* Return true if the script run by EVAL, or EVALSHA if 'evalsha' is true,
+ * opted in running under a keyspace shard lock, starting with the
+ * LUA_SHARD_OPTIN comment. Such a script accepts that a call it could not
+ * make there after writing fails, and to be aborted after writing when it
+ * reaches lua-time-limit (see luaMaskCountHook()). */
+int luaScriptOptsInShard(robj *script, int evalsha) {
+    size_t len = strlen(LUA_SHARD_OPTIN);
+    sds body;
+
+    if (!sdsEncodedObject(script)) return 0;
+    if (evalsha) {
+        if (sdslen((sds)ptrFromObj(script)) != 40) return 0;
+        script = luaScriptBody((const char*)ptrFromObj(script));
+        if (script == NULL) return 0;
+    }
+    body = (sds)ptrFromObj(script);
+    return sdslen(body) >= len && !memcmp(body,LUA_SHARD_OPTIN,len) &&
+           (sdslen(body) == len || isspace(body[len]));
+}
+
 /* Define a Lua function with the specified body.
  * The function name will be generated in the following form:
  *
@@ -1215,7 +1367,9 @@ int redis_math_randomseed (lua_State *L) {
  * to scriptingReset() function), otherwise NULL is returned.
  *
  * The function handles the fact of being called with a script that already
- * exists, and in such a case, it behaves like in the success case.
+ * exists, and in such a case, it behaves like in the success case. The
+ * function is then not defined in 'lua' if it was not already: the other
+ * interpreters define it from the scripts dictionary when they need it.
  *
  * If 'c' is not NULL, on error the client is informed with an appropriate
  * error describing the nature of the problem and the Lua interpreter error. */
@@ -1228,46 +1382,30 @@ sds luaCreateFunction(client *c, lua_State *lua, robj *body) {
     sha1hex(funcname+2,(char*)ptrFromObj(body),sdslen((sds)ptrFromObj(body)));
 
     sds sha = sdsnewlen(funcname+2,40);
-    if ((de = dictFind(server.lua_scripts,sha)) != NULL) {
-        sdsfree(sha);
-        return (sds)dictGetKey(de);
-    }
-
-    sds funcdef = sdsempty();
-    funcdef = sdscat(funcdef,"function ");
-    funcdef = sdscatlen(funcdef,funcname,42);
-    funcdef = sdscatlen(funcdef,"() ",3);
-    funcdef = sdscatlen(funcdef,ptrFromObj(body),sdslen((sds)ptrFromObj(body)));
-    funcdef = sdscatlen(funcdef,"\nend",4);
-
-    if (luaL_loadbuffer(lua,funcdef,sdslen(funcdef),"@user_script")) {
-        if (c != NULL) {
-            addReplyErrorFormat(c,
-                "Error compiling script (new function): %s\n",
-                lua_tostring(lua,-1));
+    {
+        std::unique_lock<std::mutex> ulock(g_lockLuaScripts);
+        if ((de = dictFind(server.lua_scripts,sha)) != NULL) {
+            sdsfree(sha);
+            return (sds)dictGetKey(de);
         }
-        lua_pop(lua,1);
-        sdsfree(sha);
-        sdsfree(funcdef);
-        return NULL;
     }
-    sdsfree(funcdef);
 
-    if (lua_pcall(lua,0,0,0)) {
-        if (c != NULL) {
-            addReplyErrorFormat(c,"Error running script (new function): %s\n",
-                lua_tostring(lua,-1));
-        }
-        lua_pop(lua,1);
+    if (luaDefineFunction(c,lua,funcname,body) == C_ERR) {
         sdsfree(sha);
         return NULL;
     }
 
     /* We also save a SHA1 -> Original script map in a dictionary
      * so that we can replicate / write in the AOF all the
-     * EVALSHA commands as EVAL using the original script. */
+     * EVALSHA commands as EVAL using the original script. Another thread
+     * may have added the same script in the meantime. */
+    std::unique_lock<std::mutex> ulock(g_lockLuaScripts);
+    if ((de = dictFind(server.lua_scripts,sha)) != NULL) {
+        sdsfree(sha);
+        return (sds)dictGetKey(de);
+    }
     int retval = dictAdd(server.lua_scripts,sha,body);
-    serverAssertWithInfo(c ? c : server.lua_client,NULL,retval == DICT_OK);
+    serverAssertWithInfo(c ? c : serverTL->lua_client,NULL,retval == DICT_OK);
     server.lua_scripts_mem += sdsZmallocSize(sha) + getStringObjectSdsUsedMemory(body);
     incrRefCount(body);
     return sha;
@@ -1275,10 +1413,34 @@ sds luaCreateFunction(client *c, lua_State *lua, robj *body) {
 
 /* This is the Lua script "count" hook that we use to detect scripts timeout. */
 void luaMaskCountHook(lua_State *lua, lua_Debug *ar) {
-    long long elapsed = mstime() - server.lua_time_start;
+    long long elapsed = mstime() - serverTL->lua_time_start;
     UNUSED(ar);
     UNUSED(lua);
 
+    /* A script running under a keyspace shard lock can't reenter the event
+     * loop, nor be killed with SCRIPT KILL or SHUTDOWN NOSAVE, which need the
+     * global lock, so it is stopped when it reaches lua-time-limit. If it did
+     * not write yet it runs again under the global lock, where it is handled
+     * like any other script, otherwise it is aborted and the writes it did so
+     * far are kept. From then on the error is raised on every line, in case
+     * the script catches it. */
+    if (serverTL->lua_sharded) {
+        if (!serverTL->lua_shard_retry && !serverTL->lua_shard_timedout) {
+            if (elapsed < server.lua_time_limit) return;
+            if (serverTL->lua_write_dirty) {
+                serverLog(LL_WARNING,"Lua slow script running under a keyspace shard lock aborted after %lld milliseconds, keeping the writes it did.",elapsed);
+                serverTL->lua_shard_timedout = 1;
+            } else {
+                serverTL->lua_shard_retry = 1;
+            }
+            lua_sethook(lua,luaMaskCountHook,LUA_MASKLINE,0);
+        }
+        lua_pushstring(lua, serverTL->lua_shard_retry ?
+            "Script running again under the global lock..." :
+            "Script running under a keyspace shard lock aborted after lua-time-limit...");
+        lua_error(lua);
+    }
+
     /* Set the timeout condition if not already set and the maximum
      * execution time was reached. */
     if (elapsed >= server.lua_time_limit && server.lua_timedout == 0) {
@@ -1300,7 +1462,7 @@ void luaMaskCountHook(lua_State *lua, lua_Debug *ar) {
 }
 
 void evalGenericCommand(client *c, int evalsha) {
-    lua_State *lua = server.lua;
+    lua_State *lua = scriptingThreadLua();
     char funcname[43];
     long long numkeys;
     long long initial_server_dirty = server.dirty;
@@ -1318,11 +1480,17 @@ void evalGenericCommand(client *c, int evalsha) {
      *
      * Thanks to this flag we'll raise an error every time a write command
      * is called after a random command was used. */
-    server.lua_random_dirty = 0;
-    server.lua_write_dirty = 0;
-    server.lua_replicate_commands = server.lua_always_replicate_commands;
-    server.lua_multi_emitted = 0;
-    server.lua_repl = PROPAGATE_AOF|PROPAGATE_REPL;
+    serverTL->lua_random_dirty = 0;
+    serverTL->lua_write_dirty = 0;
+    serverTL->lua_replicate_commands = server.lua_always_replicate_commands;
+    serverTL->lua_multi_emitted = 0;
+    serverTL->lua_repl = PROPAGATE_AOF|PROPAGATE_REPL;
+
+    /* keyspaceShardLockForCommand() let the script run under the shard lock
+     * of its keys instead of the exclusive global lock. */
+    serverTL->lua_sharded = aeThreadOwnsSharedLock();
+    serverTL->lua_shard_timedout = 0;
+    serverTL->lua_shard_retry = 0;
 
     /* Get the number of arguments that are keys */
     if (getLongLongFromObjectOrReply(c,c->argv[2],&numkeys,NULL) != C_OK)
@@ -1364,22 +1532,34 @@ void evalGenericCommand(client *c, int evalsha) {
     if (lua_isnil(lua,-1)) {
         lua_pop(lua,1); /* remove the nil from the stack */
         /* Function not defined... let's define it if we have the
-         * body of the function. If this is an EVALSHA call we can just
-         * return an error. */
-        if (evalsha) {
-            lua_pop(lua,1); /* remove the error handler from the stack. */
-            addReply(c, shared.noscripterr);
-            return;
-        }
-        if (luaCreateFunction(c,lua,c->argv[1]) == NULL) {
+         * body of the function. */
+        if (!evalsha && luaCreateFunction(c,lua,c->argv[1]) == NULL) {
             lua_pop(lua,1); /* remove the error handler from the stack. */
             /* The error is sent to the client by luaCreateFunction()
              * itself when it returns NULL. */
             return;
         }
-        /* Now the following is guaranteed to return non nil */
         lua_getglobal(lua, funcname);
-        serverAssert(!lua_isnil(lua,-1));
+        if (lua_isnil(lua,-1)) {
+            lua_pop(lua,1);
+            /* The script was created by another thread, or by SCRIPT LOAD,
+             * define it in our interpreter from the scripts dictionary. If
+             * this is an EVALSHA call of an unknown script we can just
+             * return an error. */
+            robj *body = luaScriptBody(funcname+2);
+            if (body == NULL) {
+                lua_pop(lua,1); /* remove the error handler from the stack. */
+                addReply(c, shared.noscripterr);
+                return;
+            }
+            if (luaDefineFunction(c,lua,funcname,body) == C_ERR) {
+                lua_pop(lua,1); /* remove the error handler from the stack. */
+                return;
+            }
+            /* Now the following is guaranteed to return non nil */
+            lua_getglobal(lua, funcname);
+            serverAssert(!lua_isnil(lua,-1));
+        }
     }
 
     /* Populate the argv and keys table accordingly to the arguments that
@@ -1388,7 +1568,7 @@ void evalGenericCommand(client *c, int evalsha) {
     luaSetGlobalArray(lua,"ARGV",c->argv+3+numkeys,c->argc-3-numkeys);
 
     /* Select the right DB in the context of the Lua client */
-    selectDb(server.lua_client,c->db->id);
+    selectDb(serverTL->lua_client,c->db->id);
 
     /* Set a hook in order to be able to stop the script execution if it
      * is running for too much time.
@@ -1397,14 +1577,17 @@ void evalGenericCommand(client *c, int evalsha) {
      *
      * If we are debugging, we set instead a "line" hook so that the
      * debugger is call-back at every line executed by the script. */
-    server.lua_caller = c;
-    server.lua_time_start = mstime();
-    server.lua_kill = 0;
+    serverTL->lua_caller = c;
+    serverTL->lua_time_start = mstime();
+    if (!serverTL->lua_sharded) {
+        server.lua_caller = c;
+        server.lua_kill = 0;
+    }
     if (server.lua_time_limit > 0 && ldb.active == 0) {
         lua_sethook(lua,luaMaskCountHook,LUA_MASKCOUNT,100000);
         delhook = 1;
     } else if (ldb.active) {
-        lua_sethook(server.lua,luaLdbLineHook,LUA_MASKLINE|LUA_MASKCOUNT,100000);
+        lua_sethook(lua,luaLdbLineHook,LUA_MASKLINE|LUA_MASKCOUNT,100000);
         delhook = 1;
     }
 
@@ -1420,10 +1603,16 @@ void evalGenericCommand(client *c, int evalsha) {
         /* Restore the client that was protected when the script timeout
          * was detected. */
         unprotectClient(c);
-        if (server.masterhost && server.master)
-            queueClientForReprocessing(server.master);
+        listIter li;
+        listNode *ln;
+        listRewind(server.masters,&li);
+        while ((ln = listNext(&li))) {
+            redisMaster *mi = (redisMaster*)listNodeValue(ln);
+            if (mi->master) queueClientForReprocessing(mi->master);
+        }
     }
-    server.lua_caller = NULL;
+    serverTL->lua_caller = NULL;
+    if (!serverTL->lua_sharded) server.lua_caller = NULL;
 
     /* Call the Lua garbage collector from time to time to avoid a
      * full cycle performed by Lua, which adds too latency.
@@ -1433,7 +1622,7 @@ void evalGenericCommand(client *c, int evalsha) {
      * for every command uses too much CPU. */
     #define LUA_GC_CYCLE_PERIOD 50
     {
-        static long gc_count = 0;
+        static __thread long gc_count = 0;
 
         gc_count++;
         if (gc_count == LUA_GC_CYCLE_PERIOD) {
@@ -1442,7 +1631,11 @@ void evalGenericCommand(client *c, int evalsha) {
         }
     }
 
-    if (err) {
+    if (serverTL->lua_shard_retry) {
+        /* Nothing was written: the caller runs the script again under the
+         * global lock, which replies. */
+        lua_pop(lua,2); /* Consume the Lua reply and remove error handler. */
+    } else if (err) {
         addReplyErrorFormat(c,"Error running script (call to %s): %s\n",
             funcname, lua_tostring(lua,-1));
         lua_pop(lua,2); /* Consume the Lua reply and remove error handler. */
@@ -1455,9 +1648,9 @@ void evalGenericCommand(client *c, int evalsha) {
 
     /* If we are using single commands replication, emit EXEC if there
      * was at least a write. */
-    if (server.lua_replicate_commands) {
+    if (serverTL->lua_replicate_commands) {
         preventCommandPropagation(c);
-        if (server.lua_multi_emitted) {
+        if (serverTL->lua_multi_emitted) {
             robj *propargv[1];
             propargv[0] = createStringObject("EXEC",4);
             alsoPropagate(server.execCommand,c->db->id,propargv,1,
@@ -1476,7 +1669,7 @@ void evalGenericCommand(client *c, int evalsha) {
      * For repliation, everytime a new slave attaches to the master, we need to
      * flush our cache of scripts that can be replicated as EVALSHA, while
      * for AOF we need to do so every time we rewrite the AOF file. */
-    if (evalsha && !server.lua_replicate_commands) {
+    if (evalsha && !serverTL->lua_replicate_commands && !serverTL->lua_sharded) {
         if (!replicationScriptCacheExists((sds)ptrFromObj(c->argv[1]))) {
             /* This script is not in our script cache, replicate it as
              * EVAL, then add it into the script cache, as from now on
@@ -1556,7 +1749,7 @@ NULL
                 addReply(c,shared.czero);
         }
     } else if (c->argc == 3 && !strcasecmp((const char*)ptrFromObj(c->argv[1]),"load")) {
-        sds sha = luaCreateFunction(c,server.lua,c->argv[2]);
+        sds sha = luaCreateFunction(c,scriptingThreadLua(),c->argv[2]);
         if (sha == NULL) return; /* The error was sent by luaCreateFunction(). */
         addReplyBulkCBuffer(c,sha,40);
         forceCommandPropagation(c,PROPAGATE_REPL|PROPAGATE_AOF);
@@ -1565,7 +1758,7 @@ NULL
             addReplySds(c,sdsnew("-NOTBUSY No scripts in execution right now.\r\n"));
         } else if (server.lua_caller->flags & CLIENT_MASTER) {
             addReplySds(c,sdsnew("-UNKILLABLE The busy script was sent by a master instance in the context of replication and cannot be killed.\r\n"));
-        } else if (server.lua_write_dirty) {
+        } else if (server.rgthreadvar[server.lua_caller->iel].lua_write_dirty) {
             addReplySds(c,sdsnew("-UNKILLABLE Sorry the script already executed write commands against the dataset. You can either wait the script termination or kill the server in a hard way using the SHUTDOWN NOSAVE command.\r\n"));
         } else {
             server.lua_kill = 1;
@@ -1699,6 +1892,8 @@ void ldbSendLogs(void) {
  * The caller should call ldbEndSession() only if ldbStartSession()
  * returned 1. */
 int ldbStartSession(client *c) {
+    /* The debugger talks to the socket directly, possibly from a child */
+    aeUnbufferFile(server.rgthreadvar[c->iel].el, c->fd);
     ldb.forked = (c->flags & CLIENT_LUA_DEBUG_SYNC) == 0;
     if (ldb.forked) {
         pid_t cp = fork();
@@ -2277,7 +2472,7 @@ void ldbEval(lua_State *lua, sds *argv, int argc) {
  * implementation, with ldb.step enabled, so as a side effect the Redis command
  * and its reply are logged. */
 void ldbRedis(lua_State *lua, sds *argv, int argc) {
-    int j, saved_rc = server.lua_replicate_commands;
+    int j, saved_rc = serverTL->lua_replicate_commands;
 
     lua_getglobal(lua,"redis");
     lua_pushstring(lua,"call");
@@ -2285,10 +2480,10 @@ void ldbRedis(lua_State *lua, sds *argv, int argc) {
     for (j = 1; j < argc; j++)
         lua_pushlstring(lua,argv[j],sdslen(argv[j]));
     ldb.step = 1;               /* Force redis.call() to log. */
-    server.lua_replicate_commands = 1;
+    serverTL->lua_replicate_commands = 1;
     lua_pcall(lua,argc-1,1,0);  /* Stack: redis, result */
     ldb.step = 0;               /* Disable logging. */
-    server.lua_replicate_commands = saved_rc;
+    serverTL->lua_replicate_commands = saved_rc;
     lua_pop(lua,2);             /* Discard the result and clean the stack. */
 }
 
@@ -2462,7 +2657,7 @@ void luaLdbLineHook(lua_State *lua, lua_Debug *ar) {
 
     /* Check if a timeout occurred. */
     if (ar->event == LUA_HOOKCOUNT && ldb.step == 0 && bp == 0) {
-        mstime_t elapsed = mstime() - server.lua_time_start;
+        mstime_t elapsed = mstime() - serverTL->lua_time_start;
         mstime_t timelimit = server.lua_time_limit ?
                              server.lua_time_limit : 5000;
         if (elapsed >= timelimit) {
@@ -2492,7 +2687,7 @@ void luaLdbLineHook(lua_State *lua, lua_Debug *ar) {
             lua_pushstring(lua, "timeout during Lua debugging with client closing connection");
             lua_error(lua);
         }
-        server.lua_time_start = mstime();
+        serverTL->lua_time_start = mstime();
     }
 }
 
@@ -58,6 +58,9 @@
 #include <locale.h>
 #include <sys/socket.h>
 #include <algorithm>
+#include <mutex>
+#include <dlfcn.h>
+#include <cxxabi.h>
 #include <uuid/uuid.h>
 
 /* Our shared "common" objects */
@@ -76,6 +79,7 @@ double R_Zero, R_PosInf, R_NegInf, R_Nan;
 struct redisServer server; /* Server global state */
 __thread struct redisServerThreadVars *serverTL = NULL;   // thread local server vars
 volatile unsigned long lru_clock; /* Server global current LRU time. */
+static fastlock g_lockShardSlowlog;  /* Slowlog/latency updates under shard locks */
 
 /* Our command table.
  *
@@ -161,6 +165,14 @@ volatile unsigned long lru_clock; /* Server global current LRU time. */
  *              us time. Note that commands that may trigger a DEL as a side
  *              effect (like SET) are not fast commands.
  *
+ * shardable:   The command only touches keys that hash to a single keyspace
+ *              shard, never adds more than one key, and has no side effects
+ *              outside of those keys and the calling client. When
+ *              keyspace-lock-shards is enabled such commands may run under
+ *              a shard lock instead of the exclusive global lock. Shardable
+ *              read-only commands only take the shard lock for reading, so
+ *              they run concurrently even when they touch the same shard.
+ *
  * The following additional flags are only used in order to put commands
  * in a specific ACL category. Commands can have multiple ACL categories.
  *
@@ -188,33 +200,33 @@ struct redisCommand redisCommandTable[] = {
      0,NULL,0,0,0,0,0,0},
 
     {"get",getCommand,2,
-     "read-only fast @string",
+     "read-only fast shardable @string",
      0,NULL,1,1,1,0,0,0},
 
     /* Note that we can't flag set as fast, since it may perform an
      * implicit DEL of a large key. */
     {"set",setCommand,-3,
-     "write use-memory @string",
+     "write use-memory shardable @string",
      0,NULL,1,1,1,0,0,0},
 
     {"setnx",setnxCommand,3,
-     "write use-memory fast @string",
+     "write use-memory fast shardable @string",
      0,NULL,1,1,1,0,0,0},
 
     {"setex",setexCommand,4,
-     "write use-memory @string",
+     "write use-memory shardable @string",
      0,NULL,1,1,1,0,0,0},
 
     {"psetex",psetexCommand,4,
-     "write use-memory @string",
+     "write use-memory shardable @string",
      0,NULL,1,1,1,0,0,0},
 
     {"append",appendCommand,3,
-     "write use-memory fast @string",
+     "write use-memory fast shardable @string",
      0,NULL,1,1,1,0,0,0},
 
     {"strlen",strlenCommand,2,
-     "read-only fast @string",
+     "read-only fast shardable @string",
      0,NULL,1,1,1,0,0,0},
 
     {"del",delCommand,-2,
@@ -226,7 +238,7 @@ struct redisCommand redisCommandTable[] = {
      0,NULL,1,-1,1,0,0,0},
 
     {"exists",existsCommand,-2,
-     "read-only fast @keyspace",
+     "read-only fast shardable @keyspace",
      0,NULL,1,-1,1,0,0,0},
 
     {"setbit",setbitCommand,4,
@@ -254,15 +266,15 @@ struct redisCommand redisCommandTable[] = {
      0,NULL,1,1,1,0,0,0},
 
     {"incr",incrCommand,2,
-     "write use-memory fast @string",
+     "write use-memory fast shardable @string",
      0,NULL,1,1,1,0,0,0},
 
     {"decr",decrCommand,2,
-     "write use-memory fast @string",
+     "write use-memory fast shardable @string",
      0,NULL,1,1,1,0,0,0},
 
     {"mget",mgetCommand,-2,
-     "read-only fast @string",
+     "read-only fast shardable @string",
      0,NULL,1,-1,1,0,0,0},
 
     {"rpush",rpushCommand,-3,
@@ -554,19 +566,19 @@ struct redisCommand redisCommandTable[] = {
      0,NULL,1,1,1,0,0,0},
 
     {"incrby",incrbyCommand,3,
-     "write use-memory fast @string",
+     "write use-memory fast shardable @string",
      0,NULL,1,1,1,0,0,0},
 
     {"decrby",decrbyCommand,3,
-     "write use-memory fast @string",
+     "write use-memory fast shardable @string",
      0,NULL,1,1,1,0,0,0},
 
     {"incrbyfloat",incrbyfloatCommand,3,
-     "write use-memory fast @string",
+     "write use-memory fast shardable @string",
      0,NULL,1,1,1,0,0,0},
 
     {"getset",getsetCommand,3,
-     "write use-memory fast @string",
+     "write use-memory fast shardable @string",
      0,NULL,1,1,1,0,0,0},
 
     {"mset",msetCommand,-3,
@@ -667,7 +679,7 @@ struct redisCommand redisCommandTable[] = {
      0,NULL,0,0,0,0,0,0},
 
     {"type",typeCommand,2,
-     "read-only fast @keyspace",
+     "read-only fast shardable @keyspace",
      0,NULL,1,1,1,0,0,0},
 
     {"multi",multiCommand,1,
@@ -694,6 +706,10 @@ struct redisCommand redisCommandTable[] = {
      "admin no-script ok-loading ok-stale",
      0,NULL,0,0,0,0,0,0},
 
+    {"rreplay",rreplayCommand,-4,
+     "admin write no-script",
+     0,NULL,0,0,0,0,0,0},
+
     {"flushdb",flushdbCommand,-1,
      "write @keyspace @dangerous",
      0,NULL,0,0,0,0,0,0},
@@ -715,7 +731,7 @@ struct redisCommand redisCommandTable[] = {
      0,NULL,0,0,0,0,0,0},
 
     {"ttl",ttlCommand,2,
-     "read-only fast random @keyspace",
+     "read-only fast random shardable @keyspace",
      0,NULL,1,1,1,0,0,0},
 
     {"touch",touchCommand,-2,
@@ -723,7 +739,7 @@ struct redisCommand redisCommandTable[] = {
      0,NULL,1,-1,1,0,0,0},
 
     {"pttl",pttlCommand,2,
-     "read-only fast random @keyspace",
+     "read-only fast random shardable @keyspace",
      0,NULL,1,1,1,0,0,0},
 
     {"persist",persistCommand,2,
@@ -1046,7 +1062,7 @@ void serverLogRaw(int level, const char *msg) {
         } else if (pid != server.pid) {
             role_char = 'C'; /* RDB / AOF writing child. */
         } else {
-            role_char = (server.masterhost ? 'S':'M'); /* Slave or Master. */
+            role_char = (listLength(server.masters) ? 'S':'M'); /* Slave or Master. */
         }
         fprintf(fp,"%d:%c %s %c %s\n",
             (int)getpid(),role_char, buf,c[level],msg);
@@ -1416,13 +1432,26 @@ int htNeedsResize(dict *dict) {
             (used*100/size < HASHTABLE_MIN_FILL));
 }
 
+/* When keyspace shard locks are enabled a keyspace table must never have
+ * fewer buckets than there are shards, so that two keys sharing a bucket
+ * always share a shard lock. Grow tables that are too small and never
+ * shrink them below that size. */
+static void tryResizeKeyspaceTable(dict *d) {
+    unsigned long minslots = server.keyspace_lock_shards;
+
+    if (dictIsRehashing(d)) return;
+    if (dictSlots(d) < minslots)
+        dictExpand(d,minslots);
+    else if (htNeedsResize(d) && dictSize(d) >= minslots)
+        dictResize(d);
+}
+
 /* If the percentage of used slots in the HT reaches HASHTABLE_MIN_FILL
  * we resize the hash table to save memory */
 void tryResizeHashTables(int dbid) {
-    if (htNeedsResize(server.db[dbid].pdict))
-        dictResize(server.db[dbid].pdict);
-    if (htNeedsResize(server.db[dbid].expires))
-        dictResize(server.db[dbid].expires);
+    tryResizeKeyspaceTable(server.db[dbid].pdict);
+    tryResizeKeyspaceTable(server.db[dbid].expires);
+    tryResizeKeyspaceTable(server.db[dbid].mvcc);
 }
 
 /* Our hash table implementation performs rehashing incrementally while
@@ -1443,6 +1472,11 @@ int incrementallyRehash(int dbid) {
         dictRehashMilliseconds(server.db[dbid].expires,1);
         return 1; /* already used our millisecond for this loop... */
     }
+    /* Timestamps */
+    if (dictIsRehashing(server.db[dbid].mvcc)) {
+        dictRehashMilliseconds(server.db[dbid].mvcc,1);
+        return 1; /* already used our millisecond for this loop... */
+    }
     return 0;
 }
 
@@ -1687,9 +1721,9 @@ void clientsCron(int iel) {
 void databasesCron(void) {
     /* Expire keys by random sampling. Not required for slaves
      * as master will synthesize DELs for us. */
-    if (server.active_expire_enabled && server.masterhost == NULL) {
+    if (server.active_expire_enabled && listLength(server.masters) == 0) {
         activeExpireCycle(ACTIVE_EXPIRE_CYCLE_SLOW);
-    } else if (server.masterhost != NULL) {
+    } else if (listLength(server.masters)) {
         expireSlaveKeys();
     }
 
@@ -1700,7 +1734,9 @@ void databasesCron(void) {
     /* Perform hash tables rehashing if needed, but only if there are no
      * other processes saving the DB on disk. Otherwise rehashing is bad
      * as will cause a lot of copy-on-write of memory pages. */
-    if (server.rdb_child_pid == -1 && server.aof_child_pid == -1) {
+    if (server.rdb_child_pid == -1 && server.aof_child_pid == -1 &&
+        !server.snapshot_capturing)
+    {
         /* We use global counters so if we stop the computation at a given
          * DB we'll be able to start from the successive in the next
          * cron loop iteration. */
@@ -1848,7 +1884,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
             /* LUA memory isn't part of zmalloc_used, but it is part of the process RSS,
              * so we must desuct it in order to be able to calculate correct
              * "allocator fragmentation" ratio */
-            size_t lua_memory = lua_gc(server.lua,LUA_GCCOUNT,0)*1024LL;
+            size_t lua_memory = scriptingMemory();
             server.cron_malloc_stats.allocator_resident = server.cron_malloc_stats.process_rss - lua_memory;
         }
         if (!server.cron_malloc_stats.allocator_active)
@@ -1905,6 +1941,9 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
         rewriteAppendOnlyFileBackground();
     }
 
+    /* Check if a forkless BGSAVE terminated. */
+    snapshotCron();
+
     /* Check if a background saving or AOF rewrite in progress terminated. */
     if (server.rdb_child_pid != -1 || server.aof_child_pid != -1 ||
         ldbPendingChildren())
@@ -1950,7 +1989,8 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
              * the given amount of seconds, and if the latest bgsave was
              * successful or if, in case of an error, at least
              * CONFIG_BGSAVE_RETRY_DELAY seconds already elapsed. */
-            if (server.dirty >= sp->changes &&
+            if (!server.rdb_thread_active &&
+                server.dirty >= sp->changes &&
                 server.unixtime-server.lastsave > sp->seconds &&
                 (server.unixtime-server.lastbgsave_try >
                  CONFIG_BGSAVE_RETRY_DELAY ||
@@ -1960,7 +2000,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
                     sp->changes, (int)sp->seconds);
                 rdbSaveInfo rsi, *rsiptr;
                 rsiptr = rdbPopulateSaveInfo(&rsi);
-                rdbSaveBackground(rsiptr);
+                rdbStartBgsave(rsiptr);
                 break;
             }
         }
@@ -2033,7 +2073,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     {
         rdbSaveInfo rsi, *rsiptr;
         rsiptr = rdbPopulateSaveInfo(&rsi);
-        if (rdbSaveBackground(rsiptr) == C_OK)
+        if (rdbStartBgsave(rsiptr) == C_OK)
             server.rdb_bgsave_scheduled = 0;
     }
 
@@ -2074,7 +2114,7 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
 
     /* Run a fast expire cycle (the called function will return
      * ASAP if a fast cycle is not needed). */
-    if (server.active_expire_enabled && server.masterhost == NULL)
+    if (server.active_expire_enabled && listLength(server.masters) == 0)
         activeExpireCycle(ACTIVE_EXPIRE_CYCLE_FAST);
 
     /* Send all the slaves an ACK request if at least one client blocked
@@ -2296,6 +2336,7 @@ void initServerConfig(void) {
     server.client_max_querybuf_len = PROTO_MAX_QUERYBUF_LEN;
     server.saveparams = NULL;
     server.loading = 0;
+    server.async_loading = 0;
     server.logfile = zstrdup(CONFIG_DEFAULT_LOGFILE);
     server.syslog_enabled = CONFIG_DEFAULT_SYSLOG_ENABLED;
     server.syslog_ident = zstrdup(CONFIG_DEFAULT_SYSLOG_IDENT);
@@ -2320,11 +2361,17 @@ void initServerConfig(void) {
     server.aof_flush_postponed_start = 0;
     server.aof_rewrite_incremental_fsync = CONFIG_DEFAULT_AOF_REWRITE_INCREMENTAL_FSYNC;
     server.rdb_save_incremental_fsync = CONFIG_DEFAULT_RDB_SAVE_INCREMENTAL_FSYNC;
+    server.rdb_load_threads = CONFIG_DEFAULT_RDB_LOAD_THREADS;
+    server.rdb_save_threads = CONFIG_DEFAULT_RDB_SAVE_THREADS;
+    server.forkless_bgsave = CONFIG_DEFAULT_FORKLESS_BGSAVE;
     server.aof_load_truncated = CONFIG_DEFAULT_AOF_LOAD_TRUNCATED;
     server.aof_use_rdb_preamble = CONFIG_DEFAULT_AOF_USE_RDB_PREAMBLE;
     server.pidfile = NULL;
     server.rdb_filename = NULL;
     server.rdb_s3bucketpath = NULL;
+    server.s3_endpoint = NULL;
+    server.s3_region = zstrdup(CONFIG_DEFAULT_S3_REGION);
+    server.s3_threads = CONFIG_DEFAULT_S3_THREADS;
     server.aof_filename = zstrdup(CONFIG_DEFAULT_AOF_FILENAME);
     server.acl_filename = zstrdup(CONFIG_DEFAULT_ACL_FILENAME);
     server.rdb_compression = CONFIG_DEFAULT_RDB_COMPRESSION;
@@ -2340,6 +2387,10 @@ void initServerConfig(void) {
     server.maxmemory = CONFIG_DEFAULT_MAXMEMORY;
     server.maxmemory_policy = CONFIG_DEFAULT_MAXMEMORY_POLICY;
     server.maxmemory_samples = CONFIG_DEFAULT_MAXMEMORY_SAMPLES;
+    server.maxmemory_eviction_thread = CONFIG_DEFAULT_MAXMEMORY_EVICTION_THREAD;
+    server.maxmemory_eviction_low_watermark = CONFIG_DEFAULT_MAXMEMORY_EVICTION_LOW_WATERMARK;
+    server.scratch_file_tiering = CONFIG_DEFAULT_SCRATCH_FILE_TIERING;
+    server.scratch_file_tiering_lfu_threshold = CONFIG_DEFAULT_SCRATCH_FILE_TIERING_LFU_THRESHOLD;
     server.lfu_log_factor = CONFIG_DEFAULT_LFU_LOG_FACTOR;
     server.lfu_decay_time = CONFIG_DEFAULT_LFU_DECAY_TIME;
     server.hash_max_ziplist_entries = OBJ_HASH_MAX_ZIPLIST_ENTRIES;
@@ -2373,6 +2424,9 @@ void initServerConfig(void) {
     server.always_show_logo = CONFIG_DEFAULT_ALWAYS_SHOW_LOGO;
     server.lua_time_limit = LUA_SCRIPT_TIME_LIMIT;
     server.fActiveReplica = CONFIG_DEFAULT_ACTIVE_REPLICA;
+    server.fActiveReplicaTimestamps = CONFIG_DEFAULT_ACTIVE_REPLICA_TIMESTAMPS;
+    server.mvcc_tstamp = 0;
+    server.mvcc_cmd_stamp = 0;
 
     unsigned int lruclock = getLRUClock();
     atomicSet(server.lruclock,lruclock);
@@ -2384,21 +2438,17 @@ void initServerConfig(void) {
 
     /* Replication related */
     server.masterauth = NULL;
-    server.masterhost = NULL;
-    server.masterport = 6379;
-    server.master = NULL;
-    server.cached_master = NULL;
-    server.master_initial_offset = -1;
-    server.repl_state = REPL_STATE_NONE;
+    server.masters = listCreate();
+    server.fMultiMaster = CONFIG_DEFAULT_MULTI_MASTER;
     server.repl_syncio_timeout = CONFIG_REPL_SYNCIO_TIMEOUT;
     server.repl_serve_stale_data = CONFIG_DEFAULT_SLAVE_SERVE_STALE_DATA;
     server.repl_slave_ro = CONFIG_DEFAULT_SLAVE_READ_ONLY;
     server.repl_slave_ignore_maxmemory = CONFIG_DEFAULT_SLAVE_IGNORE_MAXMEMORY;
     server.repl_slave_lazy_flush = CONFIG_DEFAULT_SLAVE_LAZY_FLUSH;
-    server.repl_down_since = 0; /* Never connected, repl is down since EVER. */
     server.repl_disable_tcp_nodelay = CONFIG_DEFAULT_REPL_DISABLE_TCP_NODELAY;
     server.repl_diskless_sync = CONFIG_DEFAULT_REPL_DISKLESS_SYNC;
     server.repl_diskless_sync_delay = CONFIG_DEFAULT_REPL_DISKLESS_SYNC_DELAY;
+    server.repl_diskless_load = CONFIG_DEFAULT_REPL_DISKLESS_LOAD;
     server.repl_ping_slave_period = CONFIG_DEFAULT_REPL_PING_SLAVE_PERIOD;
     server.repl_timeout = CONFIG_DEFAULT_REPL_TIMEOUT;
     server.repl_min_slaves_to_write = CONFIG_DEFAULT_MIN_SLAVES_TO_WRITE;
@@ -2412,7 +2462,8 @@ void initServerConfig(void) {
     server.repl_backlog = NULL;
     server.repl_backlog_size = CONFIG_DEFAULT_REPL_BACKLOG_SIZE;
     server.repl_backlog_histlen = 0;
-    server.repl_backlog_idx = 0;
+    server.repl_backlog_buflen = 0;
+    server.repl_backlog_spare = NULL;
     server.repl_backlog_off = 0;
     server.repl_backlog_time_limit = CONFIG_DEFAULT_REPL_BACKLOG_TIME_LIMIT;
     server.repl_no_slaves_since = time(NULL);
@@ -2466,10 +2517,15 @@ void initServerConfig(void) {
      * script to the slave / AOF. This is the new way starting from
      * Redis 5. However it is possible to revert it via redis.conf. */
     server.lua_always_replicate_commands = 1;
+    server.lua_shard_scripts = CONFIG_DEFAULT_LUA_SHARD_SCRIPTS;
+    server.lua_persist_scripts = CONFIG_DEFAULT_LUA_PERSIST_SCRIPTS;
 
     /* Multithreading */
     server.cthreads = CONFIG_DEFAULT_THREADS;
     server.fThreadAffinity = CONFIG_DEFAULT_THREAD_AFFINITY;
+    server.keyspace_lock_shards = CONFIG_DEFAULT_KEYSPACE_LOCK_SHARDS;
+    server.repl_apply_threads = CONFIG_DEFAULT_REPL_APPLY_THREADS;
+    server.fIoUring = CONFIG_DEFAULT_IO_URING;
 }
 
 extern char **environ;
@@ -2731,6 +2787,9 @@ void resetServerStats(void) {
     server.stat_expired_stale_perc = 0;
     server.stat_expired_time_cap_reached_count = 0;
     server.stat_evictedkeys = 0;
+    server.stat_evictedkeys_background = 0;
+    server.stat_tiering_demoted = 0;
+    server.stat_tiering_promoted = 0;
     server.stat_keyspace_misses = 0;
     server.stat_keyspace_hits = 0;
     server.stat_active_defrag_hits = 0;
@@ -2744,6 +2803,10 @@ void resetServerStats(void) {
     server.stat_sync_full = 0;
     server.stat_sync_partial_ok = 0;
     server.stat_sync_partial_err = 0;
+    server.stat_mvcc_rejected = 0;
+    server.stat_repl_apply_threaded = 0;
+    for (j = 0; j < MAX_EVENT_LOOPS; j++)
+        server.rgthreadvar[j].stat_shard_commands = 0;
     for (j = 0; j < STATS_METRIC_COUNT; j++) {
         server.inst_metric[j].idx = 0;
         server.inst_metric[j].last_sample_time = mstime();
@@ -2844,6 +2907,16 @@ void initServer(void) {
 
     fastlock_init(&server.flock);
 
+    if (server.fIoUring) {
+        for (int iel = 0; iel < server.cthreads; ++iel) {
+            if (aeSetApi(server.rgthreadvar[iel].el, "io_uring") == AE_ERR) {
+                serverLog(LL_WARNING,"io_uring is not supported here, the event loops will use %s.",
+                    aeGetApiName());
+                break;
+            }
+        }
+    }
+
     if (server.syslog_enabled) {
         openlog(server.syslog_ident, LOG_PID | LOG_NDELAY | LOG_NOWAIT,
             server.syslog_facility);
@@ -2873,12 +2946,29 @@ void initServer(void) {
     for (int j = 0; j < server.dbnum; j++) {
         server.db[j].pdict = dictCreate(&dbDictType,NULL);
         server.db[j].expires = dictCreate(&keyptrDictType,NULL);
+        server.db[j].mvcc = dictCreate(&keyptrDictType,NULL);
         server.db[j].blocking_keys = dictCreate(&keylistDictType,NULL);
         server.db[j].ready_keys = dictCreate(&objectKeyPointerValueDictType,NULL);
         server.db[j].watched_keys = dictCreate(&keylistDictType,NULL);
         server.db[j].id = j;
         server.db[j].avg_ttl = 0;
         server.db[j].defrag_later = listCreate();
+        server.db[j].rgshardlock = NULL;
+        server.db[j].shard_reserved = 0;
+        if (server.keyspace_lock_shards) {
+            pthread_rwlockattr_t attr;
+            pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+            /* Don't let a stream of GETs starve the writers of a shard */
+            pthread_rwlockattr_setkind_np(&attr,PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+            server.db[j].rgshardlock = (pthread_rwlock_t*)zmalloc(sizeof(pthread_rwlock_t)*server.keyspace_lock_shards, MALLOC_LOCAL);
+            for (int ishard = 0; ishard < server.keyspace_lock_shards; ++ishard)
+                pthread_rwlock_init(&server.db[j].rgshardlock[ishard],&attr);
+            pthread_rwlockattr_destroy(&attr);
+            dictExpand(server.db[j].pdict,server.keyspace_lock_shards);
+            dictExpand(server.db[j].expires,server.keyspace_lock_shards);
+        }
     }
     evictionPoolAlloc(); /* Initialize the LRU keys pool. */
     server.pubsub_channels = dictCreate(&keylistDictType,NULL);
@@ -2887,6 +2977,9 @@ void initServer(void) {
     listSetMatchMethod(server.pubsub_patterns,listMatchPubsubPattern);
     server.cronloops = 0;
     server.rdb_child_pid = -1;
+    server.rdb_thread_active = 0;
+    server.snapshot_capturing = 0;
+    server.rdb_thread_save_time_start = -1;
     server.aof_child_pid = -1;
     server.rdb_child_type = RDB_CHILD_TYPE_NONE;
     server.rdb_bgsave_scheduled = 0;
@@ -2974,6 +3067,12 @@ void initServer(void) {
     slowlogInit();
     latencyMonitorInit();
     bioInit();
+    if (server.repl_apply_threads) replicationApplyInit();
+    if (server.maxmemory_eviction_thread) evictionThreadStart();
+    if (tieringApplyConfig() == C_ERR) {
+        serverLog(LL_WARNING,"Fatal: scratch-file-tiering needs a scratch-file-path.");
+        exit(1);
+    }
     server.initial_memory_usage = zmalloc_used_memory();
 }
 
@@ -3016,6 +3115,8 @@ int populateCommandTableParseFlags(struct redisCommand *c, const char *strflags)
             c->flags |= CMD_ASKING;
         } else if (!strcasecmp(flag,"fast")) {
             c->flags |= CMD_FAST | CMD_CATEGORY_FAST;
+        } else if (!strcasecmp(flag,"shardable")) {
+            c->flags |= CMD_SHARDABLE;
         } else {
             /* Parse ACL categories here if the flag name starts with @. */
             uint64_t catflag;
@@ -3070,6 +3171,7 @@ void resetCommandTableStats(void) {
         c = (struct redisCommand *) dictGetVal(de);
         c->microseconds = 0;
         c->calls = 0;
+        latencyCommandHistogramReset(c);
     }
     dictReleaseIterator(di);
 
@@ -3256,7 +3358,12 @@ void call(client *c, int flags) {
     long long dirty, start, duration;
     int client_old_flags = c->flags;
     struct redisCommand *real_cmd = c->cmd;
-    serverAssert(GlobalLocksAcquired());
+    serverAssert(KeyspaceLocksAcquired());
+
+    /* Commands running under a keyspace shard lock execute concurrently with
+     * each other. keyspaceShardLockForCommand() guarantees there is nothing
+     * to propagate, so they skip the shared propagation state entirely. */
+    int fShard = aeThreadOwnsSharedLock();
 
     /* Sent the command to clients in MONITOR mode, only if the commands are
      * not generated from reading an AOF. */
@@ -3270,8 +3377,21 @@ void call(client *c, int flags) {
     /* Initialization: clear the flags that must be set by the command on
      * demand, and initialize the array for additional commands propagation. */
     c->flags &= ~(CLIENT_FORCE_AOF|CLIENT_FORCE_REPL|CLIENT_PREVENT_PROP);
-    redisOpArray prev_also_propagate = server.also_propagate;
-    redisOpArrayInit(&server.also_propagate);
+    redisOpArray prev_also_propagate;
+    uint64_t mvcc_prev = 0;
+    if (!fShard) {
+        prev_also_propagate = server.also_propagate;
+        redisOpArrayInit(&server.also_propagate);
+
+        /* With active-replica-timestamps the keys written by the command,
+         * and by the commands it calls, are stamped with the same time. */
+        mvcc_prev = server.mvcc_cmd_stamp;
+        if (server.fActiveReplicaTimestamps && mvcc_prev == 0 &&
+            !(c->cmd->flags & CMD_READONLY))
+        {
+            server.mvcc_cmd_stamp = mvccPack(mvccNextTstamp(),0);
+        }
+    }
 
     /* Call the command. */
     dirty = server.dirty;
@@ -3286,14 +3406,18 @@ void call(client *c, int flags) {
     if (server.loading && c->flags & CLIENT_LUA)
         flags &= ~(CMD_CALL_SLOWLOG | CMD_CALL_STATS);
 
+    /* A script that runs again under the global lock is counted there. */
+    if (fShard && serverTL != NULL && serverTL->lua_shard_retry)
+        flags &= ~(CMD_CALL_SLOWLOG | CMD_CALL_STATS);
+
     /* If the caller is Lua, we want to force the EVAL caller to propagate
      * the script if the command flag or client flag are forcing the
      * propagation. */
-    if (c->flags & CLIENT_LUA && server.lua_caller) {
+    if (c->flags & CLIENT_LUA && serverTL->lua_caller) {
         if (c->flags & CLIENT_FORCE_REPL)
-            server.lua_caller->flags |= CLIENT_FORCE_REPL;
+            serverTL->lua_caller->flags |= CLIENT_FORCE_REPL;
         if (c->flags & CLIENT_FORCE_AOF)
-            server.lua_caller->flags |= CLIENT_FORCE_AOF;
+            serverTL->lua_caller->flags |= CLIENT_FORCE_AOF;
     }
 
     /* Log the command into the Slow log if needed, and populate the
@@ -3301,6 +3425,17 @@ void call(client *c, int flags) {
     if (flags & CMD_CALL_SLOWLOG && c->cmd->proc != execCommand) {
         const char *latency_event = (c->cmd->flags & CMD_FAST) ?
                               "fast-command" : "command";
+        /* Shard lock holders serialize among themselves only when there is
+         * actually something to log. */
+        std::unique_lock<fastlock> ulock(g_lockShardSlowlog, std::defer_lock);
+        if (fShard &&
+            ((server.slowlog_log_slower_than >= 0 &&
+              duration >= server.slowlog_log_slower_than) ||
+             (server.latency_monitor_threshold &&
+              duration/1000 >= server.latency_monitor_threshold)))
+        {
+            ulock.lock();
+        }
         latencyAddSampleIfNeeded(latency_event,duration/1000);
         slowlogPushEntryIfNeeded(c,c->argv,c->argc,duration);
     }
@@ -3308,12 +3443,23 @@ void call(client *c, int flags) {
         /* use the real command that was executed (cmd and lastamc) may be
          * different, in case of MULTI-EXEC or re-written commands such as
          * EXPIRE, GEOADD, etc. */
-        real_cmd->microseconds += duration;
-        real_cmd->calls++;
+        if (fShard) {
+            atomicIncr(real_cmd->microseconds,duration);
+            atomicIncr(real_cmd->calls,1);
+        } else {
+            real_cmd->microseconds += duration;
+            real_cmd->calls++;
+        }
+        if (serverTL != NULL) {
+            int iel = serverTL - server.rgthreadvar;
+            if (real_cmd->rghist[iel] == NULL)
+                real_cmd->rghist[iel] = createLatencyHistogram();
+            latencyHistogramAdd(real_cmd->rghist[iel],duration > 0 ? duration : 0);
+        }
     }
 
     /* Propagate the command into the AOF and replication link */
-    if (flags & CMD_CALL_PROPAGATE &&
+    if (!fShard && flags & CMD_CALL_PROPAGATE &&
         (c->flags & CLIENT_PREVENT_PROP) != CLIENT_PREVENT_PROP)
     {
         int propagate_flags = PROPAGATE_NONE;
@@ -3353,7 +3499,7 @@ void call(client *c, int flags) {
     /* Handle the alsoPropagate() API to handle commands that want to propagate
      * multiple separated commands. Note that alsoPropagate() is not affected
      * by CLIENT_PREVENT_PROP flag. */
-    if (server.also_propagate.numops) {
+    if (!fShard && server.also_propagate.numops) {
         int j;
         redisOp *rop;
 
@@ -3371,9 +3517,18 @@ void call(client *c, int flags) {
         redisOpArrayFree(&server.also_propagate);
     }
 
+    if (fShard) {
+        /* The replica apply threads have no thread vars. */
+        if (serverTL != NULL && serverTL->lua_shard_retry) return;
+        if (serverTL != NULL) serverTL->stat_shard_commands++;
+        atomicIncr(server.stat_numcommands,1);
+        return;
+    }
+
     ProcessPendingAsyncWrites();
     
     server.also_propagate = prev_also_propagate;
+    server.mvcc_cmd_stamp = mvcc_prev;
     server.stat_numcommands++;
 }
 
@@ -3386,7 +3541,7 @@ void call(client *c, int flags) {
  * other operations can be performed by the caller. Otherwise
  * if C_ERR is returned the client was destroyed (i.e. after QUIT). */
 int processCommand(client *c) {
-    serverAssert(GlobalLocksAcquired());
+    serverAssert(KeyspaceLocksAcquired());
     /* The QUIT command is handled separately. Normal command procs will
      * go through checking for replication and QUIT will cause trouble
      * when FORCE_REPLICATION is enabled and would be implemented in
@@ -3398,7 +3553,7 @@ int processCommand(client *c) {
     }
 
     AssertCorrectThread(c);
-    serverAssert(GlobalLocksAcquired());
+    serverAssert(KeyspaceLocksAcquired());
 
     /* Now lookup the command and check ASAP about trivial error conditions
      * such as wrong arity, bad command name and so forth. */
@@ -3457,7 +3612,7 @@ int processCommand(client *c) {
     if (server.cluster_enabled &&
         !(c->flags & CLIENT_MASTER) &&
         !(c->flags & CLIENT_LUA &&
-          server.lua_caller->flags & CLIENT_MASTER) &&
+          serverTL->lua_caller->flags & CLIENT_MASTER) &&
         !(c->cmd->getkeys_proc == NULL && c->cmd->firstkey == 0 &&
           c->cmd->proc != execCommand))
     {
@@ -3481,8 +3636,11 @@ int processCommand(client *c) {
      * Note that we do not want to reclaim memory if we are here re-entering
      * the event loop since there is a busy Lua script running in timeout
      * condition, to avoid mixing the propagation of scripts with the
-     * propagation of DELs due to eviction. */
-    if (server.maxmemory && !server.lua_timedout) {
+     * propagation of DELs due to eviction.
+     *
+     * Commands running under a keyspace shard lock can't evict, but
+     * keyspaceShardLockForCommand() only lets them run below the limit. */
+    if (server.maxmemory && !server.lua_timedout && !aeThreadOwnsSharedLock()) {
         int out_of_memory = freeMemoryIfNeededAndSafe() == C_ERR;
         /* freeMemoryIfNeeded may flush slave output buffers. This may result
          * into a slave, that may be the active client, to be freed. */
@@ -3504,7 +3662,7 @@ int processCommand(client *c) {
      * and if this is a master instance. */
     int deny_write_type = writeCommandsDeniedByDiskError();
     if (deny_write_type != DISK_ERROR_TYPE_NONE &&
-        server.masterhost == NULL &&
+        listLength(server.masters) == 0 &&
         (c->cmd->flags & CMD_WRITE ||
          c->cmd->proc == pingCommand))
     {
@@ -3521,7 +3679,7 @@ int processCommand(client *c) {
 
     /* Don't accept write commands if there are not enough good slaves and
      * user configured the min-slaves-to-write option. */
-    if (server.masterhost == NULL &&
+    if (listLength(server.masters) == 0 &&
         server.repl_min_slaves_to_write &&
         server.repl_min_slaves_max_lag &&
         c->cmd->flags & CMD_WRITE &&
@@ -3534,7 +3692,7 @@ int processCommand(client *c) {
 
     /* Don't accept write commands if this is a read only slave. But
      * accept write commands if this is our master. */
-    if (server.masterhost && server.repl_slave_ro &&
+    if (listLength(server.masters) && server.repl_slave_ro &&
         !(c->flags & CLIENT_MASTER) &&
         c->cmd->flags & CMD_WRITE)
     {
@@ -3557,9 +3715,8 @@ int processCommand(client *c) {
     /* Only allow commands with flag "t", such as INFO, SLAVEOF and so on,
      * when slave-serve-stale-data is no and we are a slave with a broken
      * link with master. */
-    if (server.masterhost && server.repl_state != REPL_STATE_CONNECTED &&
-        server.repl_serve_stale_data == 0 &&
-        !(c->cmd->flags & CMD_STALE))
+    if (listLength(server.masters) && server.repl_serve_stale_data == 0 &&
+        !(c->cmd->flags & CMD_STALE) && !FAllMastersConnected())
     {
         flagTransaction(c);
         addReply(c, shared.masterdownerr);
@@ -3567,8 +3724,11 @@ int processCommand(client *c) {
     }
 
     /* Loading DB? Return an error if the command has not the
-     * CMD_LOADING flag. */
-    if (server.loading && !(c->cmd->flags & CMD_LOADING)) {
+     * CMD_LOADING flag. While a replica loads the dataset of its master
+     * aside of the old one, the old one keeps serving read only commands. */
+    if (server.loading && !(c->cmd->flags & CMD_LOADING) &&
+        !(server.async_loading && (c->cmd->flags & CMD_READONLY)))
+    {
         addReply(c, shared.loadingerr);
         return C_OK;
     }
@@ -3600,7 +3760,7 @@ int processCommand(client *c) {
     } else {
         call(c,CMD_CALL_FULL);
         c->woff = server.master_repl_offset;
-        if (listLength(server.ready_keys))
+        if (listLength(server.ready_keys) && !aeThreadOwnsSharedLock())
             handleClientsBlockedOnKeys();
     }
     return C_OK;
@@ -3643,6 +3803,10 @@ int prepareForShutdown(int flags) {
         serverLog(LL_WARNING,"There is a child saving an .rdb. Killing it!");
         killRDBChild();
     }
+    if (server.rdb_thread_active) {
+        serverLog(LL_WARNING,"There is a thread saving an .rdb. Aborting it!");
+        snapshotAbort();
+    }
 
     if (server.aof_state != AOF_OFF) {
         /* Kill the AOF saving child as the AOF we already have may be longer
@@ -4024,7 +4188,7 @@ extern "C" sds genRedisInfoString(const char *section) {
         size_t zmalloc_used = zmalloc_used_memory();
         size_t total_system_mem = server.system_memory_size;
         const char *evict_policy = evictPolicyToString();
-        long long memory_lua = (long long)lua_gc(server.lua,LUA_GCCOUNT,0)*1024;
+        long long memory_lua = (long long)scriptingMemory();
         struct redisMemOverhead *mh = getMemoryOverheadData();
 
         /* Peak memory is updated from time to time by serverCron() so it
@@ -4126,6 +4290,27 @@ extern "C" sds genRedisInfoString(const char *section) {
             server.active_defrag_running,
             lazyfreeGetPendingObjectsCount()
         );
+#ifdef USE_MEMKIND
+        struct storage_pool_stats pool_stats;
+        storage_pool_stats(&pool_stats);
+        info = sdscatprintf(info,
+            "storage_pool_pages:%zu\r\n"
+            "storage_pool_bytes:%zu\r\n"
+            "storage_pool_used_objects:%zu\r\n"
+            "storage_pool_free_objects:%zu\r\n"
+            "storage_pool_frag_ratio:%.2f\r\n"
+            "scratch_file_used:%zu\r\n"
+            "tiering_demoted_values:%lld\r\n"
+            "tiering_promoted_values:%lld\r\n",
+            pool_stats.pages,
+            pool_stats.page_bytes,
+            pool_stats.used_objects,
+            pool_stats.free_objects,
+            pool_stats.used_bytes ? (float)pool_stats.page_bytes/pool_stats.used_bytes : 1,
+            storage_scratch_used(),
+            server.stat_tiering_demoted,
+            server.stat_tiering_promoted);
+#endif
         freeMemoryOverheadData(mh);
     }
 
@@ -4135,6 +4320,7 @@ extern "C" sds genRedisInfoString(const char *section) {
         info = sdscatprintf(info,
             "# Persistence\r\n"
             "loading:%d\r\n"
+            "async_loading:%d\r\n"
             "rdb_changes_since_last_save:%lld\r\n"
             "rdb_bgsave_in_progress:%d\r\n"
             "rdb_last_save_time:%jd\r\n"
@@ -4151,13 +4337,16 @@ extern "C" sds genRedisInfoString(const char *section) {
             "aof_last_write_status:%s\r\n"
             "aof_last_cow_size:%zu\r\n",
             server.loading,
+            server.async_loading,
             server.dirty,
-            server.rdb_child_pid != -1,
+            server.rdb_child_pid != -1 || server.rdb_thread_active,
             (intmax_t)server.lastsave,
             (server.lastbgsave_status == C_OK) ? "ok" : "err",
             (intmax_t)server.rdb_save_time_last,
-            (intmax_t)((server.rdb_child_pid == -1) ?
-                -1 : time(NULL)-server.rdb_save_time_start),
+            (intmax_t)((server.rdb_child_pid != -1) ?
+                time(NULL)-server.rdb_save_time_start :
+                (server.rdb_thread_active ?
+                 time(NULL)-server.rdb_thread_save_time_start : -1)),
             server.stat_rdb_cow_bytes,
             server.aof_state != AOF_OFF,
             server.aof_child_pid != -1,
@@ -4221,6 +4410,10 @@ extern "C" sds genRedisInfoString(const char *section) {
 
     /* Stats */
     if (allsections || defsections || !strcasecmp(section,"stats")) {
+        long long stat_shard_commands = 0;
+        for (int iel = 0; iel < server.cthreads; ++iel)
+            stat_shard_commands += server.rgthreadvar[iel].stat_shard_commands;
+
         if (sections++) info = sdscat(info,"\r\n");
         info = sdscatprintf(info,
             "# Stats\r\n"
@@ -4235,10 +4428,12 @@ extern "C" sds genRedisInfoString(const char *section) {
             "sync_full:%lld\r\n"
             "sync_partial_ok:%lld\r\n"
             "sync_partial_err:%lld\r\n"
+            "mvcc_rejected_writes:%lld\r\n"
             "expired_keys:%lld\r\n"
             "expired_stale_perc:%.2f\r\n"
             "expired_time_cap_reached_count:%lld\r\n"
             "evicted_keys:%lld\r\n"
+            "evicted_keys_background:%lld\r\n"
             "keyspace_hits:%lld\r\n"
             "keyspace_misses:%lld\r\n"
             "pubsub_channels:%ld\r\n"
@@ -4249,7 +4444,9 @@ extern "C" sds genRedisInfoString(const char *section) {
             "active_defrag_hits:%lld\r\n"
             "active_defrag_misses:%lld\r\n"
             "active_defrag_key_hits:%lld\r\n"
-            "active_defrag_key_misses:%lld\r\n",
+            "active_defrag_key_misses:%lld\r\n"
+            "keyspace_shard_commands:%lld\r\n"
+            "replica_threaded_applied_commands:%lld\r\n",
             server.stat_numconnections,
             server.stat_numcommands,
             getInstantaneousMetric(STATS_METRIC_COMMAND),
@@ -4261,10 +4458,12 @@ extern "C" sds genRedisInfoString(const char *section) {
             server.stat_sync_full,
             server.stat_sync_partial_ok,
             server.stat_sync_partial_err,
+            server.stat_mvcc_rejected,
             server.stat_expiredkeys,
             server.stat_expired_stale_perc*100,
             server.stat_expired_time_cap_reached_count,
             server.stat_evictedkeys,
+            server.stat_evictedkeys_background,
             server.stat_keyspace_hits,
             server.stat_keyspace_misses,
             dictSize(server.pubsub_channels),
@@ -4275,7 +4474,9 @@ extern "C" sds genRedisInfoString(const char *section) {
             server.stat_active_defrag_hits,
             server.stat_active_defrag_misses,
             server.stat_active_defrag_key_hits,
-            server.stat_active_defrag_key_misses);
+            server.stat_active_defrag_key_misses,
+            stat_shard_commands,
+            server.stat_repl_apply_threaded);
     }
 
     /* Replication */
@@ -4284,47 +4485,64 @@ extern "C" sds genRedisInfoString(const char *section) {
         info = sdscatprintf(info,
             "# Replication\r\n"
             "role:%s\r\n",
-            server.masterhost == NULL ? "master" : "slave");
-        if (server.masterhost) {
+            listLength(server.masters) == 0 ? "master" : "slave");
+        listIter li;
+        listNode *ln;
+        int cmaster = 0;
+        listRewind(server.masters,&li);
+        while ((ln = listNext(&li))) {
+            redisMaster *mi = (redisMaster*)listNodeValue(ln);
             long long slave_repl_offset = 1;
+            /* The first master is reported with the classic field names,
+             * the others of a multi-master replica with a master_<n>_
+             * prefix. */
+            char master_prefix[32] = "master_";
+            char slave_prefix[32] = "";
+            if (cmaster > 0) {
+                snprintf(master_prefix,sizeof(master_prefix),"master_%d_",cmaster);
+                snprintf(slave_prefix,sizeof(slave_prefix),"master_%d_",cmaster);
+            }
+            ++cmaster;
 
-            if (server.master)
-                slave_repl_offset = server.master->reploff;
-            else if (server.cached_master)
-                slave_repl_offset = server.cached_master->reploff;
+            if (mi->master)
+                slave_repl_offset = mi->master->reploff;
+            else if (mi->cached_master)
+                slave_repl_offset = mi->cached_master->reploff;
 
             info = sdscatprintf(info,
-                "master_host:%s\r\n"
-                "master_port:%d\r\n"
-                "master_link_status:%s\r\n"
-                "master_last_io_seconds_ago:%d\r\n"
-                "master_sync_in_progress:%d\r\n"
-                "slave_repl_offset:%lld\r\n"
-                ,server.masterhost,
-                server.masterport,
-                (server.repl_state == REPL_STATE_CONNECTED) ?
+                "%shost:%s\r\n"
+                "%sport:%d\r\n"
+                "%slink_status:%s\r\n"
+                "%slast_io_seconds_ago:%d\r\n"
+                "%ssync_in_progress:%d\r\n"
+                "%sslave_repl_offset:%lld\r\n"
+                ,master_prefix, mi->masterhost,
+                master_prefix, mi->masterport,
+                master_prefix, (mi->repl_state == REPL_STATE_CONNECTED) ?
                     "up" : "down",
-                server.master ?
-                ((int)(server.unixtime-server.master->lastinteraction)) : -1,
-                server.repl_state == REPL_STATE_TRANSFER,
-                slave_repl_offset
+                master_prefix, mi->master ?
+                ((int)(server.unixtime-mi->master->lastinteraction)) : -1,
+                master_prefix, mi->repl_state == REPL_STATE_TRANSFER,
+                slave_prefix, slave_repl_offset
             );
 
-            if (server.repl_state == REPL_STATE_TRANSFER) {
+            if (mi->repl_state == REPL_STATE_TRANSFER) {
                 info = sdscatprintf(info,
-                    "master_sync_left_bytes:%lld\r\n"
-                    "master_sync_last_io_seconds_ago:%d\r\n"
-                    , (long long)
-                        (server.repl_transfer_size - server.repl_transfer_read),
-                    (int)(server.unixtime-server.repl_transfer_lastio)
+                    "%ssync_left_bytes:%lld\r\n"
+                    "%ssync_last_io_seconds_ago:%d\r\n"
+                    , master_prefix, (long long)
+                        (mi->repl_transfer_size - mi->repl_transfer_read),
+                    master_prefix, (int)(server.unixtime-mi->repl_transfer_lastio)
                 );
             }
 
-            if (server.repl_state != REPL_STATE_CONNECTED) {
+            if (mi->repl_state != REPL_STATE_CONNECTED) {
                 info = sdscatprintf(info,
-                    "master_link_down_since_seconds:%jd\r\n",
-                    (intmax_t)server.unixtime-server.repl_down_since);
+                    "%slink_down_since_seconds:%jd\r\n",
+                    master_prefix, (intmax_t)server.unixtime-mi->repl_down_since);
             }
+        }
+        if (listLength(server.masters)) {
             info = sdscatprintf(info,
                 "slave_priority:%d\r\n"
                 "slave_read_only:%d\r\n",
@@ -4425,24 +4643,99 @@ extern "C" sds genRedisInfoString(const char *section) {
         fastlock_getlongwaitcount());
     }
 
+    /* Global lock contention */
+    if (allsections || !strcasecmp(section,"locks")) {
+        aeLockStats total, stats;
+        aeLockSite sites[64];
+        int islot, csites;
+
+        if (sections++) info = sdscat(info,"\r\n");
+        memset(&total,0,sizeof(total));
+        for (islot = 0; aeGetLockStats(islot,&stats); islot++) {
+            total.acquisitions += stats.acquisitions;
+            total.contended += stats.contended;
+            total.wait_ns += stats.wait_ns;
+            total.hold_ns += stats.hold_ns;
+            total.shared_acquisitions += stats.shared_acquisitions;
+            total.shared_failures += stats.shared_failures;
+        }
+        info = sdscatprintf(info,
+            "# Locks\r\n"
+            "global_lock_acquisitions:%llu\r\n"
+            "global_lock_contended:%llu\r\n"
+            "global_lock_wait_usec:%llu\r\n"
+            "global_lock_hold_usec:%llu\r\n"
+            "global_lock_shared_acquisitions:%llu\r\n"
+            "global_lock_shared_failures:%llu\r\n"
+            "lock_site_sampling:%d\r\n",
+            total.acquisitions, total.contended,
+            total.wait_ns/1000, total.hold_ns/1000,
+            total.shared_acquisitions, total.shared_failures,
+            aeGetLockSiteSampling());
+        for (islot = 0; aeGetLockStats(islot,&stats); islot++) {
+            if (stats.acquisitions == 0 && stats.shared_acquisitions == 0 &&
+                stats.shared_failures == 0) continue;
+            info = sdscatprintf(info,
+                "lock_thread_%d:tid=%d,acquisitions=%llu,contended=%llu,"
+                "wait_usec=%llu,hold_usec=%llu,shared_acquisitions=%llu,"
+                "shared_failures=%llu\r\n",
+                islot, stats.tid, stats.acquisitions, stats.contended,
+                stats.wait_ns/1000, stats.hold_ns/1000,
+                stats.shared_acquisitions, stats.shared_failures);
+        }
+
+        /* Call sites holding the lock the longest first. */
+        csites = aeGetLockSites(sites,sizeof(sites)/sizeof(sites[0]));
+        std::sort(sites, sites+csites, [](const aeLockSite &a, const aeLockSite &b) {
+            return a.hold_ns > b.hold_ns;
+        });
+        for (int isite = 0; isite < csites; isite++) {
+            Dl_info dlinfo;
+            sds name;
+
+            if (dladdr(sites[isite].site,&dlinfo) && dlinfo.dli_sname != NULL) {
+                char *demangled = abi::__cxa_demangle(dlinfo.dli_sname,NULL,NULL,NULL);
+                /* Drop the parameter list, it may contain commas. */
+                if (demangled && strchr(demangled,'(')) *strchr(demangled,'(') = '\0';
+                name = sdscatprintf(sdsempty(),"%s+0x%lx",
+                    demangled ? demangled : dlinfo.dli_sname,
+                    (unsigned long)((char*)sites[isite].site-(char*)dlinfo.dli_saddr));
+                free(demangled);
+            } else
+                name = sdscatprintf(sdsempty(),"%p",sites[isite].site);
+            info = sdscatprintf(info,
+                "lock_site_%d:site=%s,samples=%llu,hold_usec=%llu,max_hold_usec=%llu\r\n",
+                isite, name, sites[isite].samples, sites[isite].hold_ns/1000,
+                sites[isite].max_hold_ns/1000);
+            sdsfree(name);
+        }
+    }
+
     /* Command statistics */
     if (allsections || !strcasecmp(section,"commandstats")) {
         if (sections++) info = sdscat(info,"\r\n");
         info = sdscatprintf(info, "# Commandstats\r\n");
 
         struct redisCommand *c;
+        struct latencyHistogram *hist = createLatencyHistogram();
         dictEntry *de;
         dictIterator *di;
         di = dictGetSafeIterator(server.commands);
         while((de = dictNext(di)) != NULL) {
             c = (struct redisCommand *) dictGetVal(de);
             if (!c->calls) continue;
+            latencyCommandHistogram(c,hist);
             info = sdscatprintf(info,
-                "cmdstat_%s:calls=%lld,usec=%lld,usec_per_call=%.2f\r\n",
+                "cmdstat_%s:calls=%lld,usec=%lld,usec_per_call=%.2f,"
+                "p50=%llu,p99=%llu,p999=%llu\r\n",
                 c->name, c->calls, c->microseconds,
-                (c->calls == 0) ? 0 : ((float)c->microseconds/c->calls));
+                (c->calls == 0) ? 0 : ((float)c->microseconds/c->calls),
+                (unsigned long long)latencyHistogramPercentile(hist,50),
+                (unsigned long long)latencyHistogramPercentile(hist,99),
+                (unsigned long long)latencyHistogramPercentile(hist,99.9));
         }
         dictReleaseIterator(di);
+        zfree(hist);
     }
 
     /* Cluster */
@@ -4694,7 +4987,7 @@ void loadDataFromDisk(void) {
                 (float)(ustime()-start)/1000000);
 
             /* Restore the replication ID / offset from the RDB file. */
-            if ((server.masterhost || (server.cluster_enabled && nodeIsSlave(server.cluster->myself)))&&
+            if ((listLength(server.masters) || (server.cluster_enabled && nodeIsSlave(server.cluster->myself)))&&
                 rsi.repl_id_is_set &&
                 rsi.repl_offset != -1 &&
                 /* Note that older implementations may save a repl_stream_db
@@ -4707,8 +5000,11 @@ void loadDataFromDisk(void) {
                 /* If we are a slave, create a cached master from this
                  * information, in order to allow partial resynchronizations
                  * with masters. */
-                replicationCacheMasterUsingMyself();
-                selectDb(server.cached_master,rsi.repl_stream_db);
+                redisMaster *mi = firstMaster();
+                if (mi != NULL) {
+                    replicationCacheMasterUsingMyself(mi);
+                    selectDb(mi->cached_master,rsi.repl_stream_db);
+                }
             }
         } else if (errno != ENOENT) {
             serverLog(LL_WARNING,"Fatal error loading the DB: %s. Exiting.",strerror(errno));
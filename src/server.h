@@ -153,6 +153,10 @@ extern "C" {
 #define CONFIG_DEFAULT_REPL_DISABLE_TCP_NODELAY 0
 #define CONFIG_DEFAULT_MAXMEMORY 0
 #define CONFIG_DEFAULT_MAXMEMORY_SAMPLES 5
+#define CONFIG_DEFAULT_MAXMEMORY_EVICTION_THREAD 0
+#define CONFIG_DEFAULT_MAXMEMORY_EVICTION_LOW_WATERMARK 90
+#define CONFIG_DEFAULT_SCRATCH_FILE_TIERING 0
+#define CONFIG_DEFAULT_SCRATCH_FILE_TIERING_LFU_THRESHOLD 2
 #define CONFIG_DEFAULT_LFU_LOG_FACTOR 10
 #define CONFIG_DEFAULT_LFU_DECAY_TIME 1
 #define CONFIG_DEFAULT_AOF_FILENAME "appendonly.aof"
@@ -162,6 +166,14 @@ extern "C" {
 #define CONFIG_DEFAULT_ACTIVE_REHASHING 1
 #define CONFIG_DEFAULT_AOF_REWRITE_INCREMENTAL_FSYNC 1
 #define CONFIG_DEFAULT_RDB_SAVE_INCREMENTAL_FSYNC 1
+#define CONFIG_DEFAULT_RDB_LOAD_THREADS 0
+#define CONFIG_MAX_RDB_LOAD_THREADS 64
+#define CONFIG_DEFAULT_RDB_SAVE_THREADS 0
+#define CONFIG_MAX_RDB_SAVE_THREADS 64
+#define CONFIG_DEFAULT_FORKLESS_BGSAVE 0
+#define CONFIG_DEFAULT_S3_REGION "us-east-1"
+#define CONFIG_DEFAULT_S3_THREADS 4
+#define CONFIG_MAX_S3_THREADS 64
 #define CONFIG_DEFAULT_MIN_SLAVES_TO_WRITE 0
 #define CONFIG_DEFAULT_MIN_SLAVES_MAX_LAG 10
 #define CONFIG_DEFAULT_ACL_FILENAME ""
@@ -186,8 +198,28 @@ extern "C" {
 
 #define CONFIG_DEFAULT_THREADS 1
 #define CONFIG_DEFAULT_THREAD_AFFINITY 0
+#define CONFIG_DEFAULT_KEYSPACE_LOCK_SHARDS 0
+#define CONFIG_DEFAULT_LUA_SHARD_SCRIPTS 0
+#define CONFIG_DEFAULT_LUA_PERSIST_SCRIPTS 1
+#define CONFIG_DEFAULT_REPL_APPLY_THREADS 0
+#define CONFIG_MAX_REPL_APPLY_THREADS 64
+#define CONFIG_DEFAULT_IO_URING 0
 
 #define CONFIG_DEFAULT_ACTIVE_REPLICA 0
+#define CONFIG_DEFAULT_ACTIVE_REPLICA_TIMESTAMPS 0
+#define CONFIG_DEFAULT_MULTI_MASTER 0
+
+/* Timestamps of active-replica-timestamps are hybrid logical clocks: the
+ * wall clock in milliseconds shifted left by MVCC_MS_SHIFT bits, the low
+ * bits counting the events within the same millisecond. The stamps kept in
+ * db->mvcc pack the timestamp with the index of the server that originated
+ * the write in its low MVCC_ORIGIN_BITS bits, see mvccOriginIndex(). */
+#define MVCC_MS_SHIFT 12
+#define MVCC_ORIGIN_BITS 8
+#define MVCC_MAX_ORIGINS (1<<MVCC_ORIGIN_BITS)
+#define mvccPack(tstamp,origin) (((tstamp)<<MVCC_ORIGIN_BITS)|(uint64_t)(origin))
+#define MVCC_TSTAMP(stamp) ((stamp)>>MVCC_ORIGIN_BITS)
+#define MVCC_ORIGIN(stamp) ((int)((stamp)&(MVCC_MAX_ORIGINS-1)))
 
 #define ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP 20 /* Loopkups per loop. */
 #define ACTIVE_EXPIRE_CYCLE_FAST_DURATION 1000 /* Microseconds */
@@ -206,8 +238,13 @@ extern "C" {
 #define PROTO_MAX_QUERYBUF_LEN  (1024*1024*1024) /* 1GB max query buffer. */
 #define PROTO_IOBUF_LEN         (1024*16)  /* Generic I/O buffer size */
 #define PROTO_REPLY_CHUNK_BYTES (16*1024) /* 16k output buffer */
+#define PROTO_REPLY_OBJ_MIN_BYTES (16*1024) /* Larger values are referenced, not copied */
+#define REPL_BACKLOG_BLOCK_BYTES (16*1024) /* Replication backlog block size */
 #define PROTO_INLINE_MAX_SIZE   (1024*64) /* Max size of inline reads */
 #define PROTO_MBULK_BIG_ARG     (1024*32)
+#define PROTO_ARGV_REUSE_MAX    1024 /* Larger argv arrays are not kept across commands */
+#define ARGV_POOL_CLASSES       4    /* Pooled argument objects: 16 byte classes up to 64 */
+#define ARGV_POOL_MAX_PER_CLASS 128  /* Max pooled argument objects per class and thread */
 #define LONG_STR_SIZE      21          /* Bytes needed for long -> str + '\0' */
 #define REDIS_AUTOSYNC_BYTES (1024*1024*32) /* fdatasync every 32MB */
 
@@ -266,6 +303,9 @@ extern "C" {
 #define CMD_CATEGORY_TRANSACTION (1ULL<<35)
 #define CMD_CATEGORY_SCRIPTING (1ULL<<36)
 
+/* Command flags used by the keyspace shard locks. */
+#define CMD_SHARDABLE (1ULL<<37)       /* "shardable" flag */
+
 /* AOF states */
 #define AOF_OFF 0             /* AOF is off */
 #define AOF_ON 1              /* AOF is on */
@@ -404,6 +444,12 @@ extern "C" {
 #define AOF_FSYNC_EVERYSEC 2
 #define CONFIG_DEFAULT_AOF_FSYNC AOF_FSYNC_EVERYSEC
 
+/* Replica full sync loading (repl-diskless-load) */
+#define REPL_DISKLESS_LOAD_DISABLED 0
+#define REPL_DISKLESS_LOAD_WHEN_DB_EMPTY 1
+#define REPL_DISKLESS_LOAD_SWAPDB 2
+#define CONFIG_DEFAULT_REPL_DISKLESS_LOAD REPL_DISKLESS_LOAD_DISABLED
+
 /* Zipped structures related defaults */
 #define OBJ_HASH_MAX_ZIPLIST_ENTRIES 512
 #define OBJ_HASH_MAX_ZIPLIST_VALUE 64
@@ -447,6 +493,8 @@ extern "C" {
 
 /* Scripting */
 #define LUA_SCRIPT_TIME_LIMIT 5000 /* milliseconds */
+#define LUA_SHARD_OPTIN "--!shardable" /* First line of the scripts that may
+                                          run under a keyspace shard lock */
 
 /* Units */
 #define UNIT_SECONDS 0
@@ -685,6 +733,10 @@ struct evictionPoolEntry; /* Defined in evict.c */
  * which is actually a linked list of blocks like that, that is: client->reply. */
 typedef struct clientReplyBlock {
     size_t size, used;
+    robj *obj;  /* If set the block holds a reference to this string object
+                   and sends 'used' bytes of it from 'off' instead of buf,
+                   'size' is the memory the reference accounts for. */
+    size_t off;
 #ifndef __cplusplus
     char buf[];
 #else
@@ -695,18 +747,33 @@ typedef struct clientReplyBlock {
 #endif
 } clientReplyBlock;
 
+/* The bytes of the reply held by the block, see clientReplyBlock.obj */
+__attribute__((always_inline)) inline const char *replyBlockData(clientReplyBlock *o)
+{
+    if (o->obj) return (const char*)ptrFromObj(o->obj) + o->off;
+#ifndef __cplusplus
+    return o->buf;
+#else
+    return o->buf();
+#endif
+}
+
 /* Redis database representation. There are multiple databases identified
  * by integers from 0 (the default database) up to the max configured
  * database. The database number is the 'id' field in the structure. */
 typedef struct redisDb {
     dict *pdict;                 /* The keyspace for this DB */
     dict *expires;              /* Timeout of keys with a timeout set */
+    dict *mvcc;                 /* Time of the last write of the keys, only
+                                 * with active-replica-timestamps */
     dict *blocking_keys;        /* Keys with clients waiting for data (BLPOP)*/
     dict *ready_keys;           /* Blocked keys that received a PUSH */
     dict *watched_keys;         /* WATCHED keys for MULTI/EXEC CAS */
     int id;                     /* Database ID */
     long long avg_ttl;          /* Average TTL, just for stats */
     list *defrag_later;         /* List of key names to attempt to defrag one by one, gradually. */
+    pthread_rwlock_t *rgshardlock; /* Keyspace shard locks, NULL if disabled */
+    long shard_reserved;        /* Keys that scripts running under a shard lock may add */
 } redisDb;
 
 /* Client MULTI/EXEC state */
@@ -1068,8 +1135,59 @@ struct redisServerThreadVars {
     list *clients_pending_asyncwrite;
     int cclients;
     struct fastlock lockPendingWrite;
+    long long stat_shard_commands; /* Commands run under a keyspace shard lock */
+    int fShardReadOnly;         /* Running a read-only command under a shard read lock */
+    robj *argv_pool[ARGV_POOL_CLASSES+1]; /* Freelists of unretained argument objects */
+    int argv_pool_len[ARGV_POOL_CLASSES+1];
+    /* Scripting */
+    lua_State *lua;             /* The Lua interpreter of the thread, created on first use */
+    client *lua_client;         /* The "fake client" to query Redis from Lua */
+    client *lua_caller;         /* The client running EVAL on this thread, or NULL */
+    mstime_t lua_time_start;    /* Start time of script, milliseconds time */
+    int lua_write_dirty;        /* True if a write command was called during the
+                                   execution of the current script. */
+    int lua_random_dirty;       /* True if a random command was called during the
+                                   execution of the current script. */
+    int lua_replicate_commands; /* True if we are doing single commands repl. */
+    int lua_multi_emitted;      /* True if we already proagated MULTI. */
+    int lua_repl;               /* Script replication flags for redis.set_repl(). */
+    int lua_sharded;            /* The script runs under a keyspace shard lock */
+    int lua_shard_timedout;     /* Such a script was aborted after writing */
+    int lua_shard_retry;        /* Such a script has to run again under the
+                                   global lock, it did not write. */
+    redisDb *lua_shard_db;      /* DB where the keys of the script are reserved */
+    long lua_shard_reserved;    /* Number of keys reserved */
 };
 
+/* State of the link with one of our masters. A replica has a single master,
+ * unless multi-master is enabled. */
+typedef struct redisMaster {
+    char *masterhost;               /* Hostname of master */
+    int masterport;                 /* Port of master */
+    client *master;     /* Client that is master for this slave */
+    client *cached_master; /* Cached master to be reused for PSYNC. */
+    int repl_state;          /* Replication status if the instance is a slave */
+    off_t repl_transfer_size; /* Size of RDB to read from master during sync. */
+    off_t repl_transfer_read; /* Amount of RDB read from master during sync. */
+    off_t repl_transfer_last_fsync_off; /* Offset when we fsync-ed last time. */
+    int repl_transfer_s;     /* Slave -> Master SYNC socket */
+    int repl_transfer_fd;    /* Slave -> Master SYNC temp file descriptor */
+    char *repl_transfer_tmpfile; /* Slave-> master SYNC temp file name */
+    time_t repl_transfer_lastio; /* Unix time of the latest read, for timeout */
+    time_t repl_down_since; /* Unix time at which link with master went down */
+    /* EOF mark of a diskless transfer, and the last bytes received to
+     * detect it. */
+    int repl_transfer_usemark;
+    char repl_transfer_eofmark[CONFIG_RUN_ID_SIZE];
+    char repl_transfer_lastbytes[CONFIG_RUN_ID_SIZE];
+    /* The following fields is where we store master PSYNC replid/offset/UUID
+     * while the PSYNC is in progress. At the end we'll copy the fields into
+     * the master client structure. */
+    unsigned char master_uuid[UUID_BINARY_LEN];
+    char master_replid[CONFIG_RUN_ID_SIZE+1];  /* Master PSYNC runid. */
+    long long master_initial_offset;           /* Master PSYNC offset. */
+} redisMaster;
+
 struct redisServer {
     /* General */
     pid_t pid;                  /* Main process pid. */
@@ -1087,6 +1205,9 @@ struct redisServer {
 
     int cthreads;               /* Number of main worker threads */
     int fThreadAffinity;        /* Should we pin threads to cores? */
+    int keyspace_lock_shards;   /* Number of keyspace shard locks per DB (0 = off) */
+    int repl_apply_threads;     /* Threads applying our master's commands (0 = off) */
+    int fIoUring;               /* Use io_uring instead of epoll for the event loops */
     struct redisServerThreadVars rgthreadvar[MAX_EVENT_LOOPS];
 
     unsigned int lruclock;      /* Clock for LRU eviction */
@@ -1133,6 +1254,7 @@ struct redisServer {
                                    queries. Will still serve RESP2 queries. */
     /* RDB / AOF loading information */
     int loading;                /* We are loading data from disk if true */
+    int async_loading;          /* The old dataset serves reads while loading */
     off_t loading_total_bytes;
     off_t loading_loaded_bytes;
     time_t loading_start_time;
@@ -1151,6 +1273,9 @@ struct redisServer {
     double stat_expired_stale_perc; /* Percentage of keys probably expired */
     long long stat_expired_time_cap_reached_count; /* Early expire cylce stops.*/
     long long stat_evictedkeys;     /* Number of evicted keys (maxmemory) */
+    long long stat_evictedkeys_background; /* ... of them by the eviction thread */
+    long long stat_tiering_demoted; /* Values moved to the scratch file */
+    long long stat_tiering_promoted; /* Values moved back to DRAM */
     long long stat_keyspace_hits;   /* Number of successful lookups of keys */
     long long stat_keyspace_misses; /* Number of failed lookups of keys */
     long long stat_active_defrag_hits;      /* number of allocations moved */
@@ -1223,6 +1348,9 @@ struct redisServer {
     unsigned long aof_delayed_fsync;  /* delayed AOF fsync() counter */
     int aof_rewrite_incremental_fsync;/* fsync incrementally while aof rewriting? */
     int rdb_save_incremental_fsync;   /* fsync incrementally while rdb saving? */
+    int rdb_load_threads;           /* Threads decoding values while loading (0 = serial) */
+    int rdb_save_threads;           /* Threads saving chunks of keys (0 = serial) */
+    int forkless_bgsave;            /* BGSAVE with a snapshot thread, no fork() */
     int aof_last_write_status;      /* C_OK or C_ERR */
     int aof_last_write_errno;       /* Valid if aof_last_write_status is ERR */
     int aof_load_truncated;         /* Don't stop on unexpected AOF EOF. */
@@ -1242,10 +1370,16 @@ struct redisServer {
     long long dirty;                /* Changes to DB from the last save */
     long long dirty_before_bgsave;  /* Used to restore dirty on failed BGSAVE */
     pid_t rdb_child_pid;            /* PID of RDB saving child */
+    int rdb_thread_active;          /* Forkless BGSAVE thread is running */
+    int snapshot_capturing;         /* Writers must preserve values for it */
+    time_t rdb_thread_save_time_start; /* Forkless BGSAVE start time. */
     struct saveparam *saveparams;   /* Save points array for RDB */
     int saveparamslen;              /* Number of saving points */
     char *rdb_filename;             /* Name of RDB file */
     char *rdb_s3bucketpath;         /* Path for AWS S3 backup of RDB file */
+    char *s3_endpoint;              /* host[:port] of an S3 endpoint, NULL = aws CLI */
+    char *s3_region;                /* Region used to sign S3 requests */
+    int s3_threads;                 /* Parts transferred in parallel with S3 */
     int rdb_compression;            /* Use compression in RDB? */
     int rdb_checksum;               /* Use RDB checksum? */
     time_t lastsave;                /* Unix time of last successful save */
@@ -1279,11 +1413,15 @@ struct redisServer {
     long long second_replid_offset; /* Accept offsets up to this for replid2. */
     int slaveseldb;                 /* Last SELECTed DB in replication output */
     int repl_ping_slave_period;     /* Master pings the slave every N seconds */
-    char *repl_backlog;             /* Replication backlog for partial syncs */
-    long long repl_backlog_size;    /* Backlog circular buffer size */
+    list *repl_backlog;             /* Replication backlog for partial syncs,
+                                       a list of string objects shared with
+                                       the output buffers of the replicas. */
+    long long repl_backlog_size;    /* Backlog size */
     long long repl_backlog_histlen; /* Backlog actual data length */
-    long long repl_backlog_idx;     /* Backlog circular buffer current offset,
-                                       that is the next byte will'll write to.*/
+    long long repl_backlog_buflen;  /* Bytes held by the backlog blocks, the
+                                       first block may start before the first
+                                       byte of the history. */
+    list *repl_backlog_spare;       /* Backlog blocks ready for reuse */
     long long repl_backlog_off;     /* Replication "master offset" of first
                                        byte in the replication backlog buffer.*/
     time_t repl_backlog_time_limit; /* Time without slaves after the backlog
@@ -1295,36 +1433,21 @@ struct redisServer {
     int repl_good_slaves_count;     /* Number of slaves with lag <= max_lag. */
     int repl_diskless_sync;         /* Send RDB to slaves sockets directly. */
     int repl_diskless_sync_delay;   /* Delay to start a diskless repl BGSAVE. */
+    int repl_diskless_load;         /* Load the RDB of our master from the socket, REPL_DISKLESS_LOAD_* */
     /* Replication (slave) */
     char *masteruser;               /* AUTH with this user and masterauth with master */
     char *masterauth;               /* AUTH with this password with master */
-    char *masterhost;               /* Hostname of master */
-    int masterport;                 /* Port of master */
+    list *masters;                  /* The redisMaster links of this slave */
+    int fMultiMaster;               /* Can we replicate from several masters? */
     int repl_timeout;               /* Timeout after N seconds of master idle */
-    client *master;     /* Client that is master for this slave */
-    client *cached_master; /* Cached master to be reused for PSYNC. */
     int repl_syncio_timeout; /* Timeout for synchronous I/O calls */
-    int repl_state;          /* Replication status if the instance is a slave */
-    off_t repl_transfer_size; /* Size of RDB to read from master during sync. */
-    off_t repl_transfer_read; /* Amount of RDB read from master during sync. */
-    off_t repl_transfer_last_fsync_off; /* Offset when we fsync-ed last time. */
-    int repl_transfer_s;     /* Slave -> Master SYNC socket */
-    int repl_transfer_fd;    /* Slave -> Master SYNC temp file descriptor */
-    char *repl_transfer_tmpfile; /* Slave-> master SYNC temp file name */
-    time_t repl_transfer_lastio; /* Unix time of the latest read, for timeout */
     int repl_serve_stale_data; /* Serve stale data when link is down? */
     int repl_slave_ro;          /* Slave is read only? */
     int repl_slave_ignore_maxmemory;    /* If true slaves do not evict. */
-    time_t repl_down_since; /* Unix time at which link with master went down */
     int repl_disable_tcp_nodelay;   /* Disable TCP_NODELAY after SYNC? */
     int slave_priority;             /* Reported in INFO and used by Sentinel. */
     int slave_announce_port;        /* Give the master this listening port. */
     char *slave_announce_ip;        /* Give the master this ip address. */
-    /* The following two fields is where we store master PSYNC replid/offset
-     * while the PSYNC is in progress. At the end we'll copy the fields into
-     * the server->master client structure. */
-    char master_replid[CONFIG_RUN_ID_SIZE+1];  /* Master PSYNC runid. */
-    long long master_initial_offset;           /* Master PSYNC offset. */
     int repl_slave_lazy_flush;          /* Lazy FLUSHALL before loading DB? */
     /* Replication script cache. */
     dict *repl_scriptcache_dict;        /* SHA1 all slaves are aware of. */
@@ -1338,6 +1461,10 @@ struct redisServer {
     unsigned long long maxmemory;   /* Max number of memory bytes to use */
     int maxmemory_policy;           /* Policy for key eviction */
     int maxmemory_samples;          /* Pricision of random sampling */
+    int maxmemory_eviction_thread;  /* Evict in the background too */
+    int maxmemory_eviction_low_watermark; /* % of maxmemory the thread aims at */
+    int scratch_file_tiering;       /* Only cold values go to the scratch file */
+    int scratch_file_tiering_lfu_threshold; /* Demote below this LFU counter */
     int lfu_log_factor;             /* LFU logarithmic counter factor. */
     int lfu_decay_time;             /* LFU counter decay factor. */
     long long proto_max_bulk_len;   /* Protocol bulk length maximum size. */
@@ -1391,25 +1518,21 @@ struct redisServer {
                                       to set in order to suppress certain
                                       native Redis Cluster features. Check the
                                       REDISMODULE_CLUSTER_FLAG_*. */
-    /* Scripting */
-    lua_State *lua; /* The Lua interpreter. We use just one for all clients */
-    client *lua_client;   /* The "fake client" to query Redis from Lua */
-    client *lua_caller;   /* The client running EVAL right now, or NULL */
+    /* Scripting. Every thread has its own Lua interpreter, see the
+     * redisServerThreadVars. */
+    client *lua_caller;   /* The client running EVAL under the global lock, or
+                             NULL. Scripts running under a keyspace shard lock
+                             can't be killed. */
     dict *lua_scripts;         /* A dictionary of SHA1 -> Lua scripts */
     unsigned long long lua_scripts_mem;  /* Cached scripts' memory + oh */
     mstime_t lua_time_limit;  /* Script timeout in milliseconds */
-    mstime_t lua_time_start;  /* Start time of script, milliseconds time */
-    int lua_write_dirty;  /* True if a write command was called during the
-                             execution of the current script. */
-    int lua_random_dirty; /* True if a random command was called during the
-                             execution of the current script. */
-    int lua_replicate_commands; /* True if we are doing single commands repl. */
-    int lua_multi_emitted;/* True if we already proagated MULTI. */
-    int lua_repl;         /* Script replication flags for redis.set_repl(). */
     int lua_timedout;     /* True if we reached the time limit for script
                              execution. */
     int lua_kill;         /* Kill the script if true. */
     int lua_always_replicate_commands; /* Default replication type. */
+    int lua_shard_scripts;    /* Run EVAL under a keyspace shard lock when the
+                                 keys of the script share a shard. */
+    int lua_persist_scripts;  /* Save the script cache in every RDB. */
     /* Lazy free */
     int lazyfree_lazy_eviction;
     int lazyfree_lazy_expire;
@@ -1435,9 +1558,12 @@ struct redisServer {
     pthread_mutex_t unixtime_mutex;
 
     int fActiveReplica;                          /* Can this replica also be a master? */
+    int fActiveReplicaTimestamps;                /* Resolve active replica conflicts with per key timestamps */
+    uint64_t mvcc_tstamp;                        /* Hybrid logical clock of the keyspace writes */
+    uint64_t mvcc_cmd_stamp;                     /* Packed timestamp of the command being executed, 0 if none */
+    long long stat_mvcc_rejected;                /* Replicated commands dropped as older than the keys */
+    long long stat_repl_apply_threaded;          /* Commands of our master applied by the apply threads */
     unsigned char uuid[UUID_BINARY_LEN];         /* This server's UUID - populated on boot */
-    unsigned char master_uuid[UUID_BINARY_LEN];  /* Used during sync with master, this is our master's UUID */
-                                                /* After we've connected with our master use the UUID in server.master */
 
     struct fastlock flock;
 };
@@ -1468,6 +1594,8 @@ struct redisCommand {
                    ACLs. A connection is able to execute a given command if
                    the user associated to the connection has this command
                    bit set in the bitmap of allowed commands. */
+    struct latencyHistogram *rghist[MAX_EVENT_LOOPS]; /* Per thread latency
+                   histograms, allocated on the first call on each thread. */
 };
 
 struct redisFunctionSym {
@@ -1543,7 +1671,14 @@ extern dictType zsetDictType;
 extern dictType clusterNodesDictType;
 extern dictType clusterNodesBlackListDictType;
 extern dictType dbDictType;
+extern dictType keylistDictType;
 extern dictType shaScriptObjectDictType;
+
+/* The master we replicate from, or the first one with multi-master. */
+static inline redisMaster *firstMaster(void) {
+    if (listLength(server.masters) == 0) return NULL;
+    return (redisMaster*)listNodeValue(listFirst(server.masters));
+}
 extern double R_Zero, R_PosInf, R_NegInf, R_Nan;
 extern dictType hashDictType;
 extern dictType replScriptCacheDictType;
@@ -1606,6 +1741,7 @@ void addReplyNullArray(client *c);
 void addReplyBool(client *c, int b);
 void addReplyVerbatim(client *c, const char *s, size_t len, const char *ext);
 void addReplyProto(client *c, const char *s, size_t len);
+void addReplyObjectRange(client *c, robj *obj, size_t off, size_t len);
 void addReplyBulk(client *c, robj *obj);
 void addReplyBulkCString(client *c, const char *s);
 void addReplyBulkCBuffer(client *c, const void *p, size_t len);
@@ -1664,6 +1800,7 @@ void unprotectClient(client *c);
 void addReplyAsync(client *c, robj *obj);
 void addReplyArrayLenAsync(client *c, long length);
 void addReplyProtoAsync(client *c, const char *s, size_t len);
+void addReplyObjectRangeAsync(client *c, robj *obj, size_t off, size_t len);
 void addReplyBulkAsync(client *c, robj *obj);
 void addReplyBulkCBufferAsync(client *c, const void *p, size_t len);
 void addReplyErrorAsync(client *c, const char *err);
@@ -1731,6 +1868,8 @@ robj *createObject(int type, void *ptr);
 robj *createStringObject(const char *ptr, size_t len);
 robj *createRawStringObject(const char *ptr, size_t len);
 robj *createEmbeddedStringObject(const char *ptr, size_t len);
+robj *createArgvStringObject(const char *ptr, size_t len);
+void freeArgvStringObject(robj *o);
 robj *dupStringObject(const robj *o);
 int isSdsRepresentableAsLongLong(sds s, long long *llval);
 int isObjectRepresentableAsLongLong(robj *o, long long *llongval);
@@ -1772,15 +1911,27 @@ ssize_t syncReadLine(int fd, char *ptr, ssize_t size, long long timeout);
 
 /* Replication */
 void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc);
+uint64_t mvccNextTstamp(void);
+void mvccObserveTstamp(uint64_t tstamp);
+int mvccOriginIndex(const unsigned char *uuid);
+const unsigned char *mvccOriginUuid(int origin);
+int mvccIsNewer(uint64_t stamp, uint64_t stampOther);
 void replicationFeedSlavesFromMasterStream(list *slaves, char *buf, size_t buflen);
 void replicationFeedMonitors(client *c, list *monitors, int dictid, robj **argv, int argc);
 void updateSlavesWaitingBgsave(int bgsaveerr, int type);
 void replicationCron(void);
-void replicationHandleMasterDisconnection(void);
-void replicationCacheMaster(client *c);
+void replicationHandleMasterDisconnection(redisMaster *mi);
+void replicationCacheMaster(redisMaster *mi, client *c);
 void resizeReplicationBacklog(long long newsize);
-void replicationSetMaster(char *ip, int port);
-void replicationUnsetMaster(void);
+redisMaster *replicationCreateMasterInfo(char *ip, int port);
+redisMaster *replicationAddMaster(char *ip, int port);
+void replicationUnsetMaster(redisMaster *mi);
+void replicationUnsetAllMasters(void);
+redisMaster *MasterInfoFromClient(client *c);
+int FAllMastersConnected(void);
+void replicationApplyInit(void);
+int replicationApplyDispatch(client *c);
+void replicationApplyDrain(void);
 void refreshGoodSlavesCount(void);
 void replicationScriptCacheInit(void);
 void replicationScriptCacheFlush(void);
@@ -1797,11 +1948,13 @@ int replicationSetupSlaveForFullResync(client *slave, long long offset);
 void changeReplicationId(void);
 void clearReplicationId2(void);
 void chopReplicationBacklog(void);
-void replicationCacheMasterUsingMyself(void);
+void replicationCacheMasterUsingMyself(redisMaster *mi);
 void feedReplicationBacklog(void *ptr, size_t len);
+size_t replicationBacklogMemoryUsage(void);
 
 /* Generic persistence functions */
 void startLoading(FILE *fp);
+void startLoadingStream(size_t size);
 void loadingProgress(off_t pos);
 void stopLoading(void);
 
@@ -1814,6 +1967,15 @@ int writeCommandsDeniedByDiskError(void);
 #include "rdb.h"
 int rdbSaveRio(rio *rdb, int *error, int flags, rdbSaveInfo *rsi);
 void killRDBChild(void);
+int rdbStartBgsave(rdbSaveInfo *rsi);
+
+/* Forkless snapshots */
+int snapshotCanStart(void);
+int snapshotStart(rdbSaveInfo *rsi);
+void snapshotAbort(void);
+void snapshotDrain(int dbid);
+void snapshotCron(void);
+void snapshotPreserveKeyCore(redisDb *db, robj *key);
 
 /* AOF persistence */
 void flushAppendOnlyFile(int force);
@@ -1951,6 +2113,7 @@ void serverLogFromHandler(int level, const char *msg);
 void usage(void);
 void updateDictResizePolicy(void);
 int htNeedsResize(dict *dict);
+void tryResizeHashTables(int dbid);
 void populateCommandTable(void);
 void resetCommandTableStats(void);
 void adjustOpenFilesLimit(void);
@@ -2033,6 +2196,8 @@ void propagateExpire(redisDb *db, robj *key, int lazy);
 int expireIfNeeded(redisDb *db, robj *key);
 long long getExpire(redisDb *db, robj *key);
 void setExpire(client *c, redisDb *db, robj *key, long long when);
+void setMvccStamp(redisDb *db, robj *key, uint64_t stamp);
+uint64_t getMvccStamp(redisDb *db, robj *key);
 robj *lookupKey(redisDb *db, robj *key, int flags);
 robj *lookupKeyRead(redisDb *db, robj *key);
 robj *lookupKeyWrite(redisDb *db, robj *key);
@@ -2047,13 +2212,16 @@ void objectSetLRUOrLFU(robj *val, long long lfu_freq, long long lru_idle,
 #define LOOKUP_NOTOUCH (1<<0)
 void dbAdd(redisDb *db, robj *key, robj *val);
 void dbOverwrite(redisDb *db, robj *key, robj *val);
-int dbMerge(redisDb *db, robj *key, robj *val, int fReplace);
+int dbMerge(redisDb *db, robj *key, robj *val, int fReplace, uint64_t stamp);
 void setKey(redisDb *db, robj *key, robj *val);
 int dbExists(redisDb *db, robj *key);
 robj *dbRandomKey(redisDb *db);
 int dbSyncDelete(redisDb *db, robj *key);
 int dbDelete(redisDb *db, robj *key);
 robj *dbUnshareStringValue(redisDb *db, robj *key, robj *o);
+pthread_rwlock_t *keyspaceShardLockForCommand(client *c, int *pfWrite);
+pthread_rwlock_t *keyspaceShardLockForReplicaCommand(client *c);
+void keyspaceShardReleaseScriptKeys(void);
 
 #define EMPTYDB_NO_FLAGS 0      /* No flags. */
 #define EMPTYDB_ASYNC (1<<0)    /* Reclaim memory in another thread. */
@@ -2115,6 +2283,9 @@ int ldbRemoveChild(pid_t pid);
 void ldbKillForkedSessions(void);
 int ldbPendingChildren(void);
 sds luaCreateFunction(client *c, lua_State *lua, robj *body);
+int luaScriptOptsInShard(robj *script, int evalsha);
+lua_State *scriptingThreadLua(void);
+size_t scriptingMemory(void);
 
 /* Blocked clients */
 void processUnblockedClients(int iel);
@@ -2137,6 +2308,13 @@ size_t getSlaveKeyWithExpireCount(void);
 
 /* evict.c -- maxmemory handling and LRU eviction. */
 void evictionPoolAlloc(void);
+void evictionThreadStart(void);
+void evictionThreadWakeup(void);
+
+/* tiering.c -- cold values on the scratch file */
+void tieringPromoteValue(robj *o);
+int tieringApplyConfig(void);
+size_t tieringColdMemory(void);
 #define LFU_INIT_VAL 5
 unsigned long LFUGetTimeInMinutes(void);
 uint8_t LFULogIncr(uint8_t value);
@@ -2315,6 +2493,7 @@ void bitopCommand(client *c);
 void bitcountCommand(client *c);
 void bitposCommand(client *c);
 void replconfCommand(client *c);
+void rreplayCommand(client *c);
 void waitCommand(client *c);
 void geoencodeCommand(client *c);
 void geodecodeCommand(client *c);
@@ -2382,6 +2561,18 @@ static inline int GlobalLocksAcquired(void)  // Used in asserts to verify all gl
     return aeThreadOwnsLock() || moduleGILAcquiredByModule();
 }
 
+/* Called before a key is modified or deleted, so that a forkless BGSAVE
+ * that did not reach the key yet can save the value it had when it started. */
+static inline void snapshotPreserveKey(redisDb *db, robj *key)
+{
+    if (server.snapshot_capturing) snapshotPreserveKeyCore(db,key);
+}
+
+static inline int KeyspaceLocksAcquired(void)  // Like GlobalLocksAcquired() but also true when running under a keyspace shard lock
+{
+    return GlobalLocksAcquired() || aeThreadOwnsSharedLock();
+}
+
 inline int ielFromEventLoop(const aeEventLoop *eventLoop)
 {
     int iel = 0;
@@ -0,0 +1,420 @@
+/* Forkless snapshots
+ *
+ * With forkless-bgsave enabled a BGSAVE doesn't fork(). A snapshot thread
+ * walks the hash table buckets of every DB in order, serializing a bounded
+ * number of buckets at a time while holding the global lock, and writes the
+ * result to the temp file after releasing it. The bucket positions of the
+ * keyspace are pinned for the duration of the walk by counting the snapshot
+ * as a dict iterator, which stops incremental rehashing.
+ *
+ * To produce a point-in-time view, the write paths of db.c call
+ * snapshotPreserveKey() before modifying or deleting a key. If the cursor of
+ * the thread did not reach the key yet, its current value is serialized into
+ * the 'preserved' dict of its DB, and the walk skips it later: preserved
+ * values are written at the end of the file instead. Keys that did not exist
+ * when the snapshot started are preserved as NULL, so they are not saved at
+ * all. This is copy-on-write at the granularity of a key, paid only by the
+ * keys actually modified during the snapshot, instead of the page granularity
+ * a forked child gets.
+ *
+ * Operations replacing whole hash tables (FLUSHDB, SWAPDB, a full resync)
+ * first drain the snapshot up to the DBs they touch, serializing them
+ * synchronously. FLUSHALL and SHUTDOWN abort it like they kill a child. */
+
+extern "C" {
+#include "rio.h"
+}
+#include "server.h"
+#include <atomic>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/* A single step of the walk serializes at most this many buckets, or stops
+ * as soon as this many bytes are pending, bounding the time the snapshot
+ * thread holds the global lock. */
+#define SNAPSHOT_STEP_BUCKETS 1024
+#define SNAPSHOT_STEP_BYTES (64*1024)
+
+enum class SnapshotStatus
+{
+    Ok,
+    Err,
+    Aborted
+};
+
+static struct
+{
+    pthread_t thread;
+    /* Cursor: next bucket to save. DBs before dbid are already saved. */
+    int dbid;
+    int table;
+    unsigned long bucket;
+    dict **rgpreserved;         /* Per DB: key -> serialized value, or NULL */
+    rio pending;                /* Serialized but not yet written to disk */
+    int fSaveLua;               /* Persist the script cache */
+    char tmpfile[256];
+    sds filename;
+    int fd;
+    long long dirty_before;
+    std::atomic<bool> fAbort;
+    std::atomic<bool> fDone;
+    SnapshotStatus status;
+    int err;                    /* errno of a failed write */
+} g_snapshot;
+
+/* Preserved values are owned by the dict. */
+static dictType preservedDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    dictSdsDestructor           /* val destructor */
+};
+
+/* Serialize a key the way rdbSaveRio() would. */
+static int snapshotSaveKey(rio *rdb, redisDb *db, sds keystr, robj *val) {
+    robj key;
+    initStaticStringObject(key,keystr);
+    return rdbSaveKeyValuePair(rdb,&key,val,getExpire(db,&key),
+                               getMvccStamp(db,&key));
+}
+
+/* Stop pinning the keyspace: writers no longer preserve values and the DBs
+ * not walked yet can rehash again. */
+static void snapshotDetach(void) {
+    serverAssert(server.snapshot_capturing);
+    for (int j = 0; j < server.dbnum; j++) {
+        if (j >= g_snapshot.dbid) server.db[j].pdict->iterators--;
+        dictRelease(g_snapshot.rgpreserved[j]);
+    }
+    zfree(g_snapshot.rgpreserved);
+    g_snapshot.rgpreserved = NULL;
+    server.snapshot_capturing = 0;
+}
+
+/* Write what follows the keyspace: the preserved values, the script cache
+ * and the EOF opcode. The checksum is added by the snapshot thread. */
+static int snapshotSaveTrailer(void) {
+    rio *rdb = &g_snapshot.pending;
+
+    for (int j = 0; j < server.dbnum; j++) {
+        dict *preserved = g_snapshot.rgpreserved[j];
+        dictIterator *di;
+        dictEntry *de;
+        int fSelected = 0;
+
+        if (dictSize(preserved) == 0) continue;
+        di = dictGetIterator(preserved);
+        while((de = dictNext(di)) != NULL) {
+            sds payload = (sds)dictGetVal(de);
+            if (payload == NULL) continue;
+            if (!fSelected) {
+                if (rdbSaveType(rdb,RDB_OPCODE_SELECTDB) == -1 ||
+                    rdbSaveLen(rdb,j) == -1)
+                {
+                    dictReleaseIterator(di);
+                    return C_ERR;
+                }
+                fSelected = 1;
+            }
+            if (rioWrite(rdb,payload,sdslen(payload)) == 0) {
+                dictReleaseIterator(di);
+                return C_ERR;
+            }
+        }
+        dictReleaseIterator(di);
+    }
+
+    if (g_snapshot.fSaveLua && rdbSaveLuaScripts(rdb) == -1)
+        return C_ERR;
+
+    if (rdbSaveType(rdb,RDB_OPCODE_EOF) == -1) return C_ERR;
+    return C_OK;
+}
+
+/* Serialize the next buckets of the walk into the pending buffer. Returns 1
+ * once the whole keyspace was walked, the trailer is pending and the
+ * keyspace is no longer pinned, otherwise 0. Called with the global lock. */
+static int snapshotSaveStep(void) {
+    rio *rdb = &g_snapshot.pending;
+    unsigned long buckets = 0;
+
+    serverAssert(server.snapshot_capturing);
+    while (g_snapshot.dbid < server.dbnum) {
+        redisDb *db = server.db+g_snapshot.dbid;
+        dict *d = db->pdict;
+        dictht *ht = &d->ht[g_snapshot.table];
+
+        if (g_snapshot.table == 0 && g_snapshot.bucket == 0 && dictSize(d)) {
+            /* Entering a DB: SELECTDB and RESIZEDB as in rdbSaveRio(). */
+            if (rdbSaveType(rdb,RDB_OPCODE_SELECTDB) == -1) goto werr;
+            if (rdbSaveLen(rdb,g_snapshot.dbid) == -1) goto werr;
+            if (rdbSaveType(rdb,RDB_OPCODE_RESIZEDB) == -1) goto werr;
+            if (rdbSaveLen(rdb,dictSize(d)) == -1) goto werr;
+            if (rdbSaveLen(rdb,dictSize(db->expires)) == -1) goto werr;
+        }
+
+        if (g_snapshot.bucket < ht->size) {
+            dict *preserved = g_snapshot.rgpreserved[g_snapshot.dbid];
+            for (dictEntry *de = ht->table[g_snapshot.bucket]; de != NULL; de = de->next) {
+                sds keystr = (sds)dictGetKey(de);
+                if (dictSize(preserved) && dictFind(preserved,keystr)) continue;
+                if (snapshotSaveKey(rdb,db,keystr,(robj*)dictGetVal(de)) == -1)
+                    goto werr;
+            }
+            g_snapshot.bucket++;
+            if (++buckets >= SNAPSHOT_STEP_BUCKETS ||
+                sdslen(rdb->io.buffer.ptr) >= SNAPSHOT_STEP_BYTES) return 0;
+            continue;
+        }
+
+        /* Done with this table. Keys added after the snapshot started may
+         * live in ht[1], but they are all preserved as NULL. */
+        if (g_snapshot.table == 0 && dictIsRehashing(d)) {
+            g_snapshot.table = 1;
+            g_snapshot.bucket = 0;
+            continue;
+        }
+        d->iterators--;
+        g_snapshot.dbid++;
+        g_snapshot.table = 0;
+        g_snapshot.bucket = 0;
+    }
+
+    if (snapshotSaveTrailer() == C_ERR) goto werr;
+    snapshotDetach();
+    return 1;
+
+werr:
+    /* Writing to a buffer only fails on a serialization error, which would
+     * crash rdbSaveRio() too. */
+    serverPanic("Forkless BGSAVE failed to serialize the keyspace");
+    return 1;
+}
+
+/* Take the pending buffer, to write it without holding the global lock. */
+static sds snapshotTakePending(void) {
+    sds buf = g_snapshot.pending.io.buffer.ptr;
+    rioInitWithBuffer(&g_snapshot.pending,sdsempty());
+    return buf;
+}
+
+static void *snapshotThreadMain(void *) {
+    rio rdb;
+    int fFinished = 0;
+    uint64_t cksum;
+
+    rioInitWithFile(&rdb,g_snapshot.fd);
+    if (server.rdb_checksum)
+        rdb.update_cksum = rioGenericUpdateChecksum;
+    if (server.rdb_save_incremental_fsync)
+        rioSetAutoSync(&rdb,REDIS_AUTOSYNC_BYTES);
+
+    g_snapshot.status = SnapshotStatus::Ok;
+    while (!fFinished) {
+        aeAcquireLock();
+        if (g_snapshot.fAbort) {
+            aeReleaseLock();
+            g_snapshot.status = SnapshotStatus::Aborted;
+            break;
+        }
+        /* The main thread may have completed the walk draining it. */
+        fFinished = !server.snapshot_capturing || snapshotSaveStep();
+        sds buf = snapshotTakePending();
+        aeReleaseLock();
+
+        size_t cb = sdslen(buf);
+        int fWritten = rioWrite(&rdb,buf,cb) != 0;
+        sdsfree(buf);
+        if (!fWritten) {
+            g_snapshot.err = errno;
+            g_snapshot.status = SnapshotStatus::Err;
+            aeAcquireLock();
+            if (server.snapshot_capturing) snapshotDetach();
+            aeReleaseLock();
+            break;
+        }
+    }
+
+    if (g_snapshot.status == SnapshotStatus::Ok) {
+        /* CRC64 checksum, zero if checksum computation is disabled. */
+        cksum = rdb.cksum;
+        memrev64ifbe(&cksum);
+        if (rioWrite(&rdb,&cksum,8) == 0 || fsync(g_snapshot.fd) == -1) {
+            g_snapshot.err = errno;
+            g_snapshot.status = SnapshotStatus::Err;
+        }
+    }
+    close(g_snapshot.fd);
+    g_snapshot.fd = -1;
+
+    /* The rename is left to snapshotCron(), under the global lock, so it
+     * can't race a SAVE or a child writing the same file. */
+    if (g_snapshot.status != SnapshotStatus::Ok) unlink(g_snapshot.tmpfile);
+
+    sdsfree(g_snapshot.pending.io.buffer.ptr);
+    g_snapshot.pending.io.buffer.ptr = NULL;
+    g_snapshot.fDone = true;
+    return NULL;
+}
+
+/* Return true if the next BGSAVE can use the snapshot thread. Module data
+ * types and the S3 target still use a forked child. */
+int snapshotCanStart(void) {
+    return server.forkless_bgsave && !server.rdb_thread_active &&
+           server.rdb_filename != NULL && server.rdb_s3bucketpath == NULL &&
+           moduleCount() == 0;
+}
+
+/* Start a forkless BGSAVE. Returns C_OK if the snapshot thread was started,
+ * C_ERR otherwise. */
+int snapshotStart(rdbSaveInfo *rsi) {
+    char magic[10];
+
+    serverAssert(GlobalLocksAcquired());
+    if (server.rdb_thread_active) return C_ERR;
+
+    server.lastbgsave_try = time(NULL);
+    snprintf(g_snapshot.tmpfile,sizeof(g_snapshot.tmpfile),
+        "temp-snapshot-%d.rdb",(int) getpid());
+    g_snapshot.fd = open(g_snapshot.tmpfile,O_WRONLY|O_CREAT|O_TRUNC,0644);
+    if (g_snapshot.fd == -1) {
+        server.lastbgsave_status = C_ERR;
+        serverLog(LL_WARNING,"Can't save in background: open %s: %s",
+            g_snapshot.tmpfile, strerror(errno));
+        return C_ERR;
+    }
+
+    /* The header is written from the state at the start of the snapshot. */
+    rioInitWithBuffer(&g_snapshot.pending,sdsempty());
+    snprintf(magic,sizeof(magic),"REDIS%04d",RDB_VERSION);
+    rioWrite(&g_snapshot.pending,magic,9);
+    rdbSaveInfoAuxFields(&g_snapshot.pending,RDB_SAVE_NONE,rsi);
+
+    g_snapshot.rgpreserved = (dict**)zmalloc(sizeof(dict*)*server.dbnum, MALLOC_LOCAL);
+    for (int j = 0; j < server.dbnum; j++) {
+        g_snapshot.rgpreserved[j] = dictCreate(&preservedDictType,NULL);
+        server.db[j].pdict->iterators++;
+    }
+    g_snapshot.dbid = 0;
+    g_snapshot.table = 0;
+    g_snapshot.bucket = 0;
+    g_snapshot.fSaveLua = rsi != NULL || server.lua_persist_scripts;
+    g_snapshot.filename = sdsnew(server.rdb_filename);
+    g_snapshot.dirty_before = server.dirty;
+    g_snapshot.fAbort = false;
+    g_snapshot.fDone = false;
+    g_snapshot.err = 0;
+    server.snapshot_capturing = 1;
+    server.rdb_thread_active = 1;
+
+    if (pthread_create(&g_snapshot.thread,NULL,snapshotThreadMain,NULL) != 0) {
+        snapshotDetach();
+        server.rdb_thread_active = 0;
+        sdsfree(g_snapshot.pending.io.buffer.ptr);
+        sdsfree(g_snapshot.filename);
+        close(g_snapshot.fd);
+        unlink(g_snapshot.tmpfile);
+        server.lastbgsave_status = C_ERR;
+        serverLog(LL_WARNING,"Can't save in background: can't create the snapshot thread");
+        return C_ERR;
+    }
+    server.rdb_thread_save_time_start = time(NULL);
+    serverLog(LL_NOTICE,"Background saving started by snapshot thread");
+    return C_OK;
+}
+
+/* Abort a forkless BGSAVE, for instance because FLUSHALL made the dataset
+ * it is saving obsolete. The thread notices it at its next step. */
+void snapshotAbort(void) {
+    serverAssert(GlobalLocksAcquired());
+    if (!server.rdb_thread_active || g_snapshot.fAbort) return;
+    g_snapshot.fAbort = true;
+    if (server.snapshot_capturing) snapshotDetach();
+    unlink(g_snapshot.tmpfile);
+}
+
+/* Walk the keyspace on the calling thread until the snapshot is done with
+ * DB 'dbid' (every DB if -1), before its hash tables are emptied or
+ * replaced. The serialized data is written by the snapshot thread. */
+void snapshotDrain(int dbid) {
+    serverAssert(GlobalLocksAcquired());
+    if (dbid == -1) dbid = server.dbnum-1;
+    while (server.snapshot_capturing && g_snapshot.dbid <= dbid)
+        snapshotSaveStep();
+}
+
+/* Called by serverCron(): handle the end of the snapshot thread like
+ * backgroundSaveDoneHandlerDisk() handles the end of a child. */
+void snapshotCron(void) {
+    if (!server.rdb_thread_active || !g_snapshot.fDone) return;
+    pthread_join(g_snapshot.thread,NULL);
+
+    if (g_snapshot.status == SnapshotStatus::Ok && g_snapshot.fAbort)
+        g_snapshot.status = SnapshotStatus::Aborted;
+    if (g_snapshot.status == SnapshotStatus::Ok &&
+        rename(g_snapshot.tmpfile,g_snapshot.filename) == -1)
+    {
+        g_snapshot.err = errno;
+        g_snapshot.status = SnapshotStatus::Err;
+    }
+    if (g_snapshot.status != SnapshotStatus::Ok) unlink(g_snapshot.tmpfile);
+
+    switch (g_snapshot.status) {
+    case SnapshotStatus::Ok:
+        serverLog(LL_NOTICE,"Background saving terminated with success");
+        server.dirty = server.dirty - g_snapshot.dirty_before;
+        server.lastsave = time(NULL);
+        server.lastbgsave_status = C_OK;
+        break;
+    case SnapshotStatus::Err:
+        serverLog(LL_WARNING,"Background saving error: %s",
+            strerror(g_snapshot.err));
+        server.lastbgsave_status = C_ERR;
+        break;
+    case SnapshotStatus::Aborted:
+        serverLog(LL_WARNING,"Background saving aborted");
+        break;
+    }
+    sdsfree(g_snapshot.filename);
+    g_snapshot.filename = NULL;
+    server.rdb_thread_active = 0;
+    server.rdb_save_time_last = time(NULL)-server.rdb_thread_save_time_start;
+    server.rdb_thread_save_time_start = -1;
+}
+
+/* See snapshotPreserveKey(). */
+void snapshotPreserveKeyCore(redisDb *db, robj *key) {
+    dict *d = db->pdict;
+    dict *preserved;
+    sds keystr = (sds)ptrFromObj(key);
+    sds payload = NULL;
+
+    if (db->id < g_snapshot.dbid) return;   /* Already saved */
+    preserved = g_snapshot.rgpreserved[db->id];
+    if (dictSize(preserved) && dictFind(preserved,keystr)) return;
+
+    dictEntry *de = dictFind(d,keystr);
+    if (de != NULL) {
+        if (db->id == g_snapshot.dbid) {
+            /* Rehashing is stopped, so the key stays where it is until the
+             * walk is done with this DB. */
+            uint64_t h = dictHashKey(d,keystr);
+            int table = (dictIsRehashing(d) &&
+                (long)(h & d->ht[0].sizemask) < d->rehashidx) ? 1 : 0;
+            unsigned long bucket = h & d->ht[table].sizemask;
+            if (table < g_snapshot.table ||
+                (table == g_snapshot.table && bucket < g_snapshot.bucket))
+                return;     /* Already saved */
+        }
+        rio rdb;
+        rioInitWithBuffer(&rdb,sdsempty());
+        snapshotSaveKey(&rdb,db,keystr,(robj*)dictGetVal(de));
+        payload = rdb.io.buffer.ptr;
+    }
+    /* A key that didn't exist is preserved as NULL wherever the dict places
+     * it, so it is never saved. */
+    dictAdd(preserved,sdsdup(keystr),payload);
+}
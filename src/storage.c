@@ -14,6 +14,8 @@
 
 struct memkind *mkdisk = NULL;
 static const char *PMEM_DIR = NULL;
+static int fTiering = 0;        // MALLOC_SHARED allocations stay in DRAM
+static size_t cbScratchUsed = 0;
 
 int memkind_pmem_iskind(struct memkind *kind, const void *pv);
 
@@ -21,99 +23,230 @@ void handle_prefork();
 void handle_postfork_parent();
 void handle_postfork_child();
 
-#define OBJECT_PAGE_BUFFER_SIZE 8192 //(size in objs)
+/* Object pools
+ *
+ * Fixed size objects are carved from pages of OBJECT_PAGE_MIN_OBJECTS slots
+ * or more. Every thread allocates from pools of its own, so threads don't
+ * contend on the same pages, and any thread may free an object: the pages
+ * are aligned on their size, a power of two, so the page of an object (and
+ * the pool owning it) is found by masking its address.
+ *
+ * In each page 'allocmap' has a bit set for every slot in use, and 'fullmap'
+ * one for every word of 'allocmap' without free slots, so that a free slot
+ * is found with two ctz. The pages with free slots are linked together, and
+ * allocations are served from the first one. A page left empty is released,
+ * unless it is the only one of its pool with free slots. */
+#define OBJECT_PAGE_MIN_OBJECTS 8192
+#define OBJECT_PAGE_BUFFER_SIZE (2*OBJECT_PAGE_MIN_OBJECTS) //(max size in objs)
 #define OBJ_PAGE_BITS_PER_WORD 64
+#define OBJ_PAGE_WORDS (OBJECT_PAGE_BUFFER_SIZE/OBJ_PAGE_BITS_PER_WORD)
+struct alloc_pool;
 struct object_page
 {
-    uint64_t allocmap[OBJECT_PAGE_BUFFER_SIZE/(8*sizeof(uint64_t))];
-    struct object_page *pnext;
+    uint64_t allocmap[OBJ_PAGE_WORDS];
+    uint64_t fullmap[OBJ_PAGE_WORDS/OBJ_PAGE_BITS_PER_WORD];
+    struct alloc_pool *ppool;
+    struct object_page *pnextFree;
+    struct object_page *pprevFree;
+    unsigned cobjUsed;
     char rgb[];
 };
 
 struct alloc_pool
 {
     unsigned cbObject;
-    struct object_page *pobjpageHead;
+    unsigned cobjPage;      // slots of a page
+    size_t cbPage;          // size and alignment of a page
+    pthread_mutex_t lock;   // taken by frees from other threads too
+    struct object_page *ppageFreeHead;
+    size_t cpages;
+    size_t cobjUsed;
+    struct alloc_pool *pnext;
 };
 
-
-struct object_page *pool_allocate_page(int cbObject)
+#define EMBSTR_ROBJ_SIZE (sizeof(robj)+sizeof(struct sdshdr8)+OBJ_ENCODING_EMBSTR_SIZE_LIMIT+1)
+enum POOL_CLASS
 {
-    size_t cb = (((size_t)cbObject) * OBJECT_PAGE_BUFFER_SIZE) + sizeof(struct object_page);
-    return scalloc(cb, 1, MALLOC_SHARED);
-}
-void pool_initialize(struct alloc_pool *ppool, int cbObject)
+    POOL_OBJ,
+    POOL_EMBSTR_OBJ,
+    POOL_CLASS_COUNT
+};
+static const unsigned rgcbPoolClass[POOL_CLASS_COUNT] = { sizeof(robj), EMBSTR_ROBJ_SIZE };
+static size_t rgcbPagePoolClass[POOL_CLASS_COUNT];
+static __thread struct alloc_pool *rgpoolThread[POOL_CLASS_COUNT];
+static struct alloc_pool *ppoolHead = NULL;    // the pools of all the threads
+static pthread_mutex_t poolsLock = PTHREAD_MUTEX_INITIALIZER;
+
+static memkind_t kindFromClass(enum MALLOC_CLASS class);
+static void *scratch_track_alloc(memkind_t kind, void *pv);
+
+static unsigned pool_object_size(enum POOL_CLASS pclass)
 {
+    unsigned cbObject = rgcbPoolClass[pclass];
     if ((cbObject % 8) != 0)
     {
         cbObject += 8 - (cbObject % 8);
     }
+    return cbObject;
+}
+
+static size_t pool_page_size(unsigned cbObject)
+{
+    size_t cbPage = 1;
+    while (cbPage < sizeof(struct object_page) + ((size_t)cbObject) * OBJECT_PAGE_MIN_OBJECTS)
+        cbPage <<= 1;
+    return cbPage;
+}
+
+static struct alloc_pool *pool_create(enum POOL_CLASS pclass)
+{
+    struct alloc_pool *ppool = salloc(sizeof(struct alloc_pool), MALLOC_LOCAL);
+    unsigned cbObject = pool_object_size(pclass);
+
     ppool->cbObject = cbObject;
-    ppool->pobjpageHead = pool_allocate_page(cbObject);
+    ppool->cbPage = rgcbPagePoolClass[pclass];
+    ppool->cobjPage = (ppool->cbPage - sizeof(struct object_page)) / cbObject;
+    if (ppool->cobjPage > OBJECT_PAGE_BUFFER_SIZE)
+        ppool->cobjPage = OBJECT_PAGE_BUFFER_SIZE;
+    pthread_mutex_init(&ppool->lock, NULL);
+    ppool->ppageFreeHead = NULL;
+    ppool->cpages = 0;
+    ppool->cobjUsed = 0;
+
+    pthread_mutex_lock(&poolsLock);
+    ppool->pnext = ppoolHead;
+    ppoolHead = ppool;
+    pthread_mutex_unlock(&poolsLock);
+    return ppool;
 }
-static int IdxAllocObject(struct object_page *page)
+
+static void pool_link_free_page(struct alloc_pool *ppool, struct object_page *page)
 {
-    for (size_t iword = 0; iword < OBJ_PAGE_BITS_PER_WORD; ++iword)
-    {
-        if ((page->allocmap[iword] + 1) != 0)
-        {
-            int ibit = 0;
-            uint64_t bitword = page->allocmap[iword];
-            while (bitword & 1)
-            {
-                bitword >>= 1;
-                ++ibit;
-            }
-            page->allocmap[iword] |= 1ULL << ibit;
-            return (iword * OBJ_PAGE_BITS_PER_WORD) + ibit;
-        }
-    }
-    return -1;
+    page->pprevFree = NULL;
+    page->pnextFree = ppool->ppageFreeHead;
+    if (page->pnextFree != NULL)
+        page->pnextFree->pprevFree = page;
+    ppool->ppageFreeHead = page;
 }
-void *pool_alloc(struct alloc_pool *ppool)
+
+static void pool_unlink_free_page(struct alloc_pool *ppool, struct object_page *page)
 {
-    struct object_page *cur = ppool->pobjpageHead;
-    for (;;)
+    if (page->pprevFree != NULL)
+        page->pprevFree->pnextFree = page->pnextFree;
+    else
+        ppool->ppageFreeHead = page->pnextFree;
+    if (page->pnextFree != NULL)
+        page->pnextFree->pprevFree = page->pprevFree;
+    page->pnextFree = page->pprevFree = NULL;
+}
+
+static struct object_page *pool_allocate_page(struct alloc_pool *ppool)
+{
+    struct object_page *page;
+    memkind_t kind = kindFromClass(MALLOC_SHARED);
+    void *pv = NULL;
+
+    if (memkind_posix_memalign(kind, &pv, ppool->cbPage, ppool->cbPage) != 0)
     {
-        int idx = IdxAllocObject(cur);
-        if (idx >= 0)
-        {
-            return cur->rgb + (((size_t)ppool->cbObject) * idx);
-        }
+        serverLog(LOG_CRIT, "Out of memory allocating an object page");
+        exit(EXIT_FAILURE);
+    }
+    page = scratch_track_alloc(kind, pv);
+    memset(page, 0, sizeof(struct object_page));
+    page->ppool = ppool;
+
+    // The slots past the end of the page are never free
+    for (unsigned idx = ppool->cobjPage; idx < OBJECT_PAGE_BUFFER_SIZE; ++idx)
+        page->allocmap[idx / OBJ_PAGE_BITS_PER_WORD] |= 1ULL << (idx % OBJ_PAGE_BITS_PER_WORD);
+    for (unsigned iword = 0; iword < OBJ_PAGE_WORDS; ++iword)
+    {
+        if (page->allocmap[iword] == UINT64_MAX)
+            page->fullmap[iword / OBJ_PAGE_BITS_PER_WORD] |= 1ULL << (iword % OBJ_PAGE_BITS_PER_WORD);
+    }
 
-        if (cur->pnext == NULL)
-        {
-            cur->pnext = pool_allocate_page(ppool->cbObject);
-        }
+    pool_link_free_page(ppool, page);
+    ppool->cpages++;
+    return page;
+}
 
-        cur = cur->pnext;
+static int IdxAllocObject(struct object_page *page)
+{
+    for (size_t ifull = 0; ifull < OBJ_PAGE_WORDS/OBJ_PAGE_BITS_PER_WORD; ++ifull)
+    {
+        if (page->fullmap[ifull] == UINT64_MAX)
+            continue;
+        int iword = (ifull * OBJ_PAGE_BITS_PER_WORD) + __builtin_ctzll(~page->fullmap[ifull]);
+        int ibit = __builtin_ctzll(~page->allocmap[iword]);
+        page->allocmap[iword] |= 1ULL << ibit;
+        if (page->allocmap[iword] == UINT64_MAX)
+            page->fullmap[ifull] |= 1ULL << (iword % OBJ_PAGE_BITS_PER_WORD);
+        return (iword * OBJ_PAGE_BITS_PER_WORD) + ibit;
     }
+    return -1;
 }
 
-void pool_free(struct alloc_pool *ppool, void *pv)
+static void *pool_alloc(enum POOL_CLASS pclass)
 {
-    struct object_page *cur = ppool->pobjpageHead;
+    struct alloc_pool *ppool = rgpoolThread[pclass];
+    if (ppool == NULL)
+        ppool = rgpoolThread[pclass] = pool_create(pclass);
+
+    pthread_mutex_lock(&ppool->lock);
+    struct object_page *page = ppool->ppageFreeHead;
+    if (page == NULL)
+        page = pool_allocate_page(ppool);
+    int idx = IdxAllocObject(page);
+    serverAssert(idx >= 0);
+    if (++page->cobjUsed == ppool->cobjPage)
+        pool_unlink_free_page(ppool, page);
+    ppool->cobjUsed++;
+    pthread_mutex_unlock(&ppool->lock);
+    return page->rgb + (((size_t)ppool->cbObject) * idx);
+}
+
+static void pool_free(enum POOL_CLASS pclass, void *pv)
+{
+    struct object_page *page = (struct object_page*)((uintptr_t)pv & ~(uintptr_t)(rgcbPagePoolClass[pclass] - 1));
+    struct alloc_pool *ppool = page->ppool;
     char *obj = pv;
 
-    for (;cur != NULL;)
+    pthread_mutex_lock(&ppool->lock);
+    int idx = (obj - page->rgb) / ppool->cbObject;
+    int iword = idx / OBJ_PAGE_BITS_PER_WORD;
+    uint64_t mask = 1ULL << (idx % OBJ_PAGE_BITS_PER_WORD);
+    serverAssert(page->allocmap[iword] & mask);
+    page->allocmap[iword] &= ~mask;
+    page->fullmap[iword / OBJ_PAGE_BITS_PER_WORD] &= ~(1ULL << (iword % OBJ_PAGE_BITS_PER_WORD));
+    if (page->cobjUsed-- == ppool->cobjPage)
+        pool_link_free_page(ppool, page);
+    ppool->cobjUsed--;
+
+    if (page->cobjUsed == 0 && (page->pnextFree != NULL || page->pprevFree != NULL))
     {
-        if (obj >= cur->rgb && (obj < (cur->rgb + (OBJECT_PAGE_BUFFER_SIZE * ppool->cbObject))))
-        {
-            // Its on this page
-            int idx = (obj - cur->rgb) / ppool->cbObject;
-            cur->allocmap[idx / OBJ_PAGE_BITS_PER_WORD] &= ~(1ULL << (idx % OBJ_PAGE_BITS_PER_WORD));
-            return;
-        }
-        cur = cur->pnext;
+        // Empty, and not the last page we can allocate from
+        pool_unlink_free_page(ppool, page);
+        ppool->cpages--;
+        sfree(page);
     }
-    serverLog(LOG_CRIT, "obj not from pool");
-    sfree(obj); // we don't know where it came from
-    return;
+    pthread_mutex_unlock(&ppool->lock);
 }
 
-#define EMBSTR_ROBJ_SIZE (sizeof(robj)+sizeof(struct sdshdr8)+OBJ_ENCODING_EMBSTR_SIZE_LIMIT+1)
-struct alloc_pool poolobj;
-struct alloc_pool poolembstrobj;
+void storage_pool_stats(struct storage_pool_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&poolsLock);
+    for (struct alloc_pool *ppool = ppoolHead; ppool != NULL; ppool = ppool->pnext)
+    {
+        pthread_mutex_lock(&ppool->lock);
+        stats->pages += ppool->cpages;
+        stats->page_bytes += ppool->cpages * ppool->cbPage;
+        stats->used_objects += ppool->cobjUsed;
+        stats->used_bytes += ppool->cobjUsed * ppool->cbObject;
+        stats->free_objects += (ppool->cpages * ppool->cobjPage) - ppool->cobjUsed;
+        pthread_mutex_unlock(&ppool->lock);
+    }
+    pthread_mutex_unlock(&poolsLock);
+}
 
 int forkFile()
 {
@@ -136,8 +269,8 @@ void storage_init(const char *tmpfilePath, size_t cbFileReserve)
     {
         serverAssert(mkdisk == NULL);
         mkdisk = MEMKIND_DEFAULT;
-        pool_initialize(&poolobj, sizeof(robj));
-        pool_initialize(&poolembstrobj, EMBSTR_ROBJ_SIZE);
+        for (enum POOL_CLASS pclass = 0; pclass < POOL_CLASS_COUNT; ++pclass)
+            rgcbPagePoolClass[pclass] = pool_page_size(pool_object_size(pclass));
     }
     else
     {
@@ -181,19 +314,19 @@ void storage_init(const char *tmpfilePath, size_t cbFileReserve)
 
 struct redisObject *salloc_obj()
 {
-    return pool_alloc(&poolobj);
+    return pool_alloc(POOL_OBJ);
 }
 void sfree_obj(struct redisObject *obj)
 {
-    pool_free(&poolobj, obj);
+    pool_free(POOL_OBJ, obj);
 }
 struct redisObject *salloc_objembstr()
 {
-    return pool_alloc(&poolembstrobj);
+    return pool_alloc(POOL_EMBSTR_OBJ);
 }
 void sfree_objembstr(robj *obj)
 {
-    pool_free(&poolembstrobj, obj);
+    pool_free(POOL_EMBSTR_OBJ, obj);
 }
 
 static memkind_t kindFromPtr(const void *pv)
@@ -216,6 +349,8 @@ static memkind_t kindFromClass(enum MALLOC_CLASS class)
     switch (class)
     {
     case MALLOC_SHARED:
+        return fTiering ? MEMKIND_DEFAULT : mkdisk;
+    case MALLOC_COLD:
         return mkdisk;
     default:
         break;
@@ -223,27 +358,79 @@ static memkind_t kindFromClass(enum MALLOC_CLASS class)
     return MEMKIND_DEFAULT;
 }
 
+int storage_has_scratch_file()
+{
+    return mkdisk != NULL && mkdisk != MEMKIND_DEFAULT;
+}
+
+void storage_set_tiering(int fEnable)
+{
+    fTiering = fEnable;
+}
+
+// Bytes allocated on the scratch file
+size_t storage_scratch_used()
+{
+    return __atomic_load_n(&cbScratchUsed, __ATOMIC_RELAXED);
+}
+
+int salloc_is_cold(const void *pv)
+{
+    return storage_has_scratch_file() && kindFromPtr(pv) == mkdisk;
+}
+
+static void *scratch_track_alloc(memkind_t kind, void *pv)
+{
+    if (pv != NULL && kind != MEMKIND_DEFAULT)
+        __atomic_fetch_add(&cbScratchUsed, memkind_malloc_usable_size(kind, pv), __ATOMIC_RELAXED);
+    return pv;
+}
+
 void *salloc(size_t cb, enum MALLOC_CLASS class)
 {
+    memkind_t kind = kindFromClass(class);
     if (cb == 0) 
         cb = 1;
         
-    return memkind_malloc(kindFromClass(class), cb);
+    return scratch_track_alloc(kind, memkind_malloc(kind, cb));
 }
 
 void *scalloc(size_t cb, size_t c, enum MALLOC_CLASS class)
 {
-    return memkind_calloc(kindFromClass(class), cb, c);
+    memkind_t kind = kindFromClass(class);
+    return scratch_track_alloc(kind, memkind_calloc(kind, cb, c));
 }
 
 void sfree(void *pv)
 {
-    memkind_free(kindFromPtr(pv), pv);
+    memkind_t kind = kindFromPtr(pv);
+    if (pv != NULL && kind != MEMKIND_DEFAULT)
+        __atomic_fetch_sub(&cbScratchUsed, memkind_malloc_usable_size(kind, pv), __ATOMIC_RELAXED);
+    memkind_free(kind, pv);
 }
 
 void *srealloc(void *pv, size_t cb, enum MALLOC_CLASS class)
 {
-    return memkind_realloc(kindFromClass(class), pv, cb);
+    memkind_t kind = kindFromClass(class);
+    if (pv == NULL)
+        return salloc(cb, class);
+
+    if (kindFromPtr(pv) != kind)
+    {
+        // memkind can't realloc across kinds, for instance when a value
+        // demoted by the tiering is modified: it moves back to DRAM
+        size_t cbOld = salloc_usable_size(pv);
+        void *pvNew = salloc(cb, class);
+        if (pvNew == NULL)
+            return NULL;
+        memcpy(pvNew, pv, cbOld < cb ? cbOld : cb);
+        sfree(pv);
+        return pvNew;
+    }
+
+    if (kind != MEMKIND_DEFAULT)
+        __atomic_fetch_sub(&cbScratchUsed, memkind_malloc_usable_size(kind, pv), __ATOMIC_RELAXED);
+    return scratch_track_alloc(kind, memkind_realloc(kind, pv, cb));
 }
 
 int fdNew = -1;
@@ -11,9 +11,14 @@ enum MALLOC_CLASS
 {
     MALLOC_LOCAL,
     MALLOC_SHARED,
+    MALLOC_COLD,    // Values demoted by the tiering, always on the scratch file
 };
 
 void storage_init(const char *tmpfilePath, size_t cbFileReserve);
+int storage_has_scratch_file();
+void storage_set_tiering(int fTiering);
+size_t storage_scratch_used();
+int salloc_is_cold(const void *pv);
 
 void *salloc(size_t cb, enum MALLOC_CLASS mclass);
 void *scalloc(size_t cb, size_t c, enum MALLOC_CLASS mclass);
@@ -26,6 +31,16 @@ void sfree_objembstr(struct redisObject *obj);
 struct redisObject *salloc_obj();
 void sfree_obj(struct redisObject *obj);
 
+struct storage_pool_stats
+{
+    size_t pages;           // pages of the object pools
+    size_t page_bytes;      // memory of the pages
+    size_t used_objects;    // slots in use
+    size_t used_bytes;      // memory of the slots in use
+    size_t free_objects;    // free slots of the pages
+};
+void storage_pool_stats(struct storage_pool_stats *stats);
+
 #ifdef __cplusplus
 }
 #endif
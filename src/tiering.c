@@ -0,0 +1,220 @@
+/* Tiered storage
+ *
+ * With scratch-file-tiering enabled the MALLOC_SHARED allocations are served
+ * from DRAM instead of the scratch file, and only the values of the keys that
+ * are not accessed anymore are moved there. A thread scans the keyspace in
+ * the background, a few buckets at a time under the global lock, and demotes
+ * the values whose access counter decayed below
+ * scratch-file-tiering-lfu-threshold to the MALLOC_COLD class. The keys, their
+ * dictEntry and robj always stay in DRAM, so the keyspace can be walked
+ * without touching the scratch file. A demoted value is promoted back to DRAM
+ * as soon as a command accesses it, but not by the lookups that don't touch
+ * the access time (OBJECT, TYPE, DEBUG, ...), or when it is modified, since
+ * srealloc() moves allocations to the class asked for.
+ *
+ * Only the values held by the keyspace alone (refcount of 1) are moved: a
+ * reply referencing an object may be written to its client by another
+ * thread. Their allocations must also be few, so the tiering handles strings
+ * with the RAW encoding, lists, and the hashes, sets and sorted sets using a
+ * compact encoding.
+ */
+
+#include "server.h"
+#include "atomicvar.h"
+
+#ifdef USE_MEMKIND
+
+#include <time.h>
+
+#define TIERING_SCAN_BUCKETS 1024       /* Buckets scanned per step */
+#define TIERING_STEP_BYTES (1024*1024)  /* Demoted bytes per step at most */
+
+static pthread_t tieringThread;
+static int tieringThreadStarted = 0;
+
+/* Return the access counter of the object, as the LFU policies maintain it.
+ * With other policies the counter is derived from the idle time, decaying as
+ * it would for an object never accessed since it was created. */
+static unsigned long tieringAccessCounter(robj *o) {
+    unsigned long periods;
+
+    if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU)
+        return LFUDecrAndReturn(o);
+    if (server.lfu_decay_time == 0) return LFU_INIT_VAL;
+    periods = estimateObjectIdleTime(o)/1000/60/server.lfu_decay_time;
+    return (periods >= LFU_INIT_VAL) ? 0 : LFU_INIT_VAL-periods;
+}
+
+/* Move the zmalloc()ed allocation 'ptr' to the allocation class 'mclass',
+ * returning the new pointer. The old pointer is released. */
+static void *tieringMoveAlloc(void *ptr, enum MALLOC_CLASS mclass, size_t *moved) {
+    size_t size = zmalloc_usable(ptr);
+    void *newptr = zmalloc(size, mclass);
+
+    memcpy(newptr, ptr, size);
+    zfree(ptr);
+    if (moved) *moved += size;
+    return newptr;
+}
+
+/* Return the allocation telling in which tier a value is. */
+static void *tieringValueAlloc(robj *o) {
+    if (o->type == OBJ_STRING) return sdsAllocPtr(ptrFromObj(o));
+    if (o->type == OBJ_LIST) {
+        quicklist *ql = ptrFromObj(o);
+        return ql->head ? ql->head->zl : NULL;
+    }
+    return ptrFromObj(o);
+}
+
+/* Return true if the tiering can move the value 'o'. */
+static int tieringCanMove(robj *o) {
+    if (o->refcount != 1) return 0;
+    switch (o->type) {
+    case OBJ_STRING: return o->encoding == OBJ_ENCODING_RAW;
+    case OBJ_LIST: return o->encoding == OBJ_ENCODING_QUICKLIST;
+    case OBJ_HASH: return o->encoding == OBJ_ENCODING_ZIPLIST;
+    case OBJ_SET: return o->encoding == OBJ_ENCODING_INTSET;
+    case OBJ_ZSET: return o->encoding == OBJ_ENCODING_ZIPLIST;
+    }
+    return 0;
+}
+
+/* Move all the allocations of the value 'o' to the allocation class 'mclass',
+ * returning the number of bytes moved. */
+static size_t tieringMoveValue(robj *o, enum MALLOC_CLASS mclass) {
+    size_t moved = 0;
+
+    if (o->type == OBJ_STRING) {
+        sds s = ptrFromObj(o);
+        size_t hdrlen = s - (char*)sdsAllocPtr(s);
+        o->m_ptr = (char*)tieringMoveAlloc(sdsAllocPtr(s), mclass, &moved) + hdrlen;
+    } else if (o->type == OBJ_LIST) {
+        quicklistNode *node;
+        for (node = ((quicklist*)ptrFromObj(o))->head; node; node = node->next)
+            node->zl = tieringMoveAlloc(node->zl, mclass, &moved);
+    } else {
+        o->m_ptr = tieringMoveAlloc(ptrFromObj(o), mclass, &moved);
+    }
+    return moved;
+}
+
+/* Values can't move while another thread may read them: a forkless BGSAVE
+ * serializing the keyspace. We also don't touch the pages shared with a
+ * child, as for the access time in lookupKey(). */
+static int tieringCanMoveNow(void) {
+    return server.scratch_file_tiering && !server.rdb_thread_active &&
+        !server.snapshot_capturing && server.rdb_child_pid == -1 &&
+        server.aof_child_pid == -1 && !server.loading;
+}
+
+/* Promote the value of a key looked up by a command back to DRAM, if it was
+ * demoted. Commands holding a keyspace shard lock for reading may share the
+ * value with other readers, it stays where it is for them. */
+void tieringPromoteValue(robj *o) {
+    void *alloc;
+
+    if (!tieringCanMoveNow() || !tieringCanMove(o)) return;
+    if (serverTL != NULL && serverTL->fShardReadOnly) return;
+    if ((alloc = tieringValueAlloc(o)) == NULL || !salloc_is_cold(alloc)) return;
+    tieringMoveValue(o, MALLOC_SHARED);
+    atomicIncr(server.stat_tiering_promoted,1);
+}
+
+struct tieringScanState {
+    size_t moved;
+};
+
+static void tieringScanCallback(void *privdata, const dictEntry *de) {
+    struct tieringScanState *state = privdata;
+    robj *o = dictGetVal(de);
+    void *alloc;
+
+    if (!tieringCanMove(o)) return;
+    if (tieringAccessCounter(o) >= (unsigned long)server.scratch_file_tiering_lfu_threshold)
+        return;
+    if ((alloc = tieringValueAlloc(o)) == NULL || salloc_is_cold(alloc)) return;
+    state->moved += tieringMoveValue(o, MALLOC_COLD);
+    server.stat_tiering_demoted++;
+}
+
+/* Scan a few buckets of the keyspace for values to demote. Must be called
+ * with the global lock held. */
+static void tieringDemoteStep(void) {
+    static int dbid = 0;
+    static unsigned long cursor = 0;
+    struct tieringScanState state = { 0 };
+    int buckets = 0;
+    mstime_t latency;
+
+    latencyStartMonitor(latency);
+    while (buckets < TIERING_SCAN_BUCKETS && state.moved < TIERING_STEP_BYTES) {
+        if (dbid >= server.dbnum) dbid = 0;
+        redisDb *db = server.db+dbid;
+        if (dictSize(db->pdict) == 0) {
+            /* Don't spin on an empty keyspace. */
+            dbid++;
+            cursor = 0;
+            buckets += TIERING_SCAN_BUCKETS/16;
+            continue;
+        }
+        cursor = dictScan(db->pdict, cursor, tieringScanCallback, NULL, &state);
+        if (cursor == 0) dbid++;
+        buckets++;
+    }
+    latencyEndMonitor(latency);
+    latencyAddSampleIfNeeded("tiering-demote",latency);
+}
+
+static void *tieringThreadMain(void *arg) {
+    UNUSED(arg);
+
+    for (;;) {
+        /* One step per serverCron() tick while there are values to move,
+         * the keyspace is scanned at the pace of the active expire. */
+        usleep(1000000/server.hz);
+        if (!server.scratch_file_tiering) continue;
+
+        aeAcquireLock();
+        if (tieringCanMoveNow()) tieringDemoteStep();
+        aeReleaseLock();
+    }
+    return NULL;
+}
+
+/* Apply scratch-file-tiering, starting the demotion thread the first time it
+ * is enabled. Returns C_ERR if there is no scratch file to demote values to. */
+int tieringApplyConfig(void) {
+    if (server.scratch_file_tiering && !storage_has_scratch_file()) return C_ERR;
+    storage_set_tiering(server.scratch_file_tiering);
+    if (server.scratch_file_tiering && !tieringThreadStarted) {
+        if (pthread_create(&tieringThread,NULL,tieringThreadMain,NULL) != 0) {
+            serverLog(LL_WARNING,"Fatal: Can't initialize the tiering thread.");
+            exit(1);
+        }
+        tieringThreadStarted = 1;
+    }
+    return C_OK;
+}
+
+/* Bytes on the scratch file, that are not counted for maxmemory when the
+ * tiering is enabled: maxmemory is about the DRAM then. */
+size_t tieringColdMemory(void) {
+    return server.scratch_file_tiering ? storage_scratch_used() : 0;
+}
+
+#else /* USE_MEMKIND */
+
+void tieringPromoteValue(robj *o) {
+    UNUSED(o);
+}
+
+int tieringApplyConfig(void) {
+    return server.scratch_file_tiering ? C_ERR : C_OK;
+}
+
+size_t tieringColdMemory(void) {
+    return 0;
+}
+
+#endif
@@ -0,0 +1,71 @@
+# A master that answers the replication handshake of a single replica with a
+# full resync, then sends a diskless RDB payload slowly and drops the
+# connection before the payload is complete.
+#
+# Usage: fake_master.tcl <portfile> <keys> <interval>
+#
+# The listening port is written to <portfile>. One key holding a 1MB string
+# is sent every <interval> milliseconds, <keys> times.
+
+set portfile [lindex $argv 0]
+set keys [lindex $argv 1]
+set interval [lindex $argv 2]
+
+# Read a command sent as a RESP array, and return its arguments.
+proc read_command {fd} {
+    while {1} {
+        set line [string trimright [gets $fd] "\r"]
+        if {[eof $fd]} exit
+        if {[string index $line 0] eq {*}} break
+    }
+    set argv {}
+    for {set j 0} {$j < [string range $line 1 end]} {incr j} {
+        set len [string range [string trimright [gets $fd] "\r"] 1 end]
+        lappend argv [read $fd $len]
+        read $fd 2
+    }
+    return $argv
+}
+
+proc handle {fd addr port} {
+    fconfigure $fd -translation binary -blocking 1
+    while {1} {
+        set argv [read_command $fd]
+        set cmd [string tolower [lindex $argv 0]]
+        if {$cmd eq {ping}} {
+            puts -nonewline $fd "+PONG\r\n"
+        } elseif {$cmd eq {replconf} && [lindex $argv 1] eq {uuid}} {
+            puts -nonewline $fd "-ERR unknown subcommand\r\n"
+        } elseif {$cmd eq {replconf}} {
+            puts -nonewline $fd "+OK\r\n"
+        } elseif {$cmd eq {psync}} {
+            break
+        } else {
+            puts -nonewline $fd "-ERR unknown command\r\n"
+        }
+        flush $fd
+    }
+
+    set replid [string repeat a 40]
+    puts -nonewline $fd "+FULLRESYNC $replid 0\r\n"
+    puts -nonewline $fd "\$EOF:[string repeat b 40]\r\n"
+    puts -nonewline $fd "REDIS0009"
+    flush $fd
+    set val [string repeat x 1048576]
+    for {set j 0} {$j < $::keys} {incr j} {
+        after $::interval
+        set key "key:$j"
+        # String type, 6 bit key length, 32 bit value length.
+        puts -nonewline $fd [binary format cca*cIa* 0 [string length $key] \
+            $key 0x80 [string length $val] $val]
+        flush $fd
+    }
+    close $fd
+    exit
+}
+
+set server [socket -server handle -myaddr 127.0.0.1 0]
+set fp [open $portfile w]
+puts -nonewline $fp [lindex [fconfigure $server -sockname] 2]
+close $fp
+vwait forever
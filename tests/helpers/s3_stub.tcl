@@ -0,0 +1,120 @@
+# A minimal S3 compatible server used to test the native S3 client. It keeps
+# objects as files in a directory and supports just what the server needs:
+# multipart uploads, HEAD and ranged GET. Signatures are not verified.
+#
+# Usage: s3_stub.tcl <dir> <portfile> <flaky>
+#
+# The listening port is written to <portfile>. When <flaky> is 1 the first
+# attempt to upload each part and to get each range fails with a 500.
+
+set dir [lindex $argv 0]
+set portfile [lindex $argv 1]
+set flaky [lindex $argv 2]
+set next_upload 0
+array set attempts {}
+
+proc object_path {path} {
+    return [file join $::dir [string map {/ _} [string trimleft $path /]]]
+}
+
+proc reply {fd status {headers {}} {body {}}} {
+    puts -nonewline $fd "HTTP/1.1 $status\r\n"
+    foreach {name value} $headers {
+        puts -nonewline $fd "$name: $value\r\n"
+    }
+    puts -nonewline $fd "Content-Length: [string length $body]\r\nConnection: close\r\n\r\n"
+    puts -nonewline $fd $body
+}
+
+proc read_file {path} {
+    set f [open $path rb]
+    set data [read $f]
+    close $f
+    return $data
+}
+
+proc write_file {path data} {
+    set f [open $path wb]
+    puts -nonewline $f $data
+    close $f
+}
+
+# The first attempt of each part or range fails in flaky mode.
+proc flaky_failure {id} {
+    if {!$::flaky} {return 0}
+    if {[info exists ::attempts($id)]} {return 0}
+    set ::attempts($id) 1
+    return 1
+}
+
+proc handle {fd} {
+    fconfigure $fd -translation binary -blocking 1
+    set line [gets $fd]
+    lassign [split [string trimright $line "\r"] " "] method target
+    set length 0
+    set range {}
+    while {[gets $fd line] >= 0} {
+        set line [string trimright $line "\r"]
+        if {$line eq {}} break
+        set idx [string first ":" $line]
+        set name [string tolower [string range $line 0 [expr {$idx-1}]]]
+        set value [string trim [string range $line [expr {$idx+1}] end]]
+        if {$name eq {content-length}} {set length $value}
+        if {$name eq {range}} {set range $value}
+    }
+    set body [read $fd $length]
+
+    set query {}
+    lassign [split $target ?] path query
+    array unset q
+    array set q {}
+    foreach kv [split $query &] {
+        lassign [split $kv =] k v
+        set q($k) $v
+    }
+    set obj [object_path $path]
+
+    if {$method eq {POST} && [info exists q(uploads)]} {
+        set id [incr ::next_upload]
+        reply $fd "200 OK" {} "<InitiateMultipartUploadResult><UploadId>$id</UploadId></InitiateMultipartUploadResult>"
+    } elseif {$method eq {PUT} && [info exists q(partNumber)]} {
+        if {[flaky_failure put-$q(uploadId)-$q(partNumber)]} {
+            reply $fd "500 Internal Server Error"
+        } else {
+            write_file $obj.upload-$q(uploadId)-$q(partNumber) $body
+            reply $fd "200 OK" [list ETag "\"$q(uploadId)-$q(partNumber)\""]
+        }
+    } elseif {$method eq {POST} && [info exists q(uploadId)]} {
+        set data {}
+        foreach part [regexp -all -inline {<PartNumber>(\d+)</PartNumber>} $body] {
+            if {![string is integer $part]} continue
+            append data [read_file $obj.upload-$q(uploadId)-$part]
+            file delete $obj.upload-$q(uploadId)-$part
+        }
+        write_file $obj $data
+        reply $fd "200 OK" {} "<CompleteMultipartUploadResult></CompleteMultipartUploadResult>"
+    } elseif {$method eq {DELETE} && [info exists q(uploadId)]} {
+        foreach f [glob -nocomplain $obj.upload-$q(uploadId)-*] {file delete $f}
+        reply $fd "204 No Content"
+    } elseif {($method eq {HEAD} || $method eq {GET}) && ![file exists $obj]} {
+        reply $fd "404 Not Found"
+    } elseif {$method eq {HEAD}} {
+        puts -nonewline $fd "HTTP/1.1 200 OK\r\nContent-Length: [file size $obj]\r\nConnection: close\r\n\r\n"
+    } elseif {$method eq {GET} && [regexp {bytes=(\d+)-(\d+)} $range -> start end]} {
+        if {[flaky_failure get-$start]} {
+            reply $fd "500 Internal Server Error"
+        } else {
+            set data [string range [read_file $obj] $start $end]
+            reply $fd "206 Partial Content" [list Content-Range "bytes $start-$end/[file size $obj]"] $data
+        }
+    } elseif {$method eq {GET}} {
+        reply $fd "200 OK" {} [read_file $obj]
+    } else {
+        reply $fd "400 Bad Request"
+    }
+    close $fd
+}
+
+set server [socket -server {apply {{fd addr port} {handle $fd}}} -myaddr 127.0.0.1 0]
+write_file $portfile [lindex [fconfigure $server -sockname] 2]
+vwait forever
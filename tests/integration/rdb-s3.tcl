@@ -0,0 +1,51 @@
+proc start_s3_stub {flaky} {
+    set dir [tmpdir "s3-stub"]
+    set portfile [file join $dir port]
+    set tclsh [info nameofexecutable]
+    set pid [exec $tclsh tests/helpers/s3_stub.tcl $dir $portfile $flaky > /dev/null 2> /dev/null &]
+    wait_for_condition 50 100 {
+        [file exists $portfile] && [file size $portfile] > 0
+    } else {
+        fail "S3 stub did not start"
+    }
+    set fd [open $portfile]
+    set port [read $fd]
+    close $fd
+    return [list $pid $port]
+}
+
+set ::env(AWS_ACCESS_KEY_ID) testkey
+set ::env(AWS_SECRET_ACCESS_KEY) testsecret
+
+foreach flaky {0 1} {
+    lassign [start_s3_stub $flaky] stub_pid stub_port
+    set s3_overrides [list "db-s3-object" "s3://bucket/dump.rdb" \
+        "s3-endpoint" "127.0.0.1:$stub_port" "s3-threads" 4]
+
+    start_server [list overrides $s3_overrides] {
+        test "Native S3 multipart upload and ranged download (flaky: $flaky)" {
+            # Big enough to be uploaded and downloaded in several parts
+            r config set rdbcompression no
+            r debug populate 24 key 1000000
+            r sadd myset a b c
+            set digest [r debug digest]
+            r save
+
+            # No local file to load, so the dataset comes from S3
+            set load_path [tmpdir "server.rdb-s3-load"]
+            set srv [start_server [list overrides [concat $s3_overrides [list "dir" $load_path]]]]
+            wait_for_condition 100 100 {
+                [string match {*Ready to accept*} [exec cat [dict get $srv stdout]]]
+            } else {
+                fail "Server did not load the dataset from S3"
+            }
+            set r2 [redis [dict get $srv host] [dict get $srv port]]
+            $r2 select 9
+            assert_equal $digest [$r2 debug digest]
+            assert_equal 3 [$r2 scard myset]
+            $r2 close
+            kill_server $srv
+        }
+    }
+    exec kill $stub_pid
+}
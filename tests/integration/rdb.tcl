@@ -23,6 +23,152 @@ start_server [list overrides [list "dir" $server_path "dbfilename" "encodings.rd
 }
 }
 
+start_server [list overrides [list "dir" $server_path "dbfilename" "encodings.rdb" "rdb-load-threads" 4]] {
+  test "RDB encoding loading test with rdb-load-threads" {
+    r select 0
+    set threaded [csvdump r]
+    r config set rdb-load-threads 0
+    r debug reload
+    assert_equal $threaded [csvdump r]
+    r config get rdb-load-threads
+  } {rdb-load-threads 0}
+}
+
+start_server {overrides {rdb-load-threads 4}} {
+    test {Parallel RDB loading of a complex dataset} {
+        createComplexDataset r 10000
+        r xadd stream * foo bar
+        r set bigcompressible [string repeat abcd 10000]
+        set digest [r debug digest]
+        r debug reload
+        assert_equal $digest [r debug digest]
+        r config set rdb-load-threads 0
+        r debug reload
+        assert_equal $digest [r debug digest]
+    }
+}
+
+start_server {overrides {rdb-save-threads 4}} {
+    test {Chunked RDB save with rdb-save-threads} {
+        createComplexDataset r 10000
+        r select 9
+        r xadd stream * foo bar
+        for {set j 0} {$j < 1000} {incr j} {
+            r set key:$j [string repeat x $j]
+        }
+        set digest [r debug digest]
+        r debug reload
+        assert_equal $digest [r debug digest]
+        r config set rdb-load-threads 2
+        r bgsave
+        waitForBgsave r
+        r debug reload nosave
+        assert_equal $digest [r debug digest]
+        # Back to the single stream format
+        r config set rdb-save-threads 0
+        r debug reload
+        assert_equal $digest [r debug digest]
+    }
+}
+
+set server_path [tmpdir "server.forkless-bgsave-test"]
+
+proc count_log_message {pattern} {
+    set fp [open [srv 0 stdout] r]
+    set count 0
+    while {[gets $fp line] >= 0} {
+        if {[string match "*$pattern*" $line]} {incr count}
+    }
+    close $fp
+    return $count
+}
+
+start_server [list overrides [list "dir" $server_path "forkless-bgsave" yes]] {
+    test {Forkless BGSAVE saves the dataset as it was when it started} {
+        r select 0
+        r debug populate 20000 key 1000
+        r sadd myset a b c
+        r expire key:1 1000
+        set digest [r debug digest]
+        r bgsave
+        # Modify, delete and create keys while the thread saves
+        for {set j 0} {$j < 1000} {incr j} {
+            r set key:$j changed
+            r del key:[expr {$j+10000}]
+            r set newkey:$j x
+            r sadd myset $j
+        }
+        r swapdb 0 1
+        r flushdb
+        waitForBgsave r
+        assert_equal ok [status r rdb_last_bgsave_status]
+        set load_path [tmpdir "server.forkless-bgsave-load"]
+        file copy -force [file join $server_path dump.rdb] $load_path
+        start_server [list overrides [list "dir" $load_path]] {
+            r select 0
+            assert_equal $digest [r debug digest]
+            assert_equal 3 [r scard myset]
+        }
+    }
+
+    test {FLUSHALL aborts a forkless BGSAVE} {
+        r debug populate 20000 key 1000
+        # MULTI keeps the thread from saving anything before the FLUSHALL.
+        r multi
+        r bgsave
+        r flushall
+        r exec
+        waitForBgsave r
+        assert_equal ok [status r rdb_last_bgsave_status]
+        assert_equal 1 [count_log_message "Background saving aborted"]
+        assert_equal 0 [r dbsize]
+    }
+
+    test {SAVE is refused while a forkless BGSAVE writes the RDB file} {
+        r debug populate 20000 key 1000
+        r multi
+        r bgsave
+        r save
+        catch {r exec} err
+        waitForBgsave r
+        assert_match {*Background save already in progress*} $err
+        assert_equal ok [status r rdb_last_bgsave_status]
+        r debug reload nosave
+        assert_equal 20000 [r dbsize]
+    }
+}
+
+set server_path [tmpdir "server.rdb-lua-scripts-test"]
+
+start_server [list overrides [list "dir" $server_path]] {
+    test {Scripts are persisted in the RDB file} {
+        set sha [r script load {return redis.call('incr',KEYS[1])}]
+        r save
+        r config set forkless-bgsave yes
+        r eval {return 'forkless'} 0
+        set sha2 [r script load {return 'forkless'}]
+        r bgsave
+        waitForBgsave r
+        set load_path [tmpdir "server.rdb-lua-scripts-load"]
+        file copy -force [file join $server_path dump.rdb] $load_path
+        start_server [list overrides [list "dir" $load_path]] {
+            assert_equal {1 1} [r script exists $sha $sha2]
+            assert_equal 1 [r evalsha $sha 1 counter]
+        }
+    }
+
+    test {Scripts are not persisted with lua-persist-scripts no} {
+        r config set forkless-bgsave no
+        r config set lua-persist-scripts no
+        r save
+        set load_path [tmpdir "server.rdb-lua-scripts-load"]
+        file copy -force [file join $server_path dump.rdb] $load_path
+        start_server [list overrides [list "dir" $load_path]] {
+            assert_equal 0 [r script exists $sha]
+        }
+    }
+}
+
 set server_path [tmpdir "server.rdb-startup-test"]
 
 start_server [list overrides [list "dir" $server_path]] {
@@ -55,6 +55,50 @@ start_server {tags {"repl"}} {
     }
 }
 
+start_server {tags {"repl"}} {
+    start_server {overrides {keyspace-lock-shards 64 replica-apply-threads 4}} {
+        set master [srv -1 client]
+        set master_host [srv -1 host]
+        set master_port [srv -1 port]
+        set slave [srv 0 client]
+
+        test {Replica apply threads keep the dataset consistent} {
+            # Keyspace notifications keep the commands on the global lock
+            $slave config set notify-keyspace-events ""
+            $slave slaveof $master_host $master_port
+            wait_for_condition 50 100 {
+                [string match {*master_link_status:up*} [$slave info replication]]
+            } else {
+                fail "Replica did not sync"
+            }
+
+            set load_handle0 [start_bg_complex_data $master_host $master_port 9 100000]
+            set load_handle1 [start_bg_complex_data $master_host $master_port 11 100000]
+            for {set j 0} {$j < 2000} {incr j} {
+                $master set key$j $j
+                $master incr counter
+                $master append str $j
+                if {$j % 100 == 0} {
+                    $master multi
+                    $master incr counter
+                    $master set key$j multi
+                    $master exec
+                }
+            }
+            after 2000
+            stop_bg_complex_data $load_handle0
+            stop_bg_complex_data $load_handle1
+            wait_for_condition 50 200 {
+                [$master debug digest] eq [$slave debug digest]
+            } else {
+                fail "Master - Replica inconsistency"
+            }
+            assert_equal 2020 [$slave get counter]
+            assert {[s 0 replica_threaded_applied_commands] > 0}
+        }
+    }
+}
+
 start_server {tags {"repl"}} {
     start_server {} {
         set master [srv -1 client]
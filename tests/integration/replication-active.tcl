@@ -0,0 +1,159 @@
+set active_overrides {active-replica yes active-replica-timestamps yes}
+
+# Return the timestamp and the origin of the last write to a key.
+proc mvcc_stamp {r key} {
+    regexp {mvcc_tstamp:([0-9]+) mvcc_origin:([-0-9a-f]+)} [$r debug object $key] -> tstamp origin
+    list $tstamp $origin
+}
+
+start_server [list overrides $active_overrides] {
+    test {RREPLAY is only accepted from a master} {
+        r set foo new
+        set uuid [lindex [mvcc_stamp r foo] 1]
+        catch {r rreplay $uuid [expr {[clock milliseconds] << 20}] set foo forged} e
+        assert_match {*only accepted from a master*} $e
+        assert_equal new [r get foo]
+    }
+
+    test {Timestamps survive a DEBUG RELOAD} {
+        r set foo new
+        set stamp [mvcc_stamp r foo]
+        assert {[lindex $stamp 0] > 0}
+        r debug reload
+        assert_equal $stamp [mvcc_stamp r foo]
+    }
+}
+
+start_server [list overrides $active_overrides] {
+    start_server [list overrides $active_overrides] {
+        set master [srv -1 client]
+        set master_host [srv -1 host]
+        set master_port [srv -1 port]
+        set replica [srv 0 client]
+        set replica_host [srv 0 host]
+        set replica_port [srv 0 port]
+
+        test {Full sync keeps the most recent version of each key} {
+            $master set x from-master
+            after 5
+            $replica set x from-replica
+            $replica set y from-replica
+            after 5
+            $master set y from-master
+
+            $replica replicaof $master_host $master_port
+            wait_for_condition 50 100 {
+                [string match {*master_link_status:up*} [$replica info replication]]
+            } else {
+                fail "Replica did not sync"
+            }
+            assert_equal from-replica [$replica get x]
+            assert_equal from-master [$replica get y]
+        }
+
+        test {Writes are replicated with their timestamp} {
+            $master set z 1
+            $master incr z
+            $master hset h f v
+            wait_for_condition 50 100 {
+                [$replica get z] eq {2} && [$replica hget h f] eq {v}
+            } else {
+                fail "Writes not replicated"
+            }
+            assert_match {*mvcc_rejected_writes:0*} [$replica info stats]
+            assert_equal [mvcc_stamp $master z] [mvcc_stamp $replica z]
+            assert_equal [mvcc_stamp $master h] [mvcc_stamp $replica h]
+        }
+
+        test {Concurrent writes to the same key converge to the last one} {
+            $master replicaof $replica_host $replica_port
+            wait_for_condition 50 100 {
+                [string match {*master_link_status:up*} [$master info replication]]
+            } else {
+                fail "Master did not sync"
+            }
+            # The replica doesn't read the write of the master before it
+            # executes its own, more recent one.
+            set rd [redis_deferring_client]
+            set rd2 [redis_deferring_client]
+            $rd debug sleep 1
+            after 100
+            $master set k from-master
+            after 100
+            $rd2 set k from-replica
+            $rd read
+            $rd2 read
+            wait_for_condition 50 100 {
+                [$master get k] eq {from-replica} &&
+                [$replica get k] eq {from-replica}
+            } else {
+                fail "The writes did not converge"
+            }
+            assert_equal [mvcc_stamp $master k] [mvcc_stamp $replica k]
+            $rd close
+            $rd2 close
+        }
+    }
+}
+
+set mesh_overrides {active-replica yes multi-master yes}
+
+start_server [list overrides $mesh_overrides] {
+    start_server [list overrides $mesh_overrides] {
+        start_server [list overrides $mesh_overrides] {
+            set nodes {}
+            for {set j 0} {$j < 3} {incr j} {
+                lappend nodes [list [srv -$j client] [srv -$j host] [srv -$j port]]
+            }
+
+            test {Multi-master replicas connect to every master} {
+                foreach node $nodes {
+                    set r [lindex $node 0]
+                    foreach other $nodes {
+                        if {$other eq $node} continue
+                        $r replicaof [lindex $other 1] [lindex $other 2]
+                    }
+                }
+                foreach node $nodes {
+                    set r [lindex $node 0]
+                    wait_for_condition 50 100 {
+                        [string match {*master_link_status:up*master_1_link_status:up*} [$r info replication]]
+                    } else {
+                        fail "Mesh did not connect"
+                    }
+                    assert_equal 2 [llength [$r role]]
+                }
+            }
+
+            test {Writes on any node reach all the others once} {
+                set j 0
+                foreach node $nodes {
+                    [lindex $node 0] set key$j val$j
+                    [lindex $node 0] incr counter
+                    incr j
+                }
+                foreach node $nodes {
+                    set r [lindex $node 0]
+                    wait_for_condition 50 100 {
+                        [$r get key0] eq {val0} && [$r get key1] eq {val1} &&
+                        [$r get key2] eq {val2} && [$r get counter] eq {3}
+                    } else {
+                        fail "Writes not replicated across the mesh"
+                    }
+                }
+                # Give a command forwarded twice the time to show up
+                after 500
+                foreach node $nodes {
+                    assert_equal 3 [[lindex $node 0] get counter]
+                }
+            }
+
+            test {REPLICAOF NO ONE removes all the masters} {
+                set r [lindex [lindex $nodes 0] 0]
+                $r replicaof no one
+                assert_equal master [lindex [$r role] 0]
+                assert_match {*role:master*} [$r info replication]
+            }
+        }
+    }
+}
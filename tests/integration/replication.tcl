@@ -309,3 +309,82 @@ start_server {tags {"repl"}} {
         }
     }
 }
+
+foreach mdl {no yes} {
+    foreach sdl {on-empty-db swapdb} {
+        start_server {tags {"repl"}} {
+            set master [srv 0 client]
+            $master config set repl-diskless-sync $mdl
+            $master config set repl-diskless-sync-delay 0
+            set master_host [srv 0 host]
+            set master_port [srv 0 port]
+            start_server {} {
+                test "Replica loads the RDB from the socket (diskless: $mdl, load: $sdl)" {
+                    set replica [srv 0 client]
+                    $master debug populate 20000 key 100
+                    $master sadd myset a b c
+                    $replica config set repl-diskless-load $sdl
+                    $replica set stale 1
+                    if {$sdl eq {on-empty-db}} {
+                        $replica flushall
+                    }
+                    $replica replicaof $master_host $master_port
+                    wait_for_condition 50 100 {
+                        [string match {*master_link_status:up*} [$replica info replication]]
+                    } else {
+                        fail "Replica did not sync"
+                    }
+                    $master incr counter
+                    wait_for_condition 50 100 {
+                        [$master debug digest] eq [$replica debug digest]
+                    } else {
+                        fail "Different datasets between replica and master"
+                    }
+                    assert_equal 0 [$replica exists stale]
+                    assert_match {*Loading DB in memory from the socket*} \
+                        [exec cat [srv 0 stdout]]
+                }
+            }
+        }
+    }
+}
+
+start_server {tags {"repl"}} {
+    test {Replica serves its dataset while loading a slow payload, and keeps it when the master drops} {
+        set portfile [file join [tmpdir "fake-master"] port]
+        set tclsh [info nameofexecutable]
+        # 24MB sent in about 5 seconds, more than repl-timeout.
+        set pid [exec $tclsh tests/helpers/fake_master.tcl $portfile 24 200 > /dev/null 2> /dev/null &]
+        wait_for_condition 50 100 {
+            [file exists $portfile] && [file size $portfile] > 0
+        } else {
+            fail "Fake master did not start"
+        }
+        set fd [open $portfile]
+        set port [read $fd]
+        close $fd
+
+        r config set repl-diskless-load swapdb
+        r config set repl-timeout 2
+        r set stale 1
+        r replicaof 127.0.0.1 $port
+        wait_for_condition 50 100 {
+            [s async_loading] eq 1
+        } else {
+            fail "Replica did not start loading the payload"
+        }
+        assert_equal 1 [r get stale]
+        wait_for_condition 100 100 {
+            [s async_loading] eq 0
+        } else {
+            fail "Replica did not stop loading the payload"
+        }
+        set log [exec cat [srv 0 stdout]]
+        assert_match {*Failed trying to load the MASTER synchronization DB from socket*} $log
+        assert {![string match {*Timeout receiving bulk data*} $log]}
+        assert_equal 1 [r get stale]
+        assert_equal 1 [r dbsize]
+        r replicaof no one
+        catch {exec kill -9 $pid}
+    }
+}
@@ -17,6 +17,9 @@ set ::all_tests {
     unit/auth
     unit/protocol
     unit/keyspace
+    unit/keyspace-shards
+    unit/io-uring
+    unit/fastlock
     unit/scan
     unit/type/string
     unit/type/incr
@@ -41,8 +44,10 @@ set ::all_tests {
     integration/replication-3
     integration/replication-4
     integration/replication-psync
+    integration/replication-active
     integration/aof
     integration/rdb
+    integration/rdb-s3
     integration/convert-zipmap-hash-on-load
     integration/logging
     integration/psync2
@@ -0,0 +1,49 @@
+start_server {tags {"fastlock"}} {
+    test {A thread waiting for a held global lock parks on the futex} {
+        r config set maxmemory-policy allkeys-random
+        r debug populate 100000 key 100
+        # Above the low watermark but below maxmemory: the eviction thread
+        # wants the global lock at every tick, and DEBUG SLEEP holds it much
+        # longer than the thread spins.
+        r config set maxmemory [expr {[s used_memory] * 100 / 95}]
+        set before [s long_lock_waits]
+        r config set maxmemory-eviction-thread yes
+        r debug sleep 1
+        assert {[s long_lock_waits] > $before}
+        # The parked thread was woken and got the lock
+        wait_for_condition 50 100 {
+            [s evicted_keys_background] > 0
+        } else {
+            fail "The eviction thread did not run"
+        }
+        r config set maxmemory-eviction-thread no
+        r config set maxmemory 0
+    }
+}
+
+start_server {tags {"fastlock"} overrides {server-threads 4}} {
+    test {Contended global lock between server threads} {
+        set before [s long_lock_waits]
+        set clients {}
+        for {set j 0} {$j < 16} {incr j} {
+            lappend clients [redis_deferring_client]
+        }
+        foreach rd $clients {
+            for {set i 0} {$i < 2000} {incr i} {
+                $rd incr counter
+                $rd lpush list:[expr {$i % 16}] [string repeat x 100]
+            }
+        }
+        foreach rd $clients {
+            for {set i 0} {$i < 4000} {incr i} {
+                $rd read
+            }
+            $rd close
+        }
+        # server-threads is capped to the number of CPUs
+        if {[s server_threads] > 1} {
+            assert {[s long_lock_waits] > $before}
+        }
+        r get counter
+    } {32000}
+}
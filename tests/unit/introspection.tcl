@@ -57,4 +57,31 @@ start_server {tags {"introspection"}} {
             fail "Client still listed in CLIENT LIST after SETNAME."
         }
     }
+
+    test {INFO locks reports global lock statistics} {
+        r debug lockstats reset
+        for {set i 0} {$i < 10} {incr i} {
+            r ping
+        }
+        set info [r info locks]
+        assert_match {*global_lock_acquisitions:*} $info
+        assert_match {*lock_thread_*:tid=*,acquisitions=*} $info
+        regexp {global_lock_acquisitions:(\d+)} $info _ acquisitions
+        assert {$acquisitions >= 10}
+    }
+
+    test {DEBUG LOCKSTATS SAMPLING records lock holder call sites} {
+        r debug lockstats sampling 1
+        r debug lockstats reset
+        r ping
+        set info [r info locks]
+        r debug lockstats sampling 0
+        assert_match {*lock_site_sampling:1*} $info
+        assert_match {*lock_site_0:site=*,samples=*,hold_usec=*,max_hold_usec=*} $info
+    }
+
+    test {DEBUG LOCKSTATS SAMPLING rejects invalid rates} {
+        catch {r debug lockstats sampling -1} e
+        set e
+    } {ERR*}
 }
@@ -0,0 +1,126 @@
+start_server {tags {"io-uring"} overrides {io-uring yes}} {
+    # The server warns and stays on epoll where the kernel has no io_uring,
+    # anywhere else the event loops must really be using it
+    set have_uring [expr {![string match {*io_uring is not supported here*} [exec cat [srv 0 stdout]]]}]
+
+    if {$have_uring} {
+        test {Event loop reports its multiplexing API} {
+            assert_equal io_uring [s multiplexing_api]
+            r config get io-uring
+        } {io-uring yes}
+
+        test {Pipelined commands are served} {
+            r flushall
+            set rd [redis_deferring_client]
+            for {set i 0} {$i < 1000} {incr i} {
+                $rd set key:$i $i
+            }
+            for {set i 0} {$i < 1000} {incr i} {
+                $rd read
+            }
+            $rd close
+            list [r dbsize] [r get key:999]
+        } {1000 999}
+
+        test {Large replies wait for the socket to become writable} {
+            set payload [string repeat x 4000000]
+            r set big $payload
+            assert_equal $payload [r get big]
+            r strlen big
+        } {4000000}
+
+        test {Large requests from many clients outgrow the receive buffers} {
+            set clients {}
+            for {set i 0} {$i < 8} {incr i} {
+                set rd [redis_deferring_client]
+                $rd set big:$i [string repeat $i 2000000]
+                lappend clients $rd
+            }
+            foreach rd $clients {
+                assert_equal OK [$rd read]
+                $rd close
+            }
+            for {set i 0} {$i < 8} {incr i} {
+                assert_equal [string repeat $i 2000000] [r get big:$i]
+            }
+        }
+
+        test {Replies sent right before closing reach the client} {
+            set rd [redis_deferring_client]
+            $rd ping
+            $rd quit
+            set res [list [$rd read] [$rd read]]
+            $rd close
+            set res
+        } {PONG OK}
+
+        test {Large replies before QUIT reach the client in full} {
+            r set huge [string repeat x 8000000]
+            set fd [socket [srv 0 host] [srv 0 port]]
+            fconfigure $fd -translation binary
+            puts -nonewline $fd "SELECT 9\r\nGET huge\r\nQUIT\r\n"
+            flush $fd
+            # Read slowly, so that the last send is still waiting for room
+            # in the socket when the connection is closed
+            set reply {}
+            while {![eof $fd]} {
+                append reply [read $fd 65536]
+                after 2
+            }
+            close $fd
+            r del huge
+            list [string length $reply] [string range $reply end-6 end]
+        } [list 8000022 "\r\n+OK\r\n"]
+
+        test {Blocked clients are woken by another connection} {
+            set rd [redis_deferring_client]
+            $rd blpop mylist 0
+            wait_for_condition 50 100 {
+                [s blocked_clients] == 1
+            } else {
+                fail "Client was not blocked"
+            }
+            r rpush mylist foo
+            set res [$rd read]
+            $rd close
+            set res
+        } {mylist foo}
+
+        test {Closed connections are noticed} {
+            set clients {}
+            for {set i 0} {$i < 20} {incr i} {
+                set rd [redis_deferring_client]
+                $rd ping
+                $rd read
+                lappend clients $rd
+            }
+            foreach rd $clients {
+                $rd close
+            }
+            # Only our own connection is left
+            wait_for_condition 50 100 {
+                [s connected_clients] == 1
+            } else {
+                fail "Connections were not closed"
+            }
+        }
+
+        start_server {overrides {io-uring yes}} {
+            test {Replicas sync and stream from an io_uring master} {
+                r replicaof [srv -1 host] [srv -1 port]
+                wait_for_condition 50 100 {
+                    [s master_link_status] eq {up}
+                } else {
+                    fail "Replica did not sync"
+                }
+                r -1 set after-sync 1
+                wait_for_condition 50 100 {
+                    [r get after-sync] eq {1}
+                } else {
+                    fail "Replica did not receive the stream"
+                }
+                list [r dbsize] [r get key:999] [r strlen big]
+            } [list 1010 999 4000000]
+        }
+    }
+}
@@ -0,0 +1,194 @@
+start_server {tags {"keyspace-shards"} overrides {keyspace-lock-shards 16}} {
+    # Keyspace notifications always disable sharding
+    r config set notify-keyspace-events ""
+
+    proc shard_commands {} {
+        s keyspace_shard_commands
+    }
+
+    test {Sharded string commands are executed under shard locks} {
+        r flushall
+        set before [shard_commands]
+        r set foo bar
+        r incr counter
+        r incrby counter 10
+        r append foo baz
+        list [r get foo] [r get counter] [r strlen foo] [r exists foo] \
+             [expr {[shard_commands] > $before}]
+    } {barbaz 11 6 1 1}
+
+    test {Sharded SET with expire and TTL} {
+        r set mykey myval ex 100
+        set ttl [r ttl mykey]
+        set pttl [r pttl mykey]
+        assert {$ttl > 90 && $ttl <= 100}
+        assert {$pttl > 90000 && $pttl <= 100000}
+        r type mykey
+    } {string}
+
+    test {Sharded lookups expire keys} {
+        r psetex shortlived 1 value
+        after 10
+        list [r get shortlived] [r exists shortlived]
+    } {{} 0}
+
+    test {Sharded reads expire keys logically without deleting them} {
+        r flushall
+        r debug set-active-expire 0
+        r psetex shortlived 1 value
+        after 10
+        set res [list [r get shortlived] [r exists shortlived] [r ttl shortlived]]
+        lappend res [r dbsize]
+        # A write to the key performs the actual deletion
+        lappend res [r setnx shortlived newvalue] [r dbsize]
+        r debug set-active-expire 1
+        set res
+    } {{} 0 -2 1 1 1}
+
+    test {Multi key commands fall back when keys span shards} {
+        r flushall
+        for {set i 0} {$i < 100} {incr i} {
+            r set key:$i $i
+        }
+        set keys {}
+        set expected {}
+        for {set i 0} {$i < 100} {incr i} {
+            lappend keys key:$i
+            lappend expected $i
+        }
+        assert_equal $expected [r mget {*}$keys]
+        r exists {*}$keys
+    } {100}
+
+    test {Keyspace is consistent after many sharded writes} {
+        r flushall
+        for {set i 0} {$i < 5000} {incr i} {
+            r set key:$i $i
+        }
+        for {set i 0} {$i < 5000} {incr i 2} {
+            r incr key:$i
+        }
+        assert_equal 5000 [r dbsize]
+        assert_equal 1 [r get key:0]
+        assert_equal 1 [r get key:1]
+        r debug digest-value key:4999
+        r get key:4998
+    } {4999}
+
+    test {Commands in MULTI are not sharded} {
+        set before [shard_commands]
+        r multi
+        r set a 1
+        r incr a
+        r exec
+        assert_equal $before [shard_commands]
+        r get a
+    } {2}
+
+    test {Commands are not sharded while keys are watched} {
+        r watch a
+        set before [shard_commands]
+        r set a 5
+        assert_equal $before [shard_commands]
+        r multi
+        r incr a
+        r exec
+    } {}
+
+    test {CONFIG GET keyspace-lock-shards} {
+        r config get keyspace-lock-shards
+    } {keyspace-lock-shards 16}
+}
+
+start_server {tags {"keyspace-shards"} overrides {keyspace-lock-shards 16 lua-shard-scripts yes server-threads 2}} {
+    r config set notify-keyspace-events ""
+
+    proc shard_commands {} {
+        s keyspace_shard_commands
+    }
+
+    test {Scripts opting in on the keys they declare run under shard locks} {
+        r flushall
+        set before [shard_commands]
+        set res [r eval {--!shardable
+            redis.call('set',KEYS[1],ARGV[1])
+            return redis.call('incr',KEYS[1])
+        } 1 counter 5]
+        assert {[shard_commands] > $before}
+        list $res [r get counter]
+    } {6 6}
+
+    test {Scripts that don't opt in run under the global lock} {
+        set before [shard_commands]
+        r eval {return redis.call('incr',KEYS[1])} 1 counter
+        assert_equal $before [shard_commands]
+        r get counter
+    } {7}
+
+    test {EVALSHA defines the script in the interpreter of every thread} {
+        set sha [r script load "--!shardable\nreturn redis.call('incr',KEYS\[1\])"]
+        set clients {}
+        for {set j 0} {$j < 4} {incr j} {
+            set rd [redis_deferring_client]
+            lappend clients $rd
+            $rd evalsha $sha 1 hits
+            $rd eval "--!shardable\nreturn redis.call('incrby',KEYS\[1\],2)" 1 hits
+        }
+        foreach rd $clients {
+            $rd read
+            $rd read
+            $rd close
+        }
+        r get hits
+    } {12}
+
+    test {Sharded scripts making a call they can't make there run again under the global lock} {
+        r config resetstat
+        r set other 1
+        set res [r eval {--!shardable
+            local v = redis.call('get','other')
+            redis.call('hset',KEYS[1],'f',v)
+            return v
+        } 1 myhash]
+        assert_match {*cmdstat_eval:calls=1,*} [r info commandstats]
+        list $res [r hget myhash f]
+    } {1 1}
+
+    test {Sharded scripts fail making such a call after they wrote} {
+        catch {r eval {--!shardable
+            redis.call('set',KEYS[1],'x')
+            return redis.call('get','other')
+        } 1 counter} e
+        assert_match {*did not declare*} $e
+        r get counter
+    } {x}
+
+    test {Slow sharded scripts run again under the global lock if they did not write} {
+        r config set lua-time-limit 10
+        set res [r eval {--!shardable
+            local i = 0
+            while i < 20000000 do i = i + 1 end
+            return i
+        } 1 counter]
+        r config set lua-time-limit 5000
+        set res
+    } {20000000}
+
+    test {Slow sharded scripts are aborted after they wrote, even catching the error} {
+        r set counter 0
+        r config set lua-time-limit 10
+        catch {r eval {--!shardable
+            redis.call('incr',KEYS[1])
+            while true do pcall(function() while true do end end) end
+        } 1 counter} e
+        r config set lua-time-limit 5000
+        assert_match {*aborted after lua-time-limit*} $e
+        r get counter
+    } {1}
+
+    test {Memory of the Lua interpreters is reported} {
+        assert {[s used_memory_lua] > 0}
+        r script flush
+        r eval "--!shardable\nreturn 1" 1 counter
+    } {1}
+}
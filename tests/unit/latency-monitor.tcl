@@ -1,3 +1,9 @@
+proc cmdstat {cmd} {
+    if {[regexp "\r\ncmdstat_$cmd:(.*?)\r\n" [r info commandstats] _ value]} {
+        set _ $value
+    }
+}
+
 start_server {tags {"latency-monitor"}} {
     # Set a threshold high enough to avoid spurious latency events.
     r config set latency-monitor-threshold 200
@@ -61,4 +67,32 @@ start_server {tags {"latency-monitor"}} {
         after 500
         assert_match {*expire-cycle*} [r latency latest]
     }
+
+    test {LATENCY HISTOGRAM reports the latency distribution of commands} {
+        r config resetstat
+        r debug sleep 0.1
+        for {set i 0} {$i < 100} {incr i} {
+            r set foo $i
+        }
+        set res [r latency histogram set debug unknowncommand]
+        assert_equal 4 [llength $res]
+        array set hist [lindex $res 1]
+        assert_equal set [lindex $res 0]
+        assert_equal 100 $hist(calls)
+        assert {$hist(p50) <= $hist(p99) && $hist(p99) <= $hist(p999)}
+        # Cumulative counts end with the number of calls
+        assert_equal 100 [lindex $hist(histogram_usec) end]
+        array set hist [lindex $res 3]
+        assert_equal 1 $hist(calls)
+        assert {$hist(p50) >= 100000 && $hist(p50) < 120000}
+    }
+
+    test {INFO commandstats reports latency percentiles} {
+        assert_match {*calls=100,*p50=*,p99=*,p999=*} [cmdstat set]
+    }
+
+    test {CONFIG RESETSTAT resets the latency histograms} {
+        r config resetstat
+        r latency histogram set
+    } {}
 }
@@ -141,6 +141,61 @@ start_server {tags {"maxmemory"}} {
             }
         }
     }
+
+    foreach policy {
+        allkeys-random allkeys-lru allkeys-lfu
+    } {
+        test "maxmemory - the eviction thread honours the low watermark ($policy)" {
+            r flushall
+            set used [s used_memory]
+            set limit [expr {$used+10*1024*1024}]
+            r config set maxmemory $limit
+            r config set maxmemory-policy $policy
+            r config set maxmemory-eviction-low-watermark 80
+            r config set maxmemory-eviction-thread yes
+            # DEBUG POPULATE does not evict by itself, the thread has to.
+            r debug populate 200000 key 100
+            wait_for_condition 50 100 {
+                [s used_memory] <= $limit*80/100
+            } else {
+                fail "Memory usage not brought below the low watermark"
+            }
+            assert {[s evicted_keys_background] > 0}
+            assert {[r dbsize] > 0}
+            r config set maxmemory-eviction-thread no
+            r config set maxmemory-eviction-low-watermark 90
+        }
+    }
+
+    foreach lazy {no yes} {
+        test "maxmemory - the eviction thread honours lazyfree-lazy-eviction $lazy" {
+            r flushall
+            r config set maxmemory 0
+            r config set lazyfree-lazy-eviction $lazy
+            for {set j 0} {$j < 100} {incr j} {
+                r set key:$j [string repeat x 10000]
+            }
+            r config resetstat
+            set repl [attach_to_replication_stream]
+            set used [s used_memory]
+            r config set maxmemory-policy allkeys-random
+            r config set maxmemory-eviction-low-watermark 50
+            r config set maxmemory-eviction-thread yes
+            r config set maxmemory [expr {$used+512*1024}]
+            wait_for_condition 50 100 {
+                [s evicted_keys_background] > 0
+            } else {
+                fail "No key evicted by the eviction thread"
+            }
+            set del [expr {$lazy eq {yes} ? {unlink} : {del}}]
+            assert_replication_stream $repl [list {select *} [list $del key:*]]
+            close_replication_stream $repl
+            r config set maxmemory-eviction-thread no
+            r config set maxmemory-eviction-low-watermark 90
+            r config set maxmemory 0
+            r config set lazyfree-lazy-eviction no
+        }
+    }
 }
 
 proc test_slave_buffers {test_name cmd_count payload_len limit_memory pipeline} {
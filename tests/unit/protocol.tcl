@@ -55,6 +55,37 @@ start_server {tags {"protocol"}} {
         assert_error "*expected '$', got 'f'*" {r read}
     }
 
+    test "Pipelined commands split at arbitrary offsets" {
+        reconnect
+        set payload {}
+        for {set i 0} {$i < 200} {incr i} {
+            set val [string repeat x [expr {$i * 37 % 500}]]
+            append payload "*3\r\n\$3\r\nSET\r\n\$[string length key:$i]\r\nkey:$i\r\n"
+            append payload "\$[string length $val]\r\n$val\r\n"
+            append payload "*2\r\n\$3\r\nGET\r\n\$[string length key:$i]\r\nkey:$i\r\n"
+        }
+        set pos 0
+        set len [string length $payload]
+        while {$pos < $len} {
+            set chunk [expr {1 + int(rand()*97)}]
+            r write [string range $payload $pos [expr {$pos+$chunk-1}]]
+            r flush
+            incr pos $chunk
+        }
+        for {set i 0} {$i < 200} {incr i} {
+            assert_equal OK [r read]
+            assert_equal [string repeat x [expr {$i * 37 % 500}]] [r read]
+        }
+        r ping
+    } {PONG}
+
+    test "Multibulk length with leading zeros is rejected" {
+        reconnect
+        r write "*3\r\n\$03\r\nSET\r\n\$1\r\nx\r\n\$1\r\ny\r\n"
+        r flush
+        assert_error "*invalid bulk length*" {r read}
+    }
+
     test "Generic wrong number of args" {
         reconnect
         assert_error "*wrong*arguments*ping*" {r ping x y z}
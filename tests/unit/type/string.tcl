@@ -419,4 +419,48 @@ start_server {tags {"string"}} {
         r set foo bar
         r getrange foo 0 4294967297
     } {bar}
+
+    test {Large values modified after being queued in a reply} {
+        set payload [string repeat abcdefgh 100000]
+        r set bigval $payload
+        set rd [redis_deferring_client]
+        # The replies reference the value, writes must not change them
+        $rd get bigval
+        $rd append bigval tail
+        $rd get bigval
+        $rd setrange bigval 0 XYZ
+        $rd get bigval
+        $rd del bigval
+        $rd get bigval
+        set replies {}
+        for {set i 0} {$i < 7} {incr i} {
+            lappend replies [$rd read]
+        }
+        $rd close
+        assert_equal $payload [lindex $replies 0]
+        assert_equal "${payload}tail" [lindex $replies 2]
+        assert_equal "XYZ[string range $payload 3 end]tail" [lindex $replies 4]
+        lrange $replies 5 6
+    } {1 {}}
+
+    test {Small values stored by pipelined commands are not recycled} {
+        r flushall
+        set rd [redis_deferring_client]
+        # Arguments of one command are reused for the next one unless the
+        # command retained them
+        for {set i 0} {$i < 500} {incr i} {
+            $rd set key:$i [string repeat x [expr {$i % 45}]]
+            $rd get key:$i
+            $rd exists nokey:$i
+        }
+        for {set i 0} {$i < 1500} {incr i} {
+            $rd read
+        }
+        $rd close
+        set bad 0
+        for {set i 0} {$i < 500} {incr i} {
+            if {[r get key:$i] ne [string repeat x [expr {$i % 45}]]} {incr bad}
+        }
+        set bad
+    } {0}
 }